@@ -8,10 +8,16 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 
 #include <bullet/LinearMath/btIDebugDraw.h>
 
 #include "GLSLpreamble.h"
+#include "StreamBuffer.h"
+
+#define BULLET_DEBUG_DRAWER_INITIAL_VERTICES (1 << 18) // per frame, grown as needed
+
+// Lines are written straight into a mapped ring buffer as Bullet submits them
 
 class BulletDebugDrawer : public btIDebugDraw
 {
@@ -41,8 +47,13 @@ public:
 		frVec = glm::vec3(m * glm::vec4(frVec, 1.f));
 		toVec = glm::vec3(m * glm::vec4(toVec, 1.f));
 
-		m_vVertices.push_back(DebugVertex(frVec, col));
-		m_vVertices.push_back(DebugVertex(toVec, col));
+		GLintptr offset;
+		DebugVertex *v = static_cast<DebugVertex*>(m_VertexBuffer.allocate(2 * sizeof(DebugVertex), offset));
+		if (!v)
+			return;
+
+		v[0] = DebugVertex(frVec, col);
+		v[1] = DebugVertex(toVec, col);
 	}
 
 	void drawContactPoint(const btVector3& PointOnB, const btVector3& normalOnB, btScalar distance, int lifeTime, const btVector3& color)
@@ -74,59 +85,60 @@ public:
 	// Render the mesh
 	void Draw()
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, this->m_glVBO);
-		glBufferData(GL_ARRAY_BUFFER, m_vVertices.size() * sizeof(DebugVertex), m_vVertices.data(), GL_STREAM_DRAW);
-
-		glm::mat4 model = glm::mat4();
-		glUniformMatrix4fv(MODEL_MAT_UNIFORM_LOCATION, 1, GL_FALSE, glm::value_ptr(model));
-		
-		// Draw mesh
-		glBindVertexArray(this->m_glVAO);
-		glDrawArrays(GL_LINES, 0, m_vVertices.size());
-		glBindVertexArray(0);
+		GLsizei count = static_cast<GLsizei>(m_VertexBuffer.getFrameSize() / sizeof(DebugVertex));
+		if (count > 0)
+		{
+			glm::mat4 model = glm::mat4();
+			glUniformMatrix4fv(MODEL_MAT_UNIFORM_LOCATION, 1, GL_FALSE, glm::value_ptr(model));
+
+			// Draw mesh
+			glVertexArrayVertexBuffer(this->m_glVAO, 0, m_VertexBuffer.getBuffer(), m_VertexBuffer.getFrameOffset(), sizeof(DebugVertex));
+			glBindVertexArray(this->m_glVAO);
+			glDrawArrays(GL_LINES, 0, count);
+			glBindVertexArray(0);
+		}
 
 		flushLines();
 	}
 
+	// Ends the frame's lines, once they have been drawn
 	void flushLines()
 	{
-		m_vVertices.clear();
+		m_VertexBuffer.fence();
 	}
 
 private:
+	// 16 bytes, the ring's allocation alignment, so a frame's vertices are contiguous
 	struct DebugVertex {
 		glm::vec3 pos;
-		glm::vec3 col;
+		GLuint col; // RGBA8
 
 		DebugVertex(glm::vec3 p, glm::vec3 c)
 			: pos(p)
-			, col(c)
+			, col(glm::packUnorm4x8(glm::vec4(c, 1.f)))
 		{}
 	};
 
-	GLuint m_glVAO, m_glVBO;
+	GLuint m_glVAO;
 	int m_iDebugMode;
-	std::vector<DebugVertex> m_vVertices;
+	StreamBuffer m_VertexBuffer;
 	btTransform m_Transform;
 
 	void initGL()
 	{
-		// Create buffers/arrays
-		glGenVertexArrays(1, &this->m_glVAO);
-		glGenBuffers(1, &this->m_glVBO);
-
-		glBindVertexArray(this->m_glVAO);
+		m_VertexBuffer.init(GL_ARRAY_BUFFER, BULLET_DEBUG_DRAWER_INITIAL_VERTICES * sizeof(DebugVertex));
 
-		glBindBuffer(GL_ARRAY_BUFFER, this->m_glVBO);
+		// Create arrays; the frame's buffer range is bound when drawn
+		glCreateVertexArrays(1, &this->m_glVAO);
 
-		// Set the vertex attribute pointers
+		// Set the vertex attribute formats
 		// Vertex Positions
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(DebugVertex), (GLvoid*)0);
+		glEnableVertexArrayAttrib(this->m_glVAO, 0);
+		glVertexArrayAttribFormat(this->m_glVAO, 0, 3, GL_FLOAT, GL_FALSE, offsetof(DebugVertex, pos));
+		glVertexArrayAttribBinding(this->m_glVAO, 0, 0);
 		// Vertex Colors
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(DebugVertex), (GLvoid*)offsetof(DebugVertex, col));
-
-		glBindVertexArray(0);
+		glEnableVertexArrayAttrib(this->m_glVAO, 1);
+		glVertexArrayAttribFormat(this->m_glVAO, 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(DebugVertex, col));
+		glVertexArrayAttribBinding(this->m_glVAO, 1, 0);
 	}
 };
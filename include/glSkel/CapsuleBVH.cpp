@@ -0,0 +1,348 @@
+#include "CapsuleBVH.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#define BVH_MAX_DEPTH 128 // splits are kept within the middle half of a range, so depth stays below log4/3(n)
+
+static bool intersectBox(const glm::vec3 &bbMin, const glm::vec3 &bbMax, const glm::vec3 &origin, const glm::vec3 &invDir, float maxDistance)
+{
+	glm::vec3 t0 = (bbMin - origin) * invDir;
+	glm::vec3 t1 = (bbMax - origin) * invDir;
+	glm::vec3 tNear = glm::min(t0, t1);
+	glm::vec3 tFar = glm::max(t0, t1);
+
+	float tEnter = (std::max)((std::max)(tNear.x, tNear.y), (std::max)(tNear.z, 0.f));
+	float tExit = (std::min)((std::min)(tFar.x, tFar.y), (std::min)(tFar.z, maxDistance));
+
+	return tEnter <= tExit;
+}
+
+CapsuleBVH::CapsuleBVH()
+{
+}
+
+CapsuleBVH::~CapsuleBVH()
+{
+}
+
+void CapsuleBVH::beginBuild(std::vector<Capsule>& capsules, std::vector<GroupBoundary>& boundaries)
+{
+	clear();
+
+	m_vCapsules.swap(capsules);
+	m_vBoundaries.swap(boundaries);
+
+	if (!m_vCapsules.empty())
+	{
+		m_vNodes.reserve(2u * m_vCapsules.size() / BVH_LEAF_CAPSULES + 1u);
+
+		BuildTask root;
+		root.begin = 0u;
+		root.end = static_cast<uint32_t>(m_vCapsules.size());
+		root.parent = 0u;
+		root.isRight = false;
+		m_vBuildStack.push_back(root);
+	}
+}
+
+// Nodes are laid out depth-first, so the left child of each inner node is built right after it
+bool CapsuleBVH::continueBuild(const std::function<bool()>& shouldStop)
+{
+	while (!m_vBuildStack.empty())
+	{
+		if (shouldStop())
+			return false;
+
+		BuildTask task = m_vBuildStack.back();
+		m_vBuildStack.pop_back();
+
+		uint32_t idx = static_cast<uint32_t>(m_vNodes.size());
+		if (task.isRight)
+			m_vNodes[task.parent].right = idx;
+
+		Node node;
+		node.first = task.begin;
+		node.count = task.end - task.begin;
+		node.right = 0u;
+		node.bbMin = glm::vec3(std::numeric_limits<float>::max());
+		node.bbMax = glm::vec3(-std::numeric_limits<float>::max());
+
+		for (uint32_t i = task.begin; i < task.end; ++i)
+		{
+			const Capsule &cap = m_vCapsules[i];
+			node.bbMin = glm::min(node.bbMin, glm::min(cap.p0, cap.p1) - cap.radius);
+			node.bbMax = glm::max(node.bbMax, glm::max(cap.p0, cap.p1) + cap.radius);
+		}
+
+		m_vNodes.push_back(node);
+
+		if (node.count > BVH_LEAF_CAPSULES)
+		{
+			uint32_t split = chooseSplit(task.begin, task.end);
+
+			BuildTask right;
+			right.begin = split;
+			right.end = task.end;
+			right.parent = idx;
+			right.isRight = true;
+			m_vBuildStack.push_back(right);
+
+			BuildTask left;
+			left.begin = task.begin;
+			left.end = split;
+			left.parent = idx;
+			left.isRight = false;
+			m_vBuildStack.push_back(left);
+		}
+	}
+
+	m_vBoundaries.clear();
+	m_vBoundaries.shrink_to_fit();
+
+	return true;
+}
+
+// Splits at the shallowest group boundary within the middle half of the range, nearest the middle on ties,
+// or at the middle itself if there is none
+uint32_t CapsuleBVH::chooseSplit(uint32_t begin, uint32_t end)
+{
+	uint32_t n = end - begin;
+	uint32_t mid = begin + n / 2u;
+	uint32_t lo = begin + n / 4u;
+	uint32_t hi = end - n / 4u;
+
+	uint32_t best = mid;
+	uint32_t bestDepth = UINT32_MAX;
+	uint32_t bestDist = UINT32_MAX;
+
+	auto it = std::lower_bound(m_vBoundaries.begin(), m_vBoundaries.end(), lo, [](const GroupBoundary &b, uint32_t pos) { return b.position < pos; });
+
+	for (; it != m_vBoundaries.end() && it->position <= hi; ++it)
+	{
+		uint32_t dist = it->position > mid ? it->position - mid : mid - it->position;
+
+		if (it->depth < bestDepth || (it->depth == bestDepth && dist < bestDist))
+		{
+			best = it->position;
+			bestDepth = it->depth;
+			bestDist = dist;
+		}
+	}
+
+	return best;
+}
+
+bool CapsuleBVH::raycast(const glm::vec3 & origin, const glm::vec3 & dir, float maxDistance, Hit & hit, uint32_t first, uint32_t count)
+{
+	uint32_t last = count > UINT32_MAX - first ? UINT32_MAX : first + count;
+
+	return traverse(origin, dir, maxDistance, hit, first, last, [this](uint32_t i, const glm::vec3 &o, const glm::vec3 &d, float &distance) {
+		return intersectCapsule(m_vCapsules[i], o, d, distance);
+	});
+}
+
+bool CapsuleBVH::raycast(const glm::vec3 & origin, const glm::vec3 & dir, float maxDistance, Hit & hit, const IntersectFunc & intersect)
+{
+	return traverse(origin, dir, maxDistance, hit, 0u, UINT32_MAX, intersect);
+}
+
+// Nearest-child-first traversal, shrinking the search distance with each hit
+bool CapsuleBVH::traverse(const glm::vec3 & origin, const glm::vec3 & dir, float maxDistance, Hit & hit, uint32_t first, uint32_t last, const IntersectFunc & intersect)
+{
+	if (m_vNodes.empty() || !m_vBuildStack.empty())
+		return false;
+
+	glm::vec3 invDir = 1.f / dir;
+	float closest = maxDistance;
+	bool found = false;
+
+	uint32_t stack[BVH_MAX_DEPTH];
+	int top = 0;
+	stack[top++] = 0u;
+
+	while (top > 0)
+	{
+		uint32_t idx = stack[--top];
+		const Node &node = m_vNodes[idx];
+
+		if (node.first >= last || node.first + node.count <= first)
+			continue;
+
+		if (!intersectBox(node.bbMin, node.bbMax, origin, invDir, closest))
+			continue;
+
+		if (node.right == 0u)
+		{
+			uint32_t end = (std::min)(node.first + node.count, last);
+			for (uint32_t i = (std::max)(node.first, first); i < end; ++i)
+			{
+				float distance = closest;
+				if (intersect(i, origin, dir, distance) && distance < closest)
+				{
+					closest = distance;
+					hit.capsule = i;
+					hit.distance = distance;
+					found = true;
+				}
+			}
+		}
+		else
+		{
+			uint32_t left = idx + 1u;
+			uint32_t right = node.right;
+
+			const Node &l = m_vNodes[left];
+			const Node &r = m_vNodes[right];
+			bool leftNearer = glm::dot(dir, (r.bbMin + r.bbMax) - (l.bbMin + l.bbMax)) > 0.f;
+
+			stack[top++] = leftNearer ? right : left;
+			stack[top++] = leftNearer ? left : right;
+		}
+	}
+
+	return found;
+}
+
+void CapsuleBVH::cull(const glm::mat4 & clipFromLocal, uint32_t minRange, const std::function<void(uint32_t, uint32_t)>& visibleRange)
+{
+	if (m_vNodes.empty() || !m_vBuildStack.empty())
+		return;
+
+	// frustum planes, pointing inwards
+	glm::vec4 planes[6];
+	for (int i = 0; i < 3; ++i)
+	{
+		glm::vec4 row(clipFromLocal[0][i], clipFromLocal[1][i], clipFromLocal[2][i], clipFromLocal[3][i]);
+		glm::vec4 w(clipFromLocal[0][3], clipFromLocal[1][3], clipFromLocal[2][3], clipFromLocal[3][3]);
+		planes[2 * i] = w + row;
+		planes[2 * i + 1] = w - row;
+	}
+
+	uint32_t rangeBegin = 0u, rangeEnd = 0u;
+
+	uint32_t stack[BVH_MAX_DEPTH];
+	int top = 0;
+	stack[top++] = 0u;
+
+	while (top > 0)
+	{
+		uint32_t idx = stack[--top];
+		const Node &node = m_vNodes[idx];
+
+		bool inside = true;
+		bool outside = false;
+		for (int i = 0; i < 6 && !outside; ++i)
+		{
+			glm::vec3 n(planes[i]);
+			glm::vec3 pos(n.x > 0.f ? node.bbMax.x : node.bbMin.x, n.y > 0.f ? node.bbMax.y : node.bbMin.y, n.z > 0.f ? node.bbMax.z : node.bbMin.z);
+			glm::vec3 neg(n.x > 0.f ? node.bbMin.x : node.bbMax.x, n.y > 0.f ? node.bbMin.y : node.bbMax.y, n.z > 0.f ? node.bbMin.z : node.bbMax.z);
+
+			if (glm::dot(n, pos) + planes[i].w < 0.f)
+				outside = true;
+			else if (glm::dot(n, neg) + planes[i].w < 0.f)
+				inside = false;
+		}
+
+		if (outside)
+			continue;
+
+		if (inside || node.right == 0u || node.count <= minRange)
+		{
+			// nodes are visited in capsule order, so touching ranges are merged
+			if (rangeEnd == node.first && rangeEnd > rangeBegin)
+			{
+				rangeEnd += node.count;
+			}
+			else
+			{
+				if (rangeEnd > rangeBegin)
+					visibleRange(rangeBegin, rangeEnd - rangeBegin);
+				rangeBegin = node.first;
+				rangeEnd = node.first + node.count;
+			}
+		}
+		else
+		{
+			stack[top++] = node.right;
+			stack[top++] = idx + 1u;
+		}
+	}
+
+	if (rangeEnd > rangeBegin)
+		visibleRange(rangeBegin, rangeEnd - rangeBegin);
+}
+
+const std::vector<CapsuleBVH::Capsule>& CapsuleBVH::getCapsules()
+{
+	return m_vCapsules;
+}
+
+bool CapsuleBVH::empty()
+{
+	return m_vNodes.empty() || !m_vBuildStack.empty();
+}
+
+void CapsuleBVH::clear()
+{
+	m_vCapsules.clear();
+	m_vBoundaries.clear();
+	m_vNodes.clear();
+	m_vBuildStack.clear();
+}
+
+// Ray against a capsule's cylinder body and end spheres; dir must be normalized
+bool CapsuleBVH::intersectCapsule(const Capsule & cap, const glm::vec3 & origin, const glm::vec3 & dir, float & distance)
+{
+	glm::vec3 ba = cap.p1 - cap.p0;
+	glm::vec3 oa = origin - cap.p0;
+	float baba = glm::dot(ba, ba);
+	float bard = glm::dot(ba, dir);
+	float baoa = glm::dot(ba, oa);
+	float rdoa = glm::dot(dir, oa);
+	float oaoa = glm::dot(oa, oa);
+	float r2 = cap.radius * cap.radius;
+
+	float t = -1.f;
+
+	float a = baba - bard * bard;
+	if (a > 1e-12f)
+	{
+		float b = baba * rdoa - baoa * bard;
+		float c = baba * oaoa - baoa * baoa - r2 * baba;
+		float h = b * b - a * c;
+
+		if (h < 0.f)
+			return false;
+
+		float tBody = (-b - std::sqrt(h)) / a;
+		float y = baoa + tBody * bard;
+		if (y > 0.f && y < baba && tBody >= 0.f)
+			t = tBody;
+	}
+
+	// end spheres
+	if (t < 0.f)
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			glm::vec3 oc = i == 0 ? oa : origin - cap.p1;
+			float b = glm::dot(dir, oc);
+			float c = glm::dot(oc, oc) - r2;
+			float h = b * b - c;
+			if (h < 0.f)
+				continue;
+
+			float tCap = -b - std::sqrt(h);
+			if (tCap >= 0.f && (t < 0.f || tCap < t))
+				t = tCap;
+		}
+	}
+
+	if (t < 0.f || t >= distance)
+		return false;
+
+	distance = t;
+	return true;
+}
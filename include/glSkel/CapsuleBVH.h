@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#define BVH_LEAF_CAPSULES 4u
+
+// Bounding volume hierarchy over capsules (swept spheres). Capsules keep the order they were given in, so
+// every node covers a contiguous range of them. Splits prefer group boundaries (e.g. where branches begin
+// and end), so groups become subtrees of their own where the balance allows it.
+class CapsuleBVH
+{
+public:
+	struct Capsule {
+		glm::vec3 p0;
+		glm::vec3 p1;
+		float radius;
+
+		Capsule() : p0(0.f), p1(0.f), radius(0.f) {}
+		Capsule(const glm::vec3 &p0, const glm::vec3 &p1, float radius) : p0(p0), p1(p1), radius(radius) {}
+	};
+
+	// Position in the capsule order where a group begins or ends, and how deeply that group is nested
+	struct GroupBoundary {
+		uint32_t position;
+		uint32_t depth;
+
+		GroupBoundary(uint32_t position, uint32_t depth) : position(position), depth(depth) {}
+	};
+
+	struct Hit {
+		uint32_t capsule;
+		float distance;
+	};
+
+	// Returns true with the hit distance along the ray if the capsule (given by index) is hit closer than distance
+	typedef std::function<bool(uint32_t, const glm::vec3&, const glm::vec3&, float&)> IntersectFunc;
+
+public:
+	CapsuleBVH();
+	~CapsuleBVH();
+
+	// Starts a build over the capsules; boundaries must be sorted by position
+	void beginBuild(std::vector<Capsule> &capsules, std::vector<GroupBoundary> &boundaries);
+	// Builds nodes until done or shouldStop returns true; returns true once the tree is complete
+	bool continueBuild(const std::function<bool()> &shouldStop);
+
+	// Closest capsule hit by the ray within maxDistance, considering only capsules in [first, first + count)
+	bool raycast(const glm::vec3 &origin, const glm::vec3 &dir, float maxDistance, Hit &hit, uint32_t first = 0u, uint32_t count = UINT32_MAX);
+	// Same, with a custom test for the capsules' contents (e.g. something instanced inside the capsule bounds)
+	bool raycast(const glm::vec3 &origin, const glm::vec3 &dir, float maxDistance, Hit &hit, const IntersectFunc &intersect);
+
+	// Reports contiguous ranges of capsules whose bounds are inside or straddle the frustum of clipFromLocal.
+	// Nodes with at most minRange capsules are not split further, so ranges stay coarse.
+	void cull(const glm::mat4 &clipFromLocal, uint32_t minRange, const std::function<void(uint32_t, uint32_t)> &visibleRange);
+
+	const std::vector<Capsule>& getCapsules();
+	bool empty();
+	void clear();
+
+	static bool intersectCapsule(const Capsule &cap, const glm::vec3 &origin, const glm::vec3 &dir, float &distance);
+
+private:
+	struct Node {
+		glm::vec3 bbMin;
+		uint32_t first;
+		glm::vec3 bbMax;
+		uint32_t count;
+		uint32_t right; // second child of an inner node, the first one directly follows it; 0 for leaves
+	};
+
+	struct BuildTask {
+		uint32_t begin, end;
+		uint32_t parent;
+		bool isRight;
+	};
+
+	uint32_t chooseSplit(uint32_t begin, uint32_t end);
+
+	bool traverse(const glm::vec3 &origin, const glm::vec3 &dir, float maxDistance, Hit &hit, uint32_t first, uint32_t last, const IntersectFunc &intersect);
+
+private:
+	std::vector<Capsule> m_vCapsules;
+	std::vector<GroupBoundary> m_vBoundaries;
+	std::vector<Node> m_vNodes;
+	std::vector<BuildTask> m_vBuildStack;
+};
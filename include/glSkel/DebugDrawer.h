@@ -8,12 +8,14 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
-
-#include <algorithm>
-#include <iterator>
+#include <glm/gtc/packing.hpp>
 
 #include "GLSLpreamble.h"
+#include "StreamBuffer.h"
+
+#define DEBUG_DRAWER_INITIAL_VERTICES (1 << 16) // per primitive type and frame, grown as needed
 
+// Vertices are written straight into a mapped ring buffer per primitive type as they are submitted
 class DebugDrawer
 {
 public:
@@ -54,29 +56,28 @@ public:
 	// Draw a line using the debug drawer. To draw in a different coordinate space, use setTransform()
 	void drawPoint(const glm::vec3 &pos, const glm::vec4 &col = glm::vec4(1.f))
 	{
-		glm::vec3 pos_xformed = glm::vec3(m_mat4Transform * glm::vec4(pos, 1.f));
+		DebugVertex *v = allocate(m_PointsBuffer, 1);
+		if (!v)
+			return;
 
-		m_vPointsVertices.push_back(DebugVertex(pos_xformed, col));
+		v[0] = DebugVertex(glm::vec3(m_mat4Transform * glm::vec4(pos, 1.f)), col);
 	}
 
 	// Draw a line using the debug drawer. To draw in a different coordinate space, use setTransform()
 	void drawLine(const glm::vec3 &from, const glm::vec3 &to, const glm::vec4 &col = glm::vec4(1.f))
 	{
-		glm::vec3 from_xformed = glm::vec3(m_mat4Transform * glm::vec4(from, 1.f));
-		glm::vec3 to_xformed = glm::vec3(m_mat4Transform * glm::vec4(to, 1.f));
-
-		m_vLinesVertices.push_back(DebugVertex(from_xformed, col));
-		m_vLinesVertices.push_back(DebugVertex(to_xformed, col));
+		drawLine(from, to, col, col);
 	}
 
 	// Draw a line using the debug drawer. To draw in a different coordinate space, use setTransform()
 	void drawLine(const glm::vec3 &from, const glm::vec3 &to, const glm::vec4 &colFrom, const glm::vec4 &colTo)
 	{
-		glm::vec3 from_xformed = glm::vec3(m_mat4Transform * glm::vec4(from, 1.f));
-		glm::vec3 to_xformed = glm::vec3(m_mat4Transform * glm::vec4(to, 1.f));
+		DebugVertex *v = allocate(m_LinesBuffer, 2);
+		if (!v)
+			return;
 
-		m_vLinesVertices.push_back(DebugVertex(from_xformed, colFrom));
-		m_vLinesVertices.push_back(DebugVertex(to_xformed, colTo));
+		v[0] = DebugVertex(glm::vec3(m_mat4Transform * glm::vec4(from, 1.f)), colFrom);
+		v[1] = DebugVertex(glm::vec3(m_mat4Transform * glm::vec4(to, 1.f)), colTo);
 	}
 
 	void drawTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec4 &color)
@@ -88,13 +89,13 @@ public:
 
 	void drawSolidTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec4 &color)
 	{
-		glm::vec3 v0_xformed = glm::vec3(m_mat4Transform * glm::vec4(v0, 1.f));
-		glm::vec3 v1_xformed = glm::vec3(m_mat4Transform * glm::vec4(v1, 1.f));
-		glm::vec3 v2_xformed = glm::vec3(m_mat4Transform * glm::vec4(v2, 1.f));
+		DebugVertex *v = allocate(m_TrianglesBuffer, 3);
+		if (!v)
+			return;
 
-		m_vTrianglesVertices.push_back(DebugVertex(v0_xformed, color));
-		m_vTrianglesVertices.push_back(DebugVertex(v1_xformed, color));
-		m_vTrianglesVertices.push_back(DebugVertex(v2_xformed, color));
+		v[0] = DebugVertex(glm::vec3(m_mat4Transform * glm::vec4(v0, 1.f)), color);
+		v[1] = DebugVertex(glm::vec3(m_mat4Transform * glm::vec4(v1, 1.f)), color);
+		v[2] = DebugVertex(glm::vec3(m_mat4Transform * glm::vec4(v2, 1.f)), color);
 	}
 
 	void drawTransform(float orthoLen)
@@ -164,48 +165,35 @@ public:
 	// Render the mesh
 	void render()
 	{
-		size_t nPointsVerts = m_vPointsVertices.size();
-		size_t nLinesVerts = m_vLinesVertices.size();
-		size_t nTrisVerts = m_vTrianglesVertices.size();
-
-		std::vector<DebugVertex> buffer;
-
-		std::copy(m_vPointsVertices.begin(), m_vPointsVertices.end(), std::back_inserter(buffer));
-		std::copy(m_vLinesVertices.begin(), m_vLinesVertices.end(),	std::back_inserter(buffer));
-		std::copy(m_vTrianglesVertices.begin(), m_vTrianglesVertices.end(), std::back_inserter(buffer));
-		
-		glBindBuffer(GL_ARRAY_BUFFER, this->m_glVBO);
-		glBufferData(GL_ARRAY_BUFFER, buffer.size() * sizeof(DebugVertex), NULL, GL_STREAM_DRAW); // buffer orphaning
-		glBufferData(GL_ARRAY_BUFFER, buffer.size() * sizeof(DebugVertex), buffer.data(), GL_STREAM_DRAW);
-				
-		// Draw mesh
 		glBindVertexArray(this->m_glVAO);
-		glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(nPointsVerts));
-		glDrawArrays(GL_LINES, static_cast<GLint>(nPointsVerts), static_cast<GLsizei>(nLinesVerts));
-		glDrawArrays(GL_TRIANGLES, static_cast<GLint>(nPointsVerts + nLinesVerts), static_cast<GLsizei>(nTrisVerts));
+		drawRange(m_PointsBuffer, GL_POINTS);
+		drawRange(m_LinesBuffer, GL_LINES);
+		drawRange(m_TrianglesBuffer, GL_TRIANGLES);
 		glBindVertexArray(0);
 	}
 
+	// Ends the frame's drawing; call once what was drawn has been rendered
 	void flushLines()
 	{
-		m_vPointsVertices.clear();
-		m_vLinesVertices.clear();
-		m_vTrianglesVertices.clear();
+		m_PointsBuffer.fence();
+		m_LinesBuffer.fence();
+		m_TrianglesBuffer.fence();
 	}
 
 private:
+	// 16 bytes, the ring's allocation alignment, so a frame's vertices are contiguous
 	struct DebugVertex {
 		glm::vec3 pos;
-		glm::vec4 col;
+		GLuint col; // RGBA8
 
 		DebugVertex(glm::vec3 p, glm::vec4 c)
 			: pos(p)
-			, col(c)
+			, col(glm::packUnorm4x8(c))
 		{}
 	};
 
-	GLuint m_glVAO, m_glVBO;
-	std::vector<DebugVertex> m_vPointsVertices, m_vLinesVertices, m_vTrianglesVertices;
+	GLuint m_glVAO;
+	StreamBuffer m_PointsBuffer, m_LinesBuffer, m_TrianglesBuffer;
 	glm::mat4 m_mat4Transform;
 
 	// CTOR
@@ -214,6 +202,22 @@ private:
 		_initGL();
 	}
 
+	DebugVertex* allocate(StreamBuffer &buffer, int count)
+	{
+		GLintptr offset;
+		return static_cast<DebugVertex*>(buffer.allocate(count * sizeof(DebugVertex), offset));
+	}
+
+	void drawRange(StreamBuffer &buffer, GLenum mode)
+	{
+		GLsizei count = static_cast<GLsizei>(buffer.getFrameSize() / sizeof(DebugVertex));
+		if (count == 0)
+			return;
+
+		glVertexArrayVertexBuffer(this->m_glVAO, 0, buffer.getBuffer(), buffer.getFrameOffset(), sizeof(DebugVertex));
+		glDrawArrays(mode, 0, count);
+	}
+
 	void drawSpherePatch(const glm::vec3 &center, const glm::vec3 &up, const glm::vec3 &axis, float radius,
 		float minTh, float maxTh, float minPs, float maxPs, const glm::vec4 &color, float stepDegrees = float(10.f), bool drawCenter = true)
 	{
@@ -322,23 +326,22 @@ private:
 
 	void _initGL()
 	{
-		// Create buffers/arrays
-		glGenVertexArrays(1, &this->m_glVAO);
-		glGenBuffers(1, &this->m_glVBO);
+		m_PointsBuffer.init(GL_ARRAY_BUFFER, DEBUG_DRAWER_INITIAL_VERTICES * sizeof(DebugVertex));
+		m_LinesBuffer.init(GL_ARRAY_BUFFER, DEBUG_DRAWER_INITIAL_VERTICES * sizeof(DebugVertex));
+		m_TrianglesBuffer.init(GL_ARRAY_BUFFER, DEBUG_DRAWER_INITIAL_VERTICES * sizeof(DebugVertex));
 
-		glBindVertexArray(this->m_glVAO);
+		// Create arrays; each primitive type's buffer range is bound when drawn
+		glCreateVertexArrays(1, &this->m_glVAO);
 
-		glBindBuffer(GL_ARRAY_BUFFER, this->m_glVBO);
-
-		// Set the vertex attribute pointers
+		// Set the vertex attribute formats
 		// Vertex Positions
-		glEnableVertexAttribArray(POSITION_ATTRIB_LOCATION);
-		glVertexAttribPointer(POSITION_ATTRIB_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(DebugVertex), (GLvoid*)0);
+		glEnableVertexArrayAttrib(this->m_glVAO, POSITION_ATTRIB_LOCATION);
+		glVertexArrayAttribFormat(this->m_glVAO, POSITION_ATTRIB_LOCATION, 3, GL_FLOAT, GL_FALSE, offsetof(DebugVertex, pos));
+		glVertexArrayAttribBinding(this->m_glVAO, POSITION_ATTRIB_LOCATION, 0);
 		// Vertex Colors
-		glEnableVertexAttribArray(COLOR_ATTRIB_LOCATION);
-		glVertexAttribPointer(COLOR_ATTRIB_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(DebugVertex), (GLvoid*)offsetof(DebugVertex, col));
-
-		glBindVertexArray(0);
+		glEnableVertexArrayAttrib(this->m_glVAO, COLOR_ATTRIB_LOCATION);
+		glVertexArrayAttribFormat(this->m_glVAO, COLOR_ATTRIB_LOCATION, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(DebugVertex, col));
+		glVertexArrayAttribBinding(this->m_glVAO, COLOR_ATTRIB_LOCATION, 0);
 	}
 
 // DELETE THE FOLLOWING FUNCTIONS TO AVOID NON-SINGLETON USE
@@ -0,0 +1,177 @@
+#include "DepthPyramid.h"
+
+#include <algorithm>
+
+#include "GLSLpreamble.h"
+
+DepthPyramid::DepthPyramid()
+	: m_pDownsampleProgram(NULL)
+	, m_glDepthTexture(0)
+	, m_glDepthFBO(0)
+	, m_glPyramidTexture(0)
+	, m_nWidth(0)
+	, m_nHeight(0)
+	, m_glDepthFormat(GL_NONE)
+	, m_nLevels(0)
+{
+}
+
+DepthPyramid::~DepthPyramid()
+{
+}
+
+bool DepthPyramid::init()
+{
+	glCreateFramebuffers(1, &m_glDepthFBO);
+
+	return m_glDepthFBO != 0;
+}
+
+void DepthPyramid::destroy()
+{
+	if (m_glDepthTexture)
+		glDeleteTextures(1, &m_glDepthTexture);
+	if (m_glPyramidTexture)
+		glDeleteTextures(1, &m_glPyramidTexture);
+	if (m_glDepthFBO)
+		glDeleteFramebuffers(1, &m_glDepthFBO);
+
+	m_glDepthTexture = 0;
+	m_glPyramidTexture = 0;
+	m_glDepthFBO = 0;
+	m_nWidth = m_nHeight = 0;
+}
+
+void DepthPyramid::setProgram(GLuint * downsampleProgram)
+{
+	m_pDownsampleProgram = downsampleProgram;
+}
+
+bool DepthPyramid::isReady()
+{
+	return m_pDownsampleProgram && *m_pDownsampleProgram;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Copies the framebuffer's depth, then reduces it into the first
+//          level and each level into the next, with a barrier in between
+//-----------------------------------------------------------------------------
+bool DepthPyramid::build(GLuint framebuffer, GLsizei width, GLsizei height)
+{
+	if (!isReady() || width <= 0 || height <= 0 || !resize(framebuffer, width, height))
+		return false;
+
+	glBlitNamedFramebuffer(framebuffer, m_glDepthFBO, 0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+	glUseProgram(*m_pDownsampleProgram);
+
+	GLsizei levelWidth = m_nWidth;
+	GLsizei levelHeight = m_nHeight;
+	for (GLint level = 0; level < m_nLevels; ++level)
+	{
+		levelWidth = (std::max)(levelWidth / 2, 1);
+		levelHeight = (std::max)(levelHeight / 2, 1);
+
+		glBindTextureUnit(DEPTH_PYRAMID_TEXTURE_BINDING, level == 0 ? m_glDepthTexture : m_glPyramidTexture);
+		glUniform1i(DEPTH_PYRAMID_SOURCE_LEVEL_UNIFORM_LOCATION, level == 0 ? 0 : level - 1);
+		glBindImageTexture(DEPTH_PYRAMID_IMAGE_BINDING, m_glPyramidTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+		glDispatchCompute((levelWidth + DEPTH_PYRAMID_THREADS - 1) / DEPTH_PYRAMID_THREADS, (levelHeight + DEPTH_PYRAMID_THREADS - 1) / DEPTH_PYRAMID_THREADS, 1u);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
+
+	glBindImageTexture(DEPTH_PYRAMID_IMAGE_BINDING, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+	glBindTextureUnit(DEPTH_PYRAMID_TEXTURE_BINDING, 0);
+	glUseProgram(0);
+
+	return true;
+}
+
+GLuint DepthPyramid::getTexture()
+{
+	return m_glPyramidTexture;
+}
+
+// (Re)creates the textures when the framebuffer's size changed
+bool DepthPyramid::resize(GLuint framebuffer, GLsizei width, GLsizei height)
+{
+	if (width == m_nWidth && height == m_nHeight)
+		return true;
+
+	GLenum format = getDepthFormat(framebuffer);
+	if (format == GL_NONE)
+		return false;
+
+	if (m_glDepthTexture)
+		glDeleteTextures(1, &m_glDepthTexture);
+	if (m_glPyramidTexture)
+		glDeleteTextures(1, &m_glPyramidTexture);
+
+	m_nWidth = width;
+	m_nHeight = height;
+	m_glDepthFormat = format;
+
+	// blitting depth needs matching formats
+	glCreateTextures(GL_TEXTURE_2D, 1, &m_glDepthTexture);
+	glTextureStorage2D(m_glDepthTexture, 1, format, width, height);
+	glTextureParameteri(m_glDepthTexture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(m_glDepthTexture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTextureParameteri(m_glDepthTexture, GL_DEPTH_STENCIL_TEXTURE_MODE, GL_DEPTH_COMPONENT);
+
+	GLenum attachment = format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8 ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+	glNamedFramebufferTexture(m_glDepthFBO, GL_DEPTH_STENCIL_ATTACHMENT, 0, 0);
+	glNamedFramebufferTexture(m_glDepthFBO, attachment, m_glDepthTexture, 0);
+
+	GLsizei pyramidWidth = (std::max)(width / 2, 1);
+	GLsizei pyramidHeight = (std::max)(height / 2, 1);
+
+	m_nLevels = 1;
+	while ((std::max)(pyramidWidth, pyramidHeight) >> m_nLevels)
+		++m_nLevels;
+
+	glCreateTextures(GL_TEXTURE_2D, 1, &m_glPyramidTexture);
+	glTextureStorage2D(m_glPyramidTexture, m_nLevels, GL_R32F, pyramidWidth, pyramidHeight);
+	glTextureParameteri(m_glPyramidTexture, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTextureParameteri(m_glPyramidTexture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	if (glCheckNamedFramebufferStatus(m_glDepthFBO, GL_READ_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		m_nWidth = m_nHeight = 0; // try again next time
+		return false;
+	}
+
+	return true;
+}
+
+// Sized internal format matching the depth (and stencil) bits of the framebuffer, GL_NONE if it has no depth
+GLenum DepthPyramid::getDepthFormat(GLuint framebuffer)
+{
+	GLenum depthAttachment = framebuffer == 0 ? GL_DEPTH : GL_DEPTH_ATTACHMENT;
+	GLenum stencilAttachment = framebuffer == 0 ? GL_STENCIL : GL_STENCIL_ATTACHMENT;
+
+	// sizes can only be queried from attachments that are present
+	GLint depthType = GL_NONE, stencilType = GL_NONE;
+	glGetNamedFramebufferAttachmentParameteriv(framebuffer, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &depthType);
+	glGetNamedFramebufferAttachmentParameteriv(framebuffer, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &stencilType);
+
+	if (depthType == GL_NONE)
+		return GL_NONE;
+
+	GLint depthBits = 0, stencilBits = 0, componentType = GL_NONE;
+	glGetNamedFramebufferAttachmentParameteriv(framebuffer, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+	glGetNamedFramebufferAttachmentParameteriv(framebuffer, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &componentType);
+	if (stencilType != GL_NONE)
+		glGetNamedFramebufferAttachmentParameteriv(framebuffer, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+
+	if (depthBits == 0)
+		return GL_NONE;
+
+	if (componentType == GL_FLOAT)
+		return stencilBits > 0 ? GL_DEPTH32F_STENCIL8 : GL_DEPTH_COMPONENT32F;
+	if (stencilBits > 0)
+		return GL_DEPTH24_STENCIL8;
+	if (depthBits <= 16)
+		return GL_DEPTH_COMPONENT16;
+
+	return depthBits <= 24 ? GL_DEPTH_COMPONENT24 : GL_DEPTH_COMPONENT32;
+}
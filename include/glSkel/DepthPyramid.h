@@ -0,0 +1,43 @@
+#pragma once
+
+#include <GL/glew.h>
+
+// Mip chain of the farthest depth under each texel of a framebuffer's depth buffer, for testing whether
+// bounds are hidden behind what has been drawn. The depth is copied out (resolving multisampling) and
+// reduced level by level by a compute pass; the first level is half the framebuffer's size.
+class DepthPyramid
+{
+public:
+	DepthPyramid();
+	~DepthPyramid();
+
+	bool init();
+	void destroy();
+
+	void setProgram(GLuint *downsampleProgram);
+	// False until the downsample program has linked
+	bool isReady();
+
+	// Rebuilds the pyramid from the framebuffer's depth, resizing it along with the framebuffer.
+	// Fails if the framebuffer has no depth or the program is not ready.
+	bool build(GLuint framebuffer, GLsizei width, GLsizei height);
+
+	// R32F, sampled with texelFetch; 0 until the first build
+	GLuint getTexture();
+
+private:
+	bool resize(GLuint framebuffer, GLsizei width, GLsizei height);
+	GLenum getDepthFormat(GLuint framebuffer);
+
+private:
+	GLuint *m_pDownsampleProgram;
+
+	GLuint m_glDepthTexture; // single sampled copy of the framebuffer's depth, in its format
+	GLuint m_glDepthFBO;
+	GLuint m_glPyramidTexture;
+
+	GLsizei m_nWidth;
+	GLsizei m_nHeight;
+	GLenum m_glDepthFormat;
+	GLint m_nLevels;
+};
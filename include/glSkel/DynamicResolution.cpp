@@ -0,0 +1,260 @@
+#include "DynamicResolution.h"
+
+#include <algorithm>
+#include <cmath>
+
+DynamicResolution::DynamicResolution()
+	: m_nQueryHead(0u)
+	, m_nQueryTail(0u)
+	, m_bTiming(false)
+	, m_nGeneration(0u)
+	, m_nTimedFrames(0)
+	, m_nTargetWidth(0)
+	, m_nTargetHeight(0)
+	, m_nWindowWidth(0)
+	, m_nWindowHeight(0)
+	, m_nRenderWidth(0)
+	, m_nRenderHeight(0)
+	, m_fScale(1.f)
+	, m_fMinScale(0.5f)
+	, m_fMaxScale(1.f)
+	, m_nSamples(1)
+	, m_nMaxSamples(1)
+	, m_fTargetFrameTime(1000.f / 60.f)
+	, m_fFrameTime(0.f)
+{
+	for (auto &query : m_arrQueries)
+		query = 0u;
+	for (auto &generation : m_arrQueryGenerations)
+		generation = 0u;
+}
+
+DynamicResolution::~DynamicResolution()
+{
+}
+
+bool DynamicResolution::init()
+{
+	glCreateQueries(GL_TIME_ELAPSED, DYNAMIC_RESOLUTION_QUERIES, m_arrQueries);
+
+	return m_arrQueries[0] != 0;
+}
+
+void DynamicResolution::destroy()
+{
+	if (m_arrQueries[0])
+		glDeleteQueries(DYNAMIC_RESOLUTION_QUERIES, m_arrQueries);
+
+	for (auto &query : m_arrQueries)
+		query = 0u;
+	m_nQueryHead = m_nQueryTail = 0u;
+	m_bTiming = false;
+}
+
+void DynamicResolution::setTargetFrameTime(float milliseconds)
+{
+	m_fTargetFrameTime = milliseconds;
+}
+
+void DynamicResolution::setScaleRange(float minScale, float maxScale)
+{
+	m_fMaxScale = (std::min)((std::max)(maxScale, DYNAMIC_RESOLUTION_SCALE_STEP), 1.f);
+	m_fMinScale = (std::min)((std::max)(minScale, DYNAMIC_RESOLUTION_SCALE_STEP), m_fMaxScale);
+	m_fScale = (std::min)((std::max)(m_fScale, m_fMinScale), m_fMaxScale);
+
+	++m_nGeneration;
+	m_nTimedFrames = 0;
+}
+
+void DynamicResolution::setMaxSamples(int samples)
+{
+	// the target is a multisampled color and depth texture
+	GLint maxColorSamples = 1, maxDepthSamples = 1;
+	glGetIntegerv(GL_MAX_COLOR_TEXTURE_SAMPLES, &maxColorSamples);
+	glGetIntegerv(GL_MAX_DEPTH_TEXTURE_SAMPLES, &maxDepthSamples);
+
+	m_nMaxSamples = (std::min)((std::max)(samples, 1), static_cast<int>((std::min)(maxColorSamples, maxDepthSamples)));
+	m_nSamples = m_nMaxSamples;
+
+	++m_nGeneration;
+	m_nTimedFrames = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Applies what the finished frame timings call for, sizes the
+//          target and the part of it rendered to, and starts the frame's
+//          timer query if one is free
+//-----------------------------------------------------------------------------
+void DynamicResolution::begin(GLsizei windowWidth, GLsizei windowHeight)
+{
+	readTimings();
+
+	if (windowWidth != m_nWindowWidth || windowHeight != m_nWindowHeight)
+	{
+		m_nWindowWidth = windowWidth;
+		m_nWindowHeight = windowHeight;
+		++m_nGeneration;
+		m_nTimedFrames = 0;
+	}
+
+	// sized for the largest scale, so scale changes don't reallocate it
+	m_nTargetWidth = (std::max)(static_cast<GLsizei>(std::ceil(windowWidth * m_fMaxScale)), 1);
+	m_nTargetHeight = (std::max)(static_cast<GLsizei>(std::ceil(windowHeight * m_fMaxScale)), 1);
+
+	m_nRenderWidth = (std::min)((std::max)(static_cast<GLsizei>(windowWidth * m_fScale + 0.5f), 1), m_nTargetWidth);
+	m_nRenderHeight = (std::min)((std::max)(static_cast<GLsizei>(windowHeight * m_fScale + 0.5f), 1), m_nTargetHeight);
+
+	if (m_nQueryHead - m_nQueryTail < DYNAMIC_RESOLUTION_QUERIES)
+	{
+		GLuint slot = m_nQueryHead % DYNAMIC_RESOLUTION_QUERIES;
+		m_arrQueryGenerations[slot] = m_nGeneration;
+		glBeginQuery(GL_TIME_ELAPSED, m_arrQueries[slot]);
+		m_bTiming = true;
+	}
+}
+
+void DynamicResolution::end()
+{
+	if (m_bTiming)
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		++m_nQueryHead;
+		m_bTiming = false;
+	}
+}
+
+GLsizei DynamicResolution::getTargetWidth()
+{
+	return m_nTargetWidth;
+}
+
+GLsizei DynamicResolution::getTargetHeight()
+{
+	return m_nTargetHeight;
+}
+
+GLsizei DynamicResolution::getRenderWidth()
+{
+	return m_nRenderWidth;
+}
+
+GLsizei DynamicResolution::getRenderHeight()
+{
+	return m_nRenderHeight;
+}
+
+float DynamicResolution::getScale()
+{
+	return m_fScale;
+}
+
+int DynamicResolution::getSamples()
+{
+	return m_nSamples;
+}
+
+float DynamicResolution::getFrameTime()
+{
+	return m_fFrameTime;
+}
+
+// Collects the finished timer queries in order, without waiting on the ones still running
+void DynamicResolution::readTimings()
+{
+	while (m_nQueryTail != m_nQueryHead)
+	{
+		GLuint slot = m_nQueryTail % DYNAMIC_RESOLUTION_QUERIES;
+
+		GLint available = 0;
+		glGetQueryObjectiv(m_arrQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;
+
+		GLuint64 nanoseconds = 0u;
+		glGetQueryObjectui64v(m_arrQueries[slot], GL_QUERY_RESULT, &nanoseconds);
+		++m_nQueryTail;
+
+		if (m_arrQueryGenerations[slot] != m_nGeneration)
+			continue;
+
+		float milliseconds = static_cast<float>(nanoseconds) * 1e-6f;
+		m_fFrameTime = m_nTimedFrames == 0 ? milliseconds : m_fFrameTime + (milliseconds - m_fFrameTime) * DYNAMIC_RESOLUTION_SMOOTHING;
+		++m_nTimedFrames;
+
+		adapt();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Takes one step down the quality ladder when the frame time is
+//          above the band around the target, or one step up when it is below
+//          it; doubling the samples needs the frame time to stay under the
+//          target afterwards, so it does not bounce straight back
+//-----------------------------------------------------------------------------
+void DynamicResolution::adapt()
+{
+	if (m_fTargetFrameTime <= 0.f || m_nTimedFrames < DYNAMIC_RESOLUTION_SETTLE_FRAMES)
+		return;
+
+	// pixel count, and so roughly the cost, goes with the square of the scale
+	float desiredScale = m_fScale * std::sqrt(m_fTargetFrameTime / m_fFrameTime);
+	int baseSamples = (std::min)(DYNAMIC_RESOLUTION_BASE_SAMPLES, m_nMaxSamples);
+	bool changed = false;
+
+	if (m_fFrameTime > m_fTargetFrameTime * (1.f + DYNAMIC_RESOLUTION_TOLERANCE))
+	{
+		if (m_nSamples > baseSamples)
+			changed = changeSamples(m_nSamples / 2);
+		else if (m_fScale > m_fMinScale)
+			changed = changeScale(desiredScale);
+		else if (m_nSamples > 1)
+			changed = changeSamples(m_nSamples / 2);
+	}
+	else if (m_fFrameTime < m_fTargetFrameTime * (1.f - DYNAMIC_RESOLUTION_TOLERANCE))
+	{
+		bool samplesFit = m_fFrameTime * DYNAMIC_RESOLUTION_SAMPLES_COST < m_fTargetFrameTime;
+
+		if (m_nSamples < baseSamples)
+			changed = samplesFit && changeSamples(m_nSamples * 2);
+		else if (m_fScale < m_fMaxScale)
+			changed = changeScale(desiredScale);
+		else if (m_nSamples < m_nMaxSamples)
+			changed = samplesFit && changeSamples(m_nSamples * 2);
+	}
+
+	if (changed)
+	{
+		++m_nGeneration;
+		m_nTimedFrames = 0;
+	}
+}
+
+// Moves the scale towards the desired one by whole steps, at least one and at most DYNAMIC_RESOLUTION_MAX_SCALE_STEPS
+bool DynamicResolution::changeScale(float desired)
+{
+	int steps = static_cast<int>(std::lround((desired - m_fScale) / DYNAMIC_RESOLUTION_SCALE_STEP));
+	if (steps == 0)
+		steps = desired > m_fScale ? 1 : -1;
+	steps = (std::min)((std::max)(steps, -DYNAMIC_RESOLUTION_MAX_SCALE_STEPS), DYNAMIC_RESOLUTION_MAX_SCALE_STEPS);
+
+	float scale = std::round(m_fScale / DYNAMIC_RESOLUTION_SCALE_STEP + steps) * DYNAMIC_RESOLUTION_SCALE_STEP;
+	scale = (std::min)((std::max)(scale, m_fMinScale), m_fMaxScale);
+
+	if (scale == m_fScale)
+		return false;
+
+	m_fScale = scale;
+
+	return true;
+}
+
+bool DynamicResolution::changeSamples(int samples)
+{
+	samples = (std::min)((std::max)(samples, 1), m_nMaxSamples);
+	if (samples == m_nSamples)
+		return false;
+
+	m_nSamples = samples;
+
+	return true;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#define DYNAMIC_RESOLUTION_QUERIES 4 // frame timer queries in flight
+#define DYNAMIC_RESOLUTION_TOLERANCE 0.1f // relative band around the target frame time that is left alone
+#define DYNAMIC_RESOLUTION_SMOOTHING 0.3f // weight of each new frame time in the running average
+#define DYNAMIC_RESOLUTION_SETTLE_FRAMES 3 // timed frames after a change before the next one
+#define DYNAMIC_RESOLUTION_SCALE_STEP 0.05f // scales are multiples of this, so the size doesn't change every frame
+#define DYNAMIC_RESOLUTION_MAX_SCALE_STEPS 4 // per change
+#define DYNAMIC_RESOLUTION_BASE_SAMPLES 4 // resolution is only lowered below full scale once down to these samples
+#define DYNAMIC_RESOLUTION_SAMPLES_COST 1.5f // expected frame time factor of doubling the samples
+
+// Size (relative to the window) and MSAA level of an offscreen render target that follow the GPU frame time,
+// measured with timer queries read back a few frames late, to hold a target frame time. Quality moves along
+// one ladder: samples are halved down to the base level first, then the resolution scale drops, then the
+// remaining samples go; it climbs back up the same way. The frame is rendered into the render size corner of
+// a target of the target size, which only changes with the window, then resolved and upscaled to the window.
+class DynamicResolution
+{
+public:
+	DynamicResolution();
+	~DynamicResolution();
+
+	bool init();
+	void destroy();
+
+	// GPU time per frame to hold, within DYNAMIC_RESOLUTION_TOLERANCE
+	void setTargetFrameTime(float milliseconds);
+	// Range of the render target's size relative to the window, at most 1
+	void setScaleRange(float minScale, float maxScale);
+	// Most MSAA samples to use (clamped to what multisampled textures support), which is also where it starts
+	void setMaxSamples(int samples);
+
+	// Adapts to the frame times read back so far, picks the sizes for the frame and starts timing it
+	void begin(GLsizei windowWidth, GLsizei windowHeight);
+	// Stops timing the frame, once everything in it has been submitted
+	void end();
+
+	GLsizei getTargetWidth();
+	GLsizei getTargetHeight();
+	GLsizei getRenderWidth();
+	GLsizei getRenderHeight();
+	float getScale();
+	int getSamples();
+	// Smoothed GPU milliseconds per frame at the current settings, 0 until measured
+	float getFrameTime();
+
+private:
+	void readTimings();
+	void adapt();
+	bool changeScale(float desired);
+	bool changeSamples(int samples);
+
+private:
+	GLuint m_arrQueries[DYNAMIC_RESOLUTION_QUERIES];
+	GLuint m_arrQueryGenerations[DYNAMIC_RESOLUTION_QUERIES];
+	GLuint m_nQueryHead; // next to issue
+	GLuint m_nQueryTail; // oldest pending
+	bool m_bTiming; // whether the current frame has a query running
+	GLuint m_nGeneration; // bumped on every change, so the timings of frames from before it are dropped
+	int m_nTimedFrames; // since the last change
+
+	GLsizei m_nTargetWidth;
+	GLsizei m_nTargetHeight;
+	GLsizei m_nWindowWidth;
+	GLsizei m_nWindowHeight;
+	GLsizei m_nRenderWidth;
+	GLsizei m_nRenderHeight;
+
+	float m_fScale;
+	float m_fMinScale;
+	float m_fMaxScale;
+	int m_nSamples;
+	int m_nMaxSamples;
+
+	float m_fTargetFrameTime;
+	float m_fFrameTime;
+};
@@ -0,0 +1,167 @@
+#include "FileWatcher.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+FileWatcher::FileWatcher()
+	: m_nQueueHead(0u)
+	, m_nQueueTail(0u)
+	, m_bOverflow(false)
+	, m_bRunning(false)
+	, m_fdNotify(-1)
+{
+}
+
+FileWatcher::~FileWatcher()
+{
+	stop();
+}
+
+bool FileWatcher::start()
+{
+	if (m_bRunning)
+		return true;
+
+#ifdef __linux__
+	m_fdNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fdNotify < 0)
+		return false;
+
+	m_bRunning = true;
+	m_Thread = std::thread(&FileWatcher::run, this);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void FileWatcher::stop()
+{
+	if (!m_bRunning)
+		return;
+
+	m_bRunning = false;
+	m_Thread.join();
+
+#ifdef __linux__
+	close(m_fdNotify);
+#endif
+	m_fdNotify = -1;
+
+	std::lock_guard<std::mutex> lock(m_mutexWatches);
+	m_mapWatchedDirs.clear();
+}
+
+bool FileWatcher::isRunning()
+{
+	return m_bRunning;
+}
+
+bool FileWatcher::watch(const std::string & filename)
+{
+	if (!m_bRunning)
+		return false;
+
+	size_t slash = filename.find_last_of("/\\");
+	std::string dir = slash == std::string::npos ? "" : filename.substr(0u, slash + 1u); // keeps the separator
+
+	std::lock_guard<std::mutex> lock(m_mutexWatches);
+
+	for (auto const &watched : m_mapWatchedDirs)
+		if (watched.second == dir)
+			return true;
+
+#ifdef __linux__
+	// editors either rewrite files in place or move a new version over them
+	int wd = inotify_add_watch(m_fdNotify, dir.empty() ? "." : dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0)
+		return false;
+
+	m_mapWatchedDirs[wd] = dir;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool FileWatcher::popChange(std::string & filename)
+{
+	uint32_t tail = m_nQueueTail.load(std::memory_order_relaxed);
+	if (tail == m_nQueueHead.load(std::memory_order_acquire))
+		return false;
+
+	filename.swap(m_arrQueue[tail % FILE_WATCHER_QUEUE_SIZE]);
+	m_nQueueTail.store(tail + 1u, std::memory_order_release);
+
+	return true;
+}
+
+bool FileWatcher::checkOverflow()
+{
+	return m_bOverflow.exchange(false);
+}
+
+void FileWatcher::run()
+{
+#ifdef __linux__
+	alignas(inotify_event) char buffer[4096];
+
+	pollfd pfd;
+	pfd.fd = m_fdNotify;
+	pfd.events = POLLIN;
+
+	while (m_bRunning)
+	{
+		if (poll(&pfd, 1, FILE_WATCHER_POLL_MS) <= 0)
+			continue;
+
+		ssize_t length = read(m_fdNotify, buffer, sizeof(buffer));
+		if (length <= 0)
+			continue;
+
+		for (char *p = buffer; p < buffer + length;)
+		{
+			const inotify_event *event = reinterpret_cast<const inotify_event*>(p);
+			p += sizeof(inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				m_bOverflow = true;
+				continue;
+			}
+
+			if (event->len == 0u)
+				continue;
+
+			std::string dir;
+			{
+				std::lock_guard<std::mutex> lock(m_mutexWatches);
+				auto it = m_mapWatchedDirs.find(event->wd);
+				if (it == m_mapWatchedDirs.end())
+					continue;
+				dir = it->second;
+			}
+
+			if (!push(dir + event->name))
+				m_bOverflow = true;
+		}
+	}
+#endif
+}
+
+bool FileWatcher::push(const std::string & filename)
+{
+	uint32_t head = m_nQueueHead.load(std::memory_order_relaxed);
+	if (head - m_nQueueTail.load(std::memory_order_acquire) == FILE_WATCHER_QUEUE_SIZE)
+		return false;
+
+	m_arrQueue[head % FILE_WATCHER_QUEUE_SIZE] = filename;
+	m_nQueueHead.store(head + 1u, std::memory_order_release);
+
+	return true;
+}
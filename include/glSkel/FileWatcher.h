@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+#define FILE_WATCHER_QUEUE_SIZE 256 // changes held until popped
+#define FILE_WATCHER_POLL_MS 100 // how often the watcher thread checks whether it should stop
+
+// Reports changed files from a background thread through a lock-free single producer, single consumer queue,
+// so the consumer never blocks or touches the file system. Backed by inotify, so only available on Linux;
+// elsewhere start() fails and callers should poll file timestamps instead.
+class FileWatcher
+{
+public:
+	FileWatcher();
+	~FileWatcher();
+
+	bool start();
+	void stop();
+	bool isRunning();
+
+	// Watches the directory containing the file; changes to files in it are reported by their path as given here
+	bool watch(const std::string &filename);
+
+	// Pops the next changed file, returns false when there is none
+	bool popChange(std::string &filename);
+	// True (once) if changes were lost because the queue filled up, in which case everything should be rechecked
+	bool checkOverflow();
+
+private:
+	void run();
+	bool push(const std::string &filename);
+
+private:
+	std::string m_arrQueue[FILE_WATCHER_QUEUE_SIZE];
+	std::atomic<uint32_t> m_nQueueHead; // next slot the watcher thread fills
+	std::atomic<uint32_t> m_nQueueTail; // next slot to pop
+	std::atomic<bool> m_bOverflow;
+	std::atomic<bool> m_bRunning;
+
+	std::thread m_Thread;
+
+	int m_fdNotify;
+	std::mutex m_mutexWatches;
+	std::map<int, std::string> m_mapWatchedDirs; // watch descriptor to directory, as the prefix of reported paths
+};
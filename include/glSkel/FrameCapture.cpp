@@ -0,0 +1,377 @@
+#include "FrameCapture.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#define FRAME_CAPTURE_WAIT_NS 1000000ull // per wait on a readback's fence, repeated until it signals
+
+FrameCapture::FrameCapture()
+	: m_nNextSlot(0u)
+	, m_nFrame(0u)
+	, m_bStopping(false)
+{
+	for (auto &slot : m_arrSlots)
+	{
+		slot.buffer = 0;
+		slot.mapped = NULL;
+		slot.capacity = 0;
+		slot.fence = 0;
+		slot.frame = 0u;
+		slot.width = 0;
+		slot.height = 0;
+		slot.state = SLOT_FREE;
+	}
+}
+
+FrameCapture::~FrameCapture()
+{
+	// without GL, which is gone by now; whatever was still queued is dropped
+	if (m_EncoderThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtxEncoder);
+			m_bStopping = true;
+			m_dqEncode.clear();
+		}
+		m_cvEncode.notify_all();
+		m_EncoderThread.join();
+	}
+}
+
+bool FrameCapture::init()
+{
+	m_bStopping = false;
+	m_EncoderThread = std::thread(&FrameCapture::encoderLoop, this);
+
+	return true;
+}
+
+void FrameCapture::destroy()
+{
+	flush();
+
+	if (m_EncoderThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mtxEncoder);
+			m_bStopping = true;
+		}
+		m_cvEncode.notify_all();
+		m_EncoderThread.join();
+	}
+
+	for (auto &slot : m_arrSlots)
+	{
+		if (slot.buffer)
+		{
+			glUnmapNamedBuffer(slot.buffer);
+			glDeleteBuffers(1, &slot.buffer);
+		}
+
+		slot.buffer = 0;
+		slot.mapped = NULL;
+		slot.capacity = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Issues the copy into the next buffer of the ring. Only when every
+//          buffer is still busy (captures come faster than they're written)
+//          does it wait, for the oldest one.
+//-----------------------------------------------------------------------------
+void FrameCapture::read(GLuint texture, GLsizei width, GLsizei height, const std::string & filename)
+{
+	Slot &slot = m_arrSlots[m_nNextSlot];
+	if (slot.state == SLOT_READING)
+		handOver(slot, true);
+	waitFree(slot);
+
+	GLsizeiptr size = static_cast<GLsizeiptr>(width) * height * 4;
+	if (slot.capacity < size)
+	{
+		if (slot.buffer)
+		{
+			glUnmapNamedBuffer(slot.buffer);
+			glDeleteBuffers(1, &slot.buffer);
+		}
+
+		const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		glCreateBuffers(1, &slot.buffer);
+		glNamedBufferStorage(slot.buffer, size, NULL, flags | GL_CLIENT_STORAGE_BIT);
+		slot.mapped = static_cast<uint8_t*>(glMapNamedBufferRange(slot.buffer, 0, size, flags));
+		slot.capacity = slot.mapped ? size : 0;
+
+		if (!slot.mapped)
+		{
+			fprintf(stderr, "Frame capture: could not map a %lld byte readback buffer\n", static_cast<long long>(size));
+			return;
+		}
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	glGetTextureSubImage(texture, 0, 0, 0, 0, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, static_cast<GLsizei>(size), NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.frame = m_nFrame;
+	slot.width = width;
+	slot.height = height;
+	slot.filename = filename;
+	slot.state = SLOT_READING;
+
+	m_nNextSlot = (m_nNextSlot + 1u) % FRAME_CAPTURE_BUFFERS;
+}
+
+void FrameCapture::update()
+{
+	++m_nFrame;
+
+	// oldest first, so files are written in the order they were captured
+	for (unsigned int i = 0u; i < FRAME_CAPTURE_BUFFERS; ++i)
+	{
+		Slot &slot = m_arrSlots[(m_nNextSlot + i) % FRAME_CAPTURE_BUFFERS];
+		if (slot.state == SLOT_READING && m_nFrame - slot.frame >= FRAME_CAPTURE_LATENCY)
+			handOver(slot, false);
+	}
+}
+
+void FrameCapture::flush()
+{
+	for (unsigned int i = 0u; i < FRAME_CAPTURE_BUFFERS; ++i)
+	{
+		Slot &slot = m_arrSlots[(m_nNextSlot + i) % FRAME_CAPTURE_BUFFERS];
+		if (slot.state == SLOT_READING)
+			handOver(slot, true);
+	}
+
+	for (auto &slot : m_arrSlots)
+		waitFree(slot);
+}
+
+unsigned int FrameCapture::getPending()
+{
+	unsigned int pending = 0u;
+	for (auto const &slot : m_arrSlots)
+	{
+		if (slot.state != SLOT_FREE)
+			++pending;
+	}
+
+	return pending;
+}
+
+// Queues the slot for encoding once its copy is done; without wait, only if it is done already
+void FrameCapture::handOver(Slot & slot, bool wait)
+{
+	if (wait)
+	{
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		while (glClientWaitSync(slot.fence, flags, FRAME_CAPTURE_WAIT_NS) == GL_TIMEOUT_EXPIRED)
+			flags = 0;
+	}
+	else if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		return;
+
+	glDeleteSync(slot.fence);
+	slot.fence = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mtxEncoder);
+		slot.state = SLOT_ENCODING;
+		m_dqEncode.push_back(&slot);
+	}
+	m_cvEncode.notify_one();
+}
+
+void FrameCapture::waitFree(Slot & slot)
+{
+	std::unique_lock<std::mutex> lock(m_mtxEncoder);
+	m_cvEncoded.wait(lock, [&slot]() { return slot.state == SLOT_FREE; });
+}
+
+void FrameCapture::encoderLoop()
+{
+	for (;;)
+	{
+		Slot *slot;
+		{
+			std::unique_lock<std::mutex> lock(m_mtxEncoder);
+			m_cvEncode.wait(lock, [this]() { return m_bStopping || !m_dqEncode.empty(); });
+			if (m_dqEncode.empty())
+				return;
+
+			slot = m_dqEncode.front();
+			m_dqEncode.pop_front();
+		}
+
+		std::string extension = slot->filename.size() >= 4u ? slot->filename.substr(slot->filename.size() - 4u) : std::string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return static_cast<char>(tolower(c)); });
+
+		bool written = extension == ".png" ?
+			writePNG(slot->filename, slot->mapped, slot->width, slot->height) :
+			writeTGA(slot->filename, slot->mapped, slot->width, slot->height);
+
+		if (!written)
+			fprintf(stderr, "Frame capture: could not write %s\n", slot->filename.c_str());
+
+		{
+			std::lock_guard<std::mutex> lock(m_mtxEncoder);
+			slot->state = SLOT_FREE;
+		}
+		m_cvEncoded.notify_all();
+	}
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+	static uint32_t s_table[256];
+	static bool s_tableReady = false;
+	if (!s_tableReady)
+	{
+		for (uint32_t n = 0u; n < 256u; ++n)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1u ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			s_table[n] = c;
+		}
+		s_tableReady = true;
+	}
+
+	crc = ~crc;
+	for (size_t i = 0u; i < size; ++i)
+		crc = s_table[(crc ^ data[i]) & 0xFFu] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static void appendBigEndian(std::vector<uint8_t> &out, uint32_t value)
+{
+	out.push_back(static_cast<uint8_t>(value >> 24));
+	out.push_back(static_cast<uint8_t>(value >> 16));
+	out.push_back(static_cast<uint8_t>(value >> 8));
+	out.push_back(static_cast<uint8_t>(value));
+}
+
+static void writeChunk(std::ofstream &out, const char *type, const std::vector<uint8_t> &data)
+{
+	std::vector<uint8_t> chunk;
+	chunk.reserve(data.size() + 12u);
+	appendBigEndian(chunk, static_cast<uint32_t>(data.size()));
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	appendBigEndian(chunk, crc32(0u, chunk.data() + 4, data.size() + 4u));
+
+	out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes the pixels (bottom row first, as GL reads them) as an RGB
+//          PNG, top row first. The zlib stream uses stored blocks only, which
+//          keeps the encoder small and fast, at the cost of file size.
+//-----------------------------------------------------------------------------
+bool FrameCapture::writePNG(const std::string & filename, const uint8_t * pixels, GLsizei width, GLsizei height)
+{
+	std::ofstream out(filename, std::ios::binary);
+	if (!out)
+		return false;
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+	std::vector<uint8_t> header;
+	appendBigEndian(header, static_cast<uint32_t>(width));
+	appendBigEndian(header, static_cast<uint32_t>(height));
+	header.push_back(8); // bits per channel
+	header.push_back(2); // RGB
+	header.push_back(0); // deflate
+	header.push_back(0); // adaptive filtering, with every row unfiltered
+	header.push_back(0); // not interlaced
+	writeChunk(out, "IHDR", header);
+
+	// scanlines: a filter type byte, then the row
+	size_t rowSize = static_cast<size_t>(width) * 3u + 1u;
+	std::vector<uint8_t> raw(rowSize * height);
+	for (GLsizei y = 0; y < height; ++y)
+	{
+		const uint8_t *src = pixels + static_cast<size_t>(height - 1 - y) * width * 4u;
+		uint8_t *dst = &raw[y * rowSize];
+		*dst++ = 0;
+		for (GLsizei x = 0; x < width; ++x, src += 4)
+		{
+			*dst++ = src[0];
+			*dst++ = src[1];
+			*dst++ = src[2];
+		}
+	}
+
+	std::vector<uint8_t> data;
+	data.reserve(raw.size() + raw.size() / 65535u * 5u + 16u);
+	data.push_back(0x78); // zlib header: deflate with a 32K window, no dictionary
+	data.push_back(0x01);
+
+	uint32_t adlerA = 1u, adlerB = 0u;
+	size_t offset = 0u;
+	do
+	{
+		size_t length = (std::min)(raw.size() - offset, size_t(65535u));
+		bool last = offset + length == raw.size();
+
+		data.push_back(last ? 1 : 0); // stored block
+		data.push_back(static_cast<uint8_t>(length));
+		data.push_back(static_cast<uint8_t>(length >> 8));
+		data.push_back(static_cast<uint8_t>(~length));
+		data.push_back(static_cast<uint8_t>(~length >> 8));
+		data.insert(data.end(), raw.begin() + offset, raw.begin() + offset + length);
+
+		for (size_t i = offset; i < offset + length; ++i)
+		{
+			adlerA = (adlerA + raw[i]) % 65521u;
+			adlerB = (adlerB + adlerA) % 65521u;
+		}
+
+		offset += length;
+	} while (offset < raw.size());
+
+	appendBigEndian(data, (adlerB << 16) | adlerA);
+	writeChunk(out, "IDAT", data);
+	writeChunk(out, "IEND", std::vector<uint8_t>());
+
+	return static_cast<bool>(out);
+}
+
+// Uncompressed 24 bit TGA, which is stored bottom row first like GL reads it
+bool FrameCapture::writeTGA(const std::string & filename, const uint8_t * pixels, GLsizei width, GLsizei height)
+{
+	std::ofstream out(filename, std::ios::binary);
+	if (!out)
+		return false;
+
+	uint8_t header[18] = {};
+	header[2] = 2; // uncompressed true color
+	header[12] = static_cast<uint8_t>(width);
+	header[13] = static_cast<uint8_t>(width >> 8);
+	header[14] = static_cast<uint8_t>(height);
+	header[15] = static_cast<uint8_t>(height >> 8);
+	header[16] = 24; // bits per pixel
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	std::vector<uint8_t> row(static_cast<size_t>(width) * 3u);
+	for (GLsizei y = 0; y < height; ++y)
+	{
+		const uint8_t *src = pixels + static_cast<size_t>(y) * width * 4u;
+		for (GLsizei x = 0; x < width; ++x, src += 4)
+		{
+			row[x * 3] = src[2];
+			row[x * 3 + 1] = src[1];
+			row[x * 3 + 2] = src[0];
+		}
+		out.write(reinterpret_cast<const char*>(row.data()), row.size());
+	}
+
+	return static_cast<bool>(out);
+}
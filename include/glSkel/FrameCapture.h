@@ -0,0 +1,78 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define FRAME_CAPTURE_BUFFERS 4 // readbacks in flight or being encoded; capturing more waits for the oldest
+#define FRAME_CAPTURE_LATENCY 2 // frames after its readback is issued before a buffer is looked at again
+
+// Reads captured frames back through a ring of persistently mapped pixel pack buffers. A readback is only
+// issued into a buffer, and picked up a couple of frames later, once its fence says the copy is done, so the
+// GPU never has to catch up for it. The pixels are encoded and written out by a thread of its own straight
+// from the mapped buffer, which is only reused once that is done; encoding never runs on the job system,
+// whose waits could otherwise pick it up on the rendering thread. Files ending in .png are written as PNG
+// (uncompressed), others as TGA.
+class FrameCapture
+{
+public:
+	FrameCapture();
+	~FrameCapture();
+
+	bool init();
+	void destroy();
+
+	// Copies the texture's bottom left width x height (RGBA8) into the next buffer, to be written to filename
+	void read(GLuint texture, GLsizei width, GLsizei height, const std::string &filename);
+	// Once per frame, after its last read: hands the readbacks that have finished to the encoder
+	void update();
+	// Waits until everything read so far has been written
+	void flush();
+
+	// Readbacks not written yet
+	unsigned int getPending();
+
+private:
+	enum SLOT_STATE {
+		SLOT_FREE,
+		SLOT_READING, // copy issued, fenced
+		SLOT_ENCODING // handed to the encoder
+	};
+
+	struct Slot
+	{
+		GLuint buffer;
+		uint8_t *mapped;
+		GLsizeiptr capacity;
+		GLsync fence;
+		unsigned int frame; // issued in
+		GLsizei width, height;
+		std::string filename;
+		std::atomic<int> state;
+	};
+
+	void handOver(Slot &slot, bool wait);
+	void waitFree(Slot &slot);
+	void encoderLoop();
+
+	static bool writePNG(const std::string &filename, const uint8_t *pixels, GLsizei width, GLsizei height);
+	static bool writeTGA(const std::string &filename, const uint8_t *pixels, GLsizei width, GLsizei height);
+
+private:
+	Slot m_arrSlots[FRAME_CAPTURE_BUFFERS];
+	unsigned int m_nNextSlot;
+	unsigned int m_nFrame;
+
+	std::thread m_EncoderThread;
+	std::mutex m_mtxEncoder;
+	std::condition_variable m_cvEncode; // slots queued, or stopping
+	std::condition_variable m_cvEncoded; // a slot was freed
+	std::deque<Slot*> m_dqEncode;
+	bool m_bStopping;
+};
@@ -0,0 +1,744 @@
+#include "FrameGraph.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <glm/gtc/type_ptr.hpp>
+
+static bool isDepthFormat(GLenum format)
+{
+	switch (format)
+	{
+	case GL_DEPTH_COMPONENT16:
+	case GL_DEPTH_COMPONENT24:
+	case GL_DEPTH_COMPONENT32:
+	case GL_DEPTH_COMPONENT32F:
+	case GL_DEPTH24_STENCIL8:
+	case GL_DEPTH32F_STENCIL8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool isDepthStencilFormat(GLenum format)
+{
+	return format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+}
+
+FrameGraph::FrameGraph()
+	: m_nFrame(0u)
+	, m_bCompiled(false)
+	, m_nExecuting(-1)
+{
+	m_ReadFramebuffer.framebuffer = 0;
+	m_ReadFramebuffer.color = 0;
+	m_ReadFramebuffer.depth = 0;
+}
+
+FrameGraph::~FrameGraph()
+{
+}
+
+void FrameGraph::destroy()
+{
+	for (auto const &pooled : m_vPool)
+	{
+		if (pooled.buffer)
+			glDeleteBuffers(1, &pooled.object);
+		else
+			glDeleteTextures(1, &pooled.object);
+	}
+
+	for (auto const &cached : m_vFramebuffers)
+		if (cached.framebuffer)
+			glDeleteFramebuffers(1, &cached.framebuffer);
+
+	if (m_ReadFramebuffer.framebuffer)
+		glDeleteFramebuffers(1, &m_ReadFramebuffer.framebuffer);
+
+	m_vPool.clear();
+	m_vFramebuffers.clear();
+	m_ReadFramebuffer.framebuffer = 0;
+	m_ReadFramebuffer.color = 0;
+	m_ReadFramebuffer.depth = 0;
+
+	reset();
+}
+
+void FrameGraph::reset()
+{
+	m_vResources.clear();
+	m_vVersions.clear();
+	m_vPasses.clear();
+	m_vOrder.clear();
+	m_vnAssigned.clear();
+
+	m_bCompiled = false;
+	++m_nFrame;
+}
+
+FrameGraph::Resource FrameGraph::createTexture(const char * name, const TextureDesc & desc)
+{
+	ResourceNode node;
+	node.name = name;
+	node.buffer = false;
+	node.imported = false;
+	node.backbuffer = false;
+	node.output = false;
+	node.desc = desc;
+	node.size = 0;
+	node.object = 0;
+
+	return addResource(node);
+}
+
+FrameGraph::Resource FrameGraph::createBuffer(const char * name, GLsizeiptr size)
+{
+	ResourceNode node;
+	node.name = name;
+	node.buffer = true;
+	node.imported = false;
+	node.backbuffer = false;
+	node.output = false;
+	node.size = size;
+	node.object = 0;
+
+	return addResource(node);
+}
+
+FrameGraph::Resource FrameGraph::importTexture(const char * name, GLuint texture)
+{
+	ResourceNode node;
+	node.name = name;
+	node.buffer = false;
+	node.imported = true;
+	node.backbuffer = false;
+	node.output = false;
+	node.size = 0;
+	node.object = texture;
+
+	if (texture)
+	{
+		glGetTextureLevelParameteriv(texture, 0, GL_TEXTURE_WIDTH, &node.desc.width);
+		glGetTextureLevelParameteriv(texture, 0, GL_TEXTURE_HEIGHT, &node.desc.height);
+		glGetTextureLevelParameteriv(texture, 0, GL_TEXTURE_SAMPLES, &node.desc.samples);
+		GLint format = GL_NONE;
+		glGetTextureLevelParameteriv(texture, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+		node.desc.format = static_cast<GLenum>(format);
+		node.desc.samples = (std::max)(node.desc.samples, 1);
+	}
+
+	return addResource(node);
+}
+
+FrameGraph::Resource FrameGraph::importBackbuffer(const char * name)
+{
+	ResourceNode node;
+	node.name = name;
+	node.buffer = false;
+	node.imported = true;
+	node.backbuffer = true;
+	node.output = true;
+	node.size = 0;
+	node.object = 0;
+
+	return addResource(node);
+}
+
+void FrameGraph::markOutput(Resource resource)
+{
+	if (resource >= 0 && resource < static_cast<Resource>(m_vVersions.size()))
+		m_vResources[m_vVersions[resource].resource].output = true;
+}
+
+FrameGraph::Pass FrameGraph::addPass(const char * name, const ExecuteFunc & execute)
+{
+	PassNode pass;
+	pass.name = name;
+	pass.execute = execute;
+	pass.colorTarget = -1;
+	pass.depthTarget = -1;
+	pass.clearColor = false;
+	pass.clearDepth = false;
+	pass.clearColorValue = glm::vec4(0.f);
+	pass.clearDepthValue = 1.f;
+	pass.sideEffect = false;
+	pass.culled = false;
+
+	m_vPasses.push_back(pass);
+	m_bCompiled = false;
+
+	return static_cast<Pass>(m_vPasses.size() - 1u);
+}
+
+void FrameGraph::setSideEffect(Pass pass)
+{
+	if (pass >= 0 && pass < static_cast<Pass>(m_vPasses.size()))
+		m_vPasses[pass].sideEffect = true;
+}
+
+void FrameGraph::read(Pass pass, Resource resource)
+{
+	if (!isValid(pass, resource))
+		return;
+
+	m_vVersions[resource].readers.push_back(pass);
+	m_vPasses[pass].reads.push_back(resource);
+	m_bCompiled = false;
+}
+
+FrameGraph::Resource FrameGraph::write(Pass pass, Resource resource, bool discard)
+{
+	if (!isValid(pass, resource))
+		return -1;
+
+	// only the latest version can be written, versions don't branch
+	int node = m_vVersions[resource].resource;
+	if (m_vResources[node].lastVersion != resource)
+		return -1;
+
+	if (!discard)
+		read(pass, resource);
+
+	Resource version = addVersion(node, pass);
+	m_vPasses[pass].writes.push_back(version);
+	m_bCompiled = false;
+
+	return version;
+}
+
+FrameGraph::Resource FrameGraph::setColorTarget(Pass pass, Resource texture, bool discard)
+{
+	return setTarget(pass, texture, false, discard);
+}
+
+FrameGraph::Resource FrameGraph::clearColorTarget(Pass pass, Resource texture, const glm::vec4 & value)
+{
+	Resource version = setTarget(pass, texture, false, true);
+	if (version >= 0)
+	{
+		m_vPasses[pass].clearColor = true;
+		m_vPasses[pass].clearColorValue = value;
+	}
+
+	return version;
+}
+
+FrameGraph::Resource FrameGraph::setDepthTarget(Pass pass, Resource texture, bool discard)
+{
+	return setTarget(pass, texture, true, discard);
+}
+
+FrameGraph::Resource FrameGraph::clearDepthTarget(Pass pass, Resource texture, float value)
+{
+	Resource version = setTarget(pass, texture, true, true);
+	if (version >= 0)
+	{
+		m_vPasses[pass].clearDepth = true;
+		m_vPasses[pass].clearDepthValue = value;
+	}
+
+	return version;
+}
+
+bool FrameGraph::compile()
+{
+	retire();
+	cull();
+
+	m_bCompiled = sort();
+	if (m_bCompiled)
+		assignPooled();
+
+	return m_bCompiled;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs the passes in order, binding their targets and clearing them
+//          first if asked to, and invalidates each transient after the last
+//          pass using it, so whatever reuses its object next doesn't have to
+//          preserve or clear what it held
+//-----------------------------------------------------------------------------
+void FrameGraph::execute()
+{
+	if (!m_bCompiled)
+		return;
+
+	for (size_t position = 0u; position < m_vOrder.size(); ++position)
+	{
+		Pass p = m_vOrder[position];
+		const PassNode &pass = m_vPasses[p];
+
+		PROFILE_SCOPE(pass.name);
+		PROFILE_GPU_SCOPE(pass.name);
+
+		if (pass.colorTarget >= 0 || pass.depthTarget >= 0)
+		{
+			bindTargets(p);
+			GLuint framebuffer = p < static_cast<Pass>(m_vFramebuffers.size()) ? m_vFramebuffers[p].framebuffer : 0;
+
+			if (pass.clearColor)
+				glClearNamedFramebufferfv(framebuffer, GL_COLOR, 0, glm::value_ptr(pass.clearColorValue));
+
+			// glew declares glClearNamedFramebufferfi without the draw buffer, so depth and stencil are cleared apart
+			if (pass.clearDepth)
+			{
+				glClearNamedFramebufferfv(framebuffer, GL_DEPTH, 0, &pass.clearDepthValue);
+
+				GLint stencil = 0;
+				if (isDepthStencilFormat(m_vResources[m_vVersions[pass.depthTarget].resource].desc.format))
+					glClearNamedFramebufferiv(framebuffer, GL_STENCIL, 0, &stencil);
+			}
+		}
+
+		m_nExecuting = p;
+		if (pass.execute)
+			pass.execute();
+		m_nExecuting = -1;
+
+		for (auto const &node : m_vResources)
+		{
+			if (node.imported || node.lastUse != static_cast<int>(position) || !node.object)
+				continue;
+
+			if (node.buffer)
+				glInvalidateBufferData(node.object);
+			else
+				glInvalidateTexImage(node.object, 0);
+		}
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+GLuint FrameGraph::getTexture(Resource resource)
+{
+	if (resource < 0 || resource >= static_cast<Resource>(m_vVersions.size()))
+		return 0;
+
+	const ResourceNode &node = m_vResources[m_vVersions[resource].resource];
+	return node.buffer ? 0 : node.object;
+}
+
+GLuint FrameGraph::getBuffer(Resource resource)
+{
+	if (resource < 0 || resource >= static_cast<Resource>(m_vVersions.size()))
+		return 0;
+
+	const ResourceNode &node = m_vResources[m_vVersions[resource].resource];
+	return node.buffer ? node.object : 0;
+}
+
+GLuint FrameGraph::getTargetFramebuffer()
+{
+	if (m_nExecuting < 0)
+		return 0;
+
+	Resource color = m_vPasses[m_nExecuting].colorTarget;
+	if (color >= 0 && m_vResources[m_vVersions[color].resource].backbuffer)
+		return 0;
+
+	return m_nExecuting < static_cast<Pass>(m_vFramebuffers.size()) ? m_vFramebuffers[m_nExecuting].framebuffer : 0;
+}
+
+GLuint FrameGraph::getReadFramebuffer(Resource texture)
+{
+	if (texture < 0 || texture >= static_cast<Resource>(m_vVersions.size()))
+		return 0;
+
+	const ResourceNode &node = m_vResources[m_vVersions[texture].resource];
+	if (node.backbuffer || node.buffer)
+		return 0;
+
+	if (!m_ReadFramebuffer.framebuffer)
+		glCreateFramebuffers(1, &m_ReadFramebuffer.framebuffer);
+
+	bool depth = isDepthFormat(node.desc.format);
+	GLuint color = depth ? 0 : node.object;
+	GLuint depthTexture = depth ? node.object : 0;
+	if (m_ReadFramebuffer.color != color || m_ReadFramebuffer.depth != depthTexture)
+	{
+		attach(m_ReadFramebuffer.framebuffer, color, depthTexture, node.desc.format);
+		m_ReadFramebuffer.color = color;
+		m_ReadFramebuffer.depth = depthTexture;
+	}
+
+	return m_ReadFramebuffer.framebuffer;
+}
+
+size_t FrameGraph::getPassCount()
+{
+	return m_vPasses.size();
+}
+
+size_t FrameGraph::getCulledPassCount()
+{
+	return m_bCompiled ? m_vPasses.size() - m_vOrder.size() : 0u;
+}
+
+size_t FrameGraph::getTransientCount()
+{
+	size_t count = 0u;
+	for (auto const &node : m_vResources)
+		if (!node.imported && node.firstUse >= 0)
+			++count;
+
+	return count;
+}
+
+size_t FrameGraph::getPooledCount()
+{
+	return m_vPool.size();
+}
+
+FrameGraph::Resource FrameGraph::addResource(const ResourceNode & node)
+{
+	m_vResources.push_back(node);
+	m_vResources.back().lastVersion = -1;
+	m_vResources.back().firstUse = -1;
+	m_vResources.back().lastUse = -1;
+	m_bCompiled = false;
+
+	return addVersion(static_cast<int>(m_vResources.size() - 1u), -1);
+}
+
+FrameGraph::Resource FrameGraph::addVersion(int resource, Pass writer)
+{
+	VersionNode version;
+	version.resource = resource;
+	version.writer = writer;
+	m_vVersions.push_back(version);
+
+	Resource handle = static_cast<Resource>(m_vVersions.size() - 1u);
+	m_vResources[resource].lastVersion = handle;
+
+	return handle;
+}
+
+bool FrameGraph::isValid(Pass pass, Resource resource)
+{
+	return pass >= 0 && pass < static_cast<Pass>(m_vPasses.size()) && resource >= 0 && resource < static_cast<Resource>(m_vVersions.size());
+}
+
+FrameGraph::Resource FrameGraph::setTarget(Pass pass, Resource texture, bool depth, bool discard)
+{
+	if (!isValid(pass, texture))
+		return -1;
+
+	const ResourceNode &node = m_vResources[m_vVersions[texture].resource];
+	if (node.buffer || (depth && node.backbuffer))
+		return -1;
+
+	Resource version = write(pass, texture, discard);
+	if (version >= 0)
+		(depth ? m_vPasses[pass].depthTarget : m_vPasses[pass].colorTarget) = version;
+
+	return version;
+}
+
+// Keeps the passes with side effects or writing outputs, and everything they read from, transitively
+void FrameGraph::cull()
+{
+	std::vector<Pass> needed;
+
+	for (size_t p = 0u; p < m_vPasses.size(); ++p)
+	{
+		m_vPasses[p].culled = !m_vPasses[p].sideEffect;
+		if (m_vPasses[p].sideEffect)
+			needed.push_back(static_cast<Pass>(p));
+	}
+
+	for (auto const &node : m_vResources)
+	{
+		Pass writer = node.output ? m_vVersions[node.lastVersion].writer : -1;
+		if (writer >= 0 && m_vPasses[writer].culled)
+		{
+			m_vPasses[writer].culled = false;
+			needed.push_back(writer);
+		}
+	}
+
+	while (!needed.empty())
+	{
+		Pass p = needed.back();
+		needed.pop_back();
+
+		for (Resource version : m_vPasses[p].reads)
+		{
+			Pass writer = m_vVersions[version].writer;
+			if (writer >= 0 && m_vPasses[writer].culled)
+			{
+				m_vPasses[writer].culled = false;
+				needed.push_back(writer);
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Orders the passes left so that each resource's writers run in
+//          version order, readers after the write they read and before the
+//          next one; among the passes free to run, the first declared goes
+//          first, so independent passes keep their declaration order
+//-----------------------------------------------------------------------------
+bool FrameGraph::sort()
+{
+	size_t passCount = m_vPasses.size();
+	std::vector<std::vector<Pass>> successors(passCount);
+	std::vector<int> predecessors(passCount, 0);
+
+	auto addEdge = [&](Pass from, Pass to) {
+		if (from >= 0 && from != to)
+		{
+			successors[from].push_back(to);
+			++predecessors[to];
+		}
+	};
+
+	// versions of a resource are in the order they were written; culled writers have no needed readers
+	std::vector<Pass> lastWriter(m_vResources.size(), -1);
+	std::vector<std::vector<Pass>> readersSinceWrite(m_vResources.size());
+	for (auto const &version : m_vVersions)
+	{
+		if (version.writer >= 0 && !m_vPasses[version.writer].culled)
+		{
+			addEdge(lastWriter[version.resource], version.writer);
+			for (Pass reader : readersSinceWrite[version.resource])
+				addEdge(reader, version.writer);
+
+			lastWriter[version.resource] = version.writer;
+			readersSinceWrite[version.resource].clear();
+		}
+
+		for (Pass reader : version.readers)
+		{
+			if (m_vPasses[reader].culled)
+				continue;
+
+			addEdge(lastWriter[version.resource], reader);
+			readersSinceWrite[version.resource].push_back(reader);
+		}
+	}
+
+	m_vOrder.clear();
+
+	std::vector<bool> done(passCount, false);
+	size_t remaining = 0u;
+	for (size_t p = 0u; p < passCount; ++p)
+		if (!m_vPasses[p].culled)
+			++remaining;
+
+	while (m_vOrder.size() < remaining)
+	{
+		Pass next = -1;
+		for (size_t p = 0u; p < passCount && next < 0; ++p)
+			if (!m_vPasses[p].culled && !done[p] && predecessors[p] == 0)
+				next = static_cast<Pass>(p);
+
+		if (next < 0)
+			return false; // cycle
+
+		done[next] = true;
+		m_vOrder.push_back(next);
+
+		for (Pass successor : successors[next])
+			--predecessors[successor];
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Finds each resource's lifetime in the execution order and gives
+//          the transients pooled objects, a transient's object becoming free
+//          for the ones starting after its last pass
+//-----------------------------------------------------------------------------
+void FrameGraph::assignPooled()
+{
+	for (auto &node : m_vResources)
+	{
+		node.firstUse = node.lastUse = -1;
+		if (!node.imported)
+			node.object = 0;
+	}
+
+	for (size_t position = 0u; position < m_vOrder.size(); ++position)
+	{
+		const PassNode &pass = m_vPasses[m_vOrder[position]];
+
+		for (int list = 0; list < 2; ++list)
+		{
+			for (Resource version : list == 0 ? pass.reads : pass.writes)
+			{
+				ResourceNode &node = m_vResources[m_vVersions[version].resource];
+				if (node.firstUse < 0)
+					node.firstUse = static_cast<int>(position);
+				node.lastUse = static_cast<int>(position);
+			}
+		}
+	}
+
+	for (auto &pooled : m_vPool)
+		pooled.inUse = false;
+	m_vnAssigned.assign(m_vResources.size(), -1);
+
+	for (int position = 0; position < static_cast<int>(m_vOrder.size()); ++position)
+	{
+		for (size_t r = 0u; r < m_vResources.size(); ++r)
+		{
+			ResourceNode &node = m_vResources[r];
+			if (node.imported || node.firstUse != position)
+				continue;
+
+			m_vnAssigned[r] = acquire(node);
+			if (m_vnAssigned[r] >= 0)
+				node.object = m_vPool[m_vnAssigned[r]].object;
+		}
+
+		for (size_t r = 0u; r < m_vResources.size(); ++r)
+			if (m_vnAssigned[r] >= 0 && m_vResources[r].lastUse == position)
+				m_vPool[m_vnAssigned[r]].inUse = false;
+	}
+}
+
+// A free pooled object matching the resource (the smallest big enough, for buffers), or a new one; -1 if creating it failed
+int FrameGraph::acquire(const ResourceNode & node)
+{
+	int best = -1;
+	for (size_t i = 0u; i < m_vPool.size(); ++i)
+	{
+		const PooledObject &pooled = m_vPool[i];
+		if (pooled.inUse || pooled.buffer != node.buffer)
+			continue;
+
+		if (node.buffer ? pooled.size >= node.size && (best < 0 || pooled.size < m_vPool[best].size) : pooled.desc == node.desc)
+		{
+			best = static_cast<int>(i);
+			if (!node.buffer)
+				break;
+		}
+	}
+
+	if (best < 0)
+	{
+		PooledObject pooled;
+		pooled.buffer = node.buffer;
+		pooled.desc = node.desc;
+		pooled.size = node.size;
+		pooled.object = 0;
+
+		if (node.buffer)
+		{
+			glCreateBuffers(1, &pooled.object);
+			glNamedBufferStorage(pooled.object, node.size, NULL, 0);
+		}
+		else if (node.desc.samples > 1)
+		{
+			glCreateTextures(GL_TEXTURE_2D_MULTISAMPLE, 1, &pooled.object);
+			glTextureStorage2DMultisample(pooled.object, node.desc.samples, node.desc.format, node.desc.width, node.desc.height, GL_TRUE);
+		}
+		else
+		{
+			glCreateTextures(GL_TEXTURE_2D, 1, &pooled.object);
+			glTextureStorage2D(pooled.object, 1, node.desc.format, node.desc.width, node.desc.height);
+			glTextureParameteri(pooled.object, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTextureParameteri(pooled.object, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+
+		if (!pooled.object)
+			return -1;
+
+		m_vPool.push_back(pooled);
+		best = static_cast<int>(m_vPool.size() - 1u);
+	}
+
+	m_vPool[best].inUse = true;
+	m_vPool[best].lastFrame = m_nFrame;
+
+	return best;
+}
+
+// Deletes the pooled objects no frame has used for a while, e.g. after the targets were resized
+void FrameGraph::retire()
+{
+	size_t kept = 0u;
+	for (size_t i = 0u; i < m_vPool.size(); ++i)
+	{
+		if (m_nFrame - m_vPool[i].lastFrame <= FRAME_GRAPH_RETIRE_FRAMES)
+		{
+			m_vPool[kept++] = m_vPool[i];
+			continue;
+		}
+
+		if (m_vPool[i].buffer)
+			glDeleteBuffers(1, &m_vPool[i].object);
+		else
+			glDeleteTextures(1, &m_vPool[i].object);
+	}
+
+	if (kept == m_vPool.size())
+		return;
+
+	m_vPool.resize(kept);
+
+	// deleted textures stay alive while attached to a framebuffer, and their names can come back
+	for (auto &cached : m_vFramebuffers)
+	{
+		if (cached.framebuffer)
+			attach(cached.framebuffer, 0, 0, GL_NONE);
+		cached.color = cached.depth = 0;
+	}
+
+	if (m_ReadFramebuffer.framebuffer)
+		attach(m_ReadFramebuffer.framebuffer, 0, 0, GL_NONE);
+	m_ReadFramebuffer.color = m_ReadFramebuffer.depth = 0;
+}
+
+// Binds the pass framebuffer with its targets attached, or the window's
+void FrameGraph::bindTargets(Pass pass)
+{
+	const PassNode &node = m_vPasses[pass];
+	const ResourceNode *color = node.colorTarget >= 0 ? &m_vResources[m_vVersions[node.colorTarget].resource] : NULL;
+	const ResourceNode *depth = node.depthTarget >= 0 ? &m_vResources[m_vVersions[node.depthTarget].resource] : NULL;
+
+	if (color && color->backbuffer)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return;
+	}
+
+	if (m_vFramebuffers.size() < m_vPasses.size())
+	{
+		CachedFramebuffer empty;
+		empty.framebuffer = 0;
+		empty.color = 0;
+		empty.depth = 0;
+		m_vFramebuffers.resize(m_vPasses.size(), empty);
+	}
+
+	CachedFramebuffer &cached = m_vFramebuffers[pass];
+	if (!cached.framebuffer)
+		glCreateFramebuffers(1, &cached.framebuffer);
+
+	GLuint colorTexture = color ? color->object : 0;
+	GLuint depthTexture = depth ? depth->object : 0;
+	if (cached.color != colorTexture || cached.depth != depthTexture)
+	{
+		attach(cached.framebuffer, colorTexture, depthTexture, depth ? depth->desc.format : GL_NONE);
+		cached.color = colorTexture;
+		cached.depth = depthTexture;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, cached.framebuffer);
+}
+
+void FrameGraph::attach(GLuint framebuffer, GLuint color, GLuint depth, GLenum depthFormat)
+{
+	glNamedFramebufferTexture(framebuffer, GL_COLOR_ATTACHMENT0, color, 0);
+	glNamedFramebufferTexture(framebuffer, GL_DEPTH_STENCIL_ATTACHMENT, 0, 0);
+	if (depth)
+		glNamedFramebufferTexture(framebuffer, isDepthStencilFormat(depthFormat) ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT, depth, 0);
+
+	glNamedFramebufferDrawBuffer(framebuffer, color ? GL_COLOR_ATTACHMENT0 : GL_NONE);
+	glNamedFramebufferReadBuffer(framebuffer, color ? GL_COLOR_ATTACHMENT0 : GL_NONE);
+}
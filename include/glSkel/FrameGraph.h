@@ -0,0 +1,191 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#define FRAME_GRAPH_RETIRE_FRAMES 8 // frames a pooled texture or buffer goes unused before it is deleted
+
+// Passes of one frame declaring the resources they read and write, rebuilt every frame. Writing a resource
+// makes a new version of it, which orders the passes: readers of a version run after its writer and before
+// the next writer. Passes whose writes nothing needs are culled; a pass is needed when it has side effects
+// or writes an output (the window), and so are the writers of what needed passes read. Writing without a
+// clear keeps the previous contents, so counts as reading them.
+// Transient textures and buffers only live from the first to the last pass using them, and are taken from
+// a pool: a pooled object whose previous resource's lifetime has ended is reused for any later one with the
+// same description, and its contents are invalidated rather than cleared, unless the first writer asks for
+// a clear.
+class FrameGraph
+{
+public:
+	// A version of a resource, -1 for none
+	typedef int Resource;
+	// Index of a pass in declaration order, -1 for none
+	typedef int Pass;
+
+	struct TextureDesc
+	{
+		GLsizei			width;
+		GLsizei			height;
+		GLenum			format;
+		GLsizei			samples; // more than 1 for a multisampled texture
+
+		TextureDesc(GLsizei width = 0, GLsizei height = 0, GLenum format = GL_RGBA8, GLsizei samples = 1)
+			: width(width)
+			, height(height)
+			, format(format)
+			, samples(samples)
+		{}
+
+		bool operator==(const TextureDesc &other) const
+		{
+			return width == other.width && height == other.height && format == other.format && samples == other.samples;
+		}
+	};
+
+	typedef std::function<void()> ExecuteFunc;
+
+public:
+	FrameGraph();
+	~FrameGraph();
+
+	// Deletes the pooled objects and framebuffers
+	void destroy();
+
+	// Drops the passes and resources of the previous frame
+	void reset();
+
+	Resource createTexture(const char *name, const TextureDesc &desc);
+	Resource createBuffer(const char *name, GLsizeiptr size);
+	// An object owned elsewhere; it is never cleared or invalidated, and may be 0 when only used for ordering
+	Resource importTexture(const char *name, GLuint texture);
+	// The window's framebuffer, which is an output
+	Resource importBackbuffer(const char *name);
+	// Passes writing the resource's last version are never culled
+	void markOutput(Resource resource);
+
+	Pass addPass(const char *name, const ExecuteFunc &execute);
+	// The pass is never culled, e.g. when it writes something the graph doesn't know about
+	void setSideEffect(Pass pass);
+
+	void read(Pass pass, Resource resource);
+	// Returns the version the pass writes, keeping the contents of the one given unless discarding them
+	Resource write(Pass pass, Resource resource, bool discard = false);
+	// Written as the pass framebuffer's color or depth (and stencil) attachment, which is bound while it executes;
+	// discard when the pass overwrites all of it
+	Resource setColorTarget(Pass pass, Resource texture, bool discard = false);
+	Resource clearColorTarget(Pass pass, Resource texture, const glm::vec4 &value);
+	Resource setDepthTarget(Pass pass, Resource texture, bool discard = false);
+	Resource clearDepthTarget(Pass pass, Resource texture, float value = 1.f);
+
+	// Culls, orders and assigns pooled objects to the transient resources; false if the passes depend on each other in a cycle
+	bool compile();
+	// Runs the passes compiled, in order
+	void execute();
+
+	// While executing: the object behind a resource of a pass that uses it
+	GLuint getTexture(Resource resource);
+	GLuint getBuffer(Resource resource);
+	// While executing: the framebuffer of the pass running, 0 for the window's
+	GLuint getTargetFramebuffer();
+	// While executing: a framebuffer with only the texture attached, for blitting from it; valid until the next call
+	GLuint getReadFramebuffer(Resource texture);
+
+	size_t getPassCount();
+	// In the last compile
+	size_t getCulledPassCount();
+	size_t getTransientCount();
+	// Pooled textures and buffers, which the transients of the last compile were assigned to
+	size_t getPooledCount();
+
+private:
+	struct ResourceNode
+	{
+		std::string		name;
+		bool			buffer;
+		bool			imported;
+		bool			backbuffer;
+		bool			output;
+		TextureDesc		desc;
+		GLsizeiptr		size;
+		GLuint			object; // imported, or the pooled one assigned
+		int				lastVersion;
+		int				firstUse; // position in the execution order, -1 when unused
+		int				lastUse;
+	};
+
+	struct VersionNode
+	{
+		int				resource;
+		Pass			writer; // -1 for the initial version
+		std::vector<Pass> readers;
+	};
+
+	struct PassNode
+	{
+		std::string		name;
+		ExecuteFunc		execute;
+		std::vector<Resource> reads;
+		std::vector<Resource> writes;
+		Resource		colorTarget;
+		Resource		depthTarget;
+		bool			clearColor;
+		bool			clearDepth;
+		glm::vec4		clearColorValue;
+		float			clearDepthValue;
+		bool			sideEffect;
+		bool			culled;
+	};
+
+	struct PooledObject
+	{
+		bool			buffer;
+		TextureDesc		desc;
+		GLsizeiptr		size;
+		GLuint			object;
+		bool			inUse; // by a transient whose lifetime hasn't ended at the pass being assigned
+		unsigned int	lastFrame;
+	};
+
+	// A pass framebuffer kept across frames, re-attached only when its textures change
+	struct CachedFramebuffer
+	{
+		GLuint			framebuffer;
+		GLuint			color;
+		GLuint			depth;
+	};
+
+private:
+	Resource addResource(const ResourceNode &node);
+	Resource addVersion(int resource, Pass writer);
+	bool isValid(Pass pass, Resource resource);
+	Resource setTarget(Pass pass, Resource texture, bool depth, bool discard);
+
+	void cull();
+	bool sort();
+	void assignPooled();
+	int acquire(const ResourceNode &node);
+	void retire();
+
+	void bindTargets(Pass pass);
+	void attach(GLuint framebuffer, GLuint color, GLuint depth, GLenum depthFormat);
+
+private:
+	std::vector<ResourceNode> m_vResources;
+	std::vector<VersionNode> m_vVersions;
+	std::vector<PassNode> m_vPasses;
+	std::vector<Pass> m_vOrder; // passes left after culling, in execution order
+
+	std::vector<PooledObject> m_vPool;
+	std::vector<int> m_vnAssigned; // pooled object per resource, -1 when none
+
+	std::vector<CachedFramebuffer> m_vFramebuffers; // per pass
+	CachedFramebuffer m_ReadFramebuffer;
+
+	unsigned int m_nFrame;
+	bool m_bCompiled;
+	Pass m_nExecuting; // -1 outside execute()
+};
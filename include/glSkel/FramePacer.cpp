@@ -0,0 +1,70 @@
+#include "FramePacer.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+#include <thread>
+
+FramePacer::FramePacer()
+	: m_dPeriod(0.0)
+	, m_bPresented(false)
+	, m_fWaitTime(0.f)
+{
+#ifdef _WIN32
+	// Sleeps are otherwise rounded up to the default ~15.6 ms scheduler tick
+	timeBeginPeriod(1);
+#endif
+}
+
+FramePacer::~FramePacer()
+{
+#ifdef _WIN32
+	timeEndPeriod(1);
+#endif
+}
+
+void FramePacer::setPeriod(double seconds)
+{
+	m_dPeriod = seconds;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Sleeps for most of the time left to the frame's deadline and yields
+//          for the rest, which a sleep could overshoot. A frame that is already
+//          late goes straight through; the deadline after it is paced from its
+//          own present, so a missed one isn't made up for with short frames.
+//-----------------------------------------------------------------------------
+void FramePacer::wait()
+{
+	m_fWaitTime = 0.f;
+
+	if (!m_bPresented || m_dPeriod <= 0.0)
+		return;
+
+	Clock::time_point start = Clock::now();
+	Clock::time_point deadline = m_tpLastPresent + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(m_dPeriod - FRAME_PACER_MARGIN));
+	Clock::time_point sleepUntil = deadline - std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(FRAME_PACER_SPIN));
+
+	if (start >= deadline)
+		return;
+
+	if (start < sleepUntil)
+		std::this_thread::sleep_until(sleepUntil);
+
+	while (Clock::now() < deadline)
+		std::this_thread::yield();
+
+	m_fWaitTime = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
+
+void FramePacer::presented()
+{
+	m_tpLastPresent = Clock::now();
+	m_bPresented = true;
+}
+
+float FramePacer::getWaitTime()
+{
+	return m_fWaitTime;
+}
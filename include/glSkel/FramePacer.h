@@ -0,0 +1,35 @@
+#pragma once
+
+#include <chrono>
+
+#define FRAME_PACER_MARGIN 0.002 // seconds before a present is due that the frame is handed to the swap
+#define FRAME_PACER_SPIN 0.001 // seconds before the handoff that sleeping gives way to yielding, as sleeps overshoot
+
+// Holds a frame back until shortly before its present is due, so the thread sleeps instead of spinning in
+// the swap (or running ahead of the display when there is no vsync). Deadlines follow the last present, which
+// a vsynced swap returns right after, so they stay in phase with the display without knowing its timing.
+class FramePacer
+{
+public:
+	FramePacer();
+	~FramePacer();
+
+	// Seconds between presents, e.g. the monitor's refresh period; 0 doesn't wait at all
+	void setPeriod(double seconds);
+
+	// Sleeps, then yields, until the frame is due to be presented; returns right away when already late
+	void wait();
+	// Once the frame has been presented, i.e. the swap returned
+	void presented();
+
+	// Milliseconds the last wait() held the frame back
+	float getWaitTime();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	double m_dPeriod;
+	bool m_bPresented; // there is a last present to pace from
+	Clock::time_point m_tpLastPresent;
+	float m_fWaitTime;
+};
@@ -0,0 +1,229 @@
+#include "GeometryPool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+
+#include "GLSLpreamble.h"
+
+#define POOL_VERTEX_BINDING		0
+#define POOL_COLOR_BINDING		1
+#define POOL_INSTANCE_BINDING	2
+
+static GLuint createStorage(GLsizeiptr size)
+{
+	GLuint buffer;
+	glCreateBuffers(1, &buffer);
+	glNamedBufferStorage(buffer, size, NULL, GL_DYNAMIC_STORAGE_BIT);
+
+	return buffer;
+}
+
+GeometryPool::GeometryPool()
+	: m_glVAO(0)
+	, m_glPositionBuffer(0)
+	, m_glColorBuffer(0)
+	, m_glIndexBuffer(0)
+	, m_glInstanceBuffer(0)
+{
+}
+
+GeometryPool::~GeometryPool()
+{
+}
+
+bool GeometryPool::init()
+{
+	m_Vertices.grow(GEOMETRY_POOL_INITIAL_VERTICES);
+	m_Indices.grow(GEOMETRY_POOL_INITIAL_INDICES);
+	m_Instances.grow(GEOMETRY_POOL_INITIAL_INSTANCES);
+
+	m_glPositionBuffer = createStorage(GEOMETRY_POOL_INITIAL_VERTICES * sizeof(glm::vec3));
+	m_glColorBuffer = createStorage(GEOMETRY_POOL_INITIAL_VERTICES * sizeof(glm::vec4));
+	m_glIndexBuffer = createStorage(GEOMETRY_POOL_INITIAL_INDICES * sizeof(GLuint));
+	m_glInstanceBuffer = createStorage(GEOMETRY_POOL_INITIAL_INSTANCES * sizeof(Instance));
+
+	glCreateVertexArrays(1, &m_glVAO);
+
+	glEnableVertexArrayAttrib(m_glVAO, POSITION_ATTRIB_LOCATION);
+	glVertexArrayAttribFormat(m_glVAO, POSITION_ATTRIB_LOCATION, 3, GL_FLOAT, GL_FALSE, 0);
+	glVertexArrayAttribBinding(m_glVAO, POSITION_ATTRIB_LOCATION, POOL_VERTEX_BINDING);
+
+	glEnableVertexArrayAttrib(m_glVAO, COLOR_ATTRIB_LOCATION);
+	glVertexArrayAttribFormat(m_glVAO, COLOR_ATTRIB_LOCATION, 4, GL_FLOAT, GL_FALSE, 0);
+	glVertexArrayAttribBinding(m_glVAO, COLOR_ATTRIB_LOCATION, POOL_COLOR_BINDING);
+
+	// Per-instance attributes, ignored by non-instanced shaders
+	glVertexArrayBindingDivisor(m_glVAO, POOL_INSTANCE_BINDING, 1);
+
+	glEnableVertexArrayAttrib(m_glVAO, INSTANCE_POSITION_ATTRIB_LOCATION);
+	glVertexArrayAttribFormat(m_glVAO, INSTANCE_POSITION_ATTRIB_LOCATION, 3, GL_FLOAT, GL_FALSE, offsetof(Instance, position));
+	glVertexArrayAttribBinding(m_glVAO, INSTANCE_POSITION_ATTRIB_LOCATION, POOL_INSTANCE_BINDING);
+
+	glEnableVertexArrayAttrib(m_glVAO, INSTANCE_ORIENTATION_ATTRIB_LOCATION);
+	glVertexArrayAttribFormat(m_glVAO, INSTANCE_ORIENTATION_ATTRIB_LOCATION, 4, GL_FLOAT, GL_FALSE, offsetof(Instance, orientation));
+	glVertexArrayAttribBinding(m_glVAO, INSTANCE_ORIENTATION_ATTRIB_LOCATION, POOL_INSTANCE_BINDING);
+
+	bindBuffers();
+
+	return true;
+}
+
+GeometryPool::Allocation GeometryPool::allocate(GLsizei vertexCount, GLsizei indexCount, GLsizei instanceCount)
+{
+	Allocation alloc;
+	alloc.vertexCount = vertexCount;
+	alloc.indexCount = indexCount;
+	alloc.instanceCount = instanceCount;
+
+	// positions and colors share offsets, so the color buffer is grown alongside
+	GLuint vertexCapacity = m_Vertices.capacity;
+	alloc.baseVertex = static_cast<GLint>(reserve(m_Vertices, m_glPositionBuffer, sizeof(glm::vec3), static_cast<GLuint>(vertexCount)));
+	if (m_Vertices.capacity != vertexCapacity)
+	{
+		GLuint colors = createStorage(m_Vertices.capacity * sizeof(glm::vec4));
+		glCopyNamedBufferSubData(m_glColorBuffer, colors, 0, 0, vertexCapacity * sizeof(glm::vec4));
+		glDeleteBuffers(1, &m_glColorBuffer);
+		m_glColorBuffer = colors;
+		bindBuffers();
+	}
+
+	alloc.firstIndex = reserve(m_Indices, m_glIndexBuffer, sizeof(GLuint), static_cast<GLuint>(indexCount));
+	alloc.baseInstance = reserve(m_Instances, m_glInstanceBuffer, sizeof(Instance), static_cast<GLuint>(instanceCount));
+
+	return alloc;
+}
+
+void GeometryPool::release(Allocation & alloc)
+{
+	if (alloc.vertexCount > 0)
+		m_Vertices.release(static_cast<GLuint>(alloc.baseVertex), static_cast<GLuint>(alloc.vertexCount));
+	if (alloc.indexCount > 0)
+		m_Indices.release(alloc.firstIndex, static_cast<GLuint>(alloc.indexCount));
+	if (alloc.instanceCount > 0)
+		m_Instances.release(alloc.baseInstance, static_cast<GLuint>(alloc.instanceCount));
+
+	alloc = Allocation();
+}
+
+void GeometryPool::uploadVertices(const Allocation & alloc, const glm::vec3 * positions, const glm::vec4 * colors)
+{
+	if (alloc.vertexCount == 0)
+		return;
+
+	glNamedBufferSubData(m_glPositionBuffer, alloc.baseVertex * sizeof(glm::vec3), alloc.vertexCount * sizeof(glm::vec3), positions);
+	glNamedBufferSubData(m_glColorBuffer, alloc.baseVertex * sizeof(glm::vec4), alloc.vertexCount * sizeof(glm::vec4), colors);
+}
+
+void GeometryPool::uploadIndices(const Allocation & alloc, const GLuint * indices)
+{
+	if (alloc.indexCount == 0)
+		return;
+
+	glNamedBufferSubData(m_glIndexBuffer, alloc.firstIndex * sizeof(GLuint), alloc.indexCount * sizeof(GLuint), indices);
+}
+
+void GeometryPool::uploadInstances(const Allocation & alloc, const Instance * instances)
+{
+	if (alloc.instanceCount == 0)
+		return;
+
+	glNamedBufferSubData(m_glInstanceBuffer, alloc.baseInstance * sizeof(Instance), alloc.instanceCount * sizeof(Instance), instances);
+}
+
+GLuint GeometryPool::getVAO()
+{
+	return m_glVAO;
+}
+
+GLuint GeometryPool::getInstanceBuffer()
+{
+	return m_glInstanceBuffer;
+}
+
+// Returns the offset of count elements in the buffer, growing it if they do not fit
+GLuint GeometryPool::reserve(RangeAllocator & ranges, GLuint & buffer, GLsizeiptr elementSize, GLuint count)
+{
+	if (count == 0u)
+		return 0u;
+
+	GLuint offset;
+	if (ranges.allocate(count, offset))
+		return offset;
+
+	GLuint oldCapacity = ranges.capacity;
+	ranges.grow((std::max)(oldCapacity * 2u, oldCapacity + count));
+
+	GLuint grown = createStorage(ranges.capacity * elementSize);
+	glCopyNamedBufferSubData(buffer, grown, 0, 0, oldCapacity * elementSize);
+	glDeleteBuffers(1, &buffer);
+	buffer = grown;
+
+	bindBuffers();
+
+	ranges.allocate(count, offset);
+
+	return offset;
+}
+
+void GeometryPool::bindBuffers()
+{
+	glVertexArrayVertexBuffer(m_glVAO, POOL_VERTEX_BINDING, m_glPositionBuffer, 0, sizeof(glm::vec3));
+	glVertexArrayVertexBuffer(m_glVAO, POOL_COLOR_BINDING, m_glColorBuffer, 0, sizeof(glm::vec4));
+	glVertexArrayVertexBuffer(m_glVAO, POOL_INSTANCE_BINDING, m_glInstanceBuffer, 0, sizeof(Instance));
+	glVertexArrayElementBuffer(m_glVAO, m_glIndexBuffer);
+}
+
+bool GeometryPool::RangeAllocator::allocate(GLuint count, GLuint & offset)
+{
+	for (auto it = mapFree.begin(); it != mapFree.end(); ++it)
+	{
+		if (it->second < count)
+			continue;
+
+		offset = it->first;
+		GLuint remaining = it->second - count;
+
+		mapFree.erase(it);
+		if (remaining > 0u)
+			mapFree[offset + count] = remaining;
+
+		return true;
+	}
+
+	return false;
+}
+
+void GeometryPool::RangeAllocator::release(GLuint offset, GLuint count)
+{
+	auto next = mapFree.lower_bound(offset);
+
+	// merge with the free range after
+	if (next != mapFree.end() && next->first == offset + count)
+	{
+		count += next->second;
+		next = mapFree.erase(next);
+	}
+
+	// and the one before
+	if (next != mapFree.begin())
+	{
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset)
+		{
+			prev->second += count;
+			return;
+		}
+	}
+
+	mapFree[offset] = count;
+}
+
+void GeometryPool::RangeAllocator::grow(GLuint newCapacity)
+{
+	GLuint added = newCapacity - capacity;
+	GLuint offset = capacity;
+	capacity = newCapacity;
+
+	release(offset, added);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <map>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#define GEOMETRY_POOL_INITIAL_VERTICES	(1u << 18)
+#define GEOMETRY_POOL_INITIAL_INDICES	(1u << 20)
+#define GEOMETRY_POOL_INITIAL_INSTANCES	(1u << 14)
+
+// Vertex, index and instance storage shared by all static meshes, suballocated from a few large buffers
+// behind a single VAO, so that meshes drawn with the same program can be batched into one indirect draw.
+// Buffers grow (and are copied over) when an allocation does not fit.
+class GeometryPool
+{
+public:
+	// Per-instance vertex data, for meshes drawn once per instance
+	struct Instance {
+		glm::vec3 position;
+		glm::quat orientation;
+	};
+
+	// Where a mesh lives in the pool; its indices are relative to baseVertex
+	struct Allocation {
+		GLint baseVertex;
+		GLuint firstIndex;
+		GLuint baseInstance;
+		GLsizei vertexCount;
+		GLsizei indexCount;
+		GLsizei instanceCount;
+
+		Allocation() : baseVertex(0), firstIndex(0u), baseInstance(0u), vertexCount(0), indexCount(0), instanceCount(0) {}
+	};
+
+	// Draw of pool indices, as read by glMultiDrawElementsIndirect
+	struct DrawElementsIndirectCommand {
+		GLuint count;
+		GLuint instanceCount;
+		GLuint firstIndex;
+		GLint baseVertex;
+		GLuint baseInstance;
+	};
+
+public:
+	GeometryPool();
+	~GeometryPool();
+
+	bool init();
+
+	Allocation allocate(GLsizei vertexCount, GLsizei indexCount, GLsizei instanceCount = 0);
+	void release(Allocation &alloc);
+
+	void uploadVertices(const Allocation &alloc, const glm::vec3 *positions, const glm::vec4 *colors);
+	void uploadIndices(const Allocation &alloc, const GLuint *indices);
+	void uploadInstances(const Allocation &alloc, const Instance *instances);
+
+	GLuint getVAO();
+	// Instance data, for reading as floats from shaders; replaced when the pool grows
+	GLuint getInstanceBuffer();
+
+private:
+	// First-fit allocator over the elements of one buffer, with free ranges merged on release
+	struct RangeAllocator {
+		GLuint capacity;
+		std::map<GLuint, GLuint> mapFree; // offset to size
+
+		RangeAllocator() : capacity(0u) {}
+
+		bool allocate(GLuint count, GLuint &offset);
+		void release(GLuint offset, GLuint count);
+		void grow(GLuint newCapacity);
+	};
+
+	GLuint reserve(RangeAllocator &ranges, GLuint &buffer, GLsizeiptr elementSize, GLuint count);
+
+	void bindBuffers();
+
+private:
+	GLuint m_glVAO;
+	GLuint m_glPositionBuffer;
+	GLuint m_glColorBuffer;
+	GLuint m_glIndexBuffer;
+	GLuint m_glInstanceBuffer;
+
+	RangeAllocator m_Vertices;
+	RangeAllocator m_Indices;
+	RangeAllocator m_Instances;
+};
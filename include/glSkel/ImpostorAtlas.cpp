@@ -0,0 +1,173 @@
+#include "ImpostorAtlas.h"
+
+#include <cmath>
+#include <cstddef>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "GLSLpreamble.h"
+
+#define IMPOSTOR_ATLAS_SIZE (IMPOSTOR_GRID_SIZE * IMPOSTOR_CELL_SIZE)
+#define IMPOSTOR_MIP_LEVELS 5 // stops at 8x8 pixel views so mips never mix neighbouring cells
+
+ImpostorAtlas::ImpostorAtlas()
+	: m_glTexture(0)
+	, m_glDepthRBO(0)
+	, m_glFBO(0)
+	, m_glVAO(0)
+	, m_glInstanceVBO(0)
+	, m_nVariants(0)
+{
+}
+
+ImpostorAtlas::~ImpostorAtlas()
+{
+}
+
+bool ImpostorAtlas::init()
+{
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &m_glTexture);
+	glTextureStorage3D(m_glTexture, IMPOSTOR_MIP_LEVELS, GL_RGBA8, IMPOSTOR_ATLAS_SIZE, IMPOSTOR_ATLAS_SIZE, IMPOSTOR_MAX_VARIANTS);
+	glTextureParameteri(m_glTexture, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTextureParameteri(m_glTexture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTextureParameteri(m_glTexture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTextureParameteri(m_glTexture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glCreateRenderbuffers(1, &m_glDepthRBO);
+	glNamedRenderbufferStorage(m_glDepthRBO, GL_DEPTH_COMPONENT24, IMPOSTOR_ATLAS_SIZE, IMPOSTOR_ATLAS_SIZE);
+
+	glCreateFramebuffers(1, &m_glFBO);
+	glNamedFramebufferRenderbuffer(m_glFBO, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_glDepthRBO);
+	glNamedFramebufferTextureLayer(m_glFBO, GL_COLOR_ATTACHMENT0, m_glTexture, 0, 0);
+
+	if (glCheckNamedFramebufferStatus(m_glFBO, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		return false;
+
+	// Cards are expanded from gl_VertexID, so only per-instance attributes are needed
+	glCreateBuffers(1, &m_glInstanceVBO);
+	glCreateVertexArrays(1, &m_glVAO);
+	glVertexArrayVertexBuffer(m_glVAO, 0, m_glInstanceVBO, 0, sizeof(Instance));
+	glVertexArrayBindingDivisor(m_glVAO, 0, 1);
+
+	glEnableVertexArrayAttrib(m_glVAO, INSTANCE_POSITION_ATTRIB_LOCATION);
+	glVertexArrayAttribFormat(m_glVAO, INSTANCE_POSITION_ATTRIB_LOCATION, 4, GL_FLOAT, GL_FALSE, offsetof(Instance, positionRadius));
+	glVertexArrayAttribBinding(m_glVAO, INSTANCE_POSITION_ATTRIB_LOCATION, 0);
+
+	glEnableVertexArrayAttrib(m_glVAO, INSTANCE_ORIENTATION_ATTRIB_LOCATION);
+	glVertexArrayAttribFormat(m_glVAO, INSTANCE_ORIENTATION_ATTRIB_LOCATION, 4, GL_FLOAT, GL_FALSE, offsetof(Instance, orientation));
+	glVertexArrayAttribBinding(m_glVAO, INSTANCE_ORIENTATION_ATTRIB_LOCATION, 0);
+
+	glEnableVertexArrayAttrib(m_glVAO, IMPOSTOR_PARAMS_ATTRIB_LOCATION);
+	glVertexArrayAttribFormat(m_glVAO, IMPOSTOR_PARAMS_ATTRIB_LOCATION, 2, GL_FLOAT, GL_FALSE, offsetof(Instance, params));
+	glVertexArrayAttribBinding(m_glVAO, IMPOSTOR_PARAMS_ATTRIB_LOCATION, 0);
+
+	return true;
+}
+
+int ImpostorAtlas::allocateVariant()
+{
+	if (m_nVariants == IMPOSTOR_MAX_VARIANTS)
+		return -1;
+
+	return m_nVariants++;
+}
+
+int ImpostorAtlas::getVariantCount()
+{
+	return m_nVariants;
+}
+
+glm::mat4 ImpostorAtlas::getCellView(int cell, const glm::vec3 & center, float radius)
+{
+	glm::vec3 dir = getCellDirection(cell);
+	glm::vec3 up = std::abs(dir.y) > 0.99f ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+
+	return glm::lookAt(center + dir * 2.f * radius, center, up);
+}
+
+glm::mat4 ImpostorAtlas::getCellProjection(float radius)
+{
+	return glm::ortho(-radius, radius, -radius, radius, radius, 3.f * radius);
+}
+
+void ImpostorAtlas::beginBake(int variant, bool clear)
+{
+	glNamedFramebufferTextureLayer(m_glFBO, GL_COLOR_ATTACHMENT0, m_glTexture, 0, variant);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_glFBO);
+
+	if (clear)
+	{
+		glDisable(GL_SCISSOR_TEST);
+		glViewport(0, 0, IMPOSTOR_ATLAS_SIZE, IMPOSTOR_ATLAS_SIZE);
+		glClearColor(0.f, 0.f, 0.f, 0.f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
+
+	glEnable(GL_SCISSOR_TEST);
+}
+
+void ImpostorAtlas::bindCell(int cell)
+{
+	GLint x = (cell % IMPOSTOR_GRID_SIZE) * IMPOSTOR_CELL_SIZE;
+	GLint y = (cell / IMPOSTOR_GRID_SIZE) * IMPOSTOR_CELL_SIZE;
+
+	glViewport(x, y, IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE);
+	glScissor(x, y, IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE);
+}
+
+void ImpostorAtlas::endBake(bool complete)
+{
+	glDisable(GL_SCISSOR_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (complete)
+		glGenerateTextureMipmap(m_glTexture);
+}
+
+void ImpostorAtlas::addInstance(int variant, const glm::vec3 & center, const glm::quat & orientation, float radius, float opacity)
+{
+	Instance inst;
+	inst.positionRadius = glm::vec4(center, radius);
+	inst.orientation = orientation;
+	inst.params = glm::vec2(static_cast<float>(variant), opacity);
+
+	m_vInstances.push_back(inst);
+}
+
+// Draws and clears all instances added since the last draw
+void ImpostorAtlas::draw(GLuint shader)
+{
+	if (m_vInstances.empty())
+		return;
+
+	glNamedBufferData(m_glInstanceVBO, m_vInstances.size() * sizeof(Instance), m_vInstances.data(), GL_STREAM_DRAW);
+
+	glUseProgram(shader);
+	glBindTextureUnit(DIFFUSE_TEXTURE_BINDING, m_glTexture);
+
+	glBindVertexArray(m_glVAO);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, static_cast<GLsizei>(m_vInstances.size()));
+	glBindVertexArray(0);
+
+	m_vInstances.clear();
+}
+
+GLuint ImpostorAtlas::getTexture()
+{
+	return m_glTexture;
+}
+
+// Octahedral mapping with +Y at the center of the grid and -Y at its corners
+glm::vec3 ImpostorAtlas::getCellDirection(int cell)
+{
+	glm::vec2 e = (glm::vec2(cell % IMPOSTOR_GRID_SIZE, cell / IMPOSTOR_GRID_SIZE) + 0.5f) / static_cast<float>(IMPOSTOR_GRID_SIZE) * 2.f - 1.f;
+
+	glm::vec3 dir(e.x, 1.f - std::abs(e.x) - std::abs(e.y), e.y);
+	if (dir.y < 0.f)
+	{
+		dir.x = (1.f - std::abs(e.y)) * (e.x >= 0.f ? 1.f : -1.f);
+		dir.z = (1.f - std::abs(e.x)) * (e.y >= 0.f ? 1.f : -1.f);
+	}
+
+	return glm::normalize(dir);
+}
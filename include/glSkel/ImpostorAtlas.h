@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#define IMPOSTOR_CELL_SIZE 128 // pixels per view
+#define IMPOSTOR_MAX_VARIANTS 8
+
+// Atlas of pre-rendered views of objects, one texture array layer per variant. Views are laid out on an
+// octahedral grid covering the whole sphere of directions, so the one nearest to any camera direction is
+// found with a single encode. Far objects are drawn as a card textured with that view.
+class ImpostorAtlas
+{
+public:
+	struct Instance {
+		glm::vec4 positionRadius; // world space center of the bounding sphere and its radius
+		glm::quat orientation; // baked space -> world space
+		glm::vec2 params; // variant, opacity
+	};
+
+public:
+	ImpostorAtlas();
+	~ImpostorAtlas();
+
+	bool init();
+
+	// Returns a new atlas layer, or -1 if all are in use
+	int allocateVariant();
+	int getVariantCount();
+
+	// Ortho camera of a view cell, looking at the bounding sphere (center, radius) from the cell's direction
+	glm::mat4 getCellView(int cell, const glm::vec3 &center, float radius);
+	glm::mat4 getCellProjection(float radius);
+
+	// Binds the atlas layer of the variant for rendering, clearing it when a bake starts; each bindCell() then
+	// restricts drawing to one view. A bake may span several begin/end pairs; mipmaps are built once it is complete.
+	void beginBake(int variant, bool clear);
+	void bindCell(int cell);
+	void endBake(bool complete);
+
+	void addInstance(int variant, const glm::vec3 &center, const glm::quat &orientation, float radius, float opacity);
+	void draw(GLuint shader);
+
+	GLuint getTexture();
+
+	// Direction of the center of a grid cell; matches octDecode() in impostor.vert
+	static glm::vec3 getCellDirection(int cell);
+
+private:
+	GLuint m_glTexture;
+	GLuint m_glDepthRBO;
+	GLuint m_glFBO;
+	GLuint m_glVAO;
+	GLuint m_glInstanceVBO;
+
+	int m_nVariants;
+
+	std::vector<Instance> m_vInstances;
+};
@@ -0,0 +1,384 @@
+#include "InstanceCuller.h"
+#include "GeometryPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <glm/gtc/quaternion.hpp>
+
+#define VALIDATION_EPSILON 1e-3f // relative band around plane and LOD thresholds where the GPU may round either way
+#define OCCLUSION_STATS_WAIT_NS 1000000ull // per wait on a stats slot's fence, repeated until it signals
+
+InstanceCuller::InstanceCuller()
+	: m_pCullProgram(NULL)
+	, m_pCompactProgram(NULL)
+	, m_glCounterBuffer(0)
+	, m_glVisibleBuffer(0)
+	, m_glCommandBuffer(0)
+	, m_glCommandInfoBuffer(0)
+	, m_glDrawCountBuffer(0)
+	, m_nCounterCapacity(0)
+	, m_nVisibleCapacity(0)
+	, m_nCommandCapacity(0)
+	, m_nCommandInfoCapacity(0)
+	, m_glVisibilityBuffer(0)
+	, m_nVisibilityCapacity(0)
+	, m_glOcclusionStatsBuffer(0)
+	, m_pOcclusionStats(NULL)
+	, m_nStatsStride(0)
+	, m_nStatsSlot(0u)
+	, m_nOccludedInstances(0u)
+	, m_nDraws(0u)
+	, m_nMaxLevels(0u)
+	, m_bValidate(false)
+	, m_nValidatedInstances(0u)
+	, m_nValidationMismatches(0u)
+{
+	for (auto &fence : m_arrStatsFences)
+		fence = 0;
+}
+
+InstanceCuller::~InstanceCuller()
+{
+}
+
+bool InstanceCuller::init()
+{
+	glCreateBuffers(1, &m_glDrawCountBuffer);
+	glNamedBufferStorage(m_glDrawCountBuffer, MAX_LOD_LEVELS * sizeof(GLuint), NULL, 0);
+
+	GLint alignment;
+	glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	m_nStatsStride = (std::max)(static_cast<GLsizeiptr>(alignment), static_cast<GLsizeiptr>(sizeof(GLuint)));
+
+	GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glCreateBuffers(1, &m_glOcclusionStatsBuffer);
+	glNamedBufferStorage(m_glOcclusionStatsBuffer, STREAM_BUFFER_REGIONS * m_nStatsStride, NULL, flags);
+	glClearNamedBufferData(m_glOcclusionStatsBuffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+	m_pOcclusionStats = static_cast<const char*>(glMapNamedBufferRange(m_glOcclusionStatsBuffer, 0, STREAM_BUFFER_REGIONS * m_nStatsStride, flags));
+	if (!m_pOcclusionStats)
+		return false;
+
+	return m_DrawRing.init(GL_SHADER_STORAGE_BUFFER, INSTANCE_CULLER_INITIAL_DRAWS * sizeof(CulledDraw));
+}
+
+void InstanceCuller::setPrograms(GLuint * cullProgram, GLuint * compactProgram)
+{
+	m_pCullProgram = cullProgram;
+	m_pCompactProgram = compactProgram;
+}
+
+bool InstanceCuller::isReady()
+{
+	return m_pCullProgram && *m_pCullProgram && m_pCompactProgram && *m_pCompactProgram;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Gives each draw instanceCount visible slots per level, then runs
+//          the culling pass over every instance and the packing pass over
+//          every level
+//-----------------------------------------------------------------------------
+void InstanceCuller::cull(std::vector<CulledDraw>& draws, GLuint instanceBuffer, float lodFullDetailSize, GLint phase, GLuint depthPyramid)
+{
+	m_nDraws = static_cast<GLuint>(draws.size());
+	if (m_nDraws == 0u || !isReady())
+		return;
+
+	GLuint visibleSlots = 0u;
+	GLuint maxInstances = 0u;
+	m_nMaxLevels = 0u;
+	for (auto &draw : draws)
+	{
+		draw.visibleBase = visibleSlots;
+		visibleSlots += draw.instanceCount * draw.levels;
+		maxInstances = (std::max)(maxInstances, draw.instanceCount);
+		m_nMaxLevels = (std::max)(m_nMaxLevels, draw.levels);
+	}
+
+	reserve(m_glCounterBuffer, m_nCounterCapacity, m_nDraws * MAX_LOD_LEVELS * sizeof(GLuint));
+	reserve(m_glVisibleBuffer, m_nVisibleCapacity, (std::max)(visibleSlots, 1u) * sizeof(GLuint));
+	reserve(m_glCommandBuffer, m_nCommandCapacity, m_nDraws * MAX_LOD_LEVELS * sizeof(GeometryPool::DrawElementsIndirectCommand));
+	reserve(m_glCommandInfoBuffer, m_nCommandInfoCapacity, m_nDraws * MAX_LOD_LEVELS * sizeof(glm::uvec2));
+
+	// instances start out hidden, which the occlusion phase corrects on the first frame
+	GLint64 instanceBufferSize;
+	glGetNamedBufferParameteri64v(instanceBuffer, GL_BUFFER_SIZE, &instanceBufferSize);
+	if (reserve(m_glVisibilityBuffer, m_nVisibilityCapacity, instanceBufferSize / (INSTANCE_DATA_FLOATS * sizeof(float)) * sizeof(GLuint)))
+		glClearNamedBufferData(m_glVisibilityBuffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+	GLsizeiptr drawsSize = draws.size() * sizeof(CulledDraw);
+	GLintptr drawsOffset = m_DrawRing.write(draws.data(), drawsSize);
+
+	glClearNamedBufferSubData(m_glCounterBuffer, GL_R32UI, 0, m_nDraws * MAX_LOD_LEVELS * sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_DATA_STORAGE_BUFFER_BINDING, instanceBuffer);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, CULLED_DRAWS_STORAGE_BUFFER_BINDING, m_DrawRing.getBuffer(), drawsOffset, drawsSize);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULL_COUNTERS_STORAGE_BUFFER_BINDING, m_glCounterBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_INSTANCES_STORAGE_BUFFER_BINDING, m_glVisibleBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLED_COMMANDS_STORAGE_BUFFER_BINDING, m_glCommandBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLED_COMMAND_INFO_STORAGE_BUFFER_BINDING, m_glCommandInfoBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLED_DRAW_COUNTS_STORAGE_BUFFER_BINDING, m_glDrawCountBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_VISIBILITY_STORAGE_BUFFER_BINDING, m_glVisibilityBuffer);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, OCCLUSION_STATS_STORAGE_BUFFER_BINDING, m_glOcclusionStatsBuffer, m_nStatsSlot * m_nStatsStride, sizeof(GLuint));
+
+	if (phase == CULL_PHASE_OCCLUSION)
+		glBindTextureUnit(DEPTH_PYRAMID_TEXTURE_BINDING, depthPyramid);
+
+	// one row of work groups per draw
+	glUseProgram(*m_pCullProgram);
+	glUniform1f(LOD_FULL_DETAIL_SIZE_UNIFORM_LOCATION, lodFullDetailSize);
+	glUniform1i(CULL_PHASE_UNIFORM_LOCATION, phase);
+	glDispatchCompute((maxInstances + INSTANCE_CULL_THREADS - 1u) / INSTANCE_CULL_THREADS, m_nDraws, 1u);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	glUseProgram(*m_pCompactProgram);
+	glUniform1ui(CULLED_DRAW_COUNT_UNIFORM_LOCATION, m_nDraws);
+	glDispatchCompute(1u, 1u, 1u);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+	glUseProgram(0);
+
+	if (phase == CULL_PHASE_OCCLUSION)
+		glBindTextureUnit(DEPTH_PYRAMID_TEXTURE_BINDING, 0);
+
+	if (m_bValidate)
+		validate(draws, instanceBuffer, lodFullDetailSize, phase);
+}
+
+void InstanceCuller::draw(GLenum primitiveType, GLuint program)
+{
+	if (m_nDraws == 0u || !isReady())
+		return;
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_glCommandBuffer);
+	if (GLEW_ARB_indirect_parameters)
+		glBindBuffer(GL_PARAMETER_BUFFER_ARB, m_glDrawCountBuffer);
+
+	for (GLuint lod = 0u; lod < m_nMaxLevels; ++lod)
+	{
+		GLintptr commands = lod * m_nDraws * sizeof(GeometryPool::DrawElementsIndirectCommand);
+		glProgramUniform1ui(program, CULLED_COMMAND_OFFSET_UNIFORM_LOCATION, lod * m_nDraws);
+
+		if (GLEW_ARB_indirect_parameters)
+			glMultiDrawElementsIndirectCountARB(primitiveType, GL_UNSIGNED_INT, reinterpret_cast<const void*>(commands), lod * sizeof(GLuint), static_cast<GLsizei>(m_nDraws), 0);
+		else
+			glMultiDrawElementsIndirect(primitiveType, GL_UNSIGNED_INT, reinterpret_cast<const void*>(commands), static_cast<GLsizei>(m_nDraws), 0);
+	}
+
+	if (GLEW_ARB_indirect_parameters)
+		glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Fences the frame's occlusion count, then reads back and clears the
+//          slot of the oldest frame in flight for the next frame to use
+//-----------------------------------------------------------------------------
+void InstanceCuller::fence()
+{
+	m_DrawRing.fence();
+
+	m_nValidatedInstances = 0u;
+	m_nValidationMismatches = 0u;
+
+	glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+
+	if (m_arrStatsFences[m_nStatsSlot])
+		glDeleteSync(m_arrStatsFences[m_nStatsSlot]);
+	m_arrStatsFences[m_nStatsSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	m_nStatsSlot = (m_nStatsSlot + 1u) % STREAM_BUFFER_REGIONS;
+
+	GLsync &oldest = m_arrStatsFences[m_nStatsSlot];
+	if (!oldest)
+		return;
+
+	GLenum result;
+	do {
+		result = glClientWaitSync(oldest, GL_SYNC_FLUSH_COMMANDS_BIT, OCCLUSION_STATS_WAIT_NS);
+	} while (result == GL_TIMEOUT_EXPIRED);
+
+	glDeleteSync(oldest);
+	oldest = 0;
+
+	m_nOccludedInstances = *reinterpret_cast<const GLuint*>(m_pOcclusionStats + m_nStatsSlot * m_nStatsStride);
+	glClearNamedBufferSubData(m_glOcclusionStatsBuffer, GL_R32UI, m_nStatsSlot * m_nStatsStride, sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+}
+
+GLuint InstanceCuller::getOccludedInstances()
+{
+	return m_nOccludedInstances;
+}
+
+void InstanceCuller::setValidation(bool validate)
+{
+	m_bValidate = validate;
+}
+
+GLuint InstanceCuller::getValidatedInstances()
+{
+	return m_nValidatedInstances;
+}
+
+GLuint InstanceCuller::getValidationMismatches()
+{
+	return m_nValidationMismatches;
+}
+
+// Buffers only written by the GPU, replaced by a bigger one when too small; returns whether it was
+bool InstanceCuller::reserve(GLuint & buffer, GLsizeiptr & capacity, GLsizeiptr size)
+{
+	if (buffer && size <= capacity)
+		return false;
+
+	if (buffer)
+		glDeleteBuffers(1, &buffer);
+
+	capacity = (std::max)(size, capacity * 2);
+
+	glCreateBuffers(1, &buffer);
+	glNamedBufferStorage(buffer, capacity, NULL, 0);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Repeats the cull on the CPU with what the GPU read (the bound frame
+//          uniforms and the instance buffer) and compares which level list, if
+//          any, each instance ended up in. Instances within the epsilon band
+//          of a frustum plane or a LOD threshold may go either way. The
+//          occlusion phases are only checked for what they list, as what they
+//          leave out also depends on earlier frames and the depth pyramid.
+//-----------------------------------------------------------------------------
+bool InstanceCuller::validate(const std::vector<CulledDraw>& draws, GLuint instanceBuffer, float lodFullDetailSize, GLint phase)
+{
+	struct {
+		glm::vec4 v4Viewport;
+		glm::mat4 m4View;
+		glm::mat4 m4Projection;
+		glm::mat4 m4ViewProjection;
+	} frame;
+
+	GLint frameBuffer = 0;
+	GLint64 frameOffset = 0;
+	glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, SCENE_UNIFORM_BUFFER_LOCATION, &frameBuffer);
+	glGetInteger64i_v(GL_UNIFORM_BUFFER_START, SCENE_UNIFORM_BUFFER_LOCATION, &frameOffset);
+	glGetNamedBufferSubData(frameBuffer, frameOffset, sizeof(frame), &frame);
+
+	std::vector<GLuint> counters(m_nDraws * MAX_LOD_LEVELS);
+	glGetNamedBufferSubData(m_glCounterBuffer, 0, counters.size() * sizeof(GLuint), counters.data());
+
+	GLuint drawCounts[MAX_LOD_LEVELS];
+	glGetNamedBufferSubData(m_glDrawCountBuffer, 0, sizeof(drawCounts), drawCounts);
+
+	unsigned mismatches = 0u;
+	unsigned checked = 0u;
+
+	glm::vec4 planes[6];
+	for (int i = 0; i < 3; ++i)
+	{
+		glm::vec4 row(frame.m4ViewProjection[0][i], frame.m4ViewProjection[1][i], frame.m4ViewProjection[2][i], frame.m4ViewProjection[3][i]);
+		glm::vec4 w(frame.m4ViewProjection[0][3], frame.m4ViewProjection[1][3], frame.m4ViewProjection[2][3], frame.m4ViewProjection[3][3]);
+		planes[2 * i] = (w + row) / glm::length(glm::vec3(w + row));
+		planes[2 * i + 1] = (w - row) / glm::length(glm::vec3(w - row));
+	}
+
+	std::vector<float> instances;
+	std::vector<GLuint> visible;
+	std::vector<int> gpuLOD;
+
+	for (GLuint d = 0u; d < m_nDraws; ++d)
+	{
+		const CulledDraw &draw = draws[d];
+		if (draw.instanceCount == 0u)
+			continue;
+
+		instances.resize(draw.instanceCount * INSTANCE_DATA_FLOATS);
+		glGetNamedBufferSubData(instanceBuffer, draw.baseInstance * INSTANCE_DATA_FLOATS * sizeof(float), instances.size() * sizeof(float), instances.data());
+
+		visible.resize(draw.instanceCount * draw.levels);
+		glGetNamedBufferSubData(m_glVisibleBuffer, draw.visibleBase * sizeof(GLuint), visible.size() * sizeof(GLuint), visible.data());
+
+		// level each instance was listed at by the GPU, -1 if culled
+		gpuLOD.assign(draw.instanceCount, -1);
+		for (GLuint lod = 0u; lod < draw.levels; ++lod)
+		{
+			GLuint count = counters[d * MAX_LOD_LEVELS + lod];
+			if (count > draw.instanceCount)
+			{
+				++mismatches;
+				continue;
+			}
+
+			for (GLuint slot = 0u; slot < count; ++slot)
+			{
+				GLuint instance = visible[lod * draw.instanceCount + slot] - draw.baseInstance;
+				if (instance >= draw.instanceCount || gpuLOD[instance] >= 0)
+					++mismatches; // out of range or listed twice
+				else
+					gpuLOD[instance] = static_cast<int>(lod);
+			}
+		}
+
+		for (GLuint i = 0u; i < draw.instanceCount; ++i, ++checked)
+		{
+			const float *data = &instances[i * INSTANCE_DATA_FLOATS];
+			glm::vec3 position(data[0], data[1], data[2]);
+			glm::quat orientation(data[6], data[3], data[4], data[5]);
+
+			glm::vec3 center = glm::vec3(draw.model * glm::vec4(position + orientation * glm::vec3(draw.bounds), 1.f));
+			float radius = draw.bounds.w * draw.scale;
+			float band = VALIDATION_EPSILON * (std::max)(radius, 1.f);
+
+			bool ambiguous = false;
+			bool inside = true;
+			for (auto const &plane : planes)
+			{
+				float distance = glm::dot(glm::vec3(plane), center) + plane.w + radius;
+				ambiguous |= std::abs(distance) < band;
+				inside &= distance >= 0.f;
+			}
+
+			int lod = -1;
+			if (inside)
+			{
+				lod = 0;
+				float distance = -(frame.m4View * glm::vec4(center, 1.f)).z;
+				if (draw.levels > 1u && distance > radius)
+				{
+					float screenSize = radius / distance * frame.m4Projection[1][1] * frame.v4Viewport.w;
+					for (float size = lodFullDetailSize * 0.5f; screenSize < size && lod < static_cast<int>(draw.levels) - 1; size *= 0.5f)
+						++lod;
+
+					float size = lodFullDetailSize * 0.5f;
+					for (GLuint level = 1u; level < draw.levels; ++level, size *= 0.5f)
+						ambiguous |= std::abs(screenSize - size) < VALIDATION_EPSILON * size;
+				}
+			}
+
+			if (!ambiguous && gpuLOD[i] != lod && (phase == CULL_PHASE_ALL || gpuLOD[i] >= 0))
+				++mismatches;
+		}
+	}
+
+	// the packed commands must cover exactly the draws with visible instances at each level
+	for (GLuint lod = 0u; lod < m_nMaxLevels; ++lod)
+	{
+		GLuint expected = 0u;
+		for (GLuint d = 0u; d < m_nDraws; ++d)
+			if (lod < draws[d].levels && counters[d * MAX_LOD_LEVELS + lod] > 0u)
+				++expected;
+
+		if (drawCounts[lod] != expected)
+			++mismatches;
+	}
+
+	if (mismatches > 0u)
+		fprintf(stderr, "Instance culling: %u mismatches between GPU and CPU over %u instances\n", mismatches, checked);
+
+	m_nValidatedInstances += checked;
+	m_nValidationMismatches += mismatches;
+
+	return mismatches == 0u;
+}
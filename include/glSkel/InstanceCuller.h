@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include "GLSLpreamble.h"
+#include "StreamBuffer.h"
+
+#define INSTANCE_CULLER_INITIAL_DRAWS 64 // culled draws per frame, grown as needed
+
+// Frustum culls and picks the LOD of every instance of instanced geometry pool draws on the GPU. A compute
+// pass appends the visible instances of each draw to per-level lists, a second one packs the draws with
+// visible instances into one run of indirect commands per level, which are drawn with their count read
+// from the GPU (ARB_indirect_parameters) or, without it, with the empty commands left in.
+// Culls can also run in two phases around a DepthPyramid: first the instances that were visible in the
+// last occlusion cull, then, once the pyramid has been built from what that drew, those not hidden in it.
+class InstanceCuller
+{
+public:
+	// std430 layout of the CulledDraw struct in the culling shaders
+	struct CulledDraw {
+		glm::mat4 model;
+		glm::vec4 bounds; // bounding sphere of one instance, in the instance's frame
+		GLuint firstIndex[MAX_LOD_LEVELS];
+		GLuint indexCount[MAX_LOD_LEVELS];
+		GLint baseVertex;
+		GLuint baseInstance;
+		GLuint instanceCount;
+		GLuint levels;
+		GLuint visibleBase; // set when culled
+		float scale; // largest axis scale of the model transform
+		GLuint padding[2];
+	};
+
+public:
+	InstanceCuller();
+	~InstanceCuller();
+
+	bool init();
+
+	void setPrograms(GLuint *cullProgram, GLuint *compactProgram);
+	// False until both compute programs have linked
+	bool isReady();
+
+	// Culls the draws' instances (read from instanceBuffer, INSTANCE_DATA_FLOATS each) against the bound frame uniforms.
+	// phase is one of the CULL_PHASE_* definitions; CULL_PHASE_OCCLUSION also tests them against the depth pyramid texture (none: nothing is hidden).
+	void cull(std::vector<CulledDraw> &draws, GLuint instanceBuffer, float lodFullDetailSize, GLint phase = CULL_PHASE_ALL, GLuint depthPyramid = 0);
+	// Draws the visible instances of the last cull with program, which must be bound and reads them through the command info
+	void draw(GLenum primitiveType, GLuint program);
+
+	// Marks the end of the frame's culls
+	void fence();
+
+	// Instances hidden by the occlusion culls of the frame STREAM_BUFFER_REGIONS - 1 frames back, the last one read back
+	GLuint getOccludedInstances();
+
+	// Reads back every cull and checks it against the same test on the CPU, reporting mismatches. Slow.
+	void setValidation(bool validate);
+	// Instances checked by the validation of the culls since the last fence, and how many of them the GPU got wrong
+	GLuint getValidatedInstances();
+	GLuint getValidationMismatches();
+
+private:
+	bool reserve(GLuint &buffer, GLsizeiptr &capacity, GLsizeiptr size);
+	bool validate(const std::vector<CulledDraw> &draws, GLuint instanceBuffer, float lodFullDetailSize, GLint phase);
+
+private:
+	GLuint *m_pCullProgram;
+	GLuint *m_pCompactProgram;
+
+	StreamBuffer m_DrawRing;
+
+	// written by the culling passes
+	GLuint m_glCounterBuffer;
+	GLuint m_glVisibleBuffer;
+	GLuint m_glCommandBuffer;
+	GLuint m_glCommandInfoBuffer;
+	GLuint m_glDrawCountBuffer;
+	GLsizeiptr m_nCounterCapacity;
+	GLsizeiptr m_nVisibleCapacity;
+	GLsizeiptr m_nCommandCapacity;
+	GLsizeiptr m_nCommandInfoCapacity;
+
+	// one flag per geometry pool instance, kept from one occlusion cull to the next
+	GLuint m_glVisibilityBuffer;
+	GLsizeiptr m_nVisibilityCapacity;
+
+	// occlusion counts, one slot per frame in flight, read back through a persistent mapping once fenced
+	GLuint m_glOcclusionStatsBuffer;
+	const char *m_pOcclusionStats;
+	GLsync m_arrStatsFences[STREAM_BUFFER_REGIONS];
+	GLsizeiptr m_nStatsStride;
+	GLuint m_nStatsSlot;
+	GLuint m_nOccludedInstances;
+
+	GLuint m_nDraws; // of the last cull
+	GLuint m_nMaxLevels;
+
+	bool m_bValidate;
+	GLuint m_nValidatedInstances;
+	GLuint m_nValidationMismatches;
+};
@@ -0,0 +1,392 @@
+#include "JobSystem.h"
+#include "Profiler.h"
+
+#include <algorithm>
+
+// Worker the current thread is, and of which job system; -1 for threads that aren't workers
+static thread_local JobSystem *t_pJobSystem = NULL;
+static thread_local int t_nWorker = -1;
+static thread_local uint32_t t_uiStealSeed = 0u;
+
+JobSystem::Counter::Counter()
+	: m_nPending(0)
+{
+}
+
+bool JobSystem::Counter::done() const
+{
+	return m_nPending.load(std::memory_order_acquire) == 0;
+}
+
+JobSystem::WorkDeque::WorkDeque()
+	: m_nTop(0)
+	, m_nBottom(0)
+{
+	for (auto &slot : m_arrSlots)
+		slot.store(NULL, std::memory_order_relaxed);
+}
+
+bool JobSystem::WorkDeque::push(Job *job)
+{
+	int64_t bottom = m_nBottom.load(std::memory_order_relaxed);
+	int64_t top = m_nTop.load(std::memory_order_acquire);
+	if (bottom - top >= JOB_DEQUE_CAPACITY)
+		return false;
+
+	m_arrSlots[bottom & (JOB_DEQUE_CAPACITY - 1)].store(job, std::memory_order_release);
+	std::atomic_thread_fence(std::memory_order_release);
+	m_nBottom.store(bottom + 1, std::memory_order_relaxed);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Takes the newest job. Claiming the bottom slot before reading the
+//          top makes thieves see it gone; only the last job left is raced
+//          for, on the top index, the same way thieves race each other.
+//-----------------------------------------------------------------------------
+JobSystem::Job* JobSystem::WorkDeque::pop()
+{
+	int64_t bottom = m_nBottom.load(std::memory_order_relaxed) - 1;
+	m_nBottom.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t top = m_nTop.load(std::memory_order_relaxed);
+
+	if (top > bottom)
+	{
+		m_nBottom.store(bottom + 1, std::memory_order_relaxed);
+		return NULL;
+	}
+
+	Job *job = m_arrSlots[bottom & (JOB_DEQUE_CAPACITY - 1)].load(std::memory_order_acquire);
+	if (top == bottom)
+	{
+		if (!m_nTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			job = NULL;
+		m_nBottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+
+	return job;
+}
+
+JobSystem::Job* JobSystem::WorkDeque::steal()
+{
+	int64_t top = m_nTop.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t bottom = m_nBottom.load(std::memory_order_acquire);
+
+	if (top >= bottom)
+		return NULL;
+
+	Job *job = m_arrSlots[top & (JOB_DEQUE_CAPACITY - 1)].load(std::memory_order_acquire);
+	if (!m_nTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		return NULL;
+
+	return job;
+}
+
+bool JobSystem::WorkDeque::empty()
+{
+	return m_nBottom.load(std::memory_order_relaxed) <= m_nTop.load(std::memory_order_relaxed);
+}
+
+JobSystem::JobSystem()
+	: m_nEpoch(0u)
+	, m_nSleeping(0)
+	, m_bStopping(false)
+{
+}
+
+JobSystem::~JobSystem()
+{
+	destroy();
+}
+
+void JobSystem::init(unsigned int workers)
+{
+	destroy();
+
+	if (workers == 0u)
+		workers = (std::max)(std::thread::hardware_concurrency(), 2u) - 1u;
+
+	m_bStopping = false;
+
+	for (unsigned int i = 0u; i < workers; ++i)
+		m_vpDeques.push_back(new WorkDeque());
+
+	for (unsigned int i = 0u; i < workers; ++i)
+		m_vWorkers.push_back(std::thread(&JobSystem::workerLoop, this, static_cast<int>(i)));
+}
+
+void JobSystem::destroy()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mtxSleep);
+		m_bStopping = true;
+	}
+	m_cvWake.notify_all();
+
+	for (auto &worker : m_vWorkers)
+		worker.join();
+	m_vWorkers.clear();
+
+	// whatever was queued after the workers left
+	while (Job *job = findJob(-1))
+		execute(job);
+
+	for (auto deque : m_vpDeques)
+		delete deque;
+	m_vpDeques.clear();
+}
+
+unsigned int JobSystem::getWorkerCount()
+{
+	return static_cast<unsigned int>(m_vWorkers.size());
+}
+
+void JobSystem::run(const JobFunc &func, Counter *counter)
+{
+	Job *job = new Job();
+	job->func = func;
+	job->counter = counter;
+
+	if (counter)
+		counter->m_nPending.fetch_add(1, std::memory_order_relaxed);
+
+	submit(job);
+}
+
+void JobSystem::runAfter(Counter &dependency, const JobFunc &func, Counter *counter)
+{
+	Job *job = new Job();
+	job->func = func;
+	job->counter = counter;
+
+	if (counter)
+		counter->m_nPending.fetch_add(1, std::memory_order_relaxed);
+
+	{
+		std::lock_guard<std::mutex> lock(dependency.m_mtx);
+		if (dependency.m_nPending.load(std::memory_order_acquire) > 0)
+		{
+			dependency.m_vpContinuations.push_back(job);
+			return;
+		}
+	}
+
+	submit(job);
+}
+
+void JobSystem::wait(Counter &counter)
+{
+	int worker = getCurrentWorker();
+
+	while (!counter.done())
+	{
+		if (Job *job = findJob(worker))
+			execute(job);
+		else
+			std::this_thread::yield();
+	}
+
+	// the job that finished last may still be releasing the counter
+	std::lock_guard<std::mutex> lock(counter.m_mtx);
+}
+
+void JobSystem::parallelFor(size_t begin, size_t end, size_t minGrain, const RangeFunc &func)
+{
+	if (end <= begin)
+		return;
+
+	minGrain = (std::max)(minGrain, size_t(1u));
+
+	if (m_vWorkers.empty() || end - begin <= minGrain)
+	{
+		func(begin, end);
+		return;
+	}
+
+	Counter counter;
+	runRange(begin, end, minGrain, func, counter);
+	wait(counter);
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Works through a range on the current thread, splitting off its
+//          upper half as a job whenever this thread has nothing queued that
+//          others could take (lazy binary splitting). Busy workers thus take
+//          big ranges in few jobs, while idle ones keep getting fed.
+//-----------------------------------------------------------------------------
+void JobSystem::runRange(size_t begin, size_t end, size_t grain, const RangeFunc &func, Counter &counter)
+{
+	int worker = getCurrentWorker();
+
+	while (end - begin > grain)
+	{
+		if (!hasQueuedWork(worker))
+		{
+			size_t mid = begin + (end - begin) / 2u;
+			run([this, mid, end, grain, &func, &counter]() { runRange(mid, end, grain, func, counter); }, &counter);
+			end = mid;
+		}
+		else
+		{
+			func(begin, begin + grain);
+			begin += grain;
+		}
+	}
+
+	func(begin, end);
+}
+
+bool JobSystem::hasQueuedWork(int worker)
+{
+	if (worker >= 0)
+		return !m_vpDeques[worker]->empty();
+
+	std::lock_guard<std::mutex> lock(m_mtxInjected);
+	return !m_dqInjected.empty();
+}
+
+void JobSystem::workerLoop(int worker)
+{
+	t_pJobSystem = this;
+	t_nWorker = worker;
+	t_uiStealSeed = static_cast<uint32_t>(worker) * 2654435761u + 1u;
+
+	Profiler::getInstance().setThreadName(("Worker " + std::to_string(worker)).c_str());
+
+	int idleRounds = 0;
+	for (;;)
+	{
+		if (Job *job = findJob(worker))
+		{
+			execute(job);
+			idleRounds = 0;
+			continue;
+		}
+
+		if (m_bStopping)
+			break;
+
+		if (++idleRounds < JOB_SPIN_ROUNDS)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		// Sleep until something is submitted after this last look for work
+		unsigned int epoch = m_nEpoch.load();
+		if (Job *job = findJob(worker))
+		{
+			execute(job);
+			idleRounds = 0;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mtxSleep);
+		++m_nSleeping;
+		m_cvWake.wait(lock, [this, epoch]() { return m_bStopping || m_nEpoch.load() != epoch; });
+		--m_nSleeping;
+		idleRounds = 0;
+	}
+}
+
+int JobSystem::getCurrentWorker()
+{
+	return t_pJobSystem == this ? t_nWorker : -1;
+}
+
+void JobSystem::submit(Job *job)
+{
+	int worker = getCurrentWorker();
+
+	if (worker >= 0)
+	{
+		if (!m_vpDeques[worker]->push(job))
+		{
+			execute(job);
+			return;
+		}
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_mtxInjected);
+		m_dqInjected.push_back(job);
+	}
+
+	++m_nEpoch;
+	if (m_nSleeping.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mtxSleep);
+		m_cvWake.notify_one();
+	}
+}
+
+JobSystem::Job* JobSystem::findJob(int worker)
+{
+	if (worker >= 0)
+	{
+		if (Job *job = m_vpDeques[worker]->pop())
+			return job;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mtxInjected);
+		if (!m_dqInjected.empty())
+		{
+			Job *job = m_dqInjected.front();
+			m_dqInjected.pop_front();
+			return job;
+		}
+	}
+
+	// steal from the others, starting at a random one
+	size_t count = m_vpDeques.size();
+	if (count == 0u)
+		return NULL;
+
+	if (t_uiStealSeed == 0u)
+		t_uiStealSeed = 0x9E3779B9u;
+	t_uiStealSeed ^= t_uiStealSeed << 13;
+	t_uiStealSeed ^= t_uiStealSeed >> 17;
+	t_uiStealSeed ^= t_uiStealSeed << 5;
+	size_t first = t_uiStealSeed % count;
+
+	for (size_t i = 0u; i < count; ++i)
+	{
+		size_t victim = (first + i) % count;
+		if (static_cast<int>(victim) == worker)
+			continue;
+
+		if (Job *job = m_vpDeques[victim]->steal())
+			return job;
+	}
+
+	return NULL;
+}
+
+void JobSystem::execute(Job *job)
+{
+	PROFILE_SCOPE("Job");
+
+	job->func();
+
+	if (job->counter)
+		finish(job->counter);
+
+	delete job;
+}
+
+void JobSystem::finish(Counter *counter)
+{
+	std::vector<Job*> continuations;
+	{
+		std::lock_guard<std::mutex> lock(counter->m_mtx);
+		if (counter->m_nPending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			continuations.swap(counter->m_vpContinuations);
+	}
+
+	for (auto job : continuations)
+		submit(job);
+}
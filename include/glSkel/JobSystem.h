@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define JOB_DEQUE_CAPACITY 4096 // jobs queued per worker, a power of two; pushing to a full deque runs the job right away
+#define JOB_SPIN_ROUNDS 64 // rounds of looking for work, yielding in between, before a worker goes to sleep
+
+// Pool of worker threads shared by everything that runs in parallel. Each worker keeps its jobs in its own
+// (Chase-Lev) deque, taking the newest from the bottom while idle workers steal the oldest from the top, so
+// work spreads out in big pieces and stays on one thread otherwise. Threads that aren't workers queue their
+// jobs in a shared injection queue instead, and lend a hand with any job while they wait for theirs.
+// Without any workers everything runs on the calling thread.
+class JobSystem
+{
+private:
+	struct Job;
+
+public:
+	typedef std::function<void()> JobFunc;
+	typedef std::function<void(size_t begin, size_t end)> RangeFunc;
+
+	// Number of jobs given to it that haven't finished; jobs queued to run after it start once it reaches zero
+	class Counter
+	{
+	public:
+		Counter();
+
+		bool done() const;
+
+	private:
+		friend class JobSystem;
+
+		std::atomic<int> m_nPending;
+		std::mutex m_mtx; // held while finishing a job, so waiting can't return while the counter is still in use
+		std::vector<Job*> m_vpContinuations;
+	};
+
+public:
+	JobSystem();
+	~JobSystem();
+
+	// Starts the workers, one per hardware thread but the calling one if 0
+	void init(unsigned int workers = 0u);
+	// Finishes the queued jobs and stops the workers
+	void destroy();
+
+	unsigned int getWorkerCount();
+
+	// Queues a job, counted in counter until it has run
+	void run(const JobFunc &func, Counter *counter = NULL);
+	// Queues a job once dependency reaches zero, counted in counter from now until it has run
+	void runAfter(Counter &dependency, const JobFunc &func, Counter *counter = NULL);
+	// Runs queued jobs (anyone's) until counter reaches zero
+	void wait(Counter &counter);
+
+	// Calls func on consecutive subranges of [begin, end) that together cover it, in parallel, and returns once
+	// all of them have. A range is split in half for other threads to take whenever its thread has nothing else
+	// queued, and otherwise worked through minGrain at a time, so the grain follows how busy the workers are.
+	void parallelFor(size_t begin, size_t end, size_t minGrain, const RangeFunc &func);
+
+private:
+	struct Job
+	{
+		JobFunc			func;
+		Counter			*counter;
+	};
+
+	// Only its worker pushes and pops (at the bottom); anyone steals (from the top)
+	class WorkDeque
+	{
+	public:
+		WorkDeque();
+
+		bool push(Job *job);
+		Job* pop();
+		Job* steal();
+		bool empty();
+
+	private:
+		std::atomic<int64_t> m_nTop;
+		std::atomic<int64_t> m_nBottom;
+		std::atomic<Job*> m_arrSlots[JOB_DEQUE_CAPACITY];
+	};
+
+private:
+	void workerLoop(int worker);
+	int getCurrentWorker();
+
+	void submit(Job *job);
+	Job* findJob(int worker);
+	void execute(Job *job);
+	void finish(Counter *counter);
+
+	void runRange(size_t begin, size_t end, size_t grain, const RangeFunc &func, Counter &counter);
+	bool hasQueuedWork(int worker);
+
+private:
+	std::vector<std::thread> m_vWorkers;
+	std::vector<WorkDeque*> m_vpDeques; // per worker
+
+	std::mutex m_mtxInjected;
+	std::deque<Job*> m_dqInjected; // jobs from threads that aren't workers
+
+	std::mutex m_mtxSleep;
+	std::condition_variable m_cvWake;
+	std::atomic<unsigned int> m_nEpoch; // bumped by every submit, so a worker going to sleep can tell it missed one
+	std::atomic<int> m_nSleeping;
+	std::atomic<bool> m_bStopping;
+};
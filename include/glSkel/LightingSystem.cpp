@@ -10,10 +10,15 @@
 
 #include <glm/gtc/type_ptr.hpp>
 
-#include <string>
+#include <cstring>
 
 LightingSystem::LightingSystem()
 	: m_nLights(0)
+	, m_glLightBuffer(0)
+	, m_glClusterBuffer(0)
+	, m_pClusteringShader(NULL)
+	, m_nUploadedLights(0)
+	, m_bUploaded(false)
 {
 }
 
@@ -21,44 +26,74 @@ LightingSystem::~LightingSystem()
 {
 }
 
-void LightingSystem::registerShader(GLuint * shader)
+void LightingSystem::setClusteringShader(GLuint * shader)
 {
-	if (shader)
-		m_vpShadersWithLighting.push_back(shader);
+	m_pClusteringShader = shader;
 }
 
-// Uses the current shader
-void LightingSystem::update(glm::mat4 view)
+void LightingSystem::update(glm::mat4 view, glm::mat4 projection)
 {
-	for (auto pShader : m_vpShadersWithLighting)
+	if (m_bUploaded && m_nLights == m_nUploadedLights && view == m_mat4UploadedView && projection == m_mat4UploadedProjection &&
+		std::memcmp(m_arrLights, m_arrUploadedLights, m_nLights * sizeof(Light)) == 0)
+		return;
+
+	if (!m_glLightBuffer)
+	{
+		glCreateBuffers(1, &m_glLightBuffer);
+		glNamedBufferStorage(m_glLightBuffer, sizeof(LightBufferHeader) + MAX_LIGHTS * sizeof(LightData), NULL, GL_DYNAMIC_STORAGE_BIT);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHTS_STORAGE_BUFFER_BINDING, m_glLightBuffer);
+
+		// per-cluster light counts, then fixed size light index lists
+		glCreateBuffers(1, &m_glClusterBuffer);
+		glNamedBufferStorage(m_glClusterBuffer, LIGHT_CLUSTER_COUNT * (1 + MAX_LIGHTS_PER_CLUSTER) * sizeof(GLuint), NULL, 0);
+		glClearNamedBufferData(m_glClusterBuffer, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_CLUSTERS_STORAGE_BUFFER_BINDING, m_glClusterBuffer);
+	}
+
+	LightBufferHeader header;
+	header.inverseProjection = glm::inverse(projection);
+	header.clusterNear = projection[3][2] / (projection[2][2] - 1.f);
+	header.clusterFar = projection[3][2] / (projection[2][2] + 1.f);
+	header.numLights = m_nLights;
+	header.padding = 0;
+
+	m_vLightData.resize(m_nLights);
+	for (int i = 0; i < m_nLights; ++i)
 	{
-		if (*pShader)
-		{
-			glUseProgram(*pShader);
-
-			glUniform1i(LIGHT_COUNT_UNIFORM_LOCATION, m_nLights);
-
-			for (int i = 0; i < m_nLights; ++i)
-			{
-				std::string name = "lights[" + std::to_string(i);
-				name += "]";
-
-				glUniform4fv(glGetUniformLocation(*pShader, (name + ".color").c_str()), 1, glm::value_ptr(m_arrLights[i].color));
-				glUniform4fv(glGetUniformLocation(*pShader, (name + ".position").c_str()), 1, glm::value_ptr(view * m_arrLights[i].position));
-				glUniform4fv(glGetUniformLocation(*pShader, (name + ".direction").c_str()), 1, glm::value_ptr(glm::normalize(view * m_arrLights[i].direction)));
-				glUniform1f(glGetUniformLocation(*pShader, (name + ".ambientCoeff").c_str()), m_arrLights[i].ambientCoefficient);
-				glUniform1f(glGetUniformLocation(*pShader, (name + ".constant").c_str()), m_arrLights[i].constant);
-				glUniform1f(glGetUniformLocation(*pShader, (name + ".linear").c_str()), m_arrLights[i].linear);
-				glUniform1f(glGetUniformLocation(*pShader, (name + ".quadratic").c_str()), m_arrLights[i].quadratic);
-				glUniform1f(glGetUniformLocation(*pShader, (name + ".cutOff").c_str()), m_arrLights[i].cutOff);
-				glUniform1f(glGetUniformLocation(*pShader, (name + ".outerCutOff").c_str()), m_arrLights[i].outerCutOff);
-				glUniform1f(glGetUniformLocation(*pShader, (name + ".isOn").c_str()), m_arrLights[i].isOn);
-				glUniform1f(glGetUniformLocation(*pShader, (name + ".isSpotLight").c_str()), m_arrLights[i].isSpotLight);
-			}
-		}
+		const Light &light = m_arrLights[i];
+		LightData &data = m_vLightData[i];
+
+		data.position = view * light.position;
+		data.direction = glm::normalize(view * light.direction);
+		data.color = light.color;
+		data.ambientCoeff = light.ambientCoefficient;
+		data.constant = light.constant;
+		data.linear = light.linear;
+		data.quadratic = light.quadratic;
+		data.cutOff = light.cutOff;
+		data.outerCutOff = light.outerCutOff;
+		data.isOn = light.isOn;
+		data.isSpotLight = light.isSpotLight;
 	}
 
+	glNamedBufferSubData(m_glLightBuffer, 0, sizeof(LightBufferHeader), &header);
+	if (m_nLights > 0)
+		glNamedBufferSubData(m_glLightBuffer, sizeof(LightBufferHeader), m_nLights * sizeof(LightData), m_vLightData.data());
+
+	// Bin the lights, one work group per cluster; until the program has linked, retry every update
+	if (!m_pClusteringShader || !*m_pClusteringShader)
+		return;
+
+	glUseProgram(*m_pClusteringShader);
+	glDispatchCompute(LIGHT_CLUSTER_GRID_X, LIGHT_CLUSTER_GRID_Y, LIGHT_CLUSTER_GRID_Z);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	glUseProgram(0);
+
+	std::memcpy(m_arrUploadedLights, m_arrLights, m_nLights * sizeof(Light));
+	m_nUploadedLights = m_nLights;
+	m_mat4UploadedView = view;
+	m_mat4UploadedProjection = projection;
+	m_bUploaded = true;
 }
 
 LightingSystem::Light* LightingSystem::addDirectLight(glm::vec4 direction, glm::vec4 color, float ambientCoeff)
@@ -45,8 +45,10 @@ public:
 	LightingSystem();
 	~LightingSystem();
 
-	void registerShader(GLuint* shader);
-	void update(glm::mat4 view);
+	// Compute program binning the lights into the view frustum's clusters
+	void setClusteringShader(GLuint* shader);
+	// Uploads the lights in view space and re-bins them into clusters, if they or the camera changed
+	void update(glm::mat4 view, glm::mat4 projection);
 
 	Light* addDirectLight(glm::vec4 direction = glm::vec4(-1.f, -1.f, -1.f, 0.f)
 		, glm::vec4 color = glm::vec4(1.f)
@@ -72,12 +74,48 @@ public:
 		, float outerCutOffDeg = 15.f
 		);
 
+private:
+	// std430 layout of the Light struct in the lighting shaders
+	struct LightData {
+		glm::vec4 position;
+		glm::vec4 direction;
+		glm::vec4 color;
+		float ambientCoeff;
+		float constant;
+		float linear;
+		float quadratic;
+		float cutOff;
+		float outerCutOff;
+		float isOn;
+		float isSpotLight;
+	};
+
+	// Followed by the lights in the light buffer
+	struct LightBufferHeader {
+		glm::mat4 inverseProjection;
+		float clusterNear;
+		float clusterFar;
+		GLint numLights;
+		GLint padding; // lights are aligned to a vec4
+	};
+
 private:
 	Light m_arrLights[MAX_LIGHTS];
-	
-	std::vector<GLuint*> m_vpShadersWithLighting;
 
 	int m_nLights;
+
+	GLuint m_glLightBuffer;
+	GLuint m_glClusterBuffer;
+	GLuint* m_pClusteringShader;
+
+	std::vector<LightData> m_vLightData;
+
+	// What the light buffer was last filled from; lights are handed out by pointer, so changes are found by comparison
+	Light m_arrUploadedLights[MAX_LIGHTS];
+	int m_nUploadedLights;
+	glm::mat4 m_mat4UploadedView;
+	glm::mat4 m_mat4UploadedProjection;
+	bool m_bUploaded;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,475 @@
+#include "MeshSimplifier.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Extra weight on the planes that keep open (boundary) edges in place, which preserves silhouettes and endcaps
+#define BOUNDARY_EDGE_WEIGHT 100.0
+
+// Vertices closer than this fraction of the mesh extent are welded
+#define WELD_TOLERANCE 1e-5f
+
+// No welded vertex: ends a weld bucket's list of them, or marks an original vertex not welded yet
+#define WELD_CHAIN_END 0xFFFFFFFFu
+
+// Collapses that turn a triangle by more than this (cosine) are rejected
+#define MIN_NORMAL_COSINE 0.2f
+
+MeshSimplifier::Quadric::Quadric()
+{
+	std::fill(a, a + 10, 0.0);
+}
+
+// Quadric of the plane nx*x + ny*y + nz*z + d = 0
+MeshSimplifier::Quadric::Quadric(double nx, double ny, double nz, double d, double weight)
+{
+	a[0] = nx * nx * weight; a[1] = nx * ny * weight; a[2] = nx * nz * weight; a[3] = nx * d * weight;
+	a[4] = ny * ny * weight; a[5] = ny * nz * weight; a[6] = ny * d * weight;
+	a[7] = nz * nz * weight; a[8] = nz * d * weight;
+	a[9] = d * d * weight;
+}
+
+MeshSimplifier::Quadric& MeshSimplifier::Quadric::operator+=(const Quadric &rhs)
+{
+	for (int i = 0; i < 10; ++i)
+		a[i] += rhs.a[i];
+
+	return *this;
+}
+
+double MeshSimplifier::Quadric::evaluate(const glm::vec3 &v) const
+{
+	double x = v.x, y = v.y, z = v.z;
+
+	return a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x
+		+ a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y
+		+ a[7] * z * z + 2.0 * a[8] * z
+		+ a[9];
+}
+
+MeshSimplifier::MeshSimplifier()
+	: m_nInitialTriangles(0u)
+	, m_nTriangles(0u)
+	, m_eInitStage(INIT_BOUNDS)
+	, m_nInitCursor(0u)
+	, m_vec3WeldMin(0.f)
+	, m_vec3WeldMax(0.f)
+	, m_fWeldCellSize(0.f)
+	, m_uiFirstOriginal(0u)
+	, m_uiLastOriginal(0u)
+{
+}
+
+MeshSimplifier::~MeshSimplifier()
+{
+}
+
+bool MeshSimplifier::init(const std::vector<glm::vec3> &points, const GLuint *inds, size_t indexCount, GLint baseVertex, const std::function<bool()> &shouldStop)
+{
+	switch (m_eInitStage)
+	{
+	case INIT_BOUNDS:
+		if (indexCount < 3u)
+		{
+			m_eInitStage = INIT_DONE;
+			return true;
+		}
+
+		// Weld coincident vertices on a grid scaled to the mesh extent
+		if (m_nInitCursor == 0u)
+		{
+			m_vec3WeldMin = m_vec3WeldMax = points[baseVertex + inds[0]];
+			m_uiFirstOriginal = m_uiLastOriginal = inds[0];
+		}
+
+		for (; m_nInitCursor < indexCount; ++m_nInitCursor)
+		{
+			if (shouldStop && shouldStop())
+				return false;
+
+			m_vec3WeldMin = glm::min(m_vec3WeldMin, points[baseVertex + inds[m_nInitCursor]]);
+			m_vec3WeldMax = glm::max(m_vec3WeldMax, points[baseVertex + inds[m_nInitCursor]]);
+			m_uiFirstOriginal = (std::min)(m_uiFirstOriginal, inds[m_nInitCursor]);
+			m_uiLastOriginal = (std::max)(m_uiLastOriginal, inds[m_nInitCursor]);
+		}
+
+		m_fWeldCellSize = (std::max)(glm::length(m_vec3WeldMax - m_vec3WeldMin) * WELD_TOLERANCE, 1e-12f);
+		m_vuiWeldedOriginals.assign(m_uiLastOriginal - m_uiFirstOriginal + 1u, WELD_CHAIN_END);
+
+		// room for every original vertex, so welding never has to copy what it has built so far
+		{
+			size_t maxVerts = m_vuiWeldedOriginals.size();
+			m_vvec3Positions.reserve(maxVerts);
+			m_vuiOriginalIndex.reserve(maxVerts);
+			m_vuiWeldNext.reserve(maxVerts);
+			m_vuiRemap.reserve(maxVerts);
+			m_vuiVersion.reserve(maxVerts);
+			m_vQuadrics.reserve(maxVerts);
+			m_vvuiVertexTriangles.reserve(maxVerts);
+			m_vuiTriangles.reserve(indexCount);
+
+			// a power of two of buckets, at least one per vertex
+			size_t buckets = 1u;
+			while (buckets < maxVerts)
+				buckets <<= 1;
+			m_vuiWeldBuckets.assign(buckets, WELD_CHAIN_END);
+		}
+
+		m_nInitCursor = 0u;
+		m_eInitStage = INIT_WELDING;
+		// fall through
+
+	case INIT_WELDING:
+		for (; m_nInitCursor + 2u < indexCount; m_nInitCursor += 3u)
+		{
+			if (shouldStop && shouldStop())
+				return false;
+
+			uint32_t v0 = weld(points, inds[m_nInitCursor], baseVertex);
+			uint32_t v1 = weld(points, inds[m_nInitCursor + 1u], baseVertex);
+			uint32_t v2 = weld(points, inds[m_nInitCursor + 2u], baseVertex);
+
+			// welding can make slivers degenerate
+			if (v0 == v1 || v1 == v2 || v2 == v0)
+				continue;
+
+			m_vuiTriangles.push_back(v0);
+			m_vuiTriangles.push_back(v1);
+			m_vuiTriangles.push_back(v2);
+		}
+
+		m_nInitialTriangles = m_nTriangles = m_vuiTriangles.size() / 3u;
+		m_vbTriangleAlive.assign(m_nTriangles, true);
+
+		m_vuiWeldBuckets.clear();
+		m_vuiWeldedOriginals.clear();
+		m_vuiWeldNext.clear();
+
+		m_nInitCursor = 0u;
+		m_eInitStage = INIT_QUADRICS;
+		// fall through
+
+	case INIT_QUADRICS:
+		// Face quadrics, weighted by area, and the triangles around each vertex
+		for (; m_nInitCursor < m_nTriangles; ++m_nInitCursor)
+		{
+			if (shouldStop && shouldStop())
+				return false;
+
+			uint32_t t = static_cast<uint32_t>(m_nInitCursor);
+			const uint32_t *tri = &m_vuiTriangles[t * 3u];
+			glm::vec3 n = glm::cross(m_vvec3Positions[tri[1]] - m_vvec3Positions[tri[0]], m_vvec3Positions[tri[2]] - m_vvec3Positions[tri[0]]);
+			float area2 = glm::length(n);
+
+			if (area2 > 0.f)
+			{
+				n /= area2;
+				Quadric q(n.x, n.y, n.z, -glm::dot(n, m_vvec3Positions[tri[0]]), area2 * 0.5);
+				for (int k = 0; k < 3; ++k)
+					m_vQuadrics[tri[k]] += q;
+			}
+
+			for (int k = 0; k < 3; ++k)
+				m_vvuiVertexTriangles[tri[k]].push_back(t);
+		}
+
+		// room for a collapse per edge, and then some for the ones queued again as collapses change quadrics
+		m_vCollapseHeap.reserve(3u * m_nTriangles);
+
+		m_nInitCursor = 0u;
+		m_eInitStage = INIT_BOUNDARIES;
+		// fall through
+
+	case INIT_BOUNDARIES:
+		// Every edge is queued from the first triangle using it. Boundary edges, used by one triangle only, also get
+		// a plane through the edge, perpendicular to its face, so they resist moving sideways.
+		for (; m_nInitCursor < m_nTriangles; ++m_nInitCursor)
+		{
+			if (shouldStop && shouldStop())
+				return false;
+
+			uint32_t t = static_cast<uint32_t>(m_nInitCursor);
+			const uint32_t *tri = &m_vuiTriangles[t * 3u];
+
+			for (int k = 0; k < 3; ++k)
+			{
+				uint32_t a = (std::min)(tri[k], tri[(k + 1) % 3]);
+				uint32_t b = (std::max)(tri[k], tri[(k + 1) % 3]);
+
+				uint32_t uses = 0u;
+				uint32_t firstUse = t;
+				for (auto const &other : m_vvuiVertexTriangles[a])
+				{
+					const uint32_t *otherTri = &m_vuiTriangles[other * 3u];
+					if (otherTri[0] == b || otherTri[1] == b || otherTri[2] == b)
+					{
+						uses++;
+						firstUse = (std::min)(firstUse, other);
+					}
+				}
+
+				if (firstUse != t)
+					continue;
+
+				if (uses == 1u)
+				{
+					glm::vec3 faceNormal = glm::cross(m_vvec3Positions[tri[1]] - m_vvec3Positions[tri[0]], m_vvec3Positions[tri[2]] - m_vvec3Positions[tri[0]]);
+					glm::vec3 edgeVec = m_vvec3Positions[b] - m_vvec3Positions[a];
+					glm::vec3 n = glm::cross(edgeVec, faceNormal);
+					float len = glm::length(n);
+
+					if (len > 0.f)
+					{
+						n /= len;
+						Quadric q(n.x, n.y, n.z, -glm::dot(n, m_vvec3Positions[a]), BOUNDARY_EDGE_WEIGHT * glm::dot(edgeVec, edgeVec));
+						m_vQuadrics[a] += q;
+						m_vQuadrics[b] += q;
+					}
+				}
+
+				pushCollapse(a, b);
+			}
+		}
+
+		m_nInitCursor = 0u;
+		m_eInitStage = INIT_DONE;
+		// fall through
+
+	case INIT_DONE:
+	default:
+		return true;
+	}
+}
+
+bool MeshSimplifier::simplify(size_t targetTriangles, const std::function<bool()> &shouldStop)
+{
+	while (m_nTriangles > targetTriangles && !m_vCollapseHeap.empty())
+	{
+		if (shouldStop && shouldStop())
+			return false;
+
+		std::pop_heap(m_vCollapseHeap.begin(), m_vCollapseHeap.end());
+		Collapse c = m_vCollapseHeap.back();
+		m_vCollapseHeap.pop_back();
+
+		// skip entries made stale by earlier collapses; fresh ones were pushed when that happened
+		if (m_vuiRemap[c.from] != c.from || m_vuiRemap[c.to] != c.to ||
+			m_vuiVersion[c.from] != c.fromVersion || m_vuiVersion[c.to] != c.toVersion)
+			continue;
+
+		if (flipsTriangles(c.from, c.to))
+			continue;
+
+		collapse(c.from, c.to);
+	}
+
+	return true;
+}
+
+void MeshSimplifier::getIndices(std::vector<GLuint> &out)
+{
+	for (size_t t = 0u; t < m_vbTriangleAlive.size(); ++t)
+	{
+		if (!m_vbTriangleAlive[t])
+			continue;
+
+		for (int k = 0; k < 3; ++k)
+			out.push_back(m_vuiOriginalIndex[m_vuiTriangles[t * 3u + k]]);
+	}
+}
+
+size_t MeshSimplifier::getTriangleCount()
+{
+	return m_nTriangles;
+}
+
+size_t MeshSimplifier::getInitialTriangleCount()
+{
+	return m_nInitialTriangles;
+}
+
+void MeshSimplifier::clear()
+{
+	m_vvec3Positions.clear();
+	m_vuiOriginalIndex.clear();
+	m_vuiRemap.clear();
+	m_vuiVersion.clear();
+	m_vQuadrics.clear();
+	m_vvuiVertexTriangles.clear();
+	m_vuiTriangles.clear();
+	m_vbTriangleAlive.clear();
+	m_vCollapseHeap.clear();
+	m_nInitialTriangles = 0u;
+	m_nTriangles = 0u;
+
+	m_eInitStage = INIT_BOUNDS;
+	m_nInitCursor = 0u;
+	m_vuiWeldBuckets.clear();
+	m_vuiWeldedOriginals.clear();
+	m_vuiWeldNext.clear();
+}
+
+// Welded vertex for an original one: an earlier vertex within a cell size of it, or a new one. Coincident vertices
+// can straddle a cell boundary, so the neighbouring cells are searched too. Cells are hashed to buckets, each
+// heading a chain of the vertices in the cells hashed to it.
+uint32_t MeshSimplifier::weld(const std::vector<glm::vec3> &points, GLuint original, GLint baseVertex)
+{
+	uint32_t &weldedOriginal = m_vuiWeldedOriginals[original - m_uiFirstOriginal];
+	if (weldedOriginal != WELD_CHAIN_END)
+		return weldedOriginal;
+
+	glm::vec3 pos = points[baseVertex + original];
+	glm::ivec3 cell = glm::ivec3(glm::floor((pos - m_vec3WeldMin) / m_fWeldCellSize));
+
+	auto cellBucket = [&](const glm::ivec3 &c) {
+		uint64_t key = (uint64_t(uint32_t(c.x) & 0x1FFFFF) << 42) | (uint64_t(uint32_t(c.y) & 0x1FFFFF) << 21) | uint64_t(uint32_t(c.z) & 0x1FFFFF);
+		return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & (m_vuiWeldBuckets.size() - 1u);
+	};
+
+	uint32_t welded = WELD_CHAIN_END;
+	for (int z = -1; z <= 1 && welded == WELD_CHAIN_END; ++z)
+		for (int y = -1; y <= 1 && welded == WELD_CHAIN_END; ++y)
+			for (int x = -1; x <= 1 && welded == WELD_CHAIN_END; ++x)
+			{
+				for (uint32_t v = m_vuiWeldBuckets[cellBucket(cell + glm::ivec3(x, y, z))]; v != WELD_CHAIN_END; v = m_vuiWeldNext[v])
+				{
+					glm::vec3 d = m_vvec3Positions[v] - pos;
+					if (glm::dot(d, d) <= m_fWeldCellSize * m_fWeldCellSize)
+					{
+						welded = v;
+						break;
+					}
+				}
+			}
+
+	if (welded == WELD_CHAIN_END)
+	{
+		welded = static_cast<uint32_t>(m_vvec3Positions.size());
+		m_vvec3Positions.push_back(pos);
+		m_vuiOriginalIndex.push_back(original);
+		m_vuiRemap.push_back(welded);
+		m_vuiVersion.push_back(0u);
+		m_vQuadrics.push_back(Quadric());
+		m_vvuiVertexTriangles.push_back(std::vector<uint32_t>());
+
+		uint32_t &head = m_vuiWeldBuckets[cellBucket(cell)];
+		m_vuiWeldNext.push_back(head);
+		head = welded;
+	}
+
+	weldedOriginal = welded;
+	return welded;
+}
+
+uint32_t MeshSimplifier::find(uint32_t v)
+{
+	while (m_vuiRemap[v] != v)
+		v = m_vuiRemap[v] = m_vuiRemap[m_vuiRemap[v]];
+
+	return v;
+}
+
+// Queues the cheaper direction of collapsing the edge between a and b
+void MeshSimplifier::pushCollapse(uint32_t a, uint32_t b)
+{
+	Quadric q = m_vQuadrics[a];
+	q += m_vQuadrics[b];
+
+	double costAtA = q.evaluate(m_vvec3Positions[a]);
+	double costAtB = q.evaluate(m_vvec3Positions[b]);
+
+	Collapse c;
+	c.cost = (std::min)(costAtA, costAtB);
+	c.from = costAtB <= costAtA ? a : b;
+	c.to = costAtB <= costAtA ? b : a;
+	c.fromVersion = m_vuiVersion[c.from];
+	c.toVersion = m_vuiVersion[c.to];
+
+	m_vCollapseHeap.push_back(c);
+	std::push_heap(m_vCollapseHeap.begin(), m_vCollapseHeap.end());
+}
+
+// True if moving from onto to would fold over any surviving triangle around from
+bool MeshSimplifier::flipsTriangles(uint32_t from, uint32_t to)
+{
+	for (auto const &t : m_vvuiVertexTriangles[from])
+	{
+		if (!m_vbTriangleAlive[t])
+			continue;
+
+		const uint32_t *tri = &m_vuiTriangles[t * 3u];
+
+		// triangles on the collapsing edge disappear
+		if (tri[0] == to || tri[1] == to || tri[2] == to)
+			continue;
+
+		glm::vec3 p[3], q[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			p[k] = m_vvec3Positions[tri[k]];
+			q[k] = tri[k] == from ? m_vvec3Positions[to] : p[k];
+		}
+
+		glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+		glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+
+		float lenBefore = glm::length(before);
+		float lenAfter = glm::length(after);
+
+		if (lenAfter == 0.f)
+			return true;
+
+		if (lenBefore > 0.f && glm::dot(before, after) < MIN_NORMAL_COSINE * lenBefore * lenAfter)
+			return true;
+	}
+
+	return false;
+}
+
+void MeshSimplifier::collapse(uint32_t from, uint32_t to)
+{
+	m_vuiRemap[from] = to;
+	m_vQuadrics[to] += m_vQuadrics[from];
+	m_vuiVersion[to]++;
+
+	std::vector<uint32_t> &toTris = m_vvuiVertexTriangles[to];
+
+	for (auto const &t : m_vvuiVertexTriangles[from])
+	{
+		if (!m_vbTriangleAlive[t])
+			continue;
+
+		uint32_t *tri = &m_vuiTriangles[t * 3u];
+		for (int k = 0; k < 3; ++k)
+			if (tri[k] == from)
+				tri[k] = to;
+
+		if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0])
+		{
+			m_vbTriangleAlive[t] = false;
+			m_nTriangles--;
+		}
+		else
+		{
+			toTris.push_back(t);
+		}
+	}
+
+	m_vvuiVertexTriangles[from].clear();
+	m_vvuiVertexTriangles[from].shrink_to_fit();
+
+	// drop dead triangles and requeue every edge around the merged vertex with its new quadric
+	toTris.erase(std::remove_if(toTris.begin(), toTris.end(), [&](uint32_t t) { return !m_vbTriangleAlive[t]; }), toTris.end());
+
+	std::vector<uint32_t> neighbours;
+	for (auto const &t : toTris)
+		for (int k = 0; k < 3; ++k)
+			if (m_vuiTriangles[t * 3u + k] != to)
+				neighbours.push_back(m_vuiTriangles[t * 3u + k]);
+
+	std::sort(neighbours.begin(), neighbours.end());
+	neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+
+	for (auto const &n : neighbours)
+		pushCollapse(to, find(n));
+}
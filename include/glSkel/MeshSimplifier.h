@@ -0,0 +1,98 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+// Quadric-error edge collapse simplifier (Garland & Heckbert) for indexed triangle lists.
+// Collapses only ever move a vertex onto one of its neighbours, so every level of detail
+// produced indexes the original vertex buffer and LODs can share it.
+class MeshSimplifier
+{
+public:
+	MeshSimplifier();
+	~MeshSimplifier();
+
+	// Prepares the triangles in inds[0, indexCount) for simplification. Indices are relative to baseVertex in points.
+	// Coincident vertices (e.g. seams between separately generated segments) are welded for the purpose of collapsing.
+	// shouldStop is polled between triangles; returns false if it interrupted the work, in which case
+	// calling init() again with the same arguments resumes where it left off. Call clear() before preparing another mesh.
+	bool init(const std::vector<glm::vec3> &points, const GLuint *inds, size_t indexCount, GLint baseVertex, const std::function<bool()> &shouldStop);
+
+	// Collapses edges until at most targetTriangles remain or nothing more can be collapsed.
+	// shouldStop is polled between collapses; returns false if it interrupted the work, in which case
+	// calling simplify() again resumes where it left off.
+	bool simplify(size_t targetTriangles, const std::function<bool()> &shouldStop);
+
+	// Appends the current triangles, as indices relative to baseVertex
+	void getIndices(std::vector<GLuint> &out);
+
+	size_t getTriangleCount();
+	size_t getInitialTriangleCount();
+
+	void clear();
+
+private:
+	// Symmetric 4x4 error quadric, upper triangle only
+	struct Quadric {
+		double a[10];
+
+		Quadric();
+		Quadric(double nx, double ny, double nz, double d, double weight);
+
+		Quadric& operator+=(const Quadric &rhs);
+		double evaluate(const glm::vec3 &v) const;
+	};
+
+	struct Collapse {
+		double cost;
+		uint32_t from, to;
+		uint32_t fromVersion, toVersion;
+
+		bool operator<(const Collapse &rhs) const { return cost > rhs.cost; } // min-heap
+	};
+
+	// Stages of the resumable init()
+	enum InitStage {
+		INIT_BOUNDS,
+		INIT_WELDING,
+		INIT_QUADRICS,
+		INIT_BOUNDARIES,
+		INIT_DONE
+	};
+
+	uint32_t weld(const std::vector<glm::vec3> &points, GLuint original, GLint baseVertex);
+	uint32_t find(uint32_t v);
+	void pushCollapse(uint32_t a, uint32_t b);
+	bool flipsTriangles(uint32_t from, uint32_t to);
+	void collapse(uint32_t from, uint32_t to);
+
+private:
+	std::vector<glm::vec3> m_vvec3Positions; // welded positions
+	std::vector<GLuint> m_vuiOriginalIndex; // welded vertex -> index of one original vertex at that position
+	std::vector<uint32_t> m_vuiRemap; // collapsed vertex -> vertex it was merged into
+	std::vector<uint32_t> m_vuiVersion;
+	std::vector<Quadric> m_vQuadrics;
+	std::vector<std::vector<uint32_t>> m_vvuiVertexTriangles;
+
+	std::vector<uint32_t> m_vuiTriangles; // 3 welded vertices per triangle
+	std::vector<bool> m_vbTriangleAlive;
+
+	std::vector<Collapse> m_vCollapseHeap;
+
+	size_t m_nInitialTriangles;
+	size_t m_nTriangles;
+
+	InitStage m_eInitStage;
+	size_t m_nInitCursor; // next index (or triangle) to process in the current stage
+	glm::vec3 m_vec3WeldMin, m_vec3WeldMax;
+	float m_fWeldCellSize;
+	GLuint m_uiFirstOriginal, m_uiLastOriginal; // range of the original indices
+	std::vector<uint32_t> m_vuiWeldBuckets; // hashed grid cell -> last welded vertex in a cell hashed there
+	std::vector<uint32_t> m_vuiWeldNext; // welded vertex -> previous one in the same bucket
+	std::vector<uint32_t> m_vuiWeldedOriginals; // original index (from the first) -> welded vertex
+};
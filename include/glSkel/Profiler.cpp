@@ -0,0 +1,498 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+std::atomic<bool> Profiler::s_bEnabled(false);
+thread_local Profiler::ThreadBuffer *Profiler::t_pThreadBuffer = NULL;
+
+Profiler::CpuScope::CpuScope(const char *name)
+	: m_pName(NULL)
+	, m_nBegin(0)
+{
+	if (!isEnabled())
+		return;
+
+	m_pName = name;
+	m_nBegin = now();
+}
+
+Profiler::CpuScope::CpuScope(const std::string &name)
+	: m_pName(NULL)
+	, m_nBegin(0)
+{
+	if (!isEnabled())
+		return;
+
+	m_pName = getInstance().intern(name);
+	m_nBegin = now();
+}
+
+Profiler::CpuScope::~CpuScope()
+{
+	if (!m_pName)
+		return;
+
+	int64_t end = now();
+	ThreadBuffer *buffer = getInstance().getThreadBuffer();
+
+	uint64_t written = buffer->written.load(std::memory_order_relaxed);
+	ThreadEvent &event = buffer->events[written & (PROFILER_THREAD_EVENTS - 1)];
+	event.name.store(m_pName, std::memory_order_relaxed);
+	event.begin.store(m_nBegin, std::memory_order_relaxed);
+	event.end.store(end, std::memory_order_relaxed);
+	buffer->written.store(written + 1u, std::memory_order_release);
+}
+
+Profiler::GpuScope::GpuScope(const char *name)
+	: m_bActive(getInstance().m_bFrameEnabled)
+{
+	if (m_bActive)
+		getInstance().beginGpu(name);
+}
+
+Profiler::GpuScope::GpuScope(const std::string &name)
+	: m_bActive(getInstance().m_bFrameEnabled)
+{
+	if (m_bActive)
+		getInstance().beginGpu(getInstance().intern(name));
+}
+
+Profiler::GpuScope::~GpuScope()
+{
+	if (m_bActive)
+		getInstance().endGpu();
+}
+
+Profiler::Profiler()
+	: m_tpEpoch(std::chrono::steady_clock::now())
+	, m_bFrameEnabled(false)
+	, m_nFrame(0u)
+	, m_bSummaryRequested(false)
+	, m_bTraceDumpRequested(false)
+{
+	for (auto &frame : m_arrGpuFrames)
+	{
+		frame.queriesUsed = 0u;
+		frame.pending = false;
+		frame.cpuSync = 0;
+		frame.gpuSync = 0;
+	}
+}
+
+Profiler::~Profiler()
+{
+	// Every thread that recorded has finished by the time statics are destroyed
+	for (auto buffer : m_vpThreadBuffers)
+		delete buffer;
+}
+
+void Profiler::setEnabled(bool enable)
+{
+	s_bEnabled.store(enable, std::memory_order_relaxed);
+}
+
+void Profiler::setThreadName(const char *name)
+{
+	ThreadBuffer *buffer = getThreadBuffer();
+
+	std::lock_guard<std::mutex> lock(m_mtxThreads);
+	buffer->name = name;
+}
+
+void Profiler::requestSummary()
+{
+	m_bSummaryRequested = true;
+}
+
+void Profiler::requestTraceDump()
+{
+	m_bTraceDumpRequested = true;
+}
+
+const char* Profiler::intern(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(m_mtxNames);
+	return m_setNames.insert(name).first->c_str();
+}
+
+void Profiler::destroy()
+{
+	for (auto &frame : m_arrGpuFrames)
+	{
+		if (!frame.queryPool.empty())
+			glDeleteQueries(static_cast<GLsizei>(frame.queryPool.size()), frame.queryPool.data());
+
+		frame.queryPool.clear();
+		frame.events.clear();
+		frame.queriesUsed = 0u;
+		frame.pending = false;
+	}
+
+	m_vnOpenGpuEvents.clear();
+	m_bFrameEnabled = false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Starts a frame, taking its slot of GPU queries back first. That
+//          slot was issued PROFILER_GPU_FRAMES frames ago, so waiting on it
+//          only happens with the GPU that many frames behind.
+//-----------------------------------------------------------------------------
+void Profiler::beginFrame()
+{
+	GpuFrame &frame = m_arrGpuFrames[m_nFrame % PROFILER_GPU_FRAMES];
+	if (frame.pending)
+	{
+		readGpuFrame(frame, true);
+		closeFrameStats();
+	}
+
+	frame.events.clear();
+	frame.queriesUsed = 0u;
+	m_vnOpenGpuEvents.clear();
+
+	m_bFrameEnabled = isEnabled();
+	if (m_bFrameEnabled)
+	{
+		glGetInteger64v(GL_TIMESTAMP, &frame.gpuSync);
+		frame.cpuSync = now();
+	}
+}
+
+void Profiler::endFrame()
+{
+	GpuFrame &frame = m_arrGpuFrames[m_nFrame % PROFILER_GPU_FRAMES];
+	frame.pending = m_bFrameEnabled && !frame.events.empty();
+	m_bFrameEnabled = false;
+
+	drainThreads();
+	closeFrameStats();
+
+	// GPU frames old enough to have finished, oldest first; any that haven't are tried again next frame
+	for (unsigned int age = PROFILER_GPU_FRAMES - 1u; age >= PROFILER_GPU_LATENCY; --age)
+	{
+		if (age > m_nFrame)
+			continue;
+
+		GpuFrame &old = m_arrGpuFrames[(m_nFrame - age) % PROFILER_GPU_FRAMES];
+		if (!old.pending)
+			continue;
+
+		readGpuFrame(old, false);
+		closeFrameStats();
+	}
+
+	if (m_bSummaryRequested.exchange(false))
+		printSummary();
+
+	if (m_bTraceDumpRequested.exchange(false))
+		dumpTrace();
+
+	++m_nFrame;
+}
+
+int64_t Profiler::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - getInstance().m_tpEpoch).count();
+}
+
+Profiler::ThreadBuffer* Profiler::getThreadBuffer()
+{
+	if (!t_pThreadBuffer)
+	{
+		ThreadBuffer *buffer = new ThreadBuffer();
+		buffer->written.store(0u, std::memory_order_relaxed);
+		buffer->read = 0u;
+
+		std::lock_guard<std::mutex> lock(m_mtxThreads);
+		buffer->traceId = static_cast<uint32_t>(m_vpThreadBuffers.size()) + 1u; // 0 is the GPU
+		buffer->name = "Thread " + std::to_string(buffer->traceId);
+		m_vpThreadBuffers.push_back(buffer);
+
+		t_pThreadBuffer = buffer;
+	}
+
+	return t_pThreadBuffer;
+}
+
+void Profiler::beginGpu(const char *name)
+{
+	GpuFrame &frame = m_arrGpuFrames[m_nFrame % PROFILER_GPU_FRAMES];
+
+	if (frame.queriesUsed + 2u > frame.queryPool.size())
+	{
+		size_t count = (std::max)(frame.queryPool.size(), size_t(32u));
+		frame.queryPool.resize(frame.queryPool.size() + count);
+		glCreateQueries(GL_TIMESTAMP, static_cast<GLsizei>(count), &frame.queryPool[frame.queryPool.size() - count]);
+	}
+
+	GpuEvent event;
+	event.name = name;
+	event.queries[0] = frame.queryPool[frame.queriesUsed++];
+	event.queries[1] = frame.queryPool[frame.queriesUsed++];
+	glQueryCounter(event.queries[0], GL_TIMESTAMP);
+
+	m_vnOpenGpuEvents.push_back(frame.events.size());
+	frame.events.push_back(event);
+}
+
+void Profiler::endGpu()
+{
+	// scopes opened before the frame began have nothing to close
+	if (m_vnOpenGpuEvents.empty())
+		return;
+
+	GpuFrame &frame = m_arrGpuFrames[m_nFrame % PROFILER_GPU_FRAMES];
+	glQueryCounter(frame.events[m_vnOpenGpuEvents.back()].queries[1], GL_TIMESTAMP);
+	m_vnOpenGpuEvents.pop_back();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Takes in what each thread recorded since the last drain. A thread
+//          that recorded more than its ring holds has overwritten the oldest
+//          scopes, and can keep overwriting slots while they're copied; the
+//          write index read again afterwards tells which copies to drop.
+//-----------------------------------------------------------------------------
+void Profiler::drainThreads()
+{
+	std::lock_guard<std::mutex> lock(m_mtxThreads);
+
+	for (auto buffer : m_vpThreadBuffers)
+	{
+		uint64_t written = buffer->written.load(std::memory_order_acquire);
+		uint64_t first = (std::max)(buffer->read, written > PROFILER_THREAD_EVENTS ? written - PROFILER_THREAD_EVENTS : uint64_t(0u));
+
+		std::vector<TraceEvent> events;
+		events.reserve(static_cast<size_t>(written - first));
+
+		for (uint64_t i = first; i < written; ++i)
+		{
+			const ThreadEvent &slot = buffer->events[i & (PROFILER_THREAD_EVENTS - 1)];
+
+			TraceEvent event;
+			event.name = slot.name.load(std::memory_order_relaxed);
+			event.begin = slot.begin.load(std::memory_order_relaxed);
+			event.duration = slot.end.load(std::memory_order_relaxed) - event.begin;
+			event.thread = buffer->traceId;
+			events.push_back(event);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t rewritten = buffer->written.load(std::memory_order_relaxed);
+
+		// the slot of index rewritten may be mid-write too
+		for (uint64_t i = first; i < written; ++i)
+		{
+			if (i + PROFILER_THREAD_EVENTS <= rewritten)
+				continue;
+
+			const TraceEvent &event = events[static_cast<size_t>(i - first)];
+			record(event.name, false, event.begin, event.begin + event.duration, event.thread);
+		}
+
+		buffer->read = written;
+	}
+}
+
+void Profiler::readGpuFrame(GpuFrame &frame, bool wait)
+{
+	if (!frame.pending)
+		return;
+
+	// the last query issued is the last to become available
+	if (!wait && !frame.events.empty())
+	{
+		GLint available = GL_FALSE;
+		glGetQueryObjectiv(frame.queryPool[frame.queriesUsed - 1u], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			return;
+	}
+
+	for (auto const &event : frame.events)
+	{
+		GLuint64 begin = 0u, end = 0u;
+		glGetQueryObjectui64v(event.queries[0], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(event.queries[1], GL_QUERY_RESULT, &end);
+
+		record(event.name, true,
+			frame.cpuSync + (static_cast<int64_t>(begin) - frame.gpuSync),
+			frame.cpuSync + (static_cast<int64_t>(end) - frame.gpuSync), 0u);
+	}
+
+	frame.pending = false;
+}
+
+void Profiler::record(const char *name, bool gpu, int64_t begin, int64_t end, uint32_t thread)
+{
+	std::unordered_map<const char*, size_t> &byPointer = gpu ? m_mapGpuStats : m_mapCpuStats;
+
+	size_t index;
+	auto it = byPointer.find(name);
+	if (it != byPointer.end())
+		index = it->second;
+	else
+	{
+		// the same name can come from different literals
+		std::string key = (gpu ? "gpu:" : "cpu:") + std::string(name);
+		auto named = m_mapStatsByName.find(key);
+		if (named != m_mapStatsByName.end())
+			index = named->second;
+		else
+		{
+			ScopeStats stats;
+			stats.name = name;
+			stats.gpu = gpu;
+			stats.historyHead = 0u;
+			stats.frameTotal = 0.0;
+			stats.touched = false;
+
+			index = m_vStats.size();
+			m_vStats.push_back(stats);
+			m_mapStatsByName[key] = index;
+		}
+
+		byPointer[name] = index;
+	}
+
+	ScopeStats &stats = m_vStats[index];
+	stats.frameTotal += (end - begin) * 1e-6;
+	stats.touched = true;
+
+	TraceEvent event;
+	event.name = name;
+	event.begin = begin;
+	event.duration = end - begin;
+	event.thread = thread;
+	m_dqTrace.push_back(event);
+
+	while (m_dqTrace.size() > PROFILER_TRACE_EVENTS)
+		m_dqTrace.pop_front();
+}
+
+void Profiler::closeFrameStats()
+{
+	for (auto &stats : m_vStats)
+	{
+		if (!stats.touched)
+			continue;
+
+		float ms = static_cast<float>(stats.frameTotal);
+		if (stats.history.size() < PROFILER_HISTORY_FRAMES)
+			stats.history.push_back(ms);
+		else
+			stats.history[stats.historyHead] = ms;
+		stats.historyHead = (stats.historyHead + 1u) % PROFILER_HISTORY_FRAMES;
+
+		stats.frameTotal = 0.0;
+		stats.touched = false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Prints each scope's time per frame over the frames it ran in of
+//          the history, slowest on average first.
+//-----------------------------------------------------------------------------
+void Profiler::printSummary()
+{
+	struct Row
+	{
+		const ScopeStats *stats;
+		float min, avg, p99;
+	};
+
+	std::vector<Row> rows;
+	for (auto const &stats : m_vStats)
+	{
+		if (stats.history.empty())
+			continue;
+
+		std::vector<float> sorted = stats.history;
+		std::sort(sorted.begin(), sorted.end());
+
+		double sum = 0.0;
+		for (float ms : sorted)
+			sum += ms;
+
+		size_t p99 = static_cast<size_t>(std::ceil(sorted.size() * 0.99)) - 1u;
+
+		Row row;
+		row.stats = &stats;
+		row.min = sorted.front();
+		row.avg = static_cast<float>(sum / sorted.size());
+		row.p99 = sorted[p99];
+		rows.push_back(row);
+	}
+
+	std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) { return a.avg > b.avg; });
+
+	fprintf(stdout, "Profile of the last %u frames (ms per frame)\n", PROFILER_HISTORY_FRAMES);
+	fprintf(stdout, "  %-32s %-4s %6s %9s %9s %9s\n", "Scope", "", "Frames", "Min", "Avg", "P99");
+	for (auto const &row : rows)
+	{
+		fprintf(stdout, "  %-32s %-4s %6u %9.3f %9.3f %9.3f\n", row.stats->name.c_str(), row.stats->gpu ? "GPU" : "CPU",
+			static_cast<unsigned int>(row.stats->history.size()), row.min, row.avg, row.p99);
+	}
+	fflush(stdout);
+}
+
+static void writeJsonString(std::ostream &out, const std::string &text)
+{
+	out << '"';
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if (static_cast<unsigned char>(c) < 0x20)
+			out << ' ';
+		else
+			out << c;
+	}
+	out << '"';
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes the kept scopes as Chrome trace event JSON: a complete
+//          ("X") event per scope, in microseconds, and a thread name ("M")
+//          event per thread, the GPU being thread 0.
+//-----------------------------------------------------------------------------
+void Profiler::dumpTrace()
+{
+	char fileName[64];
+	snprintf(fileName, sizeof(fileName), "profile_%u.json", m_nFrame);
+
+	std::ofstream out(fileName);
+	if (!out)
+	{
+		fprintf(stderr, "Profiler: could not open %s\n", fileName);
+		return;
+	}
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"GPU\"}}";
+
+	{
+		std::lock_guard<std::mutex> lock(m_mtxThreads);
+		for (auto buffer : m_vpThreadBuffers)
+		{
+			out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << buffer->traceId << ",\"args\":{\"name\":";
+			writeJsonString(out, buffer->name);
+			out << "}}";
+		}
+	}
+
+	char times[64];
+	for (auto const &event : m_dqTrace)
+	{
+		out << ",\n{\"name\":";
+		writeJsonString(out, event.name);
+		snprintf(times, sizeof(times), "%.3f,\"dur\":%.3f", event.begin * 1e-3, event.duration * 1e-3);
+		out << ",\"cat\":\"" << (event.thread == 0u ? "gpu" : "cpu") << "\",\"ph\":\"X\",\"ts\":" << times
+			<< ",\"pid\":0,\"tid\":" << event.thread << "}";
+	}
+
+	out << "\n]}\n";
+
+	fprintf(stdout, "Profiler: wrote %u scopes to %s\n", static_cast<unsigned int>(m_dqTrace.size()), fileName);
+}
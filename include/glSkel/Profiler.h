@@ -0,0 +1,196 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define PROFILER_THREAD_EVENTS 16384 // CPU scopes a thread can record between two frame ends, a power of two
+#define PROFILER_GPU_FRAMES 4 // frames of GPU timestamp queries in flight
+#define PROFILER_GPU_LATENCY 2 // frames before a frame's GPU timestamps are read back, if they are ready
+#define PROFILER_HISTORY_FRAMES 240 // frames of per-scope times the summary is taken over
+#define PROFILER_TRACE_EVENTS 262144 // most recent scopes kept for the trace dump
+
+#define PROFILER_CONCAT_(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_(a, b)
+
+// Define PROFILER_DISABLED to compile the scopes out altogether
+#ifndef PROFILER_DISABLED
+#define PROFILE_SCOPE(name) Profiler::CpuScope PROFILER_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) Profiler::GpuScope PROFILER_CONCAT(profileGpuScope, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#endif
+
+// Frame profiler of named scopes. CPU scopes are timed on whichever thread runs them, into a ring buffer of the
+// thread's own that only it writes, which the rendering thread drains at the end of each frame. GPU scopes
+// (rendering thread only) bracket their commands with timestamp queries, read back a couple of frames late so
+// nothing waits on the GPU; timestamps nest and can run inside the frame's elapsed time query, unlike further
+// elapsed time queries. While disabled a scope costs one relaxed atomic load.
+// Every frame's time per scope goes into a short history summarized (min/avg/p99) on request, and the scopes
+// themselves into a trace that can be dumped as Chrome trace event JSON (chrome://tracing, Perfetto).
+class Profiler
+{
+public:
+	class CpuScope
+	{
+	public:
+		// name must outlive the profiler, e.g. a string literal
+		explicit CpuScope(const char *name);
+		// Copied (once per distinct name) only while enabled
+		explicit CpuScope(const std::string &name);
+		~CpuScope();
+
+	private:
+		const char *m_pName; // NULL when not timing
+		int64_t m_nBegin;
+	};
+
+	class GpuScope
+	{
+	public:
+		explicit GpuScope(const char *name);
+		explicit GpuScope(const std::string &name);
+		~GpuScope();
+
+	private:
+		bool m_bActive;
+	};
+
+public:
+	static Profiler& getInstance()
+	{
+		static Profiler s_instance;
+		return s_instance;
+	}
+
+	static bool isEnabled()
+	{
+		return s_bEnabled.load(std::memory_order_relaxed);
+	}
+
+	// Takes effect for CPU scopes right away, and for GPU scopes from the next frame
+	void setEnabled(bool enable);
+
+	// Labels the calling thread in the trace
+	void setThreadName(const char *name);
+
+	// Rendering thread, with the GL context current, around everything the frame does
+	void beginFrame();
+	void endFrame();
+
+	// Served at the end of the frame, from any thread
+	void requestSummary();
+	void requestTraceDump();
+
+	// A copy of the name that lives as long as the profiler
+	const char* intern(const std::string &name);
+
+	void destroy();
+
+private:
+	// One thread's scopes; the fields are atomics only so the drain can read slots the thread may be reusing
+	struct ThreadEvent
+	{
+		std::atomic<const char*> name;
+		std::atomic<int64_t> begin;
+		std::atomic<int64_t> end;
+	};
+
+	struct ThreadBuffer
+	{
+		std::string name;
+		uint32_t traceId;
+		std::atomic<uint64_t> written; // by the thread, only ever increasing
+		uint64_t read; // by the drain
+		ThreadEvent events[PROFILER_THREAD_EVENTS];
+	};
+
+	struct GpuEvent
+	{
+		const char *name;
+		GLuint queries[2]; // begin and end timestamps
+	};
+
+	struct GpuFrame
+	{
+		std::vector<GpuEvent> events;
+		std::vector<GLuint> queryPool;
+		size_t queriesUsed;
+		bool pending; // issued and not read back yet
+		int64_t cpuSync; // CPU time at which the GPU clock read gpuSync, placing the GPU scopes on the CPU timeline
+		GLint64 gpuSync;
+	};
+
+	struct TraceEvent
+	{
+		const char *name;
+		int64_t begin;
+		int64_t duration;
+		uint32_t thread;
+	};
+
+	struct ScopeStats
+	{
+		std::string name;
+		bool gpu;
+		std::vector<float> history; // milliseconds per frame it ran in, a ring of PROFILER_HISTORY_FRAMES
+		size_t historyHead;
+		double frameTotal; // milliseconds so far in the frame being gathered
+		bool touched;
+	};
+
+private:
+	Profiler();
+	~Profiler();
+
+	static int64_t now();
+	ThreadBuffer* getThreadBuffer();
+
+	void beginGpu(const char *name);
+	void endGpu();
+
+	void drainThreads();
+	void readGpuFrame(GpuFrame &frame, bool wait);
+	void record(const char *name, bool gpu, int64_t begin, int64_t end, uint32_t thread);
+	void closeFrameStats();
+
+	void printSummary();
+	void dumpTrace();
+
+private:
+	static std::atomic<bool> s_bEnabled;
+	static thread_local ThreadBuffer *t_pThreadBuffer;
+
+	std::chrono::steady_clock::time_point m_tpEpoch;
+
+	std::mutex m_mtxThreads;
+	std::vector<ThreadBuffer*> m_vpThreadBuffers;
+
+	std::mutex m_mtxNames;
+	std::unordered_set<std::string> m_setNames;
+
+	// Rendering thread
+	bool m_bFrameEnabled; // whether the current frame times GPU scopes
+	unsigned int m_nFrame;
+	GpuFrame m_arrGpuFrames[PROFILER_GPU_FRAMES];
+	std::vector<size_t> m_vnOpenGpuEvents; // into the current frame's events
+
+	std::unordered_map<const char*, size_t> m_mapCpuStats; // by name pointer; equal names share stats through m_mapStatsByName
+	std::unordered_map<const char*, size_t> m_mapGpuStats;
+	std::unordered_map<std::string, size_t> m_mapStatsByName; // "cpu:" or "gpu:" + name
+	std::vector<ScopeStats> m_vStats;
+
+	std::deque<TraceEvent> m_dqTrace;
+
+	std::atomic<bool> m_bSummaryRequested;
+	std::atomic<bool> m_bTraceDumpRequested;
+};
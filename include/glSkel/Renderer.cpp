@@ -1,6 +1,10 @@
 #include "Renderer.h"
 
 #include <vector>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <xmmintrin.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -8,12 +12,85 @@
 #include <glSkel/DebugDrawer.h>
 
 #include "GLSLpreamble.h"
+#include "Profiler.h"
+
+// Sort key fields, from most to least significant, so that state changes are grouped by cost
+#define SORT_KEY_SHADER_BITS	8
+#define SORT_KEY_VAO_BITS		16
+#define SORT_KEY_MATERIAL_BITS	16
+#define SORT_KEY_DEPTH_BITS		24
+
+//-----------------------------------------------------------------------------
+// Purpose: Size in bytes of an index of the given element type
+//-----------------------------------------------------------------------------
+static size_t indexTypeSize(GLenum indexType)
+{
+	switch (indexType)
+	{
+	case GL_UNSIGNED_BYTE:
+		return sizeof(GLubyte);
+	case GL_UNSIGNED_SHORT:
+		return sizeof(GLushort);
+	default:
+		return sizeof(GLuint);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: LSD radix sort of the items by key, a byte per pass; passes in
+//          which every key has the same byte are skipped
+//-----------------------------------------------------------------------------
+template <typename T>
+static void radixSortByKey(std::vector<T> &items, std::vector<T> &scratch)
+{
+	if (items.size() < 2u)
+		return;
+
+	scratch.resize(items.size());
+
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t counts[256] = { 0u };
+		for (auto const &item : items)
+			counts[(item.key >> shift) & 0xFFu]++;
+
+		if (counts[(items.front().key >> shift) & 0xFFu] == items.size())
+			continue;
+
+		size_t offsets[256];
+		size_t sum = 0u;
+		for (int i = 0; i < 256; ++i)
+		{
+			offsets[i] = sum;
+			sum += counts[i];
+		}
+
+		for (auto const &item : items)
+			scratch[offsets[(item.key >> shift) & 0xFFu]++] = item;
+
+		items.swap(scratch);
+	}
+}
 
 Renderer::Renderer()
-	: m_glFrameUBO(0)
-	, m_bShowWireframe(false)
+	: m_bShowWireframe(false)
+	, m_hDebugShader(-1)
+	, m_hImpostorShader(-1)
+	, m_pJobSystem(NULL)
+	, m_vec3ImpostorBakeCenter(0.f)
+	, m_fImpostorBakeRadius(0.f)
+	, m_nImpostorBakeVariant(-1)
+	, m_nImpostorBakeCell(0)
+	, m_glOutputTexture(0)
+	, m_bOcclusionCulling(true)
+	, m_bOcclusionFrame(false)
+	, m_glFrameDepthPyramid(0)
+	, m_nRenderWidth(0u)
+	, m_nRenderHeight(0u)
 	, m_fNearClip(0.1f)
 	, m_fFarClip(50.0f)
+	, m_fLODFullDetailSize(400.f)
+	, m_fImpostorSize(32.f)
 {
 }
 
@@ -24,40 +101,270 @@ Renderer::~Renderer()
 
 bool Renderer::init()
 {	
-	glCreateBuffers(1, &m_glFrameUBO);
-	glNamedBufferData(m_glFrameUBO, sizeof(FrameUniforms), NULL, GL_STATIC_DRAW); // allocate memory
-	glBindBufferRange(GL_UNIFORM_BUFFER, SCENE_UNIFORM_BUFFER_LOCATION, m_glFrameUBO, 0, sizeof(FrameUniforms));
-	
+	GLint uniformAlignment;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+	GLsizeiptr frameUniformsSize = (sizeof(FrameUniforms) + uniformAlignment - 1) / uniformAlignment * uniformAlignment;
+
+	if (!m_FrameUniformRing.init(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_PER_FRAME * frameUniformsSize) ||
+		!m_DrawDataRing.init(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BYTES_PER_FRAME))
+		return false;
+
+	setFrameUniforms(FrameUniforms());
+
 	SetupShaders();
 
-	return true;
+	return m_ImpostorAtlas.init() && m_GeometryPool.init() && m_InstanceCuller.init() && m_DepthPyramid.init() && m_DynamicResolution.init() && m_FrameCapture.init();
 }
 
 GLuint* Renderer::getShader(const char * name)
 {
-	return m_mapShaders.count(name) > 0 ? m_mapShaders[name] : NULL;
+	auto it = m_mapShaders.find(name);
+	return it != m_mapShaders.end() ? it->second : NULL;
 }
 
-const GLuint * Renderer::getFrameUBO()
+Renderer::ShaderHandle Renderer::getShaderHandle(const char * name)
 {
-	return &m_glFrameUBO;
+	auto it = m_mapShaderHandles.find(name);
+	return it != m_mapShaderHandles.end() ? it->second : -1;
+}
+
+void Renderer::setFrameUniforms(const FrameUniforms & uniforms)
+{
+	m_FrameUniforms = uniforms;
+
+	GLintptr offset = m_FrameUniformRing.write(&m_FrameUniforms, sizeof(FrameUniforms));
+	glBindBufferRange(GL_UNIFORM_BUFFER, SCENE_UNIFORM_BUFFER_LOCATION, m_FrameUniformRing.getBuffer(), offset, sizeof(FrameUniforms));
+}
+
+const FrameUniforms & Renderer::getFrameUniforms()
+{
+	return m_FrameUniforms;
+}
+
+GeometryPool & Renderer::getGeometryPool()
+{
+	return m_GeometryPool;
+}
+
+DynamicResolution & Renderer::getDynamicResolution()
+{
+	return m_DynamicResolution;
+}
+
+void Renderer::setOutputTexture(GLuint texture)
+{
+	m_glOutputTexture = texture;
+}
+
+void Renderer::captureFrame(const std::string & filename)
+{
+	m_dqCaptureRequests.push_back(filename);
+}
+
+void Renderer::flushCaptures()
+{
+	m_FrameCapture.flush();
+}
+
+void Renderer::setJobSystem(JobSystem * jobs)
+{
+	m_pJobSystem = jobs;
+}
+
+void Renderer::setViewMatrix(const glm::mat4 & view)
+{
+	m_mat4View = view;
+}
+
+void Renderer::setProjectionMatrix(const glm::mat4 & projection)
+{
+	m_mat4Projection = projection;
+
+	// clip planes of a perspective projection, for depth sorting
+	m_fNearClip = projection[3][2] / (projection[2][2] - 1.f);
+	m_fFarClip = projection[3][2] / (projection[2][2] + 1.f);
+}
+
+const glm::mat4 & Renderer::getViewMatrix()
+{
+	return m_mat4View;
+}
+
+const glm::mat4 & Renderer::getProjectionMatrix()
+{
+	return m_mat4Projection;
+}
+
+void Renderer::setLODFullDetailSize(float pixels)
+{
+	m_fLODFullDetailSize = pixels;
+}
+
+void Renderer::setImpostorSize(float pixels)
+{
+	m_fImpostorSize = pixels;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Keeps a full detail copy of the submissions to render with an
+//          orthographic camera from each view direction of the impostor grid
+//-----------------------------------------------------------------------------
+int Renderer::beginImpostorBake(std::vector<RendererSubmission>& parts, const glm::vec3 & center, float radius, int variant)
+{
+	if (variant < 0)
+		variant = m_ImpostorAtlas.allocateVariant();
+
+	if (variant < 0)
+		return -1;
+
+	m_vImpostorBakeQueue = parts;
+	for (auto &rs : m_vImpostorBakeQueue)
+	{
+		rs.lods.levels = 0;
+		rs.visibleRanges.clear();
+	}
+
+	m_vec3ImpostorBakeCenter = center;
+	m_fImpostorBakeRadius = radius;
+	m_nImpostorBakeVariant = variant;
+	m_nImpostorBakeCell = 0;
+
+	return variant;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Renders the next views of the bake in progress, so a bake costs
+//          a few views per frame instead of the whole grid in one
+//-----------------------------------------------------------------------------
+bool Renderer::continueImpostorBake()
+{
+	if (m_nImpostorBakeVariant < 0)
+		return true;
+
+	// the bake borrows the frame uniforms, so keep this frame's to put back
+	FrameUniforms savedFrameUniforms = m_FrameUniforms;
+
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+
+	m_ImpostorAtlas.beginBake(m_nImpostorBakeVariant, m_nImpostorBakeCell == 0);
+
+	int lastCell = (std::min)(m_nImpostorBakeCell + IMPOSTOR_BAKE_CELLS_PER_FRAME, IMPOSTOR_GRID_SIZE * IMPOSTOR_GRID_SIZE);
+	for (; m_nImpostorBakeCell < lastCell; ++m_nImpostorBakeCell)
+	{
+		FrameUniforms fu;
+		fu.v4Viewport = glm::vec4(0.f, 0.f, IMPOSTOR_CELL_SIZE, IMPOSTOR_CELL_SIZE);
+		fu.m4View = m_ImpostorAtlas.getCellView(m_nImpostorBakeCell, m_vec3ImpostorBakeCenter, m_fImpostorBakeRadius);
+		fu.m4Projection = m_ImpostorAtlas.getCellProjection(m_fImpostorBakeRadius);
+		fu.m4ViewProjection = fu.m4Projection * fu.m4View;
+		setFrameUniforms(fu);
+
+		m_ImpostorAtlas.bindCell(m_nImpostorBakeCell);
+
+		processRenderQueue(m_vImpostorBakeQueue);
+	}
+
+	bool complete = m_nImpostorBakeCell == IMPOSTOR_GRID_SIZE * IMPOSTOR_GRID_SIZE;
+	m_ImpostorAtlas.endBake(complete);
+
+	setFrameUniforms(savedFrameUniforms);
+
+	if (complete)
+	{
+		m_vImpostorBakeQueue.clear();
+		m_nImpostorBakeVariant = -1;
+	}
+
+	return complete;
+}
+
+void Renderer::addImpostor(int variant, const glm::vec3 & worldCenter, const glm::quat & orientation, float worldRadius, float opacity)
+{
+	m_ImpostorAtlas.addInstance(variant, worldCenter, orientation, worldRadius, opacity);
+}
+
+// Blends over the band from the impostor size up to one and a half times it
+float Renderer::getImpostorBlend(const glm::vec3 & worldCenter, float worldRadius)
+{
+	if (m_nRenderHeight == 0u)
+		return 0.f;
+
+	float screenSize = getScreenSize(worldCenter, worldRadius);
+
+	return glm::clamp((1.5f * m_fImpostorSize - screenSize) / (0.5f * m_fImpostorSize), 0.f, 1.f);
 }
 
 void Renderer::addToStaticRenderQueue(RendererSubmission &rs)
 {
+	rs.sortKey = computeSortKey(rs);
+	rs.worldBounds = computeWorldBounds(rs);
 	m_vStaticRenderQueue.push_back(rs);
 }
 
 void Renderer::addToDynamicRenderQueue(RendererSubmission &rs)
 {
+	rs.sortKey = computeSortKey(rs);
+	rs.worldBounds = computeWorldBounds(rs);
 	m_vDynamicRenderQueue.push_back(rs);
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Packs shader, VAO, material and front-to-back view depth into a
+//          key whose order minimizes state changes when drawing
+//-----------------------------------------------------------------------------
+uint64_t Renderer::computeSortKey(const RendererSubmission & rs)
+{
+	uint64_t shader = static_cast<uint64_t>(rs.shader + 1) & ((1ull << SORT_KEY_SHADER_BITS) - 1ull);
+	uint64_t vao = static_cast<uint64_t>(rs.VAO) & ((1ull << SORT_KEY_VAO_BITS) - 1ull);
+	uint64_t material = ((static_cast<uint64_t>(rs.diffuseTex) << (SORT_KEY_MATERIAL_BITS / 2)) | (static_cast<uint64_t>(rs.specularTex) & ((1ull << (SORT_KEY_MATERIAL_BITS / 2)) - 1ull))) & ((1ull << SORT_KEY_MATERIAL_BITS) - 1ull);
+
+	float viewDepth = -(m_mat4View * rs.modelToWorldTransform * glm::vec4(rs.boundsCenter, 1.f)).z;
+	float depthRange = m_fFarClip > m_fNearClip ? m_fFarClip - m_fNearClip : 1.f;
+	uint64_t depth = static_cast<uint64_t>(glm::clamp((viewDepth - m_fNearClip) / depthRange, 0.f, 1.f) * static_cast<float>((1ull << SORT_KEY_DEPTH_BITS) - 1ull));
+
+	return (shader << (SORT_KEY_VAO_BITS + SORT_KEY_MATERIAL_BITS + SORT_KEY_DEPTH_BITS)) |
+		(vao << (SORT_KEY_MATERIAL_BITS + SORT_KEY_DEPTH_BITS)) |
+		(material << SORT_KEY_DEPTH_BITS) |
+		depth;
+}
+
+// Bounding sphere in world space, scaled by the transform's largest axis
+glm::vec4 Renderer::computeWorldBounds(const RendererSubmission & rs)
+{
+	if (rs.boundsRadius <= 0.f)
+		return glm::vec4(0.f, 0.f, 0.f, -1.f);
+
+	glm::vec3 center = glm::vec3(rs.modelToWorldTransform * glm::vec4(rs.boundsCenter, 1.f));
+	float scale = (std::max)(glm::length(glm::vec3(rs.modelToWorldTransform[0])), (std::max)(glm::length(glm::vec3(rs.modelToWorldTransform[1])), glm::length(glm::vec3(rs.modelToWorldTransform[2]))));
+
+	return glm::vec4(center, rs.boundsRadius * scale);
+}
+
 void Renderer::toggleWireframe()
 {
 	m_bShowWireframe = !m_bShowWireframe;
 }
 
+const Renderer::RenderStats & Renderer::getStats()
+{
+	return m_Stats;
+}
+
+void Renderer::setInstanceCullingValidation(bool validate)
+{
+	m_InstanceCuller.setValidation(validate);
+}
+
+void Renderer::setOcclusionCulling(bool enable)
+{
+	m_bOcclusionCulling = enable;
+}
+
+bool Renderer::getOcclusionCulling()
+{
+	return m_bOcclusionCulling;
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Creates all the shaders used by HelloVR SDL
@@ -67,11 +374,34 @@ void Renderer::SetupShaders()
 	m_Shaders.SetVersion("450");
 
 	m_Shaders.SetPreambleFile("GLSLpreamble.h");
+	m_Shaders.SetProgramCacheDirectory("shadercache");
+
+	addShader("lighting", { "shaders/lighting.vert", "shaders/lighting.frag" });
+	addShader("lightingWireframe", { "shaders/lighting.vert", "shaders/lightingWF.geom", "shaders/lightingWF.frag" });
+	addShader("lightClusters", { "shaders/lightClusters.comp" });
+	addShader("debug", { "shaders/flat.vert", "shaders/flat.frag" });
+	addShader("flat", { "shaders/flat.vert", "shaders/flat.frag" });
+	addShader("impostor", { "shaders/impostor.vert", "shaders/impostor.frag" });
+	addShader("pooled", { "shaders/pooled.vert", "shaders/flat.frag" });
+	addShader("pooledCulled", { "shaders/pooledCulled.vert", "shaders/flat.frag" });
+	addShader("instanceCull", { "shaders/instanceCull.comp" });
+	addShader("instanceCompact", { "shaders/instanceCompact.comp" });
+	addShader("depthPyramid", { "shaders/depthPyramid.comp" });
+
+	m_hDebugShader = getShaderHandle("debug");
+	m_hImpostorShader = getShaderHandle("impostor");
+
+	m_InstanceCuller.setPrograms(getShader("instanceCull"), getShader("instanceCompact"));
+	m_DepthPyramid.setProgram(getShader("depthPyramid"));
+}
 
-	m_mapShaders["lighting"] = m_Shaders.AddProgramFromExts({ "shaders/lighting.vert", "shaders/lighting.frag" });
-	m_mapShaders["lightingWireframe"] = m_Shaders.AddProgramFromExts({ "shaders/lighting.vert", "shaders/lightingWF.geom", "shaders/lightingWF.frag" });
-	m_mapShaders["debug"] = m_Shaders.AddProgramFromExts({ "shaders/flat.vert", "shaders/flat.frag" });
-	m_mapShaders["flat"] = m_Shaders.AddProgramFromExts({ "shaders/flat.vert", "shaders/flat.frag" });
+void Renderer::addShader(const char * name, const std::vector<std::string>& files)
+{
+	GLuint *program = m_Shaders.AddProgramFromExts(files);
+
+	m_mapShaders[name] = program;
+	m_mapShaderHandles[name] = static_cast<ShaderHandle>(m_vpShaderPrograms.size());
+	m_vpShaderPrograms.push_back(program);
 }
 
 
@@ -80,69 +410,560 @@ void Renderer::SetupShaders()
 //-----------------------------------------------------------------------------
 void Renderer::RenderFrame(GLsizei width, GLsizei height)
 {
+	PROFILE_GPU_SCOPE("RenderFrame");
+
 	m_Shaders.UpdatePrograms();
 
-	// for now as fast as possible
-	glClearColor(0.15f, 0.15f, 0.18f, 1.0f); // nice background color, but not black
-	 //glClearColor(0.33, 0.39, 0.49, 1.0); //VTT4D background
+	m_Stats = RenderStats();
+
+	m_bOcclusionFrame = m_bOcclusionCulling && m_DepthPyramid.isReady();
 
 	glEnable(GL_MULTISAMPLE);
 
-	glViewport(0, 0, width, height);
+	m_nWindowWidth = width;
+	m_nWindowHeight = height;
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glEnable(GL_DEPTH_TEST);
+	m_DynamicResolution.begin(width, height);
+	m_nRenderWidth = static_cast<uint32_t>(m_DynamicResolution.getRenderWidth());
+	m_nRenderHeight = static_cast<uint32_t>(m_DynamicResolution.getRenderHeight());
+
+	// screen space lookups (light clusters, LOD sizes) go by the render target's size
+	glm::vec4 viewport(0.f, 0.f, static_cast<float>(m_nRenderWidth), static_cast<float>(m_nRenderHeight));
+	if (m_FrameUniforms.v4Viewport != viewport)
+	{
+		FrameUniforms uniforms = m_FrameUniforms;
+		uniforms.v4Viewport = viewport;
+		setFrameUniforms(uniforms);
+	}
+
+	buildFrameGraph();
 
+	glViewport(0, 0, m_DynamicResolution.getRenderWidth(), m_DynamicResolution.getRenderHeight());
+	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	
 
-	if (*m_mapShaders["debug"])
+	if (m_FrameGraph.compile())
+		m_FrameGraph.execute();
+
+	m_bOcclusionFrame = false;
+
+	glDisable(GL_BLEND);
+
+	glUseProgram(0);
+
+	m_DynamicResolution.end();
+
+	m_FrameCapture.update();
+
+	m_Stats.validatedInstances = m_InstanceCuller.getValidatedInstances();
+	m_Stats.cullingMismatches = m_InstanceCuller.getValidationMismatches();
+
+	// the frame's per-frame data is in flight from here on
+	m_FrameUniformRing.fence();
+	m_DrawDataRing.fence();
+	m_InstanceCuller.fence();
+
+	m_Stats.occludedInstances = m_InstanceCuller.getOccludedInstances();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Declares the frame's passes: the render queues into the cleared
+//          scene target, the occlusion phase, impostors, then resolving and
+//          upscaling into the window. The resolve is declared either way and
+//          left for the graph to cull when the target isn't multisampled.
+//-----------------------------------------------------------------------------
+void Renderer::buildFrameGraph()
+{
+	GLsizei targetWidth = m_DynamicResolution.getTargetWidth();
+	GLsizei targetHeight = m_DynamicResolution.getTargetHeight();
+	GLsizei samples = m_DynamicResolution.getSamples();
+
+	m_FrameGraph.reset();
+
+	FrameGraph::Resource color = m_FrameGraph.createTexture("sceneColor", FrameGraph::TextureDesc(targetWidth, targetHeight, SCENE_COLOR_FORMAT, samples));
+	FrameGraph::Resource depth = m_FrameGraph.createTexture("sceneDepth", FrameGraph::TextureDesc(targetWidth, targetHeight, SCENE_DEPTH_FORMAT, samples));
+	FrameGraph::Resource resolved = m_FrameGraph.createTexture("resolvedColor", FrameGraph::TextureDesc(targetWidth, targetHeight, SCENE_COLOR_FORMAT));
+	FrameGraph::Resource window;
+	if (m_glOutputTexture)
 	{
-		glUseProgram(*m_mapShaders["debug"]);
-		glUniformMatrix4fv(MODEL_MAT_UNIFORM_LOCATION, 1, GL_FALSE, glm::value_ptr(glm::mat4()));
-		DebugDrawer::getInstance().render();
+		window = m_FrameGraph.importTexture("output", m_glOutputTexture);
+		m_FrameGraph.markOutput(window);
+	}
+	else
+		window = m_FrameGraph.importBackbuffer("window");
+
+	// RENDER QUEUES
+	FrameGraph::Pass pass = m_FrameGraph.addPass("renderQueues", [this]() {
+		if (*m_vpShaderPrograms[m_hDebugShader])
+		{
+			glUseProgram(*m_vpShaderPrograms[m_hDebugShader]);
+			glUniformMatrix4fv(MODEL_MAT_UNIFORM_LOCATION, 1, GL_FALSE, glm::value_ptr(glm::mat4()));
+			DebugDrawer::getInstance().render();
+		}
 		DebugDrawer::getInstance().flushLines();
+
+		// STATIC OBJECTS
+		processRenderQueue(m_vStaticRenderQueue);
+
+		// DYNAMIC OBJECTS
+		processRenderQueue(m_vDynamicRenderQueue, true);
+	});
+	color = m_FrameGraph.clearColorTarget(pass, color, glm::vec4(0.15f, 0.15f, 0.18f, 1.0f)); // nice background color, but not black
+	depth = m_FrameGraph.clearDepthTarget(pass, depth);
+
+	// NEWLY VISIBLE INSTANCES
+	if (m_bOcclusionFrame)
+	{
+		FrameGraph::Resource pyramid = m_FrameGraph.importTexture("depthPyramid", m_DepthPyramid.getTexture());
+
+		pass = m_FrameGraph.addPass("depthPyramid", [this, depth]() {
+			// without a pyramid nothing is hidden, so everything not drawn yet is
+			m_glFrameDepthPyramid = 0;
+			if (!m_vOcclusionBatches.empty() && m_DepthPyramid.build(m_FrameGraph.getReadFramebuffer(depth), static_cast<GLsizei>(m_nRenderWidth), static_cast<GLsizei>(m_nRenderHeight)))
+				m_glFrameDepthPyramid = m_DepthPyramid.getTexture();
+		});
+		m_FrameGraph.read(pass, depth);
+		pyramid = m_FrameGraph.write(pass, pyramid, true);
+
+		pass = m_FrameGraph.addPass("occlusion", [this]() {
+			renderOcclusionPhase(m_glFrameDepthPyramid);
+		});
+		m_FrameGraph.read(pass, pyramid);
+		color = m_FrameGraph.setColorTarget(pass, color);
+		depth = m_FrameGraph.setDepthTarget(pass, depth);
 	}
 
-	// STATIC OBJECTS
-	processRenderQueue(m_vStaticRenderQueue);
+	// IMPOSTORS
+	pass = m_FrameGraph.addPass("impostors", [this]() {
+		if (*m_vpShaderPrograms[m_hImpostorShader])
+			m_ImpostorAtlas.draw(*m_vpShaderPrograms[m_hImpostorShader]);
+	});
+	color = m_FrameGraph.setColorTarget(pass, color);
+	depth = m_FrameGraph.setDepthTarget(pass, depth);
+
+	// RESOLVE
+	pass = m_FrameGraph.addPass("resolve", [this, color]() {
+		GLsizei width = static_cast<GLsizei>(m_nRenderWidth), height = static_cast<GLsizei>(m_nRenderHeight);
+		glBlitNamedFramebuffer(m_FrameGraph.getReadFramebuffer(color), m_FrameGraph.getTargetFramebuffer(), 0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	});
+	m_FrameGraph.read(pass, color);
+	resolved = m_FrameGraph.setColorTarget(pass, resolved, true);
+
+	// UPSCALE TO THE WINDOW
+	// the frame is captured from here as well, since a pass of its own would have no output to keep it
+	FrameGraph::Resource source = samples > 1 ? resolved : color;
+	std::string capture;
+	if (!m_dqCaptureRequests.empty())
+	{
+		capture = m_dqCaptureRequests.front();
+		m_dqCaptureRequests.pop_front();
+	}
+	pass = m_FrameGraph.addPass("upscale", [this, source, capture]() {
+		bool scaled = m_nRenderWidth != static_cast<uint32_t>(m_nWindowWidth) || m_nRenderHeight != static_cast<uint32_t>(m_nWindowHeight);
+		glBlitNamedFramebuffer(m_FrameGraph.getReadFramebuffer(source), m_FrameGraph.getTargetFramebuffer(), 0, 0, m_nRenderWidth, m_nRenderHeight, 0, 0, m_nWindowWidth, m_nWindowHeight, GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+
+		if (!capture.empty())
+			m_FrameCapture.read(m_FrameGraph.getTexture(source), static_cast<GLsizei>(m_nRenderWidth), static_cast<GLsizei>(m_nRenderHeight), capture);
+	});
+	m_FrameGraph.read(pass, source);
+	m_FrameGraph.setColorTarget(pass, window, true);
+}
 
-	// DYNAMIC OBJECTS
-	processRenderQueue(m_vDynamicRenderQueue, true);
+//-----------------------------------------------------------------------------
+// Purpose: Draws the GPU culled instances that are not hidden in the depth
+//          pyramid of everything drawn so far (including the instances that
+//          were visible last frame) and were not drawn yet
+//-----------------------------------------------------------------------------
+void Renderer::renderOcclusionPhase(GLuint depthPyramid)
+{
+	if (m_vOcclusionBatches.empty())
+		return;
 
-	glDisable(GL_BLEND);
+	glBindVertexArray(m_GeometryPool.getVAO());
+
+	for (auto const &batch : m_vOcclusionBatches)
+	{
+		m_vCulledDraws.assign(m_vOcclusionDraws.begin() + batch.firstDraw, m_vOcclusionDraws.begin() + batch.firstDraw + batch.drawCount);
+		m_InstanceCuller.cull(m_vCulledDraws, m_GeometryPool.getInstanceBuffer(), m_fLODFullDetailSize, CULL_PHASE_OCCLUSION, depthPyramid);
+
+		glUseProgram(batch.program);
+		if (batch.specularExponent > 0.f)
+			glUniform1f(MATERIAL_SHININESS_UNIFORM_LOCATION, batch.specularExponent);
+		if (batch.diffuseTex > 0u)
+			glBindTextureUnit(DIFFUSE_TEXTURE_BINDING, batch.diffuseTex);
+		if (batch.specularTex > 0u)
+			glBindTextureUnit(SPECULAR_TEXTURE_BINDING, batch.specularTex);
+
+		m_InstanceCuller.draw(batch.primitiveType, batch.program);
+	}
+
+	glBindVertexArray(0);
+
+	m_vCulledDraws.clear();
+	m_vOcclusionBatches.clear();
+	m_vOcclusionDraws.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Fills the sort items with the submissions whose bounding spheres
+//          are inside the frustum of the current frame uniforms, testing
+//          four spheres against each plane at a time. Groups of four are
+//          spread over the job system, then the survivors are gathered in
+//          queue order.
+//-----------------------------------------------------------------------------
+void Renderer::cullRenderQueue(const std::vector<RendererSubmission>& renderQueue)
+{
+	PROFILE_SCOPE("Renderer::cullRenderQueue");
+
+	size_t count = renderQueue.size();
+	size_t padded = (count + 3u) & ~size_t(3u);
+
+	m_vfBoundsX.resize(padded);
+	m_vfBoundsY.resize(padded);
+	m_vfBoundsZ.resize(padded);
+	m_vfBoundsRadius.resize(padded);
+	m_vucInsideMasks.resize(padded / 4u);
+
+	// frustum planes, pointing inwards and normalized so distances compare with radii
+	const glm::mat4 &clipFromWorld = m_FrameUniforms.m4ViewProjection;
+	__m128 planes[6][4];
+	for (int i = 0; i < 3; ++i)
+	{
+		glm::vec4 row(clipFromWorld[0][i], clipFromWorld[1][i], clipFromWorld[2][i], clipFromWorld[3][i]);
+		glm::vec4 w(clipFromWorld[0][3], clipFromWorld[1][3], clipFromWorld[2][3], clipFromWorld[3][3]);
+
+		for (int side = 0; side < 2; ++side)
+		{
+			glm::vec4 plane = side == 0 ? w + row : w - row;
+			plane /= glm::length(glm::vec3(plane));
+
+			for (int c = 0; c < 4; ++c)
+				planes[2 * i + side][c] = _mm_set1_ps(plane[c]);
+		}
+	}
+
+	auto cullGroups = [&](size_t firstGroup, size_t lastGroup) {
+		for (size_t i = firstGroup * 4u; i < lastGroup * 4u && i < count; ++i)
+		{
+			const glm::vec4 &bounds = renderQueue[i].worldBounds;
+			m_vfBoundsX[i] = bounds.x;
+			m_vfBoundsY[i] = bounds.y;
+			m_vfBoundsZ[i] = bounds.z;
+			m_vfBoundsRadius[i] = bounds.w < 0.f ? std::numeric_limits<float>::max() : bounds.w; // never culled
+		}
+
+		const __m128 zero = _mm_setzero_ps();
+		for (size_t group = firstGroup; group < lastGroup; ++group)
+		{
+			size_t i = group * 4u;
+			__m128 x = _mm_loadu_ps(&m_vfBoundsX[i]);
+			__m128 y = _mm_loadu_ps(&m_vfBoundsY[i]);
+			__m128 z = _mm_loadu_ps(&m_vfBoundsZ[i]);
+			__m128 r = _mm_loadu_ps(&m_vfBoundsRadius[i]);
+
+			__m128 inside = _mm_cmpeq_ps(zero, zero);
+			for (int p = 0; p < 6; ++p)
+			{
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], x), _mm_mul_ps(planes[p][1], y)), _mm_add_ps(_mm_mul_ps(planes[p][2], z), planes[p][3]));
+				inside = _mm_and_ps(inside, _mm_cmpgt_ps(_mm_add_ps(distance, r), zero));
+			}
+
+			m_vucInsideMasks[group] = static_cast<uint8_t>(_mm_movemask_ps(inside));
+		}
+	};
+
+	if (m_pJobSystem)
+		m_pJobSystem->parallelFor(0u, padded / 4u, CULL_GRAIN, cullGroups);
+	else
+		cullGroups(0u, padded / 4u);
+
+	m_vSortItems.clear();
+
+	for (size_t i = 0u; i < padded; i += 4u)
+	{
+		int mask = m_vucInsideMasks[i / 4u];
+		for (size_t j = i; j < i + 4u && j < count; ++j, mask >>= 1)
+		{
+			if (mask & 1)
+			{
+				SortItem item;
+				item.key = renderQueue[j].sortKey;
+				item.index = static_cast<uint32_t>(j);
+				m_vSortItems.push_back(item);
+			}
+		}
+	}
 
-	glUseProgram(0);	
+	m_Stats.submitted += static_cast<uint32_t>(count);
+	m_Stats.culled += static_cast<uint32_t>(count - m_vSortItems.size());
+	m_Stats.drawn += static_cast<uint32_t>(m_vSortItems.size());
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Draws the queue in sort key order, only issuing the state changes
+//          that differ from the previous submission. Runs of geometry pool
+//          submissions sharing a program and material become one multi-draw.
+//-----------------------------------------------------------------------------
 void Renderer::processRenderQueue(std::vector<RendererSubmission> &renderQueue, bool clearQueueAfterProcessing)
 {
-	for (auto i : renderQueue)
+	cullRenderQueue(renderQueue);
+
+	radixSortByKey(m_vSortItems, m_vSortScratch);
+
+	GLuint currentProgram = 0u;
+	GLuint currentVAO = 0u;
+	GLuint currentDiffuseTex = 0u;
+	GLuint currentSpecularTex = 0u;
+	float currentSpecularExponent = 0.f;
+
+	for (size_t k = 0u; k < m_vSortItems.size(); ++k)
 	{
-		if (m_mapShaders[i.shaderName] && *m_mapShaders[i.shaderName])
+		const RendererSubmission &i = renderQueue[m_vSortItems[k].index];
+
+		if (i.shader < 0 || i.shader >= static_cast<ShaderHandle>(m_vpShaderPrograms.size()) || !m_vpShaderPrograms[i.shader] || !*m_vpShaderPrograms[i.shader])
+			continue;
+
+		GLuint program = *m_vpShaderPrograms[i.shader];
+		if (program != currentProgram)
 		{
-			glUseProgram(*m_mapShaders[i.shaderName]);
-			glUniformMatrix4fv(MODEL_MAT_UNIFORM_LOCATION, 1, GL_FALSE, glm::value_ptr(i.modelToWorldTransform));
+			glUseProgram(program);
+			currentProgram = program;
+			currentSpecularExponent = 0.f; // uniforms belong to the program
+		}
 
-			if (i.specularExponent > 0.f)
-				glUniform1f(MATERIAL_SHININESS_UNIFORM_LOCATION, i.specularExponent);
+		if (i.specularExponent > 0.f && i.specularExponent != currentSpecularExponent)
+		{
+			glUniform1f(MATERIAL_SHININESS_UNIFORM_LOCATION, i.specularExponent);
+			currentSpecularExponent = i.specularExponent;
+		}
 
-			if (i.diffuseTex > 0u)
-				glBindTextureUnit(DIFFUSE_TEXTURE_BINDING, i.diffuseTex);
-			if (i.specularTex > 0u)
-				glBindTextureUnit(SPECULAR_TEXTURE_BINDING, i.specularTex);
+		if (i.diffuseTex > 0u && i.diffuseTex != currentDiffuseTex)
+		{
+			glBindTextureUnit(DIFFUSE_TEXTURE_BINDING, i.diffuseTex);
+			currentDiffuseTex = i.diffuseTex;
+		}
+		if (i.specularTex > 0u && i.specularTex != currentSpecularTex)
+		{
+			glBindTextureUnit(SPECULAR_TEXTURE_BINDING, i.specularTex);
+			currentSpecularTex = i.specularTex;
+		}
 
+		if (i.VAO != currentVAO)
+		{
 			glBindVertexArray(i.VAO);
-			glDrawElements(i.primitiveType, i.vertCount, GL_UNSIGNED_SHORT, 0);
-			glBindVertexArray(0);
+			currentVAO = i.VAO;
+		}
+
+		if (i.VAO == m_GeometryPool.getVAO())
+		{
+			// gather the run of submissions that can share this one's state
+			size_t last = k;
+			while (last + 1u < m_vSortItems.size() && canBatch(i, renderQueue[m_vSortItems[last + 1u].index]))
+				++last;
+
+			if (i.gpuCulled)
+			{
+				for (; k <= last; ++k)
+					addCulledDraw(renderQueue[m_vSortItems[k].index]);
+				k = last;
+
+				// culling switches programs
+				m_InstanceCuller.cull(m_vCulledDraws, m_GeometryPool.getInstanceBuffer(), m_fLODFullDetailSize, m_bOcclusionFrame ? CULL_PHASE_LAST_VISIBLE : CULL_PHASE_ALL);
+				glUseProgram(currentProgram);
+				m_InstanceCuller.draw(i.primitiveType, currentProgram);
+
+				// the rest of the instances wait for the depth pyramid
+				if (m_bOcclusionFrame)
+				{
+					OcclusionBatch batch;
+					batch.program = currentProgram;
+					batch.primitiveType = i.primitiveType;
+					batch.diffuseTex = i.diffuseTex;
+					batch.specularTex = i.specularTex;
+					batch.specularExponent = i.specularExponent;
+					batch.firstDraw = m_vOcclusionDraws.size();
+					batch.drawCount = m_vCulledDraws.size();
+					m_vOcclusionBatches.push_back(batch);
+
+					m_vOcclusionDraws.insert(m_vOcclusionDraws.end(), m_vCulledDraws.begin(), m_vCulledDraws.end());
+				}
+
+				m_vCulledDraws.clear();
+
+				continue;
+			}
+
+			for (; k <= last; ++k)
+			{
+				const RendererSubmission &batched = renderQueue[m_vSortItems[k].index];
+
+				getDrawRanges(batched, m_vDrawRanges);
+				for (auto const &range : m_vDrawRanges)
+				{
+					GeometryPool::DrawElementsIndirectCommand cmd;
+					cmd.count = static_cast<GLuint>(range.count);
+					cmd.instanceCount = static_cast<GLuint>(batched.instanceCount);
+					cmd.firstIndex = range.first;
+					cmd.baseVertex = batched.baseVertex;
+					cmd.baseInstance = batched.baseInstance;
+
+					m_vDrawCommands.push_back(cmd);
+					m_vmat4DrawTransforms.push_back(batched.modelToWorldTransform);
+				}
+			}
+			k = last;
+
+			drawBatch(i.primitiveType);
+
+			continue;
 		}
+
+		glUniformMatrix4fv(MODEL_MAT_UNIFORM_LOCATION, 1, GL_FALSE, glm::value_ptr(i.modelToWorldTransform));
+
+		getDrawRanges(i, m_vDrawRanges);
+		for (auto const &range : m_vDrawRanges)
+			glDrawElementsInstancedBaseVertexBaseInstance(i.primitiveType, range.count, i.indexType, (GLvoid*)(range.first * indexTypeSize(i.indexType)), i.instanceCount, i.baseVertex, i.baseInstance);
 	}
 
+	glBindVertexArray(0);
+
 	if (clearQueueAfterProcessing)
 		renderQueue.clear();
 }
 
+// Whether b can go in the same multi-draw as a, i.e. it needs no state change from it
+bool Renderer::canBatch(const RendererSubmission & a, const RendererSubmission & b)
+{
+	return a.shader == b.shader &&
+		a.VAO == b.VAO &&
+		a.primitiveType == b.primitiveType &&
+		a.diffuseTex == b.diffuseTex &&
+		a.specularTex == b.specularTex &&
+		a.specularExponent == b.specularExponent &&
+		a.gpuCulled == b.gpuCulled;
+}
+
+// Index ranges to draw for a submission: its visible ranges at full detail, otherwise the selected LOD
+void Renderer::getDrawRanges(const RendererSubmission & rs, std::vector<IndexRange>& ranges)
+{
+	ranges.clear();
+
+	IndexRange range;
+	range.first = rs.firstIndex;
+	range.count = rs.vertCount;
+
+	int lod = 0;
+	if (rs.lods.levels > 0)
+	{
+		lod = selectLOD(rs);
+		range.first = rs.lods.firstIndex[lod];
+		range.count = rs.lods.indexCount[lod];
+	}
+
+	if (lod == 0 && !rs.visibleRanges.empty())
+		ranges = rs.visibleRanges;
+	else
+		ranges.push_back(range);
+}
+
+// Instances and levels of a submission, for culling on the GPU
+void Renderer::addCulledDraw(const RendererSubmission & rs)
+{
+	InstanceCuller::CulledDraw draw;
+	draw.model = rs.modelToWorldTransform;
+	draw.bounds = rs.instanceBounds;
+	draw.baseVertex = rs.baseVertex;
+	draw.baseInstance = rs.baseInstance;
+	draw.instanceCount = static_cast<GLuint>(rs.instanceCount);
+	draw.scale = (std::max)(glm::length(glm::vec3(rs.modelToWorldTransform[0])), (std::max)(glm::length(glm::vec3(rs.modelToWorldTransform[1])), glm::length(glm::vec3(rs.modelToWorldTransform[2]))));
+
+	if (rs.lods.levels > 0)
+	{
+		draw.levels = static_cast<GLuint>(rs.lods.levels);
+		for (int lod = 0; lod < rs.lods.levels; ++lod)
+		{
+			draw.firstIndex[lod] = rs.lods.firstIndex[lod];
+			draw.indexCount[lod] = static_cast<GLuint>(rs.lods.indexCount[lod]);
+		}
+	}
+	else
+	{
+		draw.levels = 1u;
+		draw.firstIndex[0] = rs.firstIndex;
+		draw.indexCount[0] = static_cast<GLuint>(rs.vertCount);
+	}
+
+	m_vCulledDraws.push_back(draw);
+}
+
+// Issues and clears the gathered draw commands, with their model matrices indexed by draw ID
+void Renderer::drawBatch(GLenum primitiveType)
+{
+	if (m_vDrawCommands.empty())
+		return;
+
+	GLsizeiptr commandsSize = m_vDrawCommands.size() * sizeof(GeometryPool::DrawElementsIndirectCommand);
+	GLsizeiptr transformsSize = m_vmat4DrawTransforms.size() * sizeof(glm::mat4);
+
+	// one allocation, as the ring may be reallocated by the next; transforms go first for the storage buffer's
+	// offset alignment, commands only need 4 bytes
+	GLintptr transformsOffset = 0;
+	char *data = static_cast<char*>(m_DrawDataRing.allocate(transformsSize + commandsSize, transformsOffset));
+	if (!data)
+	{
+		m_vDrawCommands.clear();
+		m_vmat4DrawTransforms.clear();
+		return;
+	}
+
+	memcpy(data, m_vmat4DrawTransforms.data(), transformsSize);
+	memcpy(data + transformsSize, m_vDrawCommands.data(), commandsSize);
+	GLintptr commandsOffset = transformsOffset + transformsSize;
+
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, DRAW_TRANSFORMS_STORAGE_BUFFER_BINDING, m_DrawDataRing.getBuffer(), transformsOffset, transformsSize);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_DrawDataRing.getBuffer());
+
+	glMultiDrawElementsIndirect(primitiveType, GL_UNSIGNED_INT, reinterpret_cast<const void*>(commandsOffset), static_cast<GLsizei>(m_vDrawCommands.size()), 0);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	m_vDrawCommands.clear();
+	m_vmat4DrawTransforms.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks the level of detail from the projected height of the
+//          submission's bounding sphere; each level halves the screen size
+//-----------------------------------------------------------------------------
+int Renderer::selectLOD(const RendererSubmission & rs)
+{
+	if (rs.lods.levels <= 1 || rs.boundsRadius <= 0.f)
+		return 0;
+
+	glm::vec3 center = glm::vec3(rs.modelToWorldTransform * glm::vec4(rs.boundsCenter, 1.f));
+	float scale = (std::max)(glm::length(glm::vec3(rs.modelToWorldTransform[0])), (std::max)(glm::length(glm::vec3(rs.modelToWorldTransform[1])), glm::length(glm::vec3(rs.modelToWorldTransform[2]))));
+
+	float screenSize = getScreenSize(center, rs.boundsRadius * scale);
+
+	int lod = 0;
+	for (float size = m_fLODFullDetailSize * 0.5f; screenSize < size && lod < rs.lods.levels - 1; size *= 0.5f)
+		++lod;
+
+	return lod;
+}
+
+// Projected height in pixels of a bounding sphere; unbounded when the camera is inside it
+float Renderer::getScreenSize(const glm::vec3 & worldCenter, float worldRadius)
+{
+	float distance = -(m_mat4View * glm::vec4(worldCenter, 1.f)).z;
+
+	if (distance <= worldRadius)
+		return std::numeric_limits<float>::max();
+
+	return worldRadius / distance * m_mat4Projection[1][1] * static_cast<float>(m_nRenderHeight);
+}
+
 void Renderer::Shutdown()
 {
 }
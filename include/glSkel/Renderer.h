@@ -4,6 +4,24 @@
 #include <GLFW/glfw3.h>
 #include <glSkel/LightingSystem.h>
 #include <glSkel/shaderset.h>
+#include <glSkel/ImpostorAtlas.h>
+#include <glSkel/GeometryPool.h>
+#include <glSkel/StreamBuffer.h>
+#include <glSkel/InstanceCuller.h>
+#include <glSkel/DepthPyramid.h>
+#include <glSkel/DynamicResolution.h>
+#include <glSkel/FrameGraph.h>
+#include <glSkel/FrameCapture.h>
+#include <glSkel/JobSystem.h>
+
+#include "GLSLpreamble.h"
+
+#define FRAME_UNIFORMS_PER_FRAME 128 // initial slices per frame; impostor bakes set one per view
+#define IMPOSTOR_BAKE_CELLS_PER_FRAME 8 // impostor views rendered per frame while a bake is in progress
+#define DRAW_DATA_BYTES_PER_FRAME (1 << 20) // initial per-draw data (indirect commands and transforms) per frame
+#define SCENE_COLOR_FORMAT GL_RGBA8
+#define SCENE_DEPTH_FORMAT GL_DEPTH24_STENCIL8
+#define CULL_GRAIN 64 // fewest groups of four bounding spheres frustum culled by one thread
 
 struct FrameUniforms {
 	glm::vec4 v4Viewport;
@@ -15,26 +33,91 @@ struct FrameUniforms {
 class Renderer
 {
 public:
+	// Index of a shader program registered with the renderer, -1 for none
+	typedef int ShaderHandle;
+
+	// Index ranges of progressively simplified versions of one mesh, all sharing its vertices
+	struct LODChain
+	{
+		int				levels;
+		GLuint			firstIndex[MAX_LOD_LEVELS];
+		GLsizei			indexCount[MAX_LOD_LEVELS];
+
+		LODChain()
+			: levels(0)
+		{}
+	};
+
+	struct IndexRange
+	{
+		GLuint			first;
+		GLsizei			count;
+	};
+
 	struct RendererSubmission
 	{
 		GLenum			primitiveType;
 		GLuint			VAO;
+		GLenum			indexType; // of the VAO's element buffer; the geometry pool's are always GL_UNSIGNED_INT
 		int				vertCount;
-		std::string		shaderName;
+		GLuint			firstIndex;
+		GLint			baseVertex;
+		GLuint			baseInstance;
+		GLsizei			instanceCount;
+		LODChain		lods; // when present, replaces firstIndex/vertCount by the level picked from the bounds' screen size
+		std::vector<IndexRange> visibleRanges; // when present, only these are drawn at full detail (e.g. what survived culling)
+		glm::vec3		boundsCenter; // model space
+		float			boundsRadius;
+		ShaderHandle	shader;
 		GLuint			diffuseTex;
 		GLuint			specularTex;
 		float			specularExponent;
 		glm::mat4		modelToWorldTransform;
+		bool			gpuCulled; // each instance is frustum culled and picks its LOD on the GPU (geometry pool only), drawn by a program reading the culled instances
+		glm::vec4		instanceBounds; // gpuCulled: bounding sphere of one instance, in its own frame
+		uint64_t		sortKey; // set when queued
+		glm::vec4		worldBounds; // set when queued: world space bounding sphere center and radius, negative radius when unbounded
 
 		RendererSubmission()
 			: primitiveType(GL_NONE)
 			, VAO(0)
+			, indexType(GL_UNSIGNED_INT)
 			, vertCount(0)
-			, shaderName("")
+			, firstIndex(0)
+			, baseVertex(0)
+			, baseInstance(0)
+			, instanceCount(1)
+			, boundsCenter(glm::vec3(0.f))
+			, boundsRadius(0.f)
+			, shader(-1)
 			, diffuseTex(0)
 			, specularTex(0)
 			, specularExponent(0.f)
 			, modelToWorldTransform(glm::mat4())
+			, gpuCulled(false)
+			, instanceBounds(glm::vec4(0.f))
+			, sortKey(0ull)
+			, worldBounds(glm::vec4(0.f, 0.f, 0.f, -1.f))
+		{}
+	};
+
+	// Counts for the last frame's render queues; impostor bakes aren't included
+	struct RenderStats
+	{
+		uint32_t		submitted;
+		uint32_t		culled; // outside the view frustum
+		uint32_t		drawn;
+		uint32_t		occludedInstances; // GPU culled instances in the frustum but hidden, from a couple of frames back
+		uint32_t		validatedInstances; // GPU culled instances checked against the CPU, with instance culling validation on
+		uint32_t		cullingMismatches; // of those, the ones the GPU culled differently
+
+		RenderStats()
+			: submitted(0u)
+			, culled(0u)
+			, drawn(0u)
+			, occludedInstances(0u)
+			, validatedInstances(0u)
+			, cullingMismatches(0u)
 		{}
 	};
 
@@ -49,13 +132,59 @@ public:
 	bool init();
 
 	GLuint* getShader(const char *name);
-	const GLuint* getFrameUBO();
+	ShaderHandle getShaderHandle(const char *name);
+	// Writes the uniforms into a new slice of the frame uniform ring and binds it for the draws that follow
+	void setFrameUniforms(const FrameUniforms &uniforms);
+	const FrameUniforms& getFrameUniforms();
+	// Storage for static meshes; submissions using its VAO are batched into indirect multi-draws
+	GeometryPool& getGeometryPool();
+	// Pool that render queue culling is spread over; without one it runs on the rendering thread
+	void setJobSystem(JobSystem *jobs);
+	// The offscreen target frames are rendered into, sized to hold a target GPU frame time
+	DynamicResolution& getDynamicResolution();
+	// Texture frames are upscaled into in place of the window, e.g. to render without one; 0 for the window
+	void setOutputTexture(GLuint texture);
+	// Writes the next frame rendered, at its render size before upscaling, to a .png or .tga file. The pixels
+	// are read back a few frames later, and written by a thread of its own, so capturing doesn't stall rendering.
+	void captureFrame(const std::string &filename);
+	// Waits until every frame captured so far has been written
+	void flushCaptures();
+
+	void setViewMatrix(const glm::mat4 &view);
+	void setProjectionMatrix(const glm::mat4 &projection);
+	const glm::mat4& getViewMatrix();
+	const glm::mat4& getProjectionMatrix();
+
+	// Screen height (pixels) at or above which a submission is drawn at full detail; each LOD level halves it
+	void setLODFullDetailSize(float pixels);
+
+	// Starts rendering the submissions (in their model space) from every impostor view into an atlas layer,
+	// restarting any bake in progress. Pass the variant returned by a previous bake to re-bake it; returns -1 if the atlas is full.
+	int beginImpostorBake(std::vector<RendererSubmission> &parts, const glm::vec3 &center, float radius, int variant = -1);
+	// Renders the next few views of the bake in progress; returns true once the layer is complete, or if nothing is baking.
+	// The submissions' meshes must stay in the geometry pool until then.
+	bool continueImpostorBake();
+	void addImpostor(int variant, const glm::vec3 &worldCenter, const glm::quat &orientation, float worldRadius, float opacity);
+	// 0 when the bounds are big enough on screen to draw the mesh, 1 when only the impostor should be drawn, and in between while blending
+	float getImpostorBlend(const glm::vec3 &worldCenter, float worldRadius);
+	// Screen height (pixels) below which objects are fully replaced by their impostor
+	void setImpostorSize(float pixels);
 	
 	void addToStaticRenderQueue(RendererSubmission &rs);
 	void addToDynamicRenderQueue(RendererSubmission &rs);
 
 	void toggleWireframe();
 
+	const RenderStats& getStats();
+
+	// Checks every GPU instance cull against the CPU, which stalls on the read back
+	void setInstanceCullingValidation(bool validate);
+	// GPU culled instances visible last frame are drawn first, the rest only if not hidden behind what that drew
+	void setOcclusionCulling(bool enable);
+	bool getOcclusionCulling();
+
+	// Renders the frame graph's passes into the dynamic resolution target and upscales it to the window
+	// (width x height); the frame uniforms' viewport is replaced by the target's size
 	void RenderFrame(GLsizei width, GLsizei height);
 
 	void Shutdown();
@@ -65,9 +194,25 @@ private:
 	~Renderer();
 
 	void SetupShaders();
+	void addShader(const char *name, const std::vector<std::string> &files);
+
+	uint64_t computeSortKey(const RendererSubmission &rs);
+	glm::vec4 computeWorldBounds(const RendererSubmission &rs);
+
+	void cullRenderQueue(const std::vector<RendererSubmission> &renderQueue);
 
 	void processRenderQueue(std::vector<RendererSubmission> &renderQueue, bool clearQueueAfterProcessing = false);
 
+	bool canBatch(const RendererSubmission &a, const RendererSubmission &b);
+	void getDrawRanges(const RendererSubmission &rs, std::vector<IndexRange> &ranges);
+	void drawBatch(GLenum primitiveType);
+	void addCulledDraw(const RendererSubmission &rs);
+	void renderOcclusionPhase(GLuint depthPyramid);
+	void buildFrameGraph();
+
+	int selectLOD(const RendererSubmission &rs);
+	float getScreenSize(const glm::vec3 &worldCenter, float worldRadius);
+
 	void RenderScene();
 
 private:
@@ -79,8 +224,72 @@ private:
 	bool m_bShowWireframe;
 
 	std::map<std::string, GLuint*> m_mapShaders;
+	std::map<std::string, ShaderHandle> m_mapShaderHandles;
+	std::vector<GLuint*> m_vpShaderPrograms; // indexed by handle
+
+	ShaderHandle m_hDebugShader;
+	ShaderHandle m_hImpostorShader;
+
+	// Queue order, rebuilt and radix-sorted by key every time a queue is processed
+	struct SortItem {
+		uint64_t key;
+		uint32_t index;
+	};
+	std::vector<SortItem> m_vSortItems;
+	std::vector<SortItem> m_vSortScratch;
+
+	// Bounding spheres of the queue being culled, one array per component for testing four at a time
+	std::vector<float> m_vfBoundsX;
+	std::vector<float> m_vfBoundsY;
+	std::vector<float> m_vfBoundsZ;
+	std::vector<float> m_vfBoundsRadius;
+	std::vector<uint8_t> m_vucInsideMasks; // per group of four, a bit for each sphere inside the frustum
+
+	JobSystem *m_pJobSystem;
+
+	RenderStats m_Stats;
+
+	ImpostorAtlas m_ImpostorAtlas;
+	std::vector<RendererSubmission> m_vImpostorBakeQueue; // of the bake in progress
+	glm::vec3 m_vec3ImpostorBakeCenter;
+	float m_fImpostorBakeRadius;
+	int m_nImpostorBakeVariant; // -1 when nothing is baking
+	int m_nImpostorBakeCell; // next view to render
+	DynamicResolution m_DynamicResolution;
+	GLuint m_glOutputTexture;
+	FrameCapture m_FrameCapture;
+	std::deque<std::string> m_dqCaptureRequests; // one per frame, oldest first
+	FrameGraph m_FrameGraph;
+	GeometryPool m_GeometryPool;
+	InstanceCuller m_InstanceCuller;
+	std::vector<InstanceCuller::CulledDraw> m_vCulledDraws;
+
+	// GPU culled batches of the frame, culled again against the depth pyramid after the render queues
+	struct OcclusionBatch {
+		GLuint program;
+		GLenum primitiveType;
+		GLuint diffuseTex;
+		GLuint specularTex;
+		float specularExponent;
+		size_t firstDraw; // in m_vOcclusionDraws
+		size_t drawCount;
+	};
+	DepthPyramid m_DepthPyramid;
+	std::vector<OcclusionBatch> m_vOcclusionBatches;
+	std::vector<InstanceCuller::CulledDraw> m_vOcclusionDraws;
+	bool m_bOcclusionCulling;
+	bool m_bOcclusionFrame; // set while the render queues of a frame are processed with occlusion culling
+	GLuint m_glFrameDepthPyramid; // built this frame, 0 if it couldn't be
+
+	// Per-draw data of the indirect multi-draw being assembled
+	std::vector<GeometryPool::DrawElementsIndirectCommand> m_vDrawCommands;
+	std::vector<glm::mat4> m_vmat4DrawTransforms;
+	std::vector<IndexRange> m_vDrawRanges;
 
-	GLuint m_glFrameUBO;
+	// Per-frame data written by the CPU, fenced at the end of each frame
+	StreamBuffer m_FrameUniformRing;
+	StreamBuffer m_DrawDataRing;
+	FrameUniforms m_FrameUniforms; // last set
 
 	int m_nWindowWidth;
 	int m_nWindowHeight;
@@ -89,6 +298,8 @@ private:
 	uint32_t m_nRenderHeight;
 	float m_fNearClip;
 	float m_fFarClip;
+	float m_fLODFullDetailSize;
+	float m_fImpostorSize;
 
 	glm::mat4 m_mat4Projection;
 	glm::mat4 m_mat4View;
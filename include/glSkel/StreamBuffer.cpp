@@ -0,0 +1,177 @@
+#include "StreamBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define STREAM_BUFFER_WAIT_NS 1000000ull // per wait on a region's fence, repeated until it signals
+
+StreamBuffer::StreamBuffer()
+	: m_glBuffer(0)
+	, m_pMapped(NULL)
+	, m_nRegionSize(0)
+	, m_nAlignment(1)
+	, m_nRegion(0u)
+	, m_nOffset(0)
+	, m_bRegionReady(true)
+{
+	for (auto &fence : m_arrFences)
+		fence = 0;
+}
+
+StreamBuffer::~StreamBuffer()
+{
+}
+
+bool StreamBuffer::init(GLenum target, GLsizeiptr regionSize)
+{
+	GLint alignment = 1;
+	if (target == GL_UNIFORM_BUFFER)
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	else if (target == GL_SHADER_STORAGE_BUFFER)
+		glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+	// indirect commands and vec4s need at least 16 bytes
+	m_nAlignment = (std::max)(static_cast<GLsizeiptr>(alignment), static_cast<GLsizeiptr>(16));
+
+	return create(regionSize);
+}
+
+void StreamBuffer::destroy()
+{
+	for (auto &fence : m_arrFences)
+	{
+		if (fence)
+			glDeleteSync(fence);
+		fence = 0;
+	}
+
+	if (m_glBuffer)
+	{
+		glUnmapNamedBuffer(m_glBuffer);
+		glDeleteBuffers(1, &m_glBuffer);
+	}
+
+	m_glBuffer = 0;
+	m_pMapped = NULL;
+}
+
+void * StreamBuffer::allocate(GLsizeiptr size, GLintptr & offset)
+{
+	size = (size + m_nAlignment - 1) / m_nAlignment * m_nAlignment;
+
+	if (m_nOffset + size > m_nRegionSize)
+	{
+		if (!grow((std::max)(m_nRegionSize * 2, m_nOffset + size)))
+			return NULL;
+	}
+
+	if (!m_bRegionReady)
+	{
+		waitRegion(m_nRegion);
+		m_bRegionReady = true;
+	}
+
+	offset = m_nRegion * m_nRegionSize + m_nOffset;
+	m_nOffset += size;
+
+	return m_pMapped + offset;
+}
+
+GLintptr StreamBuffer::write(const void * data, GLsizeiptr size)
+{
+	GLintptr offset = 0;
+	void *dst = allocate(size, offset);
+	if (dst)
+		memcpy(dst, data, size);
+
+	return offset;
+}
+
+void StreamBuffer::fence()
+{
+	if (m_nOffset > 0)
+	{
+		if (m_arrFences[m_nRegion])
+			glDeleteSync(m_arrFences[m_nRegion]);
+		m_arrFences[m_nRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	m_nRegion = (m_nRegion + 1u) % STREAM_BUFFER_REGIONS;
+	m_nOffset = 0;
+	m_bRegionReady = false;
+}
+
+GLuint StreamBuffer::getBuffer()
+{
+	return m_glBuffer;
+}
+
+GLintptr StreamBuffer::getFrameOffset()
+{
+	return m_nRegion * m_nRegionSize;
+}
+
+GLsizeiptr StreamBuffer::getFrameSize()
+{
+	return m_nOffset;
+}
+
+// Moves to a bigger buffer, starting at its first region with the current frame's allocations copied over.
+// The old buffer is only released by the driver once the GPU is done with it.
+bool StreamBuffer::grow(GLsizeiptr regionSize)
+{
+	GLuint oldBuffer = m_glBuffer;
+	GLintptr oldOffset = getFrameOffset();
+	GLsizeiptr used = m_nOffset;
+
+	// keep the old buffer alive for the copy
+	m_glBuffer = 0;
+	if (oldBuffer)
+		glUnmapNamedBuffer(oldBuffer);
+
+	bool created = create(regionSize);
+
+	// the mapping is coherent, so the copy sees everything written through it
+	if (created && used > 0)
+	{
+		glCopyNamedBufferSubData(oldBuffer, m_glBuffer, oldOffset, 0, used);
+		m_nOffset = used;
+	}
+
+	if (oldBuffer)
+		glDeleteBuffers(1, &oldBuffer);
+
+	return created;
+}
+
+bool StreamBuffer::create(GLsizeiptr regionSize)
+{
+	destroy();
+
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	glCreateBuffers(1, &m_glBuffer);
+	glNamedBufferStorage(m_glBuffer, regionSize * STREAM_BUFFER_REGIONS, NULL, flags);
+	m_pMapped = static_cast<char*>(glMapNamedBufferRange(m_glBuffer, 0, regionSize * STREAM_BUFFER_REGIONS, flags));
+
+	m_nRegionSize = regionSize;
+	m_nRegion = 0u;
+	m_nOffset = 0;
+	m_bRegionReady = true; // a new buffer isn't in use yet
+
+	return m_pMapped != NULL;
+}
+
+void StreamBuffer::waitRegion(GLuint region)
+{
+	GLsync &fence = m_arrFences[region];
+	if (!fence)
+		return;
+
+	GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+	while (glClientWaitSync(fence, flags, STREAM_BUFFER_WAIT_NS) == GL_TIMEOUT_EXPIRED)
+		flags = 0;
+
+	glDeleteSync(fence);
+	fence = 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#define STREAM_BUFFER_REGIONS 3 // frames the CPU may write ahead of the GPU
+
+// Ring of per-frame regions in one persistently mapped buffer, for data written by the CPU every frame
+// (frame uniforms, per-draw transforms, indirect commands). Each region is fenced when its frame is
+// submitted and only written again once the GPU has finished reading it, so writes never stall on the
+// buffer being in use. A region that fills up grows the whole buffer, which takes effect immediately;
+// what the frame wrote so far is carried over, so consecutive allocations stay contiguous.
+class StreamBuffer
+{
+public:
+	StreamBuffer();
+	~StreamBuffer();
+
+	// target decides the offset alignment of allocations (uniform and shader storage buffers have their own)
+	bool init(GLenum target, GLsizeiptr regionSize);
+	void destroy();
+
+	// Returns where to write size bytes this frame and their offset in the buffer, waiting for the region first if needed.
+	// Allocations are only valid until the next fence(), their offsets (and the buffer) until the next allocation grows it.
+	void* allocate(GLsizeiptr size, GLintptr &offset);
+	// Copies the data into a new allocation and returns its offset
+	GLintptr write(const void *data, GLsizeiptr size);
+
+	// Marks the end of the frame's writes, once everything reading them has been submitted, and moves to the next region
+	void fence();
+
+	GLuint getBuffer();
+	// Where this frame's allocations start in the buffer, and how many bytes they take up
+	GLintptr getFrameOffset();
+	GLsizeiptr getFrameSize();
+
+private:
+	bool create(GLsizeiptr regionSize);
+	bool grow(GLsizeiptr regionSize);
+	void waitRegion(GLuint region);
+
+private:
+	GLuint m_glBuffer;
+	char *m_pMapped;
+	GLsync m_arrFences[STREAM_BUFFER_REGIONS];
+
+	GLsizeiptr m_nRegionSize;
+	GLsizeiptr m_nAlignment;
+	GLuint m_nRegion;
+	GLsizeiptr m_nOffset; // next free byte in the current region
+	bool m_bRegionReady; // whether the current region's fence has been waited on
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+
+// Hands complete values (e.g. frame snapshots) from a producer thread to a consumer thread through three
+// slots: the one being written, the one being read, and the latest published one in between. Publishing
+// and acquiring only swap slot indices, so neither thread waits on the other's copying or reading. The
+// producer is held back until the consumer has taken the previous value, so it is at most one ahead.
+template <typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer()
+		: m_nWrite(0)
+		, m_nPublished(1)
+		, m_nRead(2)
+		, m_bFresh(false)
+		, m_bStopped(false)
+	{}
+
+	// Producer: the slot to fill in, which holds whatever was published two values ago
+	T& getWriteSlot()
+	{
+		return m_arrSlots[m_nWrite];
+	}
+
+	// Producer: waits for the consumer to take the last value, then publishes the write slot.
+	// Returns false, without publishing, once stopped.
+	bool publish()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cvConsumed.wait(lock, [this]() { return !m_bFresh || m_bStopped; });
+		if (m_bStopped)
+			return false;
+
+		std::swap(m_nWrite, m_nPublished);
+		m_bFresh = true;
+		m_cvPublished.notify_one();
+
+		return true;
+	}
+
+	// Consumer: takes the latest published value into the read slot, waiting for one if asked to.
+	// Returns false if there was nothing new, in which case the read slot keeps the previous value.
+	bool acquire(bool wait)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (wait)
+			m_cvPublished.wait(lock, [this]() { return m_bFresh || m_bStopped; });
+		if (!m_bFresh)
+			return false;
+
+		std::swap(m_nRead, m_nPublished);
+		m_bFresh = false;
+		m_cvConsumed.notify_one();
+
+		return true;
+	}
+
+	// Consumer: the value last acquired
+	const T& getReadSlot()
+	{
+		return m_arrSlots[m_nRead];
+	}
+
+	// Releases both threads from waiting, for good
+	void stop()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_bStopped = true;
+		m_cvConsumed.notify_all();
+		m_cvPublished.notify_all();
+	}
+
+private:
+	T m_arrSlots[3];
+	int m_nWrite;
+	int m_nPublished;
+	int m_nRead;
+	bool m_bFresh; // the published slot hasn't been acquired yet
+	bool m_bStopped;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cvConsumed;
+	std::condition_variable m_cvPublished;
+};
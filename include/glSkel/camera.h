@@ -1,6 +1,7 @@
 #pragma once
 
 // Std. Includes
+#include <cstring>
 #include <vector>
 
 // GL Includes
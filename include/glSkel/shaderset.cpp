@@ -2,6 +2,7 @@
 
 #ifdef _WIN32
 #include <Windows.h>
+#include <direct.h>
 #else
 // Not Windows? Assume unix-like.
 #include <unistd.h>
@@ -63,6 +64,25 @@ static uint64_t GetShaderFileTimestamp(const char* filename)
     return timestamp;
 }
 
+#define FNV_OFFSET_BASIS 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+// 64-bit FNV-1a, continuing from hash
+static uint64_t HashString(uint64_t hash, const char* s)
+{
+    for (; s && *s; ++s)
+    {
+        hash ^= (unsigned char)*s;
+        hash *= FNV_PRIME;
+    }
+
+    // terminate each string, so moving characters between consecutive strings changes the hash
+    hash ^= 0xFF;
+    hash *= FNV_PRIME;
+
+    return hash;
+}
+
 static std::string ShaderStringFromFile(const char* filename)
 {
     std::ifstream fs(filename);
@@ -117,6 +137,11 @@ GLuint* ShaderSet::AddProgram(const std::vector<std::pair<std::string, GLenum>>&
             foundShader->second.Handle = glCreateShader(shaderNameType.second);
             // The sign bit is masked out, since some shader compilers treat the #line as signed, and others treat it unsigned.
             foundShader->second.HashName = (int32_t)std::hash<std::string>()(shaderNameType.first) & 0x7FFFFFFF;
+
+            // watch before the first compile reads the file, so no change gets missed
+            if (mWatcher.isRunning() || mWatcher.start())
+                mWatcher.watch(shaderNameType.first);
+            mNewShaders.push_back(&*foundShader);
         }
         shaderNameTypes.push_back(&foundShader->first);
     }
@@ -144,83 +169,71 @@ GLuint* ShaderSet::AddProgram(const std::vector<std::pair<std::string, GLenum>>&
 
 void ShaderSet::UpdatePrograms()
 {
-    // find all shaders with updated timestamps
-    std::set<std::pair<const ShaderNameTypePair, Shader>*> updatedShaders;
-    for (std::pair<const ShaderNameTypePair, Shader>& shader : mShaders)
+    if (!mParallelCompileChecked)
     {
-        uint64_t timestamp = GetShaderFileTimestamp(shader.first.Name.c_str());
-        if (timestamp > shader.second.Timestamp)
+        // let the driver compile and link on its own threads; completion is then polled instead of waited for
+        mParallelCompile = GLEW_ARB_parallel_shader_compile != GL_FALSE;
+        if (mParallelCompile)
         {
-            shader.second.Timestamp = timestamp;
-            updatedShaders.insert(&shader);
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
         }
+        mParallelCompileChecked = true;
     }
 
-    // recompile all updated shaders
-    for (std::pair<const ShaderNameTypePair, Shader>* shader : updatedShaders)
+    std::vector<std::pair<const ShaderNameTypePair, Shader>*>& updatedShaders = mUpdatedShaders;
+    updatedShaders.clear();
+
+    if (mWatcher.isRunning() && !mWatcher.checkOverflow())
     {
-        // the #line prefix ensures error messages have the right line number for their file
-        // the #line directive also allows specifying a "file name" number, which makes it possible to identify which file the error came from.
-        std::string version = "#version " + mVersion + "\n";
-        
-        std::string defines;
-        switch (shader->first.Type) {
-        case GL_VERTEX_SHADER:          defines += "#define VERTEX_SHADER\n";             break;
-        case GL_FRAGMENT_SHADER:        defines += "#define FRAGMENT_SHADER\n";           break;
-        case GL_GEOMETRY_SHADER:        defines += "#define GEOMETRY_SHADER\n";           break;
-        case GL_TESS_CONTROL_SHADER:    defines += "#define TESS_CONTROL_SHADER\n";       break;
-        case GL_TESS_EVALUATION_SHADER: defines += "#define TESS_EVALUATION_SHADER\n";    break;
-        case GL_COMPUTE_SHADER:         defines += "#define COMPUTE_SHADER\n";            break;
+        // only shaders that are new or were reported as changed
+        for (std::pair<const ShaderNameTypePair, Shader>* shader : mNewShaders)
+        {
+            shader->second.Timestamp = GetShaderFileTimestamp(shader->first.Name.c_str());
+            updatedShaders.push_back(shader);
         }
 
-        std::string preamble_hash = std::to_string((int32_t)std::hash<std::string>()("preamble") & 0x7FFFFFFF);
-        std::string preamble = "#line 1 " + preamble_hash + "\n" + 
-                               mPreamble + "\n";
-        
-        std::string source_hash = std::to_string(shader->second.HashName);
-        std::string source = "#line 1 " + source_hash + "\n" + 
-                             ShaderStringFromFile(shader->first.Name.c_str()) + "\n";
-
-        const char* strings[] = {
-            version.c_str(),
-            defines.c_str(),
-            preamble.c_str(),
-            source.c_str()
-        };
-        GLint lengths[] = {
-            (GLint)version.length(),
-            (GLint)defines.length(),
-            (GLint)preamble.length(),
-            (GLint)source.length()
-        };
-
-        glShaderSource(shader->second.Handle, sizeof(strings) / sizeof(*strings), strings, lengths);
-        glCompileShader(shader->second.Handle);
-            
-        GLint status = GL_FALSE;
-        glGetShaderiv(shader->second.Handle, GL_COMPILE_STATUS, &status);
-        if (status != GL_TRUE)
+        std::string changed;
+        while (mWatcher.popChange(changed))
         {
-            GLint logLength;
-            glGetShaderiv(shader->second.Handle, GL_INFO_LOG_LENGTH, &logLength);
-            std::vector<char> log(logLength + 1);
-            glGetShaderInfoLog(shader->second.Handle, logLength, NULL, log.data());
-            
-            std::string log_s = log.data();
-            
-            // replace all filename hashes in the error messages with actual filenames
-            for (size_t found_preamble; (found_preamble = log_s.find(preamble_hash)) != std::string::npos;) {
-                log_s.replace(found_preamble, preamble_hash.size(), "preamble");
-            }
-            for (size_t found_source; (found_source = log_s.find(source_hash)) != std::string::npos;) {
-                log_s.replace(found_source, source_hash.size(), shader->first.Name);
+            // a file can be used as several shader stages
+            for (auto it = mShaders.lower_bound(ShaderNameTypePair{ changed, 0 }); it != mShaders.end() && it->first.Name == changed; ++it)
+            {
+                if (std::find(updatedShaders.begin(), updatedShaders.end(), &*it) == updatedShaders.end())
+                {
+                    it->second.Timestamp = GetShaderFileTimestamp(changed.c_str());
+                    updatedShaders.push_back(&*it);
+                }
             }
+        }
+    }
+    else
+    {
+        // drop any queued changes, the polling below finds them all
+        std::string changed;
+        while (mWatcher.popChange(changed)) {}
 
-            fprintf(stdout, "Error compiling %s:\n%s\n", shader->first.Name.c_str(), log_s.c_str());
+        // find all shaders with updated timestamps
+        for (std::pair<const ShaderNameTypePair, Shader>& shader : mShaders)
+        {
+            uint64_t timestamp = GetShaderFileTimestamp(shader.first.Name.c_str());
+            if (timestamp > shader.second.Timestamp)
+            {
+                shader.second.Timestamp = timestamp;
+                updatedShaders.push_back(&shader);
+            }
         }
     }
 
-    // relink all programs that had their shaders updated and have all their shaders compiling successfully
+    mNewShaders.clear();
+
+    // updated shaders are only compiled if a program using them isn't found in the cache
+    for (std::pair<const ShaderNameTypePair, Shader>* shader : updatedShaders)
+    {
+        shader->second.Source = ShaderStringFromFile(shader->first.Name.c_str());
+        shader->second.Compiled = false;
+    }
+
+    // start rebuilding all programs that had their shaders updated
     for (std::pair<const std::vector<const ShaderNameTypePair*>, Program>& program : mPrograms)
     {
         bool programNeedsRelink = false;
@@ -239,10 +252,50 @@ void ShaderSet::UpdatePrograms()
                 break;
         }
 
-        // Don't attempt to link shaders that didn't compile successfully
-        bool canRelink = true;
-        if (programNeedsRelink)
+        if (!programNeedsRelink)
+            continue;
+
+        program.second.CacheKey = ProgramCacheKey(program.first);
+        if (LoadProgramBinary(program.second.InternalHandle, program.second.CacheKey))
+        {
+            program.second.PublicHandle = program.second.InternalHandle;
+            program.second.Stage = ProgramStage::Idle;
+            PrintProgramName("Loaded cached", program.first);
+            fprintf(stderr, "\n");
+            continue;
+        }
+
+        for (const ShaderNameTypePair* programShader : program.first)
+        {
+            std::pair<const ShaderNameTypePair, Shader>& shader = *mShaders.find(*programShader);
+            if (!shader.second.Compiled)
+            {
+                CompileShader(shader);
+            }
+        }
+
+        program.second.Stage = ProgramStage::Compiling;
+    }
+
+    // advance programs being rebuilt; without parallel compilation each finishes in the same update
+    for (std::pair<const std::vector<const ShaderNameTypePair*>, Program>& program : mPrograms)
+    {
+        if (program.second.Stage == ProgramStage::Compiling)
         {
+            bool compiled = true;
+            for (const ShaderNameTypePair* programShader : program.first)
+            {
+                if (!IsShaderCompiled(*mShaders.find(*programShader)))
+                {
+                    compiled = false;
+                }
+            }
+
+            if (!compiled)
+                continue;
+
+            // Don't attempt to link shaders that didn't compile successfully
+            bool canRelink = true;
             for (const ShaderNameTypePair* programShader : program.first)
             {
                 GLint status;
@@ -253,11 +306,29 @@ void ShaderSet::UpdatePrograms()
                     break;
                 }
             }
+
+            if (!canRelink)
+            {
+                program.second.Stage = ProgramStage::Idle;
+                continue;
+            }
+
+            glProgramParameteri(program.second.InternalHandle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            glLinkProgram(program.second.InternalHandle);
+            program.second.Stage = ProgramStage::Linking;
         }
 
-        if (programNeedsRelink && canRelink)
+        if (program.second.Stage == ProgramStage::Linking)
         {
-            glLinkProgram(program.second.InternalHandle);
+            if (mParallelCompile)
+            {
+                GLint complete;
+                glGetProgramiv(program.second.InternalHandle, GL_COMPLETION_STATUS_ARB, &complete);
+                if (!complete)
+                    continue;
+            }
+
+            program.second.Stage = ProgramStage::Idle;
 
             GLint logLength;
             glGetProgramiv(program.second.InternalHandle, GL_INFO_LOG_LENGTH, &logLength);
@@ -282,26 +353,7 @@ void ShaderSet::UpdatePrograms()
             GLint status;
             glGetProgramiv(program.second.InternalHandle, GL_LINK_STATUS, &status);
 
-            if (!status)
-            {
-                fprintf(stderr, "Error linking");
-            }
-            else
-            {
-                fprintf(stderr, "Successfully linked");
-            }
-
-            fprintf(stderr, " program (");
-            for (const ShaderNameTypePair* shader : program.first)
-            {
-                if (shader != program.first.front())
-                {
-                    fprintf(stderr, ", ");
-                }
-
-                fprintf(stderr, "%s", shader->Name.c_str());
-            }
-            fprintf(stderr, ")");
+            PrintProgramName(status ? "Successfully linked" : "Error linking", program.first);
             if (log[0] != '\0')
             {
                 fprintf(stderr, ":\n%s\n", log_s.c_str());
@@ -318,11 +370,217 @@ void ShaderSet::UpdatePrograms()
             else
             {
                 program.second.PublicHandle = program.second.InternalHandle;
+                SaveProgramBinary(program.second.InternalHandle, program.second.CacheKey);
             }
         }
     }
 }
 
+void ShaderSet::CompileShader(std::pair<const ShaderNameTypePair, Shader>& shader)
+{
+    // the #line prefix ensures error messages have the right line number for their file
+    // the #line directive also allows specifying a "file name" number, which makes it possible to identify which file the error came from.
+    std::string version = "#version " + mVersion + "\n";
+
+    std::string defines;
+    switch (shader.first.Type) {
+    case GL_VERTEX_SHADER:          defines += "#define VERTEX_SHADER\n";             break;
+    case GL_FRAGMENT_SHADER:        defines += "#define FRAGMENT_SHADER\n";           break;
+    case GL_GEOMETRY_SHADER:        defines += "#define GEOMETRY_SHADER\n";           break;
+    case GL_TESS_CONTROL_SHADER:    defines += "#define TESS_CONTROL_SHADER\n";       break;
+    case GL_TESS_EVALUATION_SHADER: defines += "#define TESS_EVALUATION_SHADER\n";    break;
+    case GL_COMPUTE_SHADER:         defines += "#define COMPUTE_SHADER\n";            break;
+    }
+
+    std::string preamble_hash = std::to_string((int32_t)std::hash<std::string>()("preamble") & 0x7FFFFFFF);
+    std::string preamble = "#line 1 " + preamble_hash + "\n" +
+                           mPreamble + "\n";
+
+    std::string source_hash = std::to_string(shader.second.HashName);
+    std::string source = "#line 1 " + source_hash + "\n" +
+                         shader.second.Source + "\n";
+
+    const char* strings[] = {
+        version.c_str(),
+        defines.c_str(),
+        preamble.c_str(),
+        source.c_str()
+    };
+    GLint lengths[] = {
+        (GLint)version.length(),
+        (GLint)defines.length(),
+        (GLint)preamble.length(),
+        (GLint)source.length()
+    };
+
+    glShaderSource(shader.second.Handle, sizeof(strings) / sizeof(*strings), strings, lengths);
+    glCompileShader(shader.second.Handle);
+
+    shader.second.Compiled = true;
+    shader.second.Checked = false;
+}
+
+bool ShaderSet::IsShaderCompiled(std::pair<const ShaderNameTypePair, Shader>& shader)
+{
+    if (shader.second.Checked)
+        return true;
+
+    if (mParallelCompile)
+    {
+        GLint complete;
+        glGetShaderiv(shader.second.Handle, GL_COMPLETION_STATUS_ARB, &complete);
+        if (!complete)
+            return false;
+    }
+
+    // report errors once per compile, however many programs share the shader
+    shader.second.Checked = true;
+
+    GLint status = GL_FALSE;
+    glGetShaderiv(shader.second.Handle, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        GLint logLength;
+        glGetShaderiv(shader.second.Handle, GL_INFO_LOG_LENGTH, &logLength);
+        std::vector<char> log(logLength + 1);
+        glGetShaderInfoLog(shader.second.Handle, logLength, NULL, log.data());
+
+        std::string log_s = log.data();
+
+        // replace all filename hashes in the error messages with actual filenames
+        std::string preamble_hash = std::to_string((int32_t)std::hash<std::string>()("preamble") & 0x7FFFFFFF);
+        std::string source_hash = std::to_string(shader.second.HashName);
+        for (size_t found_preamble; (found_preamble = log_s.find(preamble_hash)) != std::string::npos;) {
+            log_s.replace(found_preamble, preamble_hash.size(), "preamble");
+        }
+        for (size_t found_source; (found_source = log_s.find(source_hash)) != std::string::npos;) {
+            log_s.replace(found_source, source_hash.size(), shader.first.Name);
+        }
+
+        fprintf(stdout, "Error compiling %s:\n%s\n", shader.first.Name.c_str(), log_s.c_str());
+    }
+
+    return true;
+}
+
+void ShaderSet::PrintProgramName(const char* action, const std::vector<const ShaderNameTypePair*>& shaders)
+{
+    fprintf(stderr, "%s program (", action);
+    for (const ShaderNameTypePair* shader : shaders)
+    {
+        if (shader != shaders.front())
+        {
+            fprintf(stderr, ", ");
+        }
+
+        fprintf(stderr, "%s", shader->Name.c_str());
+    }
+    fprintf(stderr, ")");
+}
+
+uint64_t ShaderSet::ProgramCacheKey(const std::vector<const ShaderNameTypePair*>& shaders)
+{
+    // programs are keyed by shader address, so hash their shaders in name order for a key that's stable across runs
+    std::vector<const ShaderNameTypePair*> sorted = shaders;
+    std::sort(begin(sorted), end(sorted), [](const ShaderNameTypePair* a, const ShaderNameTypePair* b) { return *a < *b; });
+
+    // binaries are only valid for the driver that made them
+    uint64_t hash = HashString(FNV_OFFSET_BASIS, reinterpret_cast<const char*>(glGetString(GL_VENDOR)));
+    hash = HashString(hash, reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+    hash = HashString(hash, reinterpret_cast<const char*>(glGetString(GL_VERSION)));
+    hash = HashString(hash, mVersion.c_str());
+    hash = HashString(hash, mPreamble.c_str());
+
+    for (const ShaderNameTypePair* shader : sorted)
+    {
+        hash = HashString(hash, std::to_string(shader->Type).c_str());
+        hash = HashString(hash, mShaders[*shader].Source.c_str());
+    }
+
+    return hash;
+}
+
+std::string ShaderSet::ProgramCachePath(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+
+    return mProgramCacheDirectory + "/" + name;
+}
+
+bool ShaderSet::LoadProgramBinary(ProgramHandle program, uint64_t key)
+{
+    if (mProgramCacheDirectory.empty())
+        return false;
+
+    FILE* file = fopen(ProgramCachePath(key).c_str(), "rb");
+    if (!file)
+        return false;
+
+    // binary format, then the binary
+    GLenum format = 0;
+    std::vector<char> binary;
+    bool read = fread(&format, sizeof(format), 1, file) == 1;
+    if (read)
+    {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file) - (long)sizeof(format);
+        fseek(file, sizeof(format), SEEK_SET);
+
+        binary.resize(size > 0 ? (size_t)size : 0);
+        read = !binary.empty() && fread(binary.data(), 1, binary.size(), file) == binary.size();
+    }
+    fclose(file);
+
+    if (!read)
+        return false;
+
+    // fails if the driver rejects the binary, e.g. after an update, in which case the program is built from source
+    glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+    return status == GL_TRUE;
+}
+
+void ShaderSet::SaveProgramBinary(ProgramHandle program, uint64_t key)
+{
+    if (mProgramCacheDirectory.empty())
+        return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    GLenum format = 0;
+    std::vector<char> binary(length);
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    FILE* file = fopen(ProgramCachePath(key).c_str(), "wb");
+    if (!file)
+        return;
+
+    fwrite(&format, sizeof(format), 1, file);
+    fwrite(binary.data(), 1, length, file);
+    fclose(file);
+}
+
+void ShaderSet::SetProgramCacheDirectory(const std::string& directory)
+{
+    mProgramCacheDirectory = directory;
+
+    if (!directory.empty())
+    {
+#ifdef _WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0755);
+#endif
+    }
+}
+
 void ShaderSet::SetPreambleFile(const std::string& preambleFilename)
 {
     SetPreamble(ShaderStringFromFile(preambleFilename.c_str()));
@@ -2,13 +2,15 @@
 
 // Replace with your own GL header include
 #define GLEW_STATIC
-#include <GL\glew.h>
+#include <GL/glew.h>
 
 #include <vector>
 #include <utility>
 #include <map>
 #include <set>
 
+#include "FileWatcher.h"
+
 class ShaderSet
 {
     // typedefs for readability
@@ -32,6 +34,19 @@ class ShaderSet
         // Hash of the name of the shader. This is used to recover the shader name from the GLSL compiler error messages.
         // It's not a perfect solution, but it's a miracle when it doesn't work.
         int32_t HashName;
+        // Source as last read from the file. Shaders are only compiled when a program using them isn't in the program cache.
+        std::string Source;
+        bool Compiled;
+        // Whether the result of the last compile has been checked (and errors reported)
+        bool Checked;
+    };
+
+    // Where a program is in being rebuilt, which may take several updates when compiling in parallel
+    enum class ProgramStage
+    {
+        Idle,
+        Compiling,
+        Linking
     };
 
     // Program in the ShaderSet system.
@@ -41,6 +56,9 @@ class ShaderSet
         // the public handle becomes 0 when a linking failure happens, until the linking error gets fixed.
         ProgramHandle PublicHandle;
         ProgramHandle InternalHandle;
+        ProgramStage Stage;
+        // Hash of the driver, version, preamble and shader sources the program is built from
+        uint64_t CacheKey;
     };
 
     // the version in the version string that gets prepended to each shader
@@ -52,6 +70,29 @@ class ShaderSet
     // allows looking up the program that represents a linked set of shaders
     std::map<std::vector<const ShaderNameTypePair*>, Program> mPrograms;
 
+    // reports changed shader files, so they don't all need to be polled every update (when available)
+    FileWatcher mWatcher;
+    // shaders added since the last update, which need their first compile
+    std::vector<std::pair<const ShaderNameTypePair, Shader>*> mNewShaders;
+    // reused between updates to avoid allocating
+    std::vector<std::pair<const ShaderNameTypePair, Shader>*> mUpdatedShaders;
+
+    // directory of program binaries from previous runs, no caching if empty
+    std::string mProgramCacheDirectory;
+    // whether shaders are compiled and linked on driver threads (ARB/KHR_parallel_shader_compile)
+    bool mParallelCompile = false;
+    bool mParallelCompileChecked = false;
+
+    void CompileShader(std::pair<const ShaderNameTypePair, Shader>& shader);
+    // true once the shader has finished compiling, successfully or not
+    bool IsShaderCompiled(std::pair<const ShaderNameTypePair, Shader>& shader);
+    void PrintProgramName(const char* action, const std::vector<const ShaderNameTypePair*>& shaders);
+
+    uint64_t ProgramCacheKey(const std::vector<const ShaderNameTypePair*>& shaders);
+    std::string ProgramCachePath(uint64_t key);
+    bool LoadProgramBinary(ProgramHandle program, uint64_t key);
+    void SaveProgramBinary(ProgramHandle program, uint64_t key);
+
 public:
     ShaderSet() = default;
 
@@ -75,9 +116,16 @@ public:
     // To be const-correct, this should maybe return "const GLuint*". I'm trusting you not to write to that pointer.
     GLuint* AddProgram(const std::vector<std::pair<std::string, GLenum>>& typedShaders);
 
-    // Polls the timestamps of all the shaders and recompiles/relinks them if they changed
+    // Recompiles/relinks the shaders that changed, as reported by the file watcher.
+    // Where there is no file watcher, polls the timestamps of all the shaders instead.
+    // Programs are loaded from the program cache when possible. Otherwise, when the driver compiles in
+    // parallel, a program may take several updates to rebuild; its handle stays 0 (or the previous
+    // version) until linking completes.
     void UpdatePrograms();
 
+    // Directory to cache linked program binaries in, keyed by their sources; created if missing
+    void SetProgramCacheDirectory(const std::string& directory);
+
     // Convenience to add shaders based on extension file naming conventions
     // vertex shader: .vert
     // fragment shader: .frag
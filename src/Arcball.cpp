@@ -58,14 +58,14 @@ void ArcBall::beginDrag(const glm::vec2& msc)
   mQDown      = mQNow;
 
   // Normal 'begin' code.
-  mVDown      = (mScreenToTCS * glm::vec4(msc.x, msc.y, 0.f, 1.f)).xyz;
+  mVDown      = glm::vec3(mScreenToTCS * glm::vec4(msc.x, msc.y, 0.f, 1.f));
 }
 
 //------------------------------------------------------------------------------
 void ArcBall::drag(const glm::vec2& msc)
 {
   // Regular drag code to follow...
-  mVNow       = (mScreenToTCS * glm::vec4(msc.x, msc.y, 0.0, 1.f)).xyz;
+  mVNow       = glm::vec3(mScreenToTCS * glm::vec4(msc.x, msc.y, 0.0, 1.f));
   mVSphereFrom= mouseOnSphere(mVDown);
   mVSphereTo  = mouseOnSphere(mVNow);
 
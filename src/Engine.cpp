@@ -1,10 +1,17 @@
 #include "Engine.h"
 
 #include "LSystem.h"
+#include "Profiler.h"
 
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <random>
 
 LSystem* lsys;
 
@@ -55,12 +62,33 @@ void APIENTRY DebugCallback(GLenum source, GLenum type, GLuint id, GLenum severi
 Engine::Engine()
 	: m_pWindow(NULL)
 	, m_pLightingSystem(NULL)
+	, m_fDeltaTime(0.f)
+	, m_dLastTime(0.0)
+	, m_fAccumulator(0.f)
 	, m_pCamera(NULL)
 	, m_pArcball(NULL)
 	, m_bRunPhysics(false)
-	, m_fDeltaTime(0.f)
-	, m_fLastTime(0.f)
+	, m_bValidateInstanceCulling(false)
+	, m_bOcclusionCulling(true)
+	, m_bCaptureRequested(false)
+	, m_uiSeed(std::random_device()())
+	, m_bHeadless(false)
+	, m_nHeadlessFrames(0u)
+	, m_glOutputTexture(0)
+	, m_hPlantShader(-1)
+	, m_hPlantCulledShader(-1)
+	, m_nPlantImpostor(-1)
+	, m_nPlantImpostorBaking(-1)
+	, m_bPlantImpostorBaking(false)
+	, m_nPlantImpostorUploadCount(0u)
+	, m_bInstanceCullingValidated(false)
+	, m_nCaptures(0u)
+	, m_bSegmentPicked(false)
+	, m_fPickedSegmentRadius(0.f)
+	, m_nPickedUploadCount(0u)
 {
+	for (auto &fence : m_arrFrameFences)
+		fence = 0;
 }
 
 Engine::~Engine()
@@ -81,6 +109,21 @@ void Engine::receiveEvent(Object * obj, const int event, void * data)
 		}
 		if (key == GLFW_KEY_SPACE)
 			m_bRunPhysics = !m_bRunPhysics;
+		if (key == GLFW_KEY_V)
+			m_bValidateInstanceCulling = !m_bValidateInstanceCulling;
+		if (key == GLFW_KEY_O)
+			m_bOcclusionCulling = !m_bOcclusionCulling;
+		if (key == GLFW_KEY_F1)
+		{
+			Profiler::getInstance().setEnabled(!Profiler::isEnabled());
+			std::cout << "Profiler " << (Profiler::isEnabled() ? "enabled" : "disabled") << std::endl;
+		}
+		if (key == GLFW_KEY_F2)
+			Profiler::getInstance().requestSummary();
+		if (key == GLFW_KEY_F3)
+			Profiler::getInstance().requestTraceDump();
+		if (key == GLFW_KEY_F12)
+			m_bCaptureRequested = true;
 	}
 
 	if (event == BroadcastSystem::EVENT::KEY_PRESS || event == BroadcastSystem::EVENT::KEY_REPEAT)
@@ -114,10 +157,18 @@ void Engine::receiveEvent(Object * obj, const int event, void * data)
 		if (button == GLFW_MOUSE_BUTTON_LEFT)
 		{
 			double xpos, ypos;
-			glfwGetCursorPos(m_pWindow, &xpos, &ypos);
+			GLFWInputBroadcaster::getInstance().getCursorPos(&xpos, &ypos);
 
 			m_pArcball->beginDrag(glm::vec2(xpos, m_iHeight - ypos));
 		}
+
+		if (button == GLFW_MOUSE_BUTTON_RIGHT)
+		{
+			double xpos, ypos;
+			GLFWInputBroadcaster::getInstance().getCursorPos(&xpos, &ypos);
+
+			pickSegment(glm::vec2(xpos, m_iHeight - ypos));
+		}
 	}
 
 	if (event == BroadcastSystem::EVENT::MOUSE_UNCLICK)
@@ -134,13 +185,20 @@ void Engine::receiveEvent(Object * obj, const int event, void * data)
 			memcpy(&offsets, data, sizeof(float) * 2);
 
 			double xpos, ypos;
-			glfwGetCursorPos(m_pWindow, &xpos, &ypos);
+			GLFWInputBroadcaster::getInstance().getCursorPos(&xpos, &ypos);
 
 			m_pArcball->drag(glm::vec2(xpos, m_iHeight - ypos));
 		}
 	}
 }
 
+void Engine::setHeadless(unsigned int frames, const std::string & statsFile)
+{
+	m_bHeadless = true;
+	m_nHeadlessFrames = frames;
+	m_strStatsFile = statsFile;
+}
+
 bool Engine::init()
 {
 	m_pWindow = init_gl_context("Chondrus crispus");
@@ -151,11 +209,32 @@ bool Engine::init()
 	GLFWInputBroadcaster::getInstance().init(m_pWindow);
 	GLFWInputBroadcaster::getInstance().attach(this);  // Register self with input broadcaster
 
+	// the simulation and render threads keep two hardware threads busy already
+	unsigned int hardwareThreads = std::thread::hardware_concurrency();
+	m_JobSystem.init(hardwareThreads > 3u ? hardwareThreads - 2u : 1u);
+
 	Renderer::getInstance().init(); // this will init the renderer singleton
+	Renderer::getInstance().setJobSystem(&m_JobSystem);
+	Renderer::getInstance().getDynamicResolution().setMaxSamples(m_nMaxSamples);
+	Renderer::getInstance().getDynamicResolution().setTargetFrameTime(m_fTargetFrameTime);
+	if (m_bHeadless)
+	{
+		// held at full quality, so runs are compared on the same work
+		Renderer::getInstance().getDynamicResolution().setScaleRange(1.f, 1.f);
+		Renderer::getInstance().getDynamicResolution().setTargetFrameTime(std::numeric_limits<float>::max());
+
+		glCreateTextures(GL_TEXTURE_2D, 1, &m_glOutputTexture);
+		glTextureStorage2D(m_glOutputTexture, 1, GL_RGBA8, m_iWidth, m_iHeight);
+		Renderer::getInstance().setOutputTexture(m_glOutputTexture);
+	}
+	m_hPlantShader = Renderer::getInstance().getShaderHandle("pooled");
+	m_hPlantCulledShader = Renderer::getInstance().getShaderHandle("pooledCulled");
 	init_camera();
 	init_lighting();
 
 	lsys = new LSystem();
+	lsys->setJobSystem(&m_JobSystem);
+	lsys->setSeed(m_uiSeed);
 	lsys->setIterations(5);
 	lsys->setAngle(35.f);
 	lsys->setSize(glm::vec3(0.1f, 1.f, 1.f));
@@ -215,64 +294,482 @@ bool Engine::init()
 	return true;
 }
 
+void Engine::setSeed(uint32_t seed)
+{
+	m_uiSeed = seed;
+	lsys->setSeed(seed);
+}
+
+bool Engine::recordInput(const std::string & filename)
+{
+	if (!GLFWInputBroadcaster::getInstance().startRecording(filename, m_uiSeed))
+		return false;
+
+	m_nGenerationBudgetMicroseconds = 0u;
+	std::cout << "Recording input to " << filename << " (seed " << m_uiSeed << ")" << std::endl;
+
+	return true;
+}
+
+bool Engine::playInput(const std::string & filename)
+{
+	uint32_t seed;
+	if (!GLFWInputBroadcaster::getInstance().startPlayback(filename, &seed))
+		return false;
+
+	setSeed(seed);
+	m_nGenerationBudgetMicroseconds = 0u;
+	std::cout << "Playing back input from " << filename << " (seed " << seed << ")" << std::endl;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Renders the latest frame the simulation thread completed while it
+//          works on the next one. Input is polled here, as GLFW requires, and
+//          handled by the simulation thread's next update, so it shows up in
+//          the frame after the one being rendered. Frames are paced to the
+//          monitor's refresh, sleeping until shortly before each is due.
+//          Headless, frames are neither paced nor presented, only kept from
+//          getting more than BENCHMARK_FRAMES_IN_FLIGHT ahead of the GPU, and
+//          timed.
+//-----------------------------------------------------------------------------
 void Engine::mainLoop()
 {
-	m_fLastTime = static_cast<float>(glfwGetTime());
+	const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+	m_FramePacer.setPeriod(m_bHeadless ? 0.0 : mode && mode->refreshRate > 0 ? 1.0 / mode->refreshRate : 1.0 / 60.0);
+
+	unsigned int frameLimit = m_nHeadlessFrames;
+	if (m_bHeadless && frameLimit == 0u && !GLFWInputBroadcaster::getInstance().isPlayingBack())
+		frameLimit = BENCHMARK_DEFAULT_FRAMES;
+	unsigned int frameCount = 0u;
+	double lastFrameEnd = glfwGetTime();
+
+	Profiler &profiler = Profiler::getInstance();
+	profiler.setThreadName("Render");
+
+	m_SimulationThread = std::thread(&Engine::simulationLoop, this);
 
 	// Main Rendering Loop
-	while (!glfwWindowShouldClose(m_pWindow)) {
-		update(m_fStepSize);
+	while (!glfwWindowShouldClose(m_pWindow) && !GLFWInputBroadcaster::getInstance().isPlaybackFinished() && (frameLimit == 0u || frameCount < frameLimit)) {
+		profiler.beginFrame();
+
+		GLFWInputBroadcaster::getInstance().poll();
 
-		draw();
+		{
+			PROFILE_SCOPE("Acquire");
+			m_Frames.acquire(true);
+		}
+		const FrameSnapshot &frame = m_Frames.getReadSlot();
+		double workStart = glfwGetTime();
+
+		{
+			PROFILE_SCOPE("Draw");
+			draw(frame);
+		}
+
+		{
+			PROFILE_SCOPE("Render");
+			render();
+		}
+
+		// Generation stops short of the upload, which needs this thread's context and the simulation paused.
+		// Frames already taken from the old mesh can still draw it, it is only overwritten by a later upload.
+		if (frame.uploadPending)
+		{
+			PROFILE_SCOPE("Upload");
+			PROFILE_GPU_SCOPE("Upload");
+			std::lock_guard<std::mutex> lock(m_mtxSimulation);
+			lsys->upload();
+		}
+
+		double workEnd = glfwGetTime();
+
+		if (m_bHeadless)
+		{
+			PROFILE_SCOPE("Throttle");
+			GLsync &fence = m_arrFrameFences[frameCount % BENCHMARK_FRAMES_IN_FLIGHT];
+			if (fence)
+			{
+				GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+				while (glClientWaitSync(fence, flags, 1000000000u) == GL_TIMEOUT_EXPIRED)
+					flags = 0;
+				glDeleteSync(fence);
+			}
+			fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush();
+		}
+		else
+		{
+			// Submitted work keeps the GPU busy while this thread sleeps
+			glFlush();
+			{
+				PROFILE_SCOPE("Pace");
+				m_FramePacer.wait();
+			}
+
+			// Flip buffers and render to screen
+			{
+				PROFILE_SCOPE("Swap");
+				glfwSwapBuffers(m_pWindow);
+			}
+			m_FramePacer.presented();
+		}
 
-		render();
+		profiler.endFrame();
 
-		// Flip buffers and render to screen
-		glfwSwapBuffers(m_pWindow);
+		double frameEnd = glfwGetTime();
+		if (m_bHeadless)
+		{
+			m_vfFrameTimes.push_back(static_cast<float>((frameEnd - lastFrameEnd) * 1000.0));
+			m_vfRenderTimes.push_back(static_cast<float>((workEnd - workStart) * 1000.0));
+		}
+		lastFrameEnd = frameEnd;
+		++frameCount;
 	}
+
+	m_Frames.stop();
+	m_SimulationThread.join();
+
+	GLFWInputBroadcaster::getInstance().stopRecording();
+	Renderer::getInstance().flushCaptures();
+
+	if (m_bHeadless)
+	{
+		glFinish();
+		for (auto &fence : m_arrFrameFences)
+		{
+			if (fence)
+				glDeleteSync(fence);
+			fence = 0;
+		}
+
+		Renderer::getInstance().setOutputTexture(0);
+		glDeleteTextures(1, &m_glOutputTexture);
+		m_glOutputTexture = 0;
+
+		writeBenchmarkStats();
+	}
+
+	m_JobSystem.destroy();
+	profiler.destroy();
 }
 
-void Engine::update(float dt)
+// Milliseconds of the frames after the warmup, as a JSON object of their mean and distribution
+static void writeTimeStats(std::ostream &out, const char *name, const std::vector<float> &times)
 {
-	// Calculate deltatime of current frame
-	float newTime = static_cast<float>(glfwGetTime());
-	m_fDeltaTime = newTime - m_fLastTime;
-	m_fLastTime = newTime;
+	std::vector<float> sorted(times.begin() + (std::min)(times.size(), size_t(BENCHMARK_WARMUP_FRAMES)), times.end());
+	std::sort(sorted.begin(), sorted.end());
+
+	double sum = 0.0;
+	for (float ms : sorted)
+		sum += ms;
+
+	// nearest rank
+	auto percentile = [&sorted](double p) {
+		if (sorted.empty())
+			return 0.f;
+		size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+		return sorted[rank > 0u ? rank - 1u : 0u];
+	};
+
+	out << "\t\"" << name << "\": { \"frames\": " << sorted.size()
+		<< ", \"mean\": " << (sorted.empty() ? 0.0 : sum / sorted.size())
+		<< ", \"min\": " << (sorted.empty() ? 0.f : sorted.front())
+		<< ", \"p50\": " << percentile(0.5)
+		<< ", \"p95\": " << percentile(0.95)
+		<< ", \"p99\": " << percentile(0.99)
+		<< ", \"max\": " << (sorted.empty() ? 0.f : sorted.back()) << " }";
+}
 
-	// Poll input events first
-	GLFWInputBroadcaster::getInstance().poll();
+void Engine::writeBenchmarkStats()
+{
+	std::ofstream file;
+	if (!m_strStatsFile.empty())
+	{
+		file.open(m_strStatsFile);
+		if (!file)
+			std::cerr << "Could not write benchmark statistics to " << m_strStatsFile << ", writing them here instead" << std::endl;
+	}
+	std::ostream &out = file.is_open() ? static_cast<std::ostream&>(file) : std::cout;
+
+	out << "{" << std::endl;
+	out << "\t\"renderer\": \"" << glGetString(GL_RENDERER) << "\"," << std::endl;
+	out << "\t\"width\": " << m_iWidth << ", \"height\": " << m_iHeight << ", \"samples\": " << Renderer::getInstance().getDynamicResolution().getSamples() << "," << std::endl;
+	out << "\t\"warmupFrames\": " << BENCHMARK_WARMUP_FRAMES << "," << std::endl;
+	writeTimeStats(out, "frameTime", m_vfFrameTimes);
+	out << "," << std::endl;
+	writeTimeStats(out, "renderThreadTime", m_vfRenderTimes);
+	out << "," << std::endl;
+	writeTimeStats(out, "simulationTime", m_vfSimulationTimes);
+	out << std::endl << "}" << std::endl;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Simulates the time that has passed since the last frame in fixed
+//          steps, so the simulation behaves the same at any frame rate. What is
+//          left over, less than a step, decides how far between the last two
+//          steps the frame is drawn. Frames too long to catch up on within
+//          MAX_SIMULATION_STEPS slow the simulation down instead of making the
+//          next frame longer still.
+//-----------------------------------------------------------------------------
+void Engine::simulationLoop()
+{
+	Profiler::getInstance().setThreadName("Simulation");
 
+	m_dLastTime = glfwGetTime();
+	m_fAccumulator = 0.f;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mtxSimulation);
+		m_CurrentState = captureState();
+		m_PreviousState = m_CurrentState;
+	}
+
+	do
+	{
+		PROFILE_SCOPE("Simulate");
+		std::lock_guard<std::mutex> lock(m_mtxSimulation);
+
+		// Calculate deltatime of current frame
+		double newTime = glfwGetTime();
+		float deltaTime = static_cast<float>(newTime - m_dLastTime);
+		m_dLastTime = newTime;
+
+		// Handle the input events polled by the render thread so far, or the recorded ones with the recorded frame time
+		m_fDeltaTime = GLFWInputBroadcaster::getInstance().dispatch(deltaTime);
+
+		// Resume any pending L-system generation, spread across frames
+		{
+			PROFILE_SCOPE("Generate");
+			lsys->update(m_nGenerationBudgetMicroseconds);
+		}
+
+		m_fAccumulator += m_fDeltaTime;
+
+		int steps = 0;
+		while (m_fAccumulator >= m_fStepSize && steps < MAX_SIMULATION_STEPS)
+		{
+			PROFILE_SCOPE("Step");
+			m_PreviousState = m_CurrentState;
+			update(m_fStepSize);
+			m_CurrentState = captureState();
+
+			m_fAccumulator -= m_fStepSize;
+			++steps;
+		}
+
+		if (m_fAccumulator >= m_fStepSize)
+			m_fAccumulator = fmodf(m_fAccumulator, m_fStepSize);
+
+		snapshot(m_Frames.getWriteSlot(), m_fAccumulator / m_fStepSize);
+
+		if (m_bHeadless)
+			m_vfSimulationTimes.push_back(static_cast<float>((glfwGetTime() - newTime) * 1000.0));
+	} while (m_Frames.publish());
+}
+
+void Engine::update(float dt)
+{
 	m_pCamera->update(dt);
+}
 
-	// Create camera transformations
+Engine::SimulationState Engine::captureState()
+{
 	glm::mat4 view = m_pCamera->getViewMatrix() * glm::inverse(m_pArcball->getTransformation());
-	glm::mat4 projection = glm::perspective(
-		glm::radians(m_pCamera->getZoom()),
-		m_fAspect,
-		m_pCamera->getNearPlane(),
-		m_pCamera->getFarPlane()
-		);
-	glm::mat4 viewProjection = projection * view;
 
-	m_pLightingSystem->update(view);
+	SimulationState state;
+	state.viewRotation = glm::quat_cast(glm::mat3(view));
+	state.viewTranslation = glm::vec3(view[3]);
+	state.zoom = m_pCamera->getZoom();
+	state.plantOrientation = glm::quat_cast(lsys->getOrientation());
 
-	// Set viewport for shader uniforms
-	glNamedBufferSubData(*Renderer::getInstance().getFrameUBO(), offsetof(FrameUniforms, v4Viewport), sizeof(FrameUniforms::v4Viewport), glm::value_ptr(glm::vec4(0, 0, m_iWidth, m_iHeight)));
-	glNamedBufferSubData(*Renderer::getInstance().getFrameUBO(), offsetof(FrameUniforms, m4View), sizeof(FrameUniforms::m4View), glm::value_ptr(view));
-	glNamedBufferSubData(*Renderer::getInstance().getFrameUBO(), offsetof(FrameUniforms, m4Projection), sizeof(FrameUniforms::m4Projection), glm::value_ptr(projection));
-	glNamedBufferSubData(*Renderer::getInstance().getFrameUBO(), offsetof(FrameUniforms, m4ViewProjection), sizeof(FrameUniforms::m4ViewProjection), glm::value_ptr(viewProjection));
+	return state;
 }
 
-void Engine::draw()
+void Engine::snapshot(FrameSnapshot &frame, float alpha)
 {
+	// Views are rigid, so interpolate their rotation and translation apart
+	m_mat4View = glm::mat4_cast(glm::slerp(m_PreviousState.viewRotation, m_CurrentState.viewRotation, alpha));
+	m_mat4View[3] = glm::vec4(glm::mix(m_PreviousState.viewTranslation, m_CurrentState.viewTranslation, alpha), 1.f);
+	m_mat4Projection = glm::perspective(
+		glm::radians(glm::mix(m_PreviousState.zoom, m_CurrentState.zoom, alpha)),
+		m_fAspect,
+		m_pCamera->getNearPlane(),
+		m_pCamera->getFarPlane()
+		);
+	m_mat4PlantOrientation = glm::mat4_cast(glm::slerp(m_PreviousState.plantOrientation, m_CurrentState.plantOrientation, alpha));
+
+	frame.view = m_mat4View;
+	frame.projection = m_mat4Projection;
+	frame.occlusionCulling = m_bOcclusionCulling;
+	frame.validateInstanceCulling = m_bValidateInstanceCulling;
+	frame.capture = m_bCaptureRequested;
+	m_bCaptureRequested = false;
+	frame.uploadPending = lsys->isUploadPending();
+
+	frame.plantParts.clear();
+	frame.plantCulled = false;
+	frame.plantOrientation = m_mat4PlantOrientation;
+	frame.plantRadius = lsys->getMeshBoundingRadius();
+	frame.plantUploadCount = lsys->getUploadCount();
+
+	frame.segmentPicked = m_bSegmentPicked && m_nPickedUploadCount == lsys->getUploadCount();
+	frame.pickedSegmentModel = frame.plantOrientation * glm::translate(glm::mat4(), lsys->getMeshCenteringAdjustments());
+	frame.pickedSegmentFrom = m_vec3PickedSegmentFrom;
+	frame.pickedSegmentTo = m_vec3PickedSegmentTo;
+	frame.pickedSegmentRadius = m_fPickedSegmentRadius;
+
+	// Nothing uploaded yet
+	if (lsys->getIndexCount() == 0)
+		return;
+
 	Renderer::RendererSubmission rs;
 	rs.primitiveType = GL_TRIANGLES;
-	rs.shaderName = "flat";
+	rs.shader = m_hPlantShader;
 	rs.VAO = lsys->getVAO();
 	rs.vertCount = lsys->getIndexCount();
-	rs.modelToWorldTransform = glm::mat4(lsys->getOrientation()) * glm::translate(glm::mat4(), glm::vec3(lsys->getDataCenteringAdjustments()));
+	rs.firstIndex = lsys->getFirstIndex();
+	rs.baseVertex = lsys->getBaseVertex();
+	rs.modelToWorldTransform = glm::translate(glm::mat4(), lsys->getMeshCenteringAdjustments());
+	rs.lods = lsys->getMeshLODs();
+	rs.boundsCenter = -lsys->getMeshCenteringAdjustments();
+	rs.boundsRadius = lsys->getMeshBoundingRadius();
+
+	// the main mesh is culled branch by branch
+	glm::mat4 clipFromMesh = m_mat4Projection * m_mat4View * frame.plantOrientation * rs.modelToWorldTransform;
+	frame.plantCulled = lsys->getVisibleIndexRanges(clipFromMesh, rs.visibleRanges) && rs.visibleRanges.empty();
+
+	frame.plantParts.push_back(rs);
+
+	// Repeated branches share one mesh each, drawn once per occurrence; each occurrence is culled and picks its LOD on the GPU
+	rs.shader = m_hPlantCulledShader;
+	rs.gpuCulled = true;
+	rs.visibleRanges.clear();
+	for (auto const &branch : lsys->getInstancedBranchMeshes())
+	{
+		rs.instanceBounds = branch.bounds;
+		rs.vertCount = branch.indexCount;
+		rs.firstIndex = branch.firstIndex;
+		rs.baseVertex = branch.baseVertex;
+		rs.baseInstance = branch.baseInstance;
+		rs.instanceCount = branch.instanceCount;
+		rs.lods = branch.lods;
+
+		frame.plantParts.push_back(rs);
+	}
+}
+
+void Engine::draw(const FrameSnapshot &frame)
+{
+	Renderer &renderer = Renderer::getInstance();
+
+	m_pLightingSystem->update(frame.view, frame.projection);
 
-	Renderer::getInstance().addToDynamicRenderQueue(rs);
+	renderer.setViewMatrix(frame.view);
+	renderer.setProjectionMatrix(frame.projection);
+
+	if (frame.capture)
+		renderer.captureFrame("capture_" + std::to_string(m_nCaptures++) + ".png");
+
+	FrameUniforms frameUniforms;
+	frameUniforms.v4Viewport = glm::vec4(0, 0, m_iWidth, m_iHeight);
+	frameUniforms.m4View = frame.view;
+	frameUniforms.m4Projection = frame.projection;
+	frameUniforms.m4ViewProjection = frame.projection * frame.view;
+	renderer.setFrameUniforms(frameUniforms);
+
+	if (frame.occlusionCulling != renderer.getOcclusionCulling())
+	{
+		std::cout << "Occlusion culling " << (frame.occlusionCulling ? "on" : "off") << ", " << renderer.getStats().occludedInstances << " instances occluded" << std::endl;
+		renderer.setOcclusionCulling(frame.occlusionCulling);
+	}
+
+	if (frame.validateInstanceCulling != m_bInstanceCullingValidated)
+	{
+		m_bInstanceCullingValidated = frame.validateInstanceCulling;
+		renderer.setInstanceCullingValidation(m_bInstanceCullingValidated);
+		std::cout << "GPU instance culling validation " << (m_bInstanceCullingValidated ? "on" : "off") << std::endl;
+	}
+
+	// Nothing uploaded yet
+	if (frame.plantParts.empty())
+		return;
+
+	// Parts are centered on the origin, which is where the impostor is baked around. A new mesh is baked into the
+	// variant not on screen, restarting any bake of an older mesh, whose storage may be reused now
+	if (frame.plantUploadCount != m_nPlantImpostorUploadCount)
+	{
+		std::vector<Renderer::RendererSubmission> parts(frame.plantParts);
+		parts.front().visibleRanges.clear();
+
+		m_nPlantImpostorBaking = renderer.beginImpostorBake(parts, glm::vec3(0.f), frame.plantRadius, m_nPlantImpostorBaking);
+		m_bPlantImpostorBaking = m_nPlantImpostorBaking >= 0;
+		m_nPlantImpostorUploadCount = frame.plantUploadCount;
+	}
+
+	// The previous impostor stays on screen until every view of the new one is baked
+	if (m_bPlantImpostorBaking && renderer.continueImpostorBake())
+	{
+		std::swap(m_nPlantImpostor, m_nPlantImpostorBaking);
+		m_bPlantImpostorBaking = false;
+	}
+
+	glm::vec3 worldCenter = glm::vec3(frame.plantOrientation * glm::vec4(0.f, 0.f, 0.f, 1.f));
+
+	float impostorBlend = m_nPlantImpostor < 0 ? 0.f : renderer.getImpostorBlend(worldCenter, frame.plantRadius);
+
+	if (impostorBlend > 0.f)
+		renderer.addImpostor(m_nPlantImpostor, worldCenter, glm::quat_cast(glm::mat3(frame.plantOrientation)), frame.plantRadius, impostorBlend);
+
+	// The mesh stays until the impostor has fully faded in over it
+	if (impostorBlend < 1.f)
+	{
+		for (size_t i = frame.plantCulled ? 1u : 0u; i < frame.plantParts.size(); ++i)
+		{
+			Renderer::RendererSubmission part = frame.plantParts[i];
+			part.modelToWorldTransform = frame.plantOrientation * part.modelToWorldTransform;
+
+			renderer.addToDynamicRenderQueue(part);
+		}
+	}
+
+	if (frame.segmentPicked)
+	{
+		DebugDrawer::getInstance().setTransform(glm::value_ptr(frame.pickedSegmentModel));
+		DebugDrawer::getInstance().drawLine(frame.pickedSegmentFrom, frame.pickedSegmentTo, glm::vec4(1.f, 1.f, 0.f, 1.f));
+		DebugDrawer::getInstance().drawBox(glm::min(frame.pickedSegmentFrom, frame.pickedSegmentTo) - frame.pickedSegmentRadius, glm::max(frame.pickedSegmentFrom, frame.pickedSegmentTo) + frame.pickedSegmentRadius, glm::vec4(1.f, 1.f, 0.f, 1.f));
+		DebugDrawer::getInstance().setTransformDefault();
+	}
+}
+
+void Engine::pickSegment(glm::vec2 screenPos)
+{
+	glm::mat4 model = m_mat4PlantOrientation * glm::translate(glm::mat4(), lsys->getMeshCenteringAdjustments());
+	glm::mat4 meshFromClip = glm::inverse(m_mat4Projection * m_mat4View * model);
+
+	glm::vec2 ndc = screenPos / glm::vec2(m_iWidth, m_iHeight) * 2.f - 1.f;
+	glm::vec4 nearPt = meshFromClip * glm::vec4(ndc, -1.f, 1.f);
+	glm::vec4 farPt = meshFromClip * glm::vec4(ndc, 1.f, 1.f);
+
+	glm::vec3 origin = glm::vec3(nearPt) / nearPt.w;
+	glm::vec3 dir = glm::normalize(glm::vec3(farPt) / farPt.w - origin);
+
+	LSystem::PickResult result;
+	m_bSegmentPicked = lsys->pick(origin, dir, CAST_RAY_LEN, result);
+
+	if (m_bSegmentPicked)
+	{
+		m_vec3PickedSegmentFrom = result.from;
+		m_vec3PickedSegmentTo = result.to;
+		m_fPickedSegmentRadius = result.radius;
+		m_nPickedUploadCount = lsys->getUploadCount();
+
+		std::cout << "Picked segment " << result.segment;
+		if (result.instance >= 0)
+			std::cout << " of branch instance " << result.instance;
+		std::cout << std::endl;
+	}
 }
 
 void Engine::render()
@@ -287,7 +784,8 @@ GLFWwindow * Engine::init_gl_context(std::string winName)
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
-	glfwWindowHint(GLFW_SAMPLES, 16);
+	glfwWindowHint(GLFW_SAMPLES, 0); // frames are rendered (multisampled) offscreen and upscaled to the window
+	glfwWindowHint(GLFW_VISIBLE, m_bHeadless ? GL_FALSE : GL_TRUE); // headless, the window only provides the context
 #if _DEBUG
 	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
 #endif
@@ -299,6 +797,7 @@ GLFWwindow * Engine::init_gl_context(std::string winName)
 
 	// Create Context and Load OpenGL Functions
 	glfwMakeContextCurrent(mWindow);
+	glfwSwapInterval(m_bHeadless ? 0 : 1); // frames are paced to vsync
 
 	// GLFW Options
 	//glfwSetInputMode(mWindow, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -323,6 +822,7 @@ GLFWwindow * Engine::init_gl_context(std::string winName)
 void Engine::init_lighting()
 {
 	m_pLightingSystem = new LightingSystem();
+	m_pLightingSystem->setClusteringShader(Renderer::getInstance().getShader("lightClusters"));
 
 	m_pLightingSystem->addDirectLight()->ambientCoefficient = 0.01f;
 
@@ -331,9 +831,6 @@ void Engine::init_lighting()
 	//m_pLightingSystem->addPointLight(glm::vec4(25.f, 0.f, -25.f, 1.f));
 	//m_pLightingSystem->addPointLight(glm::vec4(-25.f, 0.f, 25.f, 1.f));
 	//m_pLightingSystem->addPointLight(glm::vec4(-25.f, 0.f, -25.f, 1.f));
-
-	m_pLightingSystem->registerShader(Renderer::getInstance().getShader("lighting"));
-	m_pLightingSystem->registerShader(Renderer::getInstance().getShader("lightingWireframe"));
 }
 
 void Engine::init_camera()
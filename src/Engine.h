@@ -1,16 +1,27 @@
 #pragma once
 
-#include <glSkel/renderer.h>
+#include <glSkel/Renderer.h>
 #include <glSkel/camera.h>
 #include <glSkel/LightingSystem.h>
 #include <glSkel/DebugDrawer.h>
+#include <glSkel/TripleBuffer.h>
+#include <glSkel/FramePacer.h>
+#include <glSkel/JobSystem.h>
+
+#include <glm/gtc/quaternion.hpp>
+
+#include <mutex>
+#include <thread>
 
 #include "GLSLpreamble.h"
 #include "GLFWInputBroadcaster.h"
 #include "Arcball.h"
 
-#define MS_PER_UPDATE 0.0333333333f
+#define MAX_SIMULATION_STEPS 8 // fixed steps per frame at most; time beyond them is dropped rather than caught up on
 #define CAST_RAY_LEN 1000.f
+#define BENCHMARK_DEFAULT_FRAMES 1000 // frames a headless run renders when not told otherwise nor playing input back
+#define BENCHMARK_WARMUP_FRAMES 30 // first frames left out of the statistics, while shaders compile and caches fill
+#define BENCHMARK_FRAMES_IN_FLIGHT 2 // frames the render thread may get ahead of the GPU, with no swap to hold it back
 
 class Engine : public BroadcastSystem::Listener
 {
@@ -23,33 +34,46 @@ public:
 	const int m_iWidth = 1280;
 	const int m_iHeight = 800;
 	const float m_fAspect = static_cast<float>(m_iWidth) / static_cast<float>(m_iHeight);
-	const float m_fStepSize = 1.f / 120.f;
+	const float m_fStepSize = 1.f / 120.f; // seconds simulated per fixed step
+	unsigned int m_nGenerationBudgetMicroseconds = 4000u; // max time spent per frame regenerating the L-system; 0 (all at once) for recorded input
+	const float m_fTargetFrameTime = 1000.f / 60.f; // GPU milliseconds per frame the render resolution and MSAA adapt to
+	const int m_nMaxSamples = 16;
 
 	float m_fDeltaTime;	// Time between current frame and last frame
-	float m_fLastTime; // Time of last frame
+	double m_dLastTime; // Time of last frame, in double as glfwGetTime() counts up from init
+	float m_fAccumulator; // Time not yet simulated, less than a step after each frame
 
 	Camera  *m_pCamera;
 
-	struct RendererSubmission
+	// Everything the render thread needs to draw a frame, produced by the simulation thread and not changed after
+	struct FrameSnapshot
 	{
-		GLenum			primitiveType;
-		GLuint			VAO;
-		int				vertCount;
-		std::string		shaderName;
-		GLuint			diffuseTex;
-		GLuint			specularTex;
-		float			specularExponent;
-		glm::mat4		modelToWorldTransform;
-
-		RendererSubmission()
-			: primitiveType(GL_NONE)
-			, VAO(0)
-			, vertCount(0)
-			, shaderName("")
-			, diffuseTex(0)
-			, specularTex(0)
-			, specularExponent(0.f)
-			, modelToWorldTransform(glm::mat4())
+		glm::mat4		view;
+		glm::mat4		projection;
+		std::vector<Renderer::RendererSubmission> plantParts; // main mesh then instanced branches, centered on the origin; empty until uploaded
+		bool			plantCulled; // none of the main mesh's branches are in view
+		glm::mat4		plantOrientation;
+		float			plantRadius;
+		unsigned int	plantUploadCount; // mesh the parts were taken from
+		bool			uploadPending; // a generated mesh is waiting for the render thread to upload it
+		bool			segmentPicked;
+		glm::mat4		pickedSegmentModel;
+		glm::vec3		pickedSegmentFrom, pickedSegmentTo; // mesh space
+		float			pickedSegmentRadius;
+		bool			occlusionCulling;
+		bool			validateInstanceCulling;
+		bool			capture; // write the frame to a file
+
+		FrameSnapshot()
+			: plantCulled(false)
+			, plantRadius(0.f)
+			, plantUploadCount(0u)
+			, uploadPending(false)
+			, segmentPicked(false)
+			, pickedSegmentRadius(0.f)
+			, occlusionCulling(true)
+			, validateInstanceCulling(false)
+			, capture(false)
 		{}
 	};
 
@@ -59,20 +83,101 @@ public:
 
 	void receiveEvent(Object * obj, const int event, void * data);
 
+	// Before init: renders into an offscreen texture of an invisible window instead, as fast as it can, at full
+	// quality, for frames frames (0: until the input played back runs out, or BENCHMARK_DEFAULT_FRAMES without
+	// any). Frame time statistics are then written as JSON to statsFile, or stdout if it is empty.
+	void setHeadless(unsigned int frames, const std::string &statsFile);
+
 	bool init();
 
+	// After init: the seed the L-system generates with, random unless set
+	void setSeed(uint32_t seed);
+	// After init: records the run's input to a file, or plays a recording back instead of the window's input. The
+	// simulation runs off the recorded frame times, the seed is the recording's and generation always finishes in
+	// the frame it starts, so a playback goes through the same simulation steps as its recording.
+	bool recordInput(const std::string &filename);
+	bool playInput(const std::string &filename);
+
+	// Runs the simulation thread, and renders the frames it produces on this (the main) thread until the window closes
 	void mainLoop();
 
+	// Simulation thread: advances the simulation by one fixed step
 	void update(float dt);
 
-	void draw();
+	// Simulation thread: writes what the state looks like alpha of the way from the previous step to the last one
+	void snapshot(FrameSnapshot &frame, float alpha);
 
+	// Render thread: sets up the frame's camera and submits its draws
+	void draw(const FrameSnapshot &frame);
+
+	// Render thread: renders the draws submitted for the frame
 	void render();
 
+private:
+	// The parts of the simulation's state that are drawn, kept for the last two steps to interpolate between
+	struct SimulationState
+	{
+		glm::quat		viewRotation;
+		glm::vec3		viewTranslation;
+		float			zoom;
+		glm::quat		plantOrientation;
+	};
+
+private:
+	void simulationLoop();
+
+	SimulationState captureState();
+
+	void writeBenchmarkStats();
+
 private:
 	ArcBall *m_pArcball;
 
 	bool m_bRunPhysics;
+	bool m_bValidateInstanceCulling; // as requested by input; the render thread applies them
+	bool m_bOcclusionCulling;
+	bool m_bCaptureRequested; // for the next snapshot
+
+	uint32_t m_uiSeed; // of the L-system
+
+	JobSystem m_JobSystem; // workers shared by the L-system and renderer, besides the simulation and render threads
+
+	TripleBuffer<FrameSnapshot> m_Frames;
+	std::thread m_SimulationThread;
+	std::mutex m_mtxSimulation; // held while the simulation thread updates, and to upload generated meshes from the render thread
+
+	SimulationState m_PreviousState;
+	SimulationState m_CurrentState;
+	glm::mat4 m_mat4View; // as last snapshot, i.e. what the user sees, for picking
+	glm::mat4 m_mat4Projection;
+	glm::mat4 m_mat4PlantOrientation;
+
+	FramePacer m_FramePacer; // render thread
+
+	bool m_bHeadless;
+	unsigned int m_nHeadlessFrames;
+	std::string m_strStatsFile;
+	GLuint m_glOutputTexture; // headless: what would be shown in the window
+	GLsync m_arrFrameFences[BENCHMARK_FRAMES_IN_FLIGHT]; // headless: end of each frame in flight
+	std::vector<float> m_vfFrameTimes; // headless: milliseconds from the end of each frame to the end of the next
+	std::vector<float> m_vfRenderTimes; // headless: milliseconds of work on the render thread per frame
+	std::vector<float> m_vfSimulationTimes; // headless: milliseconds per simulation update, on its thread
+
+	Renderer::ShaderHandle m_hPlantShader; // renderer shader handles
+	Renderer::ShaderHandle m_hPlantCulledShader;
+
+	// Render thread
+	int m_nPlantImpostor; // impostor atlas variant of the plant, -1 until baked
+	int m_nPlantImpostorBaking; // variant the latest plant mesh is baked into, swapped with the one on screen when done
+	bool m_bPlantImpostorBaking; // a bake into it is in progress
+	unsigned int m_nPlantImpostorUploadCount; // plant mesh the impostor was baked from
+	bool m_bInstanceCullingValidated; // applied to the renderer
+	unsigned int m_nCaptures; // frames captured so far
+
+	bool m_bSegmentPicked;
+	glm::vec3 m_vec3PickedSegmentFrom, m_vec3PickedSegmentTo; // mesh space
+	float m_fPickedSegmentRadius;
+	unsigned int m_nPickedUploadCount; // plant mesh the pick was made on
 
 	GLFWwindow* init_gl_context(std::string winName);
 
@@ -80,4 +185,7 @@ private:
 	void init_lighting();
 
 	void init_camera();
+
+	// Casts a ray through a window position (origin at the bottom left) and remembers the plant segment it hits
+	void pickSegment(glm::vec2 screenPos);
 };
@@ -1,4 +1,4 @@
-#pragma once
+#include <cstring>
 #include <vector>
 #include <algorithm>
 #include <iostream>
@@ -7,9 +7,25 @@
 
 
 GLFWInputBroadcaster::GLFWInputBroadcaster()
+	: frameIndex(0u)
+	, playingBack(false)
+	, playbackFrame(0u)
+	, playbackFinished(false)
 {
 }
 
+template <typename T>
+static void writeValue(std::ostream &out, const T &value)
+{
+	out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool readValue(std::istream &in, T &value)
+{
+	return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
 GLFWInputBroadcaster& GLFWInputBroadcaster::getInstance()
 {
 	static GLFWInputBroadcaster instance;
@@ -25,8 +41,11 @@ void GLFWInputBroadcaster::init(GLFWwindow * window)
 
 	memset(keys, 0, sizeof keys);
 	firstMouse = true;
+	leftMouseDown = false;
+	rightMouseDown = false;
 	lastX = 0;
 	lastY = 0;
+	glfwGetCursorPos(window, &cursorX, &cursorY);
 }
 
 bool GLFWInputBroadcaster::mouseButtonPressed(const int glfwMouseButtonCode)
@@ -44,11 +63,252 @@ bool GLFWInputBroadcaster::keyPressed(const int glfwKeyCode)
 	return keys[glfwKeyCode];
 }
 
+void GLFWInputBroadcaster::getCursorPos(double * xpos, double * ypos)
+{
+	*xpos = cursorX;
+	*ypos = cursorY;
+}
+
 void GLFWInputBroadcaster::poll()
 {
 	glfwPollEvents();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Takes the events polled so far (or recorded for this frame) and
+//          applies them in order, so the state seen by each listener is the
+//          state as of its event
+//-----------------------------------------------------------------------------
+float GLFWInputBroadcaster::dispatch(float deltaTime)
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		dispatchingEvents.swap(queuedEvents);
+	}
+
+	if (playingBack)
+	{
+		dispatchingEvents.clear();
+
+		if (playbackFrame < playbackFrames.size())
+		{
+			const RecordedFrame &frame = playbackFrames[playbackFrame++];
+			deltaTime = frame.deltaTime;
+			dispatchingEvents.assign(playbackEvents.begin() + frame.firstEvent, playbackEvents.begin() + frame.firstEvent + frame.eventCount);
+		}
+		else
+		{
+			deltaTime = 0.f;
+			playbackFinished = true;
+		}
+	}
+	else if (recordFile.is_open())
+		record(deltaTime);
+
+	++frameIndex;
+
+	for (auto &e : dispatchingEvents)
+	{
+		switch (e.event)
+		{
+		case BroadcastSystem::EVENT::KEY_PRESS:
+		case BroadcastSystem::EVENT::KEY_REPEAT:
+			keys[e.code] = true;
+			notify(NULL, e.event, &e.code);
+			break;
+		case BroadcastSystem::EVENT::KEY_UNPRESS:
+			keys[e.code] = false;
+			notify(NULL, e.event, &e.code);
+			break;
+		case BroadcastSystem::EVENT::MOUSE_CLICK:
+		case BroadcastSystem::EVENT::MOUSE_UNCLICK:
+			if (e.code == GLFW_MOUSE_BUTTON_LEFT)
+				leftMouseDown = e.event == BroadcastSystem::EVENT::MOUSE_CLICK;
+			else if (e.code == GLFW_MOUSE_BUTTON_RIGHT)
+				rightMouseDown = e.event == BroadcastSystem::EVENT::MOUSE_CLICK;
+			notify(NULL, e.event, &e.code);
+			break;
+		case BroadcastSystem::EVENT::MOUSE_MOVE:
+			cursorX = e.cursorX;
+			cursorY = e.cursorY;
+			notify(NULL, e.event, &e.values);
+			break;
+		case BroadcastSystem::EVENT::MOUSE_SCROLL:
+			notify(NULL, e.event, &e.values[0]);
+			break;
+		}
+	}
+
+	dispatchingEvents.clear();
+
+	return deltaTime;
+}
+
+bool GLFWInputBroadcaster::startRecording(const std::string & filename, uint32_t seed)
+{
+	stopRecording();
+
+	recordFile.open(filename, std::ios::binary | std::ios::trunc);
+	if (!recordFile)
+	{
+		std::cerr << "Could not create input recording " << filename << std::endl;
+		return false;
+	}
+
+	frameIndex = 0u;
+
+	writeValue(recordFile, static_cast<uint32_t>(INPUT_RECORDING_MAGIC));
+	writeValue(recordFile, static_cast<uint32_t>(INPUT_RECORDING_VERSION));
+	writeValue(recordFile, seed);
+	writeValue(recordFile, cursorX);
+	writeValue(recordFile, cursorY);
+
+	return true;
+}
+
+void GLFWInputBroadcaster::stopRecording()
+{
+	if (recordFile.is_open())
+		recordFile.close();
+}
+
+void GLFWInputBroadcaster::record(float deltaTime)
+{
+	writeValue(recordFile, static_cast<uint8_t>(INPUT_RECORD_FRAME));
+	writeValue(recordFile, frameIndex);
+	writeValue(recordFile, deltaTime);
+
+	for (auto const &e : dispatchingEvents)
+	{
+		writeValue(recordFile, static_cast<uint8_t>(e.event));
+
+		switch (e.event)
+		{
+		case BroadcastSystem::EVENT::MOUSE_MOVE:
+			writeValue(recordFile, e.values);
+			writeValue(recordFile, e.cursorX);
+			writeValue(recordFile, e.cursorY);
+			break;
+		case BroadcastSystem::EVENT::MOUSE_SCROLL:
+			writeValue(recordFile, e.values[0]);
+			break;
+		default:
+			writeValue(recordFile, static_cast<int16_t>(e.code));
+			break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads a whole recording up front, so playback doesn't touch the
+//          disk while it is being timed
+//-----------------------------------------------------------------------------
+bool GLFWInputBroadcaster::startPlayback(const std::string & filename, uint32_t * seed)
+{
+	std::ifstream in(filename, std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "Could not open input recording " << filename << std::endl;
+		return false;
+	}
+
+	uint32_t magic = 0u, version = 0u;
+	double startX = 0.0, startY = 0.0;
+	if (!readValue(in, magic) || !readValue(in, version) || magic != INPUT_RECORDING_MAGIC || version != INPUT_RECORDING_VERSION ||
+		!readValue(in, *seed) || !readValue(in, startX) || !readValue(in, startY))
+	{
+		std::cerr << filename << " is not an input recording this version can play" << std::endl;
+		return false;
+	}
+
+	std::vector<RecordedFrame> frames;
+	std::vector<QueuedEvent> events;
+
+	uint8_t type;
+	while (readValue(in, type))
+	{
+		bool complete = true;
+
+		if (type == INPUT_RECORD_FRAME)
+		{
+			uint32_t index = 0u;
+			RecordedFrame frame = {};
+			complete = readValue(in, index) && readValue(in, frame.deltaTime) && index == frames.size();
+			frame.firstEvent = events.size();
+			frames.push_back(frame);
+		}
+		else if (!frames.empty())
+		{
+			QueuedEvent e = {};
+			e.event = type;
+
+			switch (type)
+			{
+			case BroadcastSystem::EVENT::MOUSE_MOVE:
+				complete = readValue(in, e.values) && readValue(in, e.cursorX) && readValue(in, e.cursorY);
+				break;
+			case BroadcastSystem::EVENT::MOUSE_SCROLL:
+				complete = readValue(in, e.values[0]);
+				break;
+			case BroadcastSystem::EVENT::KEY_PRESS:
+			case BroadcastSystem::EVENT::KEY_REPEAT:
+			case BroadcastSystem::EVENT::KEY_UNPRESS:
+			case BroadcastSystem::EVENT::MOUSE_CLICK:
+			case BroadcastSystem::EVENT::MOUSE_UNCLICK:
+			{
+				int16_t code = 0;
+				complete = readValue(in, code) && code >= 0 && code < 1024;
+				e.code = code;
+				break;
+			}
+			default:
+				complete = false;
+				break;
+			}
+
+			events.push_back(e);
+			++frames.back().eventCount;
+		}
+		else
+			complete = false;
+
+		if (!complete)
+		{
+			std::cerr << "Input recording " << filename << " is damaged after frame " << frames.size() << std::endl;
+			return false;
+		}
+	}
+
+	stopRecording();
+
+	playbackFrames.swap(frames);
+	playbackEvents.swap(events);
+	playbackFrame = 0u;
+	playbackFinished = false;
+	playingBack = true;
+
+	cursorX = startX;
+	cursorY = startY;
+
+	return true;
+}
+
+bool GLFWInputBroadcaster::isPlayingBack()
+{
+	return playingBack;
+}
+
+bool GLFWInputBroadcaster::isPlaybackFinished()
+{
+	return playbackFinished;
+}
+
+void GLFWInputBroadcaster::queue(const QueuedEvent & e)
+{
+	std::lock_guard<std::mutex> lock(queueMutex);
+	queuedEvents.push_back(e);
+}
+
 // Is called whenever a key is pressed/released via GLFW
 void GLFWInputBroadcaster::key_callback(GLFWwindow* window, int key, int scancode, int action, int mode)
 {	
@@ -60,44 +320,35 @@ void GLFWInputBroadcaster::key_callback(GLFWwindow* window, int key, int scancod
 
 	if (key >= 0 && key < 1024)
 	{
+		QueuedEvent e = {};
+		e.code = key;
+
 		if (action == GLFW_PRESS)
-		{
-			getInstance().keys[key] = true;
-			getInstance().notify(NULL, BroadcastSystem::EVENT::KEY_PRESS, &key);
-		}
+			e.event = BroadcastSystem::EVENT::KEY_PRESS;
 		else if (action == GLFW_REPEAT)
-		{
-			getInstance().keys[key] = true;
-			getInstance().notify(NULL, BroadcastSystem::EVENT::KEY_REPEAT, &key);
-		}
+			e.event = BroadcastSystem::EVENT::KEY_REPEAT;
 		else if (action == GLFW_RELEASE)
-		{
-			getInstance().keys[key] = false;
-			getInstance().notify(NULL, BroadcastSystem::EVENT::KEY_UNPRESS, &key);
-		}
+			e.event = BroadcastSystem::EVENT::KEY_UNPRESS;
+		else
+			return;
+
+		getInstance().queue(e);
 	}
 }
 
 void GLFWInputBroadcaster::mouse_button_callback(GLFWwindow * window, int button, int action, int mods)
 {
+	QueuedEvent e = {};
+	e.code = button;
+
 	if (action == GLFW_PRESS)
-	{
-		if (button == GLFW_MOUSE_BUTTON_LEFT)
-			getInstance().leftMouseDown = true;
-		else if (button == GLFW_MOUSE_BUTTON_RIGHT)
-			getInstance().rightMouseDown = true;
-		
-		getInstance().notify(NULL, BroadcastSystem::EVENT::MOUSE_CLICK, &button);
-	}
+		e.event = BroadcastSystem::EVENT::MOUSE_CLICK;
 	else if (action == GLFW_RELEASE)
-	{
-		if (button == GLFW_MOUSE_BUTTON_LEFT)
-			getInstance().leftMouseDown = false;
-		else if (button == GLFW_MOUSE_BUTTON_RIGHT)
-			getInstance().rightMouseDown = false;
+		e.event = BroadcastSystem::EVENT::MOUSE_UNCLICK;
+	else
+		return;
 
-		getInstance().notify(NULL, BroadcastSystem::EVENT::MOUSE_UNCLICK, &button);
-	}
+	getInstance().queue(e);
 }
 
 void GLFWInputBroadcaster::mouse_position_callback(GLFWwindow * window, double xpos, double ypos)
@@ -115,13 +366,21 @@ void GLFWInputBroadcaster::mouse_position_callback(GLFWwindow * window, double x
 	getInstance().lastX = static_cast<GLfloat>(xpos);
 	getInstance().lastY = static_cast<GLfloat>(ypos);
 
-	float offset[2] = { static_cast<float>(xoffset), static_cast<float>(yoffset) };
+	QueuedEvent e = {};
+	e.event = BroadcastSystem::EVENT::MOUSE_MOVE;
+	e.values[0] = static_cast<float>(xoffset);
+	e.values[1] = static_cast<float>(yoffset);
+	e.cursorX = xpos;
+	e.cursorY = ypos;
 
-	getInstance().notify(NULL, BroadcastSystem::EVENT::MOUSE_MOVE, &offset);
+	getInstance().queue(e);
 }
 
 void GLFWInputBroadcaster::scroll_callback(GLFWwindow * window, double xoffset, double yoffset)
 {
-	float offset = static_cast<float>(yoffset);
-	getInstance().notify(NULL, BroadcastSystem::EVENT::MOUSE_SCROLL, &offset);
+	QueuedEvent e = {};
+	e.event = BroadcastSystem::EVENT::MOUSE_SCROLL;
+	e.values[0] = static_cast<float>(yoffset);
+
+	getInstance().queue(e);
 }
@@ -1,11 +1,24 @@
 #pragma once
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
 
 #include <glSkel/BroadcastSystem.h>
 
 #include <GLFW/glfw3.h>
 
+#define INPUT_RECORDING_MAGIC 0x52494843u // "CHIR", at the start of input recordings
+#define INPUT_RECORDING_VERSION 1u
+#define INPUT_RECORD_FRAME 0xFFu // record type of a frame's start, the others being BroadcastSystem::EVENTs
+
+// Recording layout (native byte order): magic, version, uint32 seed, double cursor x and y at the start, then
+// for every dispatch a frame record (uint8 INPUT_RECORD_FRAME, uint32 frame, float delta time) followed by the
+// frame's events (uint8 event; int16 key or button, float[2] mouse offsets and double[2] cursor position, or
+// float scroll offset).
 class GLFWInputBroadcaster : public BroadcastSystem::Broadcaster
 {
 public:
@@ -13,14 +26,47 @@ public:
 
 	void init(GLFWwindow* window);
 
+	// State as of the events dispatched so far
 	bool mouseButtonPressed(const int glfwMouseButtonCode);
 	bool keyPressed(const int glfwKeyCode);
+	void getCursorPos(double *xpos, double *ypos);
 
+	// Collects the window's events; GLFW only allows this on the main thread
 	void poll();
+	// Updates the state and notifies the listeners of the events polled since the last call, on the calling thread,
+	// once per frame. Returns the time the frame should simulate: deltaTime, or during playback the recorded one.
+	float dispatch(float deltaTime);
+
+	// Writes every frame dispatched from now on to a file, with seed, the L-system seed the run generates with
+	bool startRecording(const std::string &filename, uint32_t seed);
+	void stopRecording();
+
+	// Dispatches the frames of a recording in place of the window's events, and returns the seed they were
+	// recorded with so the run can generate the same plant; the window is still polled, but only to close it
+	bool startPlayback(const std::string &filename, uint32_t *seed);
+	bool isPlayingBack();
+	// Every recorded frame has been dispatched
+	bool isPlaybackFinished();
 
 private:
 	GLFWInputBroadcaster();
 
+	struct QueuedEvent {
+		int event;
+		int code; // key or mouse button
+		float values[2]; // mouse offsets, or scroll offset
+		double cursorX, cursorY;
+	};
+
+	struct RecordedFrame {
+		float deltaTime;
+		size_t firstEvent; // in playbackEvents
+		size_t eventCount;
+	};
+
+	void queue(const QueuedEvent &e);
+	void record(float deltaTime);
+
 	static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
 	static void mouse_button_callback(GLFWwindow* window,int x, int y, int z);
 	static void mouse_position_callback(GLFWwindow* window, double xpos, double ypos);
@@ -31,6 +77,19 @@ private:
 	bool leftMouseDown;
 	bool rightMouseDown;
 	float lastX, lastY;
+	double cursorX, cursorY; // window coordinates of the last mouse move dispatched
+
+	std::mutex queueMutex;
+	std::vector<QueuedEvent> queuedEvents; // polled, not yet dispatched
+	std::vector<QueuedEvent> dispatchingEvents;
+
+	uint32_t frameIndex; // frames dispatched so far
+	std::ofstream recordFile;
+	bool playingBack;
+	std::vector<RecordedFrame> playbackFrames;
+	std::vector<QueuedEvent> playbackEvents;
+	size_t playbackFrame; // next to dispatch
+	std::atomic<bool> playbackFinished;
 
 	GLFWInputBroadcaster(GLFWInputBroadcaster const&) = delete; // no copies of singletons (C++11)
 	void operator=(GLFWInputBroadcaster const&) = delete; // no assigning of singletons (C++11)
@@ -10,19 +10,40 @@
 #define COLOR_ATTRIB_LOCATION					3
 #define INSTANCE_POSITION_ATTRIB_LOCATION		4
 #define INSTANCE_FORWARD_ATTRIB_LOCATION		5
+#define INSTANCE_ORIENTATION_ATTRIB_LOCATION	6
+#define IMPOSTOR_PARAMS_ATTRIB_LOCATION			7
 
 
 // SHADER UNIFORMS: layout(location = _____)
 
 #define MODEL_MAT_UNIFORM_LOCATION				0
 #define MATERIAL_SHININESS_UNIFORM_LOCATION		1
-#define LIGHT_COUNT_UNIFORM_LOCATION			2
+#define LOD_FULL_DETAIL_SIZE_UNIFORM_LOCATION	2
+#define CULLED_DRAW_COUNT_UNIFORM_LOCATION		3
+#define CULLED_COMMAND_OFFSET_UNIFORM_LOCATION	4
+#define CULL_PHASE_UNIFORM_LOCATION				5
+#define DEPTH_PYRAMID_SOURCE_LEVEL_UNIFORM_LOCATION	6
 
 
 // UNIFORM BLOCKS: layout(std40, binding = _____)
 
 #define SCENE_UNIFORM_BUFFER_LOCATION			0
-#define LIGHTS_UNIFORM_BUFFER_LOCATION			1
+
+
+// SHADER STORAGE BLOCKS: layout(std430, binding = _____)
+
+#define DRAW_TRANSFORMS_STORAGE_BUFFER_BINDING	0
+#define LIGHTS_STORAGE_BUFFER_BINDING			1
+#define LIGHT_CLUSTERS_STORAGE_BUFFER_BINDING	2
+#define INSTANCE_DATA_STORAGE_BUFFER_BINDING	3
+#define CULLED_DRAWS_STORAGE_BUFFER_BINDING		4
+#define CULL_COUNTERS_STORAGE_BUFFER_BINDING	5
+#define VISIBLE_INSTANCES_STORAGE_BUFFER_BINDING	6
+#define CULLED_COMMANDS_STORAGE_BUFFER_BINDING	7
+#define CULLED_COMMAND_INFO_STORAGE_BUFFER_BINDING	8
+#define CULLED_DRAW_COUNTS_STORAGE_BUFFER_BINDING	9
+#define INSTANCE_VISIBILITY_STORAGE_BUFFER_BINDING	10
+#define OCCLUSION_STATS_STORAGE_BUFFER_BINDING	11
 
 
 // TEXTURE UNITS: layout(binding = _____)
@@ -30,9 +51,39 @@
 #define DIFFUSE_TEXTURE_BINDING					0
 #define SPECULAR_TEXTURE_BINDING				1
 #define EMISSIVE_TEXTURE_BINDING				2
+#define DEPTH_PYRAMID_TEXTURE_BINDING			3
+
+
+// IMAGE UNITS: layout(binding = _____)
+
+#define DEPTH_PYRAMID_IMAGE_BINDING				0
 
 
 // LIGHTING DEFINITIONS
-#define MAX_LIGHTS 10
+#define MAX_LIGHTS 512
+// The view frustum is split into clusters (screen tiles by exponential depth slices), each with a list of the lights reaching it
+#define LIGHT_CLUSTER_GRID_X 16
+#define LIGHT_CLUSTER_GRID_Y 9
+#define LIGHT_CLUSTER_GRID_Z 24
+#define LIGHT_CLUSTER_COUNT (LIGHT_CLUSTER_GRID_X * LIGHT_CLUSTER_GRID_Y * LIGHT_CLUSTER_GRID_Z)
+#define MAX_LIGHTS_PER_CLUSTER 128
+#define LIGHT_CLUSTER_THREADS 64 // compute invocations binning the lights of one cluster
+#define LIGHT_CUTOFF_INTENSITY (1.0 / 256.0) // attenuated brightness at which a light's reach ends
+
+
+// LOD AND CULLING DEFINITIONS
+#define MAX_LOD_LEVELS 4
+#define INSTANCE_CULL_THREADS 64 // compute invocations per work group, one instance each
+#define INSTANCE_DATA_FLOATS 7 // per geometry pool instance: position, orientation quaternion (x, y, z, w)
+// Instances can be culled in two phases against a depth pyramid (max depth per texel, halving each level): the ones
+// visible last frame are drawn first, the pyramid is built from their depth, and the rest are tested against it
+#define CULL_PHASE_ALL 0 // frustum only
+#define CULL_PHASE_LAST_VISIBLE 1 // in the frustum and visible last frame
+#define CULL_PHASE_OCCLUSION 2 // in the frustum, not hidden in the pyramid and not drawn by the first phase
+#define DEPTH_PYRAMID_THREADS 8 // compute invocations per side of a work group, one pyramid texel each
+
+
+// IMPOSTOR DEFINITIONS
+#define IMPOSTOR_GRID_SIZE 8 // views per side of the octahedral view grid
 
 #endif // PREAMBLE_GLSL
\ No newline at end of file
@@ -1,13 +1,74 @@
 #include "LSystem.h"
 
 #include <glSkel/Renderer.h>
+#include <glSkel/Profiler.h>
 
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/quaternion.hpp>
 
 #include <iostream>
+#include <chrono>
 
 #include <random>
+#include <limits>
+#include <algorithm>
+
+// Bracketed branches shorter than this are cheaper to build than to look up
+#define MIN_INSTANCED_BRANCH_LENGTH 16u
+
+// Multiplier of the polynomial hash used to match identical branch strings
+#define BRANCH_HASH_BASE 1099511628211ull
+
+// Branches whose parent nodes are rotated relative to the turtle by less than this (1 - |cos(angle / 2)|) mesh identically
+#define BRANCH_ROTATION_TOLERANCE 1e-7f
+
+// Segment bounds are capsules of this many times the wider end's width, which covers the end cap
+#define SEGMENT_BOUNDS_RADIUS_SCALE 0.85f
+
+// Frustum culling doesn't split the main mesh into ranges of fewer segments than this
+#define MIN_CULLED_SEGMENTS 64u
+
+// Symbols rewritten, and segments meshed, in parallel between checks of the time budget
+#define REWRITE_SLICE 16384u
+#define MESH_SLICE 256u
+
+// Segments bounded between checks of the time budget
+#define BOUND_SLICE 4096u
+
+// Smallest ranges of symbols, and segments, handed to a thread
+#define REWRITE_GRAIN 1024u
+#define MESH_GRAIN 16u
+
+// Triangles in the cap closing a branch's last segment
+#define SEGMENT_ENDCAP_SLICES 16u
+
+// Rings of vertices along each segment's mesh, besides the first
+#define SEGMENT_SUBSEGMENTS 10u
+
+// Root frame of b expressed relative to root frame a
+static LSystem::BranchInstance relativeBranchTransform(const LSystem::BranchInstance &a, const LSystem::BranchInstance &b)
+{
+	glm::quat invRot = glm::inverse(a.orientation);
+	return LSystem::BranchInstance(invRot * (b.position - a.position), invRot * b.orientation);
+}
+
+// Root frame rel, given relative to root frame a, expressed in a's parent frame
+static LSystem::BranchInstance composeBranchTransform(const LSystem::BranchInstance &a, const LSystem::BranchInstance &rel)
+{
+	return LSystem::BranchInstance(a.position + a.orientation * rel.position, a.orientation * rel.orientation);
+}
+
+// Random number in [0, 1) for the symbol at a position of a rewriting pass, the same however the pass is split up
+static float symbolRandom(uint64_t seed, size_t position)
+{
+	// splitmix64
+	uint64_t x = seed + (static_cast<uint64_t>(position) + 1ull) * 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	x ^= x >> 31;
+
+	return static_cast<float>(x >> 40) * (1.f / 16777216.f);
+}
 
 
 LSystem::LSystem()
@@ -15,16 +76,32 @@ LSystem::LSystem()
 	, m_nIters(0)
 	, m_pCurrentNode(NULL)
 	, m_bNeedsRefresh(true)
+	, m_eStage(IDLE)
+	, m_nCurrentIter(0u)
+	, m_nCursor(0u)
+	, m_nSubCursor(0u)
+	, m_ullRewriteSeed(0ull)
+	, m_nMeshVertexCount(0u)
+	, m_nMeshIndexCount(0u)
+	, m_nMainIndexCount(0u)
+	, m_bSimplifying(false)
+	, m_nLODLevel(0)
+	, m_nUploadedIndexCount(0)
+	, m_vec3UploadedCentering(0.f)
+	, m_fUploadedBoundingRadius(0.f)
+	, m_nUploadCount(0u)
 	, m_mtEngine(std::random_device()())
-	, m_UniformDist(0.f, 1.f)
+	, m_pJobSystem(NULL)
 {
 	makeTurtleCommands();
-
-	initGL();
 }
 
 LSystem::~LSystem()
 {
+	Renderer::getInstance().getGeometryPool().release(m_PoolAllocation);
+
+	reset();
+	freeDeadScaffold(std::function<bool()>());
 }
 
 void LSystem::makeTurtleCommands()
@@ -116,26 +193,6 @@ void LSystem::makeTurtleCommands()
 	});
 }
 
-void LSystem::initGL()
-{
-	glGenVertexArrays(1, &m_glVAO);
-	glGenBuffers(1, &m_glVBO);
-	glGenBuffers(1, &m_glEBO);
-
-	glBindVertexArray(this->m_glVAO);
-	// Bind the array and element buffers
-	glBindBuffer(GL_ARRAY_BUFFER, this->m_glVBO);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->m_glEBO);
-
-	// Enable attribute arrays (with layouts to be defined later)
-	glEnableVertexAttribArray(POSITION_ATTRIB_LOCATION);
-	glVertexAttribPointer(POSITION_ATTRIB_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
-	glEnableVertexAttribArray(COLOR_ATTRIB_LOCATION);
-	// color attribute pointer will be set once position array size is known for attrib pointer offset
-
-	glBindVertexArray(0);
-}
-
 void LSystem::setStart(char symbol)
 {
 	m_chStartSymbol = symbol;
@@ -158,6 +215,17 @@ void LSystem::setSize(glm::vec3 size)
 	m_TurtleOriginalState.size = size;
 }
 
+void LSystem::setJobSystem(JobSystem *jobs)
+{
+	m_pJobSystem = jobs;
+}
+
+void LSystem::setSeed(uint32_t seed)
+{
+	m_mtEngine.seed(seed);
+	m_bNeedsRefresh = true;
+}
+
 void LSystem::setRefreshNeeded()
 {
 	m_bNeedsRefresh = true;
@@ -233,189 +301,800 @@ bool LSystem::addStochasticFinishRules(char symbol, std::vector<std::pair<float,
 	return true;
 }
 
-void LSystem::update()
+bool LSystem::update(unsigned int budgetMicroseconds)
 {
-	reset();
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point deadline = Clock::now() + std::chrono::microseconds(budgetMicroseconds);
+
+	// checking the clock is cheap, but not free, so only do it every few work items
+	unsigned int workCount = 0u;
+	auto outOfTime = [&]() {
+		return budgetMicroseconds > 0u && (++workCount & 0x3Fu) == 0u && Clock::now() >= deadline;
+	};
+	// parallel stages do a whole slice of work per check, enough to read the clock every time
+	auto sliceOutOfTime = [&]() {
+		return budgetMicroseconds > 0u && Clock::now() >= deadline;
+	};
+
+	// a refresh request restarts generation from scratch, even mid-job
+	if (m_bNeedsRefresh)
+	{
+		reset();
+		m_strWorking = std::string(1, m_chStartSymbol);
+		m_nCurrentIter = 0u;
+		m_nCursor = 0u;
+		m_nSubCursor = 0u;
+		m_ullRewriteSeed = (static_cast<uint64_t>(m_mtEngine()) << 32) | m_mtEngine();
+		m_eStage = DERIVING;
+		m_bNeedsRefresh = false;
+	}
 
-	std::cout << run() << std::endl;
+	if (!freeDeadScaffold(outOfTime))
+		return false;
 
-	//generateLines();
-	//generateQuads();
-	generateMesh(10);
+	switch (m_eStage)
+	{
+	case DERIVING:
+		// iterate parallel rewriting the specified number of times
+		while (m_nCurrentIter < m_nIters)
+		{
+			while (m_nCursor < m_strWorking.size())
+			{
+				if (sliceOutOfTime())
+					return false;
 
-	refreshGL();
+				rewriteSlice(m_mapRules, false, (std::min)(m_nCursor + REWRITE_SLICE, m_strWorking.size()));
+			}
 
-	m_bNeedsRefresh = false;
-}
+			m_strWorking.swap(m_strResult);
+			m_strResult.clear();
+			m_nCursor = 0u;
+			m_ullRewriteSeed = (static_cast<uint64_t>(m_mtEngine()) << 32) | m_mtEngine();
+			++m_nCurrentIter;
+		}
+		m_eStage = FINISHING;
+		// fall through
 
-std::string LSystem::run()
-{
-	// just return the result string if no refresh is necessary
-	if (!m_bNeedsRefresh)
-		return m_strResult;
+	case FINISHING:
+		// apply rules to finish the rewriting
+		while (m_nCursor < m_strWorking.size())
+		{
+			if (sliceOutOfTime())
+				return false;
+
+			rewriteSlice(m_mapFinishRules, true, (std::min)(m_nCursor + REWRITE_SLICE, m_strWorking.size()));
+		}
+		m_strWorking.clear();
+		m_nCursor = 0u;
 
-	// set the axiom
-	std::string startStr = std::string(1, m_chStartSymbol);
-	std::string endStr;
+		m_vBracketMatch.assign(m_strResult.size(), 0u);
+		m_vullPrefixHash.resize(m_strResult.size() + 1u);
+		m_vullHashPower.resize(m_strResult.size() + 1u);
+		m_vullPrefixHash[0] = 0ull;
+		m_vullHashPower[0] = 1ull;
 
-	// iterate parallel rewriting the specified number of times
-	for (unsigned int i = 0u; i < m_nIters; ++i)
-	{
-		endStr = iterate(startStr);
-		startStr = endStr;
+		m_eStage = INDEXING;
+		// fall through
+
+	case INDEXING:
+		// match brackets and hash the result string so repeated branches can be found in constant time
+		for (; m_nCursor < m_strResult.size(); ++m_nCursor)
+		{
+			if (outOfTime())
+				return false;
+
+			char c = m_strResult[m_nCursor];
+			m_vullPrefixHash[m_nCursor + 1u] = m_vullPrefixHash[m_nCursor] * BRANCH_HASH_BASE + static_cast<unsigned char>(c);
+			m_vullHashPower[m_nCursor + 1u] = m_vullHashPower[m_nCursor] * BRANCH_HASH_BASE;
+
+			if (c == '[')
+			{
+				m_vOpenBrackets.push_back(m_nCursor);
+			}
+			else if (c == ']' && !m_vOpenBrackets.empty())
+			{
+				m_vBracketMatch[m_vOpenBrackets.back()] = m_nCursor;
+				m_vOpenBrackets.pop_back();
+			}
+		}
+		m_vOpenBrackets.clear();
+		m_nCursor = 0u;
+
+		m_pCurrentNode = new Scaffold::Node(m_Turtle.position, m_Turtle.orientation, m_Turtle.size);
+		m_pCurrentNode->parentNode = NULL;
+		m_Scaffold.vNodes.push_back(m_pCurrentNode);
+
+		m_eStage = BUILDING;
+		// fall through
+
+	case BUILDING:
+		// walk the turtle over the result string to build the scaffold
+		for (; m_nCursor < m_strResult.size(); ++m_nCursor)
+		{
+			if (outOfTime())
+				return false;
+
+			char c = m_strResult[m_nCursor];
+
+			// repeats of an already built branch are skipped and emitted as instances
+			if (c == '[' && instanceBranch())
+				continue;
+
+			CommandMap::iterator it = m_mapTurtleCommands.find(c);
+			if (it != m_mapTurtleCommands.end())
+				it->second();
+			else
+				std::cerr << "Error: Symbol '" << c << "' not found in turtle commands." << std::endl;
+
+			if (c == '[')
+				m_vBranchBoundaries.push_back(CapsuleBVH::GroupBoundary(static_cast<uint32_t>(m_Scaffold.vSegments.size()), static_cast<uint32_t>(m_vNodeStack.size())));
+			else if (c == ']')
+				m_vBranchBoundaries.push_back(CapsuleBVH::GroupBoundary(static_cast<uint32_t>(m_Scaffold.vSegments.size()), static_cast<uint32_t>(m_vNodeStack.size() + 1u)));
+
+			if (c == ']' && !m_vOpenPrototypes.empty() && m_vBranchPrototypes[m_vOpenPrototypes.back()].closePos == m_nCursor)
+				closeBranchPrototype();
+		}
+		m_nCursor = 0u;
+
+		// lookups are only needed while building
+		m_vBracketMatch.clear();
+		m_vBracketMatch.shrink_to_fit();
+		m_vullPrefixHash.clear();
+		m_vullPrefixHash.shrink_to_fit();
+		m_vullHashPower.clear();
+		m_vullHashPower.shrink_to_fit();
+		m_mapBranchLookup.clear();
+
+		m_vSegmentCapsules.clear();
+		m_vSegmentCapsules.reserve(m_Scaffold.vSegments.size());
+		m_nMeshVertexCount = 0u;
+		m_nMeshIndexCount = 0u;
+
+		m_eStage = BOUNDING;
+		// fall through
+
+	case BOUNDING:
+		// capsules bounding every segment, which the segment hierarchy is built over
+		while (m_nCursor < m_Scaffold.vSegments.size())
+		{
+			if (sliceOutOfTime())
+				return false;
+
+			size_t end = (std::min)(m_nCursor + BOUND_SLICE, m_Scaffold.vSegments.size());
+			for (; m_nCursor < end; ++m_nCursor)
+			{
+				const Scaffold::Segment *seg = m_Scaffold.vSegments[m_nCursor];
+				float radius = SEGMENT_BOUNDS_RADIUS_SCALE * (std::max)(seg->origin->vec3Scale.x, seg->terminus->vec3Scale.x);
+				m_vSegmentCapsules.push_back(CapsuleBVH::Capsule(seg->origin->vec3Pos, seg->terminus->vec3Pos, radius));
+
+				size_t vertexCount, indexCount;
+				getSegmentMeshSize(seg, SEGMENT_SUBSEGMENTS, vertexCount, indexCount);
+				m_nMeshVertexCount += vertexCount;
+				m_nMeshIndexCount += indexCount;
+			}
+		}
+		m_nCursor = 0u;
+		m_nSubCursor = 0u;
+		m_vInstanceCapsules.clear();
+		m_vPickableInstances.clear();
+		m_eStage = BOUNDING_INSTANCES;
+		// fall through
+
+	case BOUNDING_INSTANCES:
+		// a sphere per branch instance; instances only need to bound the prototype's own segments, nested
+		// instances get spheres of their own. Each prototype's segments are gone over twice, for their box and
+		// then for the sphere around its center, before its instances.
+		for (; m_nCursor < m_vBranchPrototypes.size(); ++m_nCursor, m_nSubCursor = 0u)
+		{
+			BranchPrototype &proto = m_vBranchPrototypes[m_nCursor];
+			if (proto.vInstances.empty() || proto.segEnd == proto.segBegin)
+				continue;
+
+			size_t segCount = proto.segEnd - proto.segBegin;
+			glm::quat invRot = glm::inverse(proto.root.orientation);
+
+			if (m_nSubCursor == 0u)
+			{
+				proto.capsuleMin = glm::vec3(std::numeric_limits<float>::max());
+				proto.capsuleMax = glm::vec3(-std::numeric_limits<float>::max());
+				proto.capsuleRadius = 0.f;
+			}
+
+			for (; m_nSubCursor < 2u * segCount + proto.vInstances.size(); ++m_nSubCursor)
+			{
+				if (outOfTime())
+					return false;
+
+				glm::vec3 localCenter = (proto.capsuleMin + proto.capsuleMax) * 0.5f;
+
+				if (m_nSubCursor < 2u * segCount)
+				{
+					const CapsuleBVH::Capsule &cap = m_vSegmentCapsules[proto.segBegin + m_nSubCursor % segCount];
+					glm::vec3 p0 = invRot * (cap.p0 - proto.root.position);
+					glm::vec3 p1 = invRot * (cap.p1 - proto.root.position);
+
+					if (m_nSubCursor < segCount)
+					{
+						proto.capsuleMin = glm::min(proto.capsuleMin, glm::min(p0, p1));
+						proto.capsuleMax = glm::max(proto.capsuleMax, glm::max(p0, p1));
+
+						// the prototype is meshed once more, in its own root frame
+						size_t vertexCount, indexCount;
+						getSegmentMeshSize(m_Scaffold.vSegments[proto.segBegin + m_nSubCursor], SEGMENT_SUBSEGMENTS, vertexCount, indexCount);
+						m_nMeshVertexCount += vertexCount;
+						m_nMeshIndexCount += indexCount;
+					}
+					else
+					{
+						proto.capsuleRadius = (std::max)(proto.capsuleRadius, (std::max)(glm::length(p0 - localCenter), glm::length(p1 - localCenter)) + cap.radius);
+					}
+
+					continue;
+				}
+
+				const BranchInstance &inst = proto.vInstances[m_nSubCursor - 2u * segCount];
+				glm::vec3 center = inst.position + inst.orientation * localCenter;
+				m_vInstanceCapsules.push_back(CapsuleBVH::Capsule(center, center, proto.capsuleRadius));
+
+				PickableInstance pickable;
+				pickable.xform = inst;
+				pickable.prototypeRoot = proto.root;
+				pickable.segBegin = static_cast<uint32_t>(proto.segBegin);
+				pickable.segCount = static_cast<uint32_t>(segCount);
+				m_vPickableInstances.push_back(pickable);
+			}
+		}
+		m_nCursor = 0u;
+		m_nSubCursor = 0u;
+
+		{
+			std::vector<CapsuleBVH::GroupBoundary> noGroups;
+
+			m_SegmentBVH.beginBuild(m_vSegmentCapsules, m_vBranchBoundaries);
+			m_InstanceBVH.beginBuild(m_vInstanceCapsules, noGroups);
+		}
+
+		m_eStage = BOUNDING_HIERARCHY;
+		// fall through
+
+	case BOUNDING_HIERARCHY:
+		if (!m_SegmentBVH.continueBuild(outOfTime) || !m_InstanceBVH.continueBuild(outOfTime))
+			return false;
+
+		m_vuiSegmentFirstIndex.clear();
+		m_vuiSegmentFirstIndex.reserve(m_Scaffold.vSegments.size() + 1u);
+
+		// made room for up front, while empty, so growing never copies them between checks of the time budget;
+		// each mesh's LODs add less than its full-detail indices again
+		m_vvec3Points.reserve(m_nMeshVertexCount);
+		m_vvec4Colors.reserve(m_nMeshVertexCount);
+		m_vuiInds.reserve(2u * m_nMeshIndexCount);
+
+		m_eStage = MESHING;
+		// fall through
+
+	case MESHING:
+		//generateLines();
+		//generateQuads();
+		while (m_nCursor < m_Scaffold.vSegments.size())
+		{
+			if (sliceOutOfTime())
+				return false;
+
+			size_t end = (std::min)(m_nCursor + MESH_SLICE, m_Scaffold.vSegments.size());
+			appendSegmentMeshes(m_nCursor, end, SEGMENT_SUBSEGMENTS, &m_vuiSegmentFirstIndex);
+			m_nCursor = end;
+		}
+		m_nCursor = 0u;
+		m_nMainIndexCount = m_vuiInds.size();
+		m_vuiSegmentFirstIndex.push_back(static_cast<GLuint>(m_nMainIndexCount));
+		m_eStage = MESHING_INSTANCES;
+		// fall through
+
+	case MESHING_INSTANCES:
+		// mesh each repeated branch once, in its own root frame
+		for (; m_nCursor < m_vBranchPrototypes.size(); ++m_nCursor)
+		{
+			if (outOfTime())
+				return false;
+
+			if (!m_vBranchPrototypes[m_nCursor].vInstances.empty())
+				generateBranchPrototypeMesh(m_vBranchPrototypes[m_nCursor], SEGMENT_SUBSEGMENTS);
+		}
+		m_nCursor = 0u;
+
+		m_MainLODs = Renderer::LODChain();
+		m_MainLODs.levels = 1;
+		m_MainLODs.firstIndex[0] = 0u;
+		m_MainLODs.indexCount[0] = static_cast<GLsizei>(m_nMainIndexCount);
+
+		m_eStage = SIMPLIFYING;
+		// fall through
+
+	case SIMPLIFYING:
+		// build a chain of simplified LODs for the main mesh (cursor 0) and each instanced branch mesh,
+		// each level halving the triangle count of the previous one; indices go after the full-detail ones
+		for (; m_nCursor <= m_vInstancedBranchMeshes.size(); ++m_nCursor)
+		{
+			Renderer::LODChain &lods = m_nCursor == 0u ? m_MainLODs : m_vInstancedBranchMeshes[m_nCursor - 1u].lods;
+			GLint baseVertex = m_nCursor == 0u ? 0 : m_vInstancedBranchMeshes[m_nCursor - 1u].baseVertex;
+
+			// the simplifier is cleared between meshes, so this resumes an interrupted init() of this one
+			if (!m_bSimplifying)
+			{
+				if (!m_Simplifier.init(m_vvec3Points, m_vuiInds.data() + lods.firstIndex[0], lods.indexCount[0], baseVertex, outOfTime))
+					return false;
+
+				m_nLODLevel = 1;
+				m_bSimplifying = true;
+			}
+
+			for (; m_nLODLevel < MAX_LOD_LEVELS; ++m_nLODLevel)
+			{
+				if (!m_Simplifier.simplify(m_Simplifier.getInitialTriangleCount() >> m_nLODLevel, outOfTime))
+					return false;
+
+				lods.firstIndex[m_nLODLevel] = static_cast<GLuint>(m_vuiInds.size());
+				m_Simplifier.getIndices(m_vuiInds);
+				lods.indexCount[m_nLODLevel] = static_cast<GLsizei>(m_vuiInds.size() - lods.firstIndex[m_nLODLevel]);
+				lods.levels = m_nLODLevel + 1;
+			}
+
+			m_Simplifier.clear();
+			m_bSimplifying = false;
+		}
+		m_nCursor = 0u;
+		m_eStage = UPLOADING;
+		// fall through
+
+	case UPLOADING:
+		// waits for upload(), which needs the GL context
+		return false;
+
+	case IDLE:
+	default:
+		return true;
 	}
+}
 
-	// apply rules to finish the rewriting
-	m_strResult = finish(endStr);
+bool LSystem::isUploadPending()
+{
+	return m_eStage == UPLOADING;
+}
 
-	build();
+void LSystem::upload()
+{
+	if (m_eStage != UPLOADING)
+		return;
+
+	refreshGL();
+	m_eStage = IDLE;
+}
+
+std::string LSystem::run()
+{
+	// finish any pending generation in one go
+	update();
+	upload();
 
 	return m_strResult;
 }
 
-std::string LSystem::iterate(std::string oldstr)
+const std::string* LSystem::selectRule(char symbol, const RuleMap &rules, float random) const
 {
-	std::string newstr;
+	// Check if replacement rule exists for symbol
+	RuleMap::const_iterator it = rules.find(symbol);
 
-	for (auto const &c : oldstr)
+	// Rule does not exist
+	if (it == rules.end())
+		return NULL;
+
+	float cumsum = 0.f;
+	for (auto const &rule : it->second)
 	{
-		std::string result;
-		applyRules(c, m_mapRules, &result);
-		newstr += result;
+		cumsum += rule.first;
+		if (random <= cumsum)
+			return &rule.second;
 	}
 
-	return newstr;
+	std::cerr << "Error: Failed to apply stochastic rules for symbol '" << symbol << "'!" << std::endl;
+
+	return NULL;
 }
 
-std::string LSystem::finish(std::string oldstr)
+//-----------------------------------------------------------------------------
+// Purpose: Rewrites a slice of the working string onto the result in two
+//          parallel passes: every symbol picks its replacement, with a random
+//          number of its own so the outcome doesn't depend on how the slice is
+//          split up, then, after a prefix sum of their lengths, each is copied
+//          to its place. Symbols without a rule are kept, except that the
+//          finishing pass drops those that aren't turtle commands.
+//-----------------------------------------------------------------------------
+void LSystem::rewriteSlice(const RuleMap &rules, bool finishing, size_t end)
 {
-	std::string newstr;
+	PROFILE_SCOPE("LSystem::rewriteSlice");
 
-	for (auto const &c : oldstr)
-	{
-		std::string result;
-		if (m_mapFinishRules.count(c) != 0)
+	size_t begin = m_nCursor;
+	size_t count = end - begin;
+
+	m_vpRewrites.resize(count);
+	m_vnRewriteOffsets.resize(count + 1u);
+
+	parallelFor(0u, count, REWRITE_GRAIN, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i)
 		{
-			applyRules(c, m_mapFinishRules, &result);
-			newstr += result;
+			char c = m_strWorking[begin + i];
+			const std::string *rewrite = selectRule(c, rules, symbolRandom(m_ullRewriteSeed, begin + i));
+
+			m_vpRewrites[i] = rewrite;
+			if (rewrite)
+				m_vnRewriteOffsets[i + 1u] = rewrite->size();
+			else
+				m_vnRewriteOffsets[i + 1u] = !finishing || rules.count(c) != 0u || m_mapTurtleCommands.count(c) != 0u ? 1u : 0u;
 		}
-		else if (m_mapTurtleCommands.count(c) != 0)
+	});
+
+	m_vnRewriteOffsets[0] = 0u;
+	for (size_t i = 0u; i < count; ++i)
+		m_vnRewriteOffsets[i + 1u] += m_vnRewriteOffsets[i];
+
+	size_t base = m_strResult.size();
+	m_strResult.resize(base + m_vnRewriteOffsets[count]);
+	char *out = &m_strResult[0] + base;
+
+	parallelFor(0u, count, REWRITE_GRAIN, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i)
 		{
-			newstr += std::string(1, c);
+			if (m_vpRewrites[i])
+				std::copy(m_vpRewrites[i]->begin(), m_vpRewrites[i]->end(), out + m_vnRewriteOffsets[i]);
+			else if (m_vnRewriteOffsets[i + 1u] != m_vnRewriteOffsets[i])
+				out[m_vnRewriteOffsets[i]] = m_strWorking[begin + i];
 		}
-	}
+	});
 
-	return newstr;
+	m_nCursor = end;
 }
 
-bool LSystem::applyRules(char symbol, RuleMap rules, std::string *out)
+void LSystem::parallelFor(size_t begin, size_t end, size_t grain, const JobSystem::RangeFunc &func)
 {
-	// Check if replacement rule exists for symbol
-	std::map<char, std::vector<std::pair<float, std::string>>>::iterator it = rules.find(symbol);
+	if (m_pJobSystem)
+		m_pJobSystem->parallelFor(begin, end, grain, func);
+	else if (begin < end)
+		func(begin, end);
+}
+
+GLuint LSystem::getVAO()
+{
+	return Renderer::getInstance().getGeometryPool().getVAO();
+}
+
+// Offsets of the uploaded mesh in the geometry pool; LODs, branch meshes and visible ranges already include them
+GLuint LSystem::getFirstIndex()
+{
+	return m_PoolAllocation.firstIndex;
+}
+
+GLint LSystem::getBaseVertex()
+{
+	return m_PoolAllocation.baseVertex;
+}
+
+// Returns the index count of the last uploaded mesh, which stays drawable while a new one is generated
+GLsizei LSystem::getIndexCount()
+{
+	return m_nUploadedIndexCount;
+}
+
+float LSystem::getMeshBoundingRadius()
+{
+	return m_fUploadedBoundingRadius;
+}
+
+unsigned int LSystem::getUploadCount()
+{
+	return m_nUploadCount;
+}
+
+const Renderer::LODChain& LSystem::getMeshLODs()
+{
+	return m_UploadedMainLODs;
+}
+
+const std::vector<LSystem::InstancedBranchMesh>& LSystem::getInstancedBranchMeshes()
+{
+	return m_vUploadedBranchMeshes;
+}
+
+// Bounds are in flux while a new scaffold is built, so use the ones captured at upload time
+glm::vec3 LSystem::getMeshCenteringAdjustments()
+{
+	return m_vec3UploadedCentering;
+}
+
+// Called with the cursor on a '['. Returns true if the branch repeats an earlier one and was
+// emitted as an instance, leaving the cursor on the matching ']'.
+bool LSystem::instanceBranch()
+{
+	size_t open = m_nCursor;
+	size_t close = m_vBracketMatch[open];
+
+	if (close <= open || close - open - 1u < MIN_INSTANCED_BRANCH_LENGTH)
+		return false;
+
+	size_t len = close - open - 1u;
+	uint64_t hash = m_vullPrefixHash[close] - m_vullPrefixHash[open + 1u] * m_vullHashPower[len];
+	BranchInstance xform(m_Turtle.position, m_Turtle.orientation);
+	glm::quat entryNodeRotation = glm::inverse(m_Turtle.orientation) * m_pCurrentNode->qRot;
 
-	// Rule Exists
-	if (it != rules.end())
+	std::vector<size_t> &candidates = m_mapBranchLookup[hash];
+
+	for (auto const &idx : candidates)
 	{
-		float val = m_UniformDist(m_mtEngine);
-		float cumsum = 0.f;
+		const BranchPrototype &proto = m_vBranchPrototypes[idx];
+
+		if (proto.strLength != len || proto.entrySize != m_Turtle.size || proto.turnAngle != m_Turtle.turnAngle ||
+			glm::abs(glm::dot(proto.entryNodeRotation, entryNodeRotation)) < 1.f - BRANCH_ROTATION_TOLERANCE ||
+			m_strResult.compare(proto.strBegin, len, m_strResult, open + 1u, len) != 0)
+			continue;
+
+		// prototypes still being built need to know about this branch to reproduce it
+		for (auto const &openIdx : m_vOpenPrototypes)
+			m_vBranchPrototypes[openIdx].vNested.push_back(std::make_pair(idx, relativeBranchTransform(m_vBranchPrototypes[openIdx].root, xform)));
 
-		for (auto const &rule : it->second)
+		emitBranchInstance(idx, xform);
+
+		// grow the data bounds by the instance's box
+		for (int corner = 0; corner < 8; ++corner)
 		{
-			cumsum += rule.first;
-			if (val <= cumsum)
-			{
-				*out = rule.second;
-				return true;
-			}
+			glm::vec3 pt((corner & 1) ? proto.localMax.x : proto.localMin.x,
+				(corner & 2) ? proto.localMax.y : proto.localMin.y,
+				(corner & 4) ? proto.localMax.z : proto.localMin.z);
+			checkNewRawPosition(xform.position + xform.orientation * pt);
 		}
 
-		std::cerr << "Error: Failed to apply stochastic rules for symbol '" << symbol << "'!" << std::endl;
+		m_pCurrentNode->nInstancedBranches++;
+		m_nCursor = close;
 
-		*out = std::string(1, symbol);
-		return false;
-	}
-	else // Rule does not exist
-	{
-		*out = std::string(1, symbol);
-		return false;
+		return true;
 	}
+
+	// first occurrence, so build it and keep it as a prototype for later repeats
+	BranchPrototype proto;
+	proto.strBegin = open + 1u;
+	proto.strLength = len;
+	proto.closePos = close;
+	proto.entrySize = m_Turtle.size;
+	proto.turnAngle = m_Turtle.turnAngle;
+	proto.entryNodeRotation = entryNodeRotation;
+	proto.root = xform;
+	proto.nodeBegin = m_Scaffold.vNodes.size();
+	proto.segBegin = m_Scaffold.vSegments.size();
+
+	candidates.push_back(m_vBranchPrototypes.size());
+	m_vOpenPrototypes.push_back(m_vBranchPrototypes.size());
+	m_vBranchPrototypes.push_back(proto);
+
+	return false;
 }
 
-void LSystem::build()
+// Called once the first occurrence of the innermost open prototype has been built
+void LSystem::closeBranchPrototype()
 {
-	m_pCurrentNode = new Scaffold::Node(m_Turtle.position, m_Turtle.orientation, m_Turtle.size);
-	m_pCurrentNode->parentNode = NULL;
-	m_Scaffold.vNodes.push_back(m_pCurrentNode);
+	BranchPrototype &proto = m_vBranchPrototypes[m_vOpenPrototypes.back()];
+	m_vOpenPrototypes.pop_back();
+
+	proto.nodeEnd = m_Scaffold.vNodes.size();
+	proto.segEnd = m_Scaffold.vSegments.size();
+
+	glm::quat invRot = glm::inverse(proto.root.orientation);
 
-	for (auto const& c : m_strResult)
+	proto.localMin = proto.localMax = glm::vec3(0.f);
+
+	for (size_t i = proto.nodeBegin; i < proto.nodeEnd; ++i)
 	{
-		if (m_mapTurtleCommands.count(c))
-			m_mapTurtleCommands[c]();
-		else
-			std::cerr << "Error: Symbol '" << c << "' not found in turtle commands." << std::endl;
+		glm::vec3 pt = invRot * (m_Scaffold.vNodes[i]->vec3Pos - proto.root.position);
+		proto.localMin = glm::min(proto.localMin, pt);
+		proto.localMax = glm::max(proto.localMax, pt);
+	}
+
+	for (auto const &nested : proto.vNested)
+	{
+		const BranchPrototype &inner = m_vBranchPrototypes[nested.first];
+
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			glm::vec3 pt((corner & 1) ? inner.localMax.x : inner.localMin.x,
+				(corner & 2) ? inner.localMax.y : inner.localMin.y,
+				(corner & 4) ? inner.localMax.z : inner.localMin.z);
+			pt = nested.second.position + nested.second.orientation * pt;
+			proto.localMin = glm::min(proto.localMin, pt);
+			proto.localMax = glm::max(proto.localMax, pt);
+		}
 	}
 }
 
-GLuint LSystem::getVAO()
+void LSystem::emitBranchInstance(size_t prototype, const BranchInstance &xform)
 {
-	if (m_bNeedsRefresh)
-		update();
+	m_vBranchPrototypes[prototype].vInstances.push_back(xform);
 
-	return m_glVAO;
+	// the prototype's own first occurrence skipped these, so each instance has to bring them along
+	for (auto const &nested : m_vBranchPrototypes[prototype].vNested)
+		emitBranchInstance(nested.first, composeBranchTransform(xform, nested.second));
 }
 
-GLushort LSystem::getIndexCount()
+bool LSystem::pick(const glm::vec3 & origin, const glm::vec3 & dir, float maxDistance, PickResult & result)
 {
-	if (m_bNeedsRefresh)
-		update();
+	CapsuleBVH::Hit hit;
+	bool found = m_UploadedSegmentBVH.raycast(origin, dir, maxDistance, hit);
+
+	if (found)
+	{
+		const CapsuleBVH::Capsule &cap = m_UploadedSegmentBVH.getCapsules()[hit.capsule];
+		result.distance = hit.distance;
+		result.segment = hit.capsule;
+		result.instance = -1;
+		result.from = cap.p0;
+		result.to = cap.p1;
+		result.radius = cap.radius;
+	}
+
+	// the closest accepted hit is always the last one, so the segment found with it is the one to keep
+	uint32_t instanceSegment = 0u;
+	CapsuleBVH::Hit instanceHit;
+	bool foundInstance = m_UploadedInstanceBVH.raycast(origin, dir, found ? hit.distance : maxDistance, instanceHit,
+		[&](uint32_t i, const glm::vec3 &o, const glm::vec3 &d, float &distance) {
+			const PickableInstance &inst = m_vUploadedPickableInstances[i];
+			glm::quat toFirst = inst.prototypeRoot.orientation * glm::inverse(inst.xform.orientation);
+
+			CapsuleBVH::Hit segHit;
+			if (!m_UploadedSegmentBVH.raycast(inst.prototypeRoot.position + toFirst * (o - inst.xform.position), toFirst * d, distance, segHit, inst.segBegin, inst.segCount))
+				return false;
+
+			distance = segHit.distance;
+			instanceSegment = segHit.capsule;
+			return true;
+		});
+
+	if (foundInstance)
+	{
+		const PickableInstance &inst = m_vUploadedPickableInstances[instanceHit.capsule];
+		const CapsuleBVH::Capsule &cap = m_UploadedSegmentBVH.getCapsules()[instanceSegment];
+		glm::quat fromFirst = inst.xform.orientation * glm::inverse(inst.prototypeRoot.orientation);
+
+		result.distance = instanceHit.distance;
+		result.segment = instanceSegment;
+		result.instance = static_cast<long long>(instanceHit.capsule);
+		result.from = inst.xform.position + fromFirst * (cap.p0 - inst.prototypeRoot.position);
+		result.to = inst.xform.position + fromFirst * (cap.p1 - inst.prototypeRoot.position);
+		result.radius = cap.radius;
+	}
+
+	return found || foundInstance;
+}
 
-	return m_vusInds.size();
+bool LSystem::getVisibleIndexRanges(const glm::mat4 & clipFromMesh, std::vector<Renderer::IndexRange>& ranges)
+{
+	ranges.clear();
+
+	if (m_vuiUploadedSegmentFirstIndex.empty() || m_UploadedSegmentBVH.empty())
+		return false;
+
+	m_UploadedSegmentBVH.cull(clipFromMesh, MIN_CULLED_SEGMENTS, [&](uint32_t first, uint32_t count) {
+		Renderer::IndexRange range;
+		range.first = m_PoolAllocation.firstIndex + m_vuiUploadedSegmentFirstIndex[first];
+		range.count = static_cast<GLsizei>(m_vuiUploadedSegmentFirstIndex[first + count] - m_vuiUploadedSegmentFirstIndex[first]);
+		ranges.push_back(range);
+	});
+
+	return true;
 }
 
 void LSystem::reset()
 {
 	m_vvec3Points.clear();
 	m_vvec4Colors.clear();
-	m_vusInds.clear();
+	m_vuiInds.clear();
+	m_nMainIndexCount = 0u;
+	m_MainLODs = Renderer::LODChain();
+	m_Simplifier.clear();
+	m_bSimplifying = false;
+	m_vBranchInstances.clear();
+	m_vInstancedBranchMeshes.clear();
+
+	m_vBranchPrototypes.clear();
+	m_mapBranchLookup.clear();
+	m_vOpenPrototypes.clear();
+	m_vOpenBrackets.clear();
+	m_vBranchBoundaries.clear();
+
+	m_vSegmentCapsules.clear();
+	m_vInstanceCapsules.clear();
+	m_SegmentBVH.clear();
+	m_InstanceBVH.clear();
+	m_vPickableInstances.clear();
+	m_vuiSegmentFirstIndex.clear();
 
 	m_Turtle = m_TurtleOriginalState;
 	m_vTurtleStack.clear();
 	
-	for (auto &n : m_Scaffold.vNodes)
-		delete n;
+	// the old scaffold is freed a little per update(), as there can be a great many nodes
+	m_vpDeadNodes.insert(m_vpDeadNodes.end(), m_Scaffold.vNodes.begin(), m_Scaffold.vNodes.end());
 	m_Scaffold.vNodes.clear();
-
-	for (auto &s : m_Scaffold.vSegments)
-		delete s;
+	m_vpDeadSegments.insert(m_vpDeadSegments.end(), m_Scaffold.vSegments.begin(), m_Scaffold.vSegments.end());
 	m_Scaffold.vSegments.clear();
 
 	m_pCurrentNode = NULL;
+	m_vNodeStack.clear();
+
+	m_strResult.clear();
 
 	resetDataBounds();
 }
 
-void LSystem::refreshGL()
+bool LSystem::freeDeadScaffold(const std::function<bool()> &shouldStop)
 {
-	glBindBuffer(GL_ARRAY_BUFFER, this->m_glVBO);
-	// Buffer orphaning
-	glBufferData(GL_ARRAY_BUFFER, m_vvec3Points.size() * sizeof(glm::vec3) + m_vvec4Colors.size() * sizeof(glm::vec4), 0, GL_STREAM_DRAW);
-	// Sub buffer data for points, then colors
-	glBufferSubData(GL_ARRAY_BUFFER, 0, m_vvec3Points.size() * sizeof(glm::vec3), &m_vvec3Points[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, m_vvec3Points.size() * sizeof(glm::vec3), m_vvec4Colors.size() * sizeof(glm::vec4), &m_vvec4Colors[0]);
+	while (!m_vpDeadSegments.empty())
+	{
+		if (shouldStop && shouldStop())
+			return false;
+
+		delete m_vpDeadSegments.back();
+		m_vpDeadSegments.pop_back();
+	}
+
+	while (!m_vpDeadNodes.empty())
+	{
+		if (shouldStop && shouldStop())
+			return false;
+
+		delete m_vpDeadNodes.back();
+		m_vpDeadNodes.pop_back();
+	}
+
+	return true;
+}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->m_glEBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_vusInds.size() * sizeof(GLushort), 0, GL_STREAM_DRAW);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_vusInds.size() * sizeof(GLushort), &m_vusInds[0], GL_STREAM_DRAW);
+void LSystem::refreshGL()
+{
+	GeometryPool &pool = Renderer::getInstance().getGeometryPool();
+
+	// The new mesh goes in before the old one is released, so the old one's storage is not overwritten while it may still be in use
+	GeometryPool::Allocation alloc = pool.allocate(static_cast<GLsizei>(m_vvec3Points.size()), static_cast<GLsizei>(m_vuiInds.size()), static_cast<GLsizei>(m_vBranchInstances.size()));
+	pool.release(m_PoolAllocation);
+	m_PoolAllocation = alloc;
+
+	pool.uploadVertices(alloc, m_vvec3Points.data(), m_vvec4Colors.data());
+	pool.uploadIndices(alloc, m_vuiInds.data());
+	pool.uploadInstances(alloc, m_vBranchInstances.data());
+
+	m_nUploadedIndexCount = static_cast<GLsizei>(m_nMainIndexCount);
+	m_vUploadedBranchMeshes = m_vInstancedBranchMeshes;
+	m_UploadedMainLODs = m_MainLODs;
+	std::swap(m_UploadedSegmentBVH, m_SegmentBVH);
+	std::swap(m_UploadedInstanceBVH, m_InstanceBVH);
+	m_vUploadedPickableInstances.swap(m_vPickableInstances);
+	m_vuiUploadedSegmentFirstIndex.swap(m_vuiSegmentFirstIndex);
+
+	// Index ranges handed out for drawing are made relative to the whole pool; segment ranges when culling
+	for (auto &branch : m_vUploadedBranchMeshes)
+	{
+		branch.firstIndex += alloc.firstIndex;
+		branch.baseVertex += alloc.baseVertex;
+		branch.baseInstance += alloc.baseInstance;
+		for (int i = 0; i < branch.lods.levels; ++i)
+			branch.lods.firstIndex[i] += alloc.firstIndex;
+	}
+	for (int i = 0; i < m_UploadedMainLODs.levels; ++i)
+		m_UploadedMainLODs.firstIndex[i] += alloc.firstIndex;
 
-	// Set color sttribute pointer now that point array size is known
-	glBindVertexArray(this->m_glVAO);
-		glVertexAttribPointer(COLOR_ATTRIB_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (GLvoid*)(m_vvec3Points.size() * sizeof(glm::vec3)));
-	glBindVertexArray(0);
+	m_fUploadedBoundingRadius = glm::length(getAdjustedDimensions()) * 0.5f;
+	++m_nUploadCount;
+	m_vec3UploadedCentering = glm::vec3(getDataCenteringAdjustments());
 }
 
 void LSystem::generateLines()
 {
-	GLushort currInd = 0;
+	GLuint currInd = 0u;
 	for (auto const& seg : m_Scaffold.vSegments)
 	{
 		glm::vec3 originHeading(glm::rotate(seg->origin->qRot, glm::vec3(0.f, 1.f, 0.f)));
@@ -425,17 +1104,17 @@ void LSystem::generateLines()
 
 		m_vvec3Points.push_back(seg->origin->vec3Pos);
 		m_vvec4Colors.push_back(glm::vec4((originHeading + 1.f) * 0.5f, 1.f));
-		m_vusInds.push_back(currInd++);
+		m_vuiInds.push_back(currInd++);
 
 		m_vvec3Points.push_back(seg->terminus->vec3Pos);
 		m_vvec4Colors.push_back(glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f));
-		m_vusInds.push_back(currInd++);
+		m_vuiInds.push_back(currInd++);
 	}
 }
 
 void LSystem::generateQuads()
 {
-	GLushort currInd = 0;
+	GLuint currInd = 0u;
 	for (auto const& seg : m_Scaffold.vSegments)
 	{
 		glm::vec3 originHeading(glm::rotate(seg->origin->qRot, glm::vec3(0.f, 1.f, 0.f)));
@@ -459,13 +1138,13 @@ void LSystem::generateQuads()
 		m_vvec4Colors.push_back(glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f));
 		m_vvec4Colors.push_back(glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f));
 
-		m_vusInds.push_back(currInd + 0u);
-		m_vusInds.push_back(currInd + 1u);
-		m_vusInds.push_back(currInd + 2u);
+		m_vuiInds.push_back(currInd + 0u);
+		m_vuiInds.push_back(currInd + 1u);
+		m_vuiInds.push_back(currInd + 2u);
 
-		m_vusInds.push_back(currInd + 1u);
-		m_vusInds.push_back(currInd + 3u);
-		m_vusInds.push_back(currInd + 2u);
+		m_vuiInds.push_back(currInd + 1u);
+		m_vuiInds.push_back(currInd + 3u);
+		m_vuiInds.push_back(currInd + 2u);
 
 		currInd += 4;
 	}
@@ -473,118 +1152,208 @@ void LSystem::generateQuads()
 
 void LSystem::generateMesh(uint16_t numSubsegments)
 {
-	for (auto const& seg : m_Scaffold.vSegments)
+	appendSegmentMeshes(0u, m_Scaffold.vSegments.size(), numSubsegments, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Sizes every segment's geometry up front, so each knows where its
+//          vertices and indices go, then meshes the segments in parallel
+//-----------------------------------------------------------------------------
+void LSystem::appendSegmentMeshes(size_t first, size_t last, uint16_t numSubsegments, std::vector<GLuint> *segmentFirstIndices)
+{
+	PROFILE_SCOPE("LSystem::appendSegmentMeshes");
+
+	size_t count = last - first;
+
+	m_vnSegmentVertexOffsets.resize(count + 1u);
+	m_vnSegmentIndexOffsets.resize(count + 1u);
+	m_vnSegmentVertexOffsets[0] = m_vvec3Points.size();
+	m_vnSegmentIndexOffsets[0] = m_vuiInds.size();
+
+	for (size_t i = 0u; i < count; ++i)
 	{
-		glm::vec3 originHeading(glm::rotate(seg->origin->qRot, glm::vec3(0.f, 1.f, 0.f)));
-		glm::vec3 terminusHeading(glm::rotate(seg->terminus->qRot, glm::vec3(0.f, 1.f, 0.f)));
-		
-		glm::vec3 segVector = seg->terminus->vec3Pos - seg->origin->vec3Pos;
-		float segLen = glm::length(segVector);
+		size_t vertexCount, indexCount;
+		getSegmentMeshSize(m_Scaffold.vSegments[first + i], numSubsegments, vertexCount, indexCount);
 
-		float beginSize = seg->origin->vec3Scale.x;
-		float endSize = seg->terminus->vec3Scale.x;
+		m_vnSegmentVertexOffsets[i + 1u] = m_vnSegmentVertexOffsets[i] + vertexCount;
+		m_vnSegmentIndexOffsets[i + 1u] = m_vnSegmentIndexOffsets[i] + indexCount;
 
-		float stepSize = 1.f / (float)(numSubsegments);
+		if (segmentFirstIndices)
+			segmentFirstIndices->push_back(static_cast<GLuint>(m_vnSegmentIndexOffsets[i]));
+	}
 
-		for (uint16_t i = 0u; i < numSubsegments; ++i)
+	m_vvec3Points.resize(m_vnSegmentVertexOffsets[count]);
+	m_vvec4Colors.resize(m_vnSegmentVertexOffsets[count]);
+	m_vuiInds.resize(m_vnSegmentIndexOffsets[count]);
+
+	parallelFor(0u, count, MESH_GRAIN, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
 		{
-			float mixRatioStart = (float)i * stepSize;
-			float mixRatioEnd = (float)(i + 1) * stepSize;
-			float mixRatioHalf = (mixRatioStart + mixRatioEnd) / 2.f;
+			size_t vertex = m_vnSegmentVertexOffsets[i];
+			generateSegmentMesh(m_Scaffold.vSegments[first + i], numSubsegments, static_cast<GLuint>(vertex), m_vvec3Points.data() + vertex, m_vvec4Colors.data() + vertex, m_vuiInds.data() + m_vnSegmentIndexOffsets[i]);
+		}
+	});
+}
 
-			glm::quat interpQuatStart = glm::slerp(seg->origin->qRot, seg->terminus->qRot, mixRatioStart);
-			glm::quat interpQuatEnd = glm::slerp(seg->origin->qRot, seg->terminus->qRot, mixRatioEnd);
+void LSystem::getSegmentMeshSize(const Scaffold::Segment *seg, uint16_t numSubsegments, size_t &vertexCount, size_t &indexCount)
+{
+	bool endcap = seg->terminus->vChildren.size() == 0u && seg->terminus->nInstancedBranches == 0u;
 
-			glm::mat3 rotStart = glm::mat3_cast(interpQuatStart);
-			glm::mat3 rotEnd = glm::mat3_cast(interpQuatEnd);
+	vertexCount = (numSubsegments > 0u ? 3u * (numSubsegments + 1u) : 0u) + (endcap ? 3u * SEGMENT_ENDCAP_SLICES : 0u);
+	indexCount = 12u * numSubsegments + (endcap ? 3u * SEGMENT_ENDCAP_SLICES : 0u);
+}
 
-			glm::vec3 localRightStart = glm::normalize(rotStart[0]) * glm::mix(beginSize, endSize, mixRatioStart) * 0.5f;
-			glm::vec3 localLeftStart = -localRightStart;
+void LSystem::generateSegmentMesh(const Scaffold::Segment *seg, uint16_t numSubsegments, GLuint baseVertex, glm::vec3 *points, glm::vec4 *colors, GLuint *inds)
+{
+	GLuint vertexEnd = baseVertex; // absolute index past the last vertex written
 
-			glm::vec3 localRightEnd = glm::normalize(rotEnd[0]) * glm::mix(beginSize, endSize, mixRatioEnd) * 0.5f;
-			glm::vec3 localLeftEnd = -localRightEnd;
+	glm::vec3 terminusHeading(glm::rotate(seg->terminus->qRot, glm::vec3(0.f, 1.f, 0.f)));
+	
+	glm::vec3 segVector = seg->terminus->vec3Pos - seg->origin->vec3Pos;
 
-			glm::vec3 startPos = seg->origin->vec3Pos + segVector * mixRatioStart;
-			glm::vec3 endPos = seg->origin->vec3Pos + segVector * mixRatioEnd;
+	float beginSize = seg->origin->vec3Scale.x;
+	float endSize = seg->terminus->vec3Scale.x;
 
-			glm::vec3 startColor = glm::mix(glm::vec3(0.f), glm::vec3(1.f), mixRatioStart);
-			glm::vec3 endColor = glm::mix(glm::vec3(0.f), glm::vec3(1.f), mixRatioEnd);
+	float stepSize = 1.f / (float)(numSubsegments);
 
-			if (i == 0)
-			{
-				m_vvec3Points.push_back(startPos + localLeftStart);
-				m_vvec3Points.push_back(startPos);
-				m_vvec3Points.push_back(startPos + localRightStart);
-				m_vvec4Colors.push_back(glm::vec4((rotStart[1] + 1.f) * 0.5f, 1.f));
-				m_vvec4Colors.push_back(glm::vec4((rotStart[1] + 1.f) * 0.5f, 1.f));
-				m_vvec4Colors.push_back(glm::vec4((rotStart[1] + 1.f) * 0.5f, 1.f));
-				//m_vvec4Colors.push_back(glm::vec4(startColor, 1.f));
-				//m_vvec4Colors.push_back(glm::vec4(startColor, 1.f));
-				//m_vvec4Colors.push_back(glm::vec4(startColor, 1.f));
-			}
+	for (uint16_t i = 0u; i < numSubsegments; ++i)
+	{
+		float mixRatioStart = (float)i * stepSize;
+		float mixRatioEnd = (float)(i + 1) * stepSize;
 
-			m_vvec3Points.push_back(endPos + localLeftEnd);
-			m_vvec3Points.push_back(endPos);
-			m_vvec3Points.push_back(endPos + localRightEnd);
-			m_vvec4Colors.push_back(glm::vec4((rotEnd[1] + 1.f) * 0.5f, 1.f));
-			m_vvec4Colors.push_back(glm::vec4((rotEnd[1] + 1.f) * 0.5f, 1.f));
-			m_vvec4Colors.push_back(glm::vec4((rotEnd[1] + 1.f) * 0.5f, 1.f));
-			//m_vvec4Colors.push_back(glm::vec4(endColor, 1.f));
-			//m_vvec4Colors.push_back(glm::vec4(endColor, 1.f));
-			//m_vvec4Colors.push_back(glm::vec4(endColor, 1.f));
-
-			m_vusInds.push_back(m_vvec3Points.size() - 6u);
-			m_vusInds.push_back(m_vvec3Points.size() - 5u);
-			m_vusInds.push_back(m_vvec3Points.size() - 3u);
-
-			m_vusInds.push_back(m_vvec3Points.size() - 5u);
-			m_vusInds.push_back(m_vvec3Points.size() - 2u);
-			m_vusInds.push_back(m_vvec3Points.size() - 3u);
-
-			m_vusInds.push_back(m_vvec3Points.size() - 5u);
-			m_vusInds.push_back(m_vvec3Points.size() - 4u);
-			m_vusInds.push_back(m_vvec3Points.size() - 1u);
-
-			m_vusInds.push_back(m_vvec3Points.size() - 5u);
-			m_vusInds.push_back(m_vvec3Points.size() - 1u);
-			m_vusInds.push_back(m_vvec3Points.size() - 2u);
-		}
+		glm::quat interpQuatStart = glm::slerp(seg->origin->qRot, seg->terminus->qRot, mixRatioStart);
+		glm::quat interpQuatEnd = glm::slerp(seg->origin->qRot, seg->terminus->qRot, mixRatioEnd);
+
+		glm::mat3 rotStart = glm::mat3_cast(interpQuatStart);
+		glm::mat3 rotEnd = glm::mat3_cast(interpQuatEnd);
+
+		glm::vec3 localRightStart = glm::normalize(rotStart[0]) * glm::mix(beginSize, endSize, mixRatioStart) * 0.5f;
+		glm::vec3 localLeftStart = -localRightStart;
 
-		// check if terminal node and add endcap
-		if (seg->terminus->vChildren.size() == 0u)
+		glm::vec3 localRightEnd = glm::normalize(rotEnd[0]) * glm::mix(beginSize, endSize, mixRatioEnd) * 0.5f;
+		glm::vec3 localLeftEnd = -localRightEnd;
+
+		glm::vec3 startPos = seg->origin->vec3Pos + segVector * mixRatioStart;
+		glm::vec3 endPos = seg->origin->vec3Pos + segVector * mixRatioEnd;
+
+		if (i == 0)
 		{
-			int numSegs = 16;
-			glm::vec3 ctr = seg->terminus->vec3Pos;
+			*points++ = startPos + localLeftStart;
+			*points++ = startPos;
+			*points++ = startPos + localRightStart;
+			vertexEnd += 3u;
+			*colors++ = glm::vec4((rotStart[1] + 1.f) * 0.5f, 1.f);
+			*colors++ = glm::vec4((rotStart[1] + 1.f) * 0.5f, 1.f);
+			*colors++ = glm::vec4((rotStart[1] + 1.f) * 0.5f, 1.f);
+		}
 
-			float stepSize = 1.f / (float)numSegs;
+		*points++ = endPos + localLeftEnd;
+		*points++ = endPos;
+		*points++ = endPos + localRightEnd;
+		vertexEnd += 3u;
+		*colors++ = glm::vec4((rotEnd[1] + 1.f) * 0.5f, 1.f);
+		*colors++ = glm::vec4((rotEnd[1] + 1.f) * 0.5f, 1.f);
+		*colors++ = glm::vec4((rotEnd[1] + 1.f) * 0.5f, 1.f);
+
+		*inds++ = vertexEnd - 6u;
+		*inds++ = vertexEnd - 5u;
+		*inds++ = vertexEnd - 3u;
+
+		*inds++ = vertexEnd - 5u;
+		*inds++ = vertexEnd - 2u;
+		*inds++ = vertexEnd - 3u;
+
+		*inds++ = vertexEnd - 5u;
+		*inds++ = vertexEnd - 4u;
+		*inds++ = vertexEnd - 1u;
+
+		*inds++ = vertexEnd - 5u;
+		*inds++ = vertexEnd - 1u;
+		*inds++ = vertexEnd - 2u;
+	}
 
-			for (int i = 0; i < numSegs; ++i)
-			{
-				float ratio = (float)i / (float)(numSegs);
+	// check if terminal node and add endcap
+	if (seg->terminus->vChildren.size() == 0u && seg->terminus->nInstancedBranches == 0u)
+	{
+		int numSegs = SEGMENT_ENDCAP_SLICES;
+		glm::vec3 ctr = seg->terminus->vec3Pos;
 
-				glm::vec3 pt1(0.f);
-				glm::vec3 pt2(0.f);
+		float stepSize = 1.f / (float)numSegs;
 
-				pt1.x = sin(glm::pi<float>() * ratio);
-				pt1.y = cos(glm::pi<float>() * ratio);
+		for (int i = 0; i < numSegs; ++i)
+		{
+			float ratio = (float)i / (float)(numSegs);
 
-				pt2.x = sin(glm::pi<float>() * (ratio + stepSize));
-				pt2.y = cos(glm::pi<float>() * (ratio + stepSize));
+			glm::vec3 pt1(0.f);
+			glm::vec3 pt2(0.f);
 
-				glm::mat4 trans = glm::translate(glm::mat4(), ctr) * glm::mat4_cast(glm::rotate(seg->terminus->qRot, glm::radians(90.f), glm::vec3(0.f, 0.f, 1.f))) * glm::scale(glm::mat4(), glm::vec3(seg->terminus->vec3Scale.x * 0.85f, seg->terminus->vec3Scale.x * 0.5f, 1.f));
+			pt1.x = sin(glm::pi<float>() * ratio);
+			pt1.y = cos(glm::pi<float>() * ratio);
 
-				m_vvec3Points.push_back(glm::vec3(trans * glm::vec4(0.f, 0.f, 0.f, 1.f)));
-				m_vvec3Points.push_back(glm::vec3(trans * glm::vec4(pt1, 1.f)));
-				m_vvec3Points.push_back(glm::vec3(trans * glm::vec4(pt2, 1.f)));
+			pt2.x = sin(glm::pi<float>() * (ratio + stepSize));
+			pt2.y = cos(glm::pi<float>() * (ratio + stepSize));
 
-				m_vvec4Colors.push_back(glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f));
-				m_vvec4Colors.push_back(glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f));
-				m_vvec4Colors.push_back(glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f));
+			glm::mat4 trans = glm::translate(glm::mat4(), ctr) * glm::mat4_cast(glm::rotate(seg->terminus->qRot, glm::radians(90.f), glm::vec3(0.f, 0.f, 1.f))) * glm::scale(glm::mat4(), glm::vec3(seg->terminus->vec3Scale.x * 0.85f, seg->terminus->vec3Scale.x * 0.5f, 1.f));
 
-				m_vusInds.push_back(m_vvec3Points.size() - 3u);
-				m_vusInds.push_back(m_vvec3Points.size() - 2u);
-				m_vusInds.push_back(m_vvec3Points.size() - 1u);
-			}
+			*points++ = glm::vec3(trans * glm::vec4(0.f, 0.f, 0.f, 1.f));
+			*points++ = glm::vec3(trans * glm::vec4(pt1, 1.f));
+			*points++ = glm::vec3(trans * glm::vec4(pt2, 1.f));
+			vertexEnd += 3u;
+
+			*colors++ = glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f);
+			*colors++ = glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f);
+			*colors++ = glm::vec4((terminusHeading + 1.f) * 0.5f, 1.f);
+
+			*inds++ = vertexEnd - 3u;
+			*inds++ = vertexEnd - 2u;
+			*inds++ = vertexEnd - 1u;
 		}
 	}
 }
+
+void LSystem::generateBranchPrototypeMesh(const BranchPrototype &proto, uint16_t numSubsegments)
+{
+	InstancedBranchMesh mesh;
+	mesh.firstIndex = static_cast<GLuint>(m_vuiInds.size());
+	mesh.baseVertex = static_cast<GLint>(m_vvec3Points.size());
+
+	appendSegmentMeshes(proto.segBegin, proto.segEnd, numSubsegments, NULL);
+
+	// move the first occurrence's geometry into the branch root frame
+	glm::quat invRot = glm::inverse(proto.root.orientation);
+	for (size_t i = mesh.baseVertex; i < m_vvec3Points.size(); ++i)
+		m_vvec3Points[i] = invRot * (m_vvec3Points[i] - proto.root.position);
+
+	glm::vec3 bbMin(std::numeric_limits<float>::max());
+	glm::vec3 bbMax(-std::numeric_limits<float>::max());
+	for (size_t i = mesh.baseVertex; i < m_vvec3Points.size(); ++i)
+	{
+		bbMin = glm::min(bbMin, m_vvec3Points[i]);
+		bbMax = glm::max(bbMax, m_vvec3Points[i]);
+	}
+
+	glm::vec3 center = (bbMin + bbMax) * 0.5f;
+	float radius = 0.f;
+	for (size_t i = mesh.baseVertex; i < m_vvec3Points.size(); ++i)
+		radius = (std::max)(radius, glm::length(m_vvec3Points[i] - center));
+	mesh.bounds = glm::vec4(center, radius);
+
+	// indices are relative to the base vertex
+	for (size_t i = mesh.firstIndex; i < m_vuiInds.size(); ++i)
+		m_vuiInds[i] -= static_cast<GLuint>(mesh.baseVertex);
+
+	mesh.indexCount = static_cast<GLsizei>(m_vuiInds.size() - mesh.firstIndex);
+	mesh.baseInstance = static_cast<GLuint>(m_vBranchInstances.size());
+	mesh.instanceCount = static_cast<GLsizei>(proto.vInstances.size());
+	mesh.lods.levels = 1;
+	mesh.lods.firstIndex[0] = mesh.firstIndex;
+	mesh.lods.indexCount[0] = mesh.indexCount;
+
+	// per-instance vertex data, as the pool takes it
+	for (auto const &inst : proto.vInstances)
+	{
+		GeometryPool::Instance poolInst = { inst.position, inst.orientation };
+		m_vBranchInstances.push_back(poolInst);
+	}
+	m_vInstancedBranchMeshes.push_back(mesh);
+}
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <random>
 #include <functional>
 
@@ -13,12 +14,46 @@
 
 #include <glSkel/Object.h>
 #include <glSkel/Dataset.h>
+#include <glSkel/Renderer.h>
+#include <glSkel/MeshSimplifier.h>
+#include <glSkel/CapsuleBVH.h>
+#include <glSkel/JobSystem.h>
 
 class LSystem : public Object, public Dataset
 {
 	typedef std::map<char, std::vector<std::pair<float, std::string>>> RuleMap;
 	typedef std::map<char, std::function<void()>> CommandMap;
 
+public:
+	// Root transform of one occurrence of a repeated sub-branch
+	struct BranchInstance {
+		glm::vec3 position;
+		glm::quat orientation;
+
+		BranchInstance() : position(glm::vec3(0.f)), orientation(glm::quat()) {}
+		BranchInstance(glm::vec3 pos, glm::quat rot) : position(pos), orientation(rot) {}
+	};
+
+	// Index range of a sub-branch meshed once in its own local frame, drawn once per repeat occurrence
+	struct InstancedBranchMesh {
+		GLuint firstIndex;
+		GLsizei indexCount;
+		GLint baseVertex;
+		GLuint baseInstance;
+		GLsizei instanceCount;
+		Renderer::LODChain lods;
+		glm::vec4 bounds; // bounding sphere (center, radius) in the branch root frame
+	};
+
+	// Closest segment hit by a ray, in mesh space
+	struct PickResult {
+		float distance;
+		size_t segment; // scaffold segment hit, or the segment of the instanced branch's first occurrence
+		long long instance; // branch instance hit, -1 if the segment was hit directly
+		glm::vec3 from, to; // segment end points where it was hit
+		float radius; // of the segment's bounding capsule
+	};
+
 public:	
 	LSystem();
 	~LSystem();
@@ -29,28 +64,56 @@ public:
 	void setSegmentLength(float len);
 	void setSize(glm::vec3 size);
 	void setRefreshNeeded();
+	// Restarts the random numbers stochastic rules are picked with; a seed generates the same plants every run
+	void setSeed(uint32_t seed);
 	bool addRule(char symbol, std::string replacement);
 	bool addStochasticRules(char symbol, std::vector<std::pair<float, std::string>> replacementRules);
 	bool addFinishRule(char symbol, std::string replacement);
 	bool addStochasticFinishRules(char symbol, std::vector<std::pair<float, std::string>> replacementRules);
 
-	void update();
+	// Pool that rewriting and meshing are spread over; without one they run on the calling thread
+	void setJobSystem(JobSystem *jobs);
+
+	// Advances generation by at most budgetMicroseconds (0 = run to completion), up to the upload.
+	// Needs no GL context. Returns true once the latest mesh has been uploaded and nothing is pending.
+	bool update(unsigned int budgetMicroseconds = 0u);
+	// Whether a generated mesh is waiting for upload()
+	bool isUploadPending();
+	// Uploads the generated mesh into the renderer's geometry pool and makes it the one drawn and picked;
+	// on the GL context's thread, while nothing else uses the L-system
+	void upload();
 
 	std::string run();
 
 	GLuint getVAO();
-	GLushort getIndexCount();
+	GLuint getFirstIndex();
+	GLint getBaseVertex();
+	GLsizei getIndexCount();
+	glm::vec3 getMeshCenteringAdjustments();
+	float getMeshBoundingRadius();
+	unsigned int getUploadCount(); // changes whenever a new mesh is uploaded
+	const Renderer::LODChain& getMeshLODs();
+	const std::vector<InstancedBranchMesh>& getInstancedBranchMeshes();
+
+	// Ray picking against the uploaded mesh's segments; origin and dir (normalized) are in mesh space
+	bool pick(const glm::vec3 &origin, const glm::vec3 &dir, float maxDistance, PickResult &result);
+	// Index ranges of the uploaded full-detail mesh whose branches may be inside the frustum of clipFromMesh.
+	// Returns false if there is nothing to cull with yet, in which case the whole mesh should be drawn.
+	bool getVisibleIndexRanges(const glm::mat4 &clipFromMesh, std::vector<Renderer::IndexRange> &ranges);
 
 private:
 	void makeTurtleCommands();
-	void initGL();
 
-	std::string iterate(std::string oldstr);
-	std::string finish(std::string oldstr);
-	bool applyRules(char symbol, RuleMap rules, std::string *out);
-	void build();
+	// Replacement the rules pick for the symbol with the given random number in [0, 1), NULL if none applies
+	const std::string* selectRule(char symbol, const RuleMap &rules, float random) const;
+	// Rewrites the working string from the cursor up to end onto the result
+	void rewriteSlice(const RuleMap &rules, bool finishing, size_t end);
+
+	void parallelFor(size_t begin, size_t end, size_t grain, const JobSystem::RangeFunc &func);
 
 	void reset();
+	// Frees the scaffold reset() left behind, until shouldStop says otherwise; returns true once it is all gone
+	bool freeDeadScaffold(const std::function<bool()> &shouldStop);
 
 	void refreshGL();
 
@@ -59,6 +122,22 @@ private:
 	void generateMesh(uint16_t numSubsegments);
 
 private:
+	// Stages of the resumable generation job driven by update()
+	enum GenerationStage {
+		IDLE,
+		DERIVING,
+		FINISHING,
+		INDEXING,
+		BUILDING,
+		BOUNDING,
+		BOUNDING_INSTANCES,
+		BOUNDING_HIERARCHY,
+		MESHING,
+		MESHING_INSTANCES,
+		SIMPLIFYING,
+		UPLOADING
+	};
+
 	struct TurtleState {
 		glm::vec3 position;
 		glm::quat orientation;
@@ -94,14 +173,51 @@ private:
 			glm::vec3 vec3Pos;
 			glm::quat qRot;
 			glm::vec3 vec3Scale;
+			unsigned int nInstancedBranches; // child branches emitted as instances instead of being built
 
-			Node(glm::vec3 pos, glm::quat rot, glm::vec3 scale) : vec3Pos(pos), qRot(rot), vec3Scale(scale) {}
+			Node(glm::vec3 pos, glm::quat rot, glm::vec3 scale) : vec3Pos(pos), qRot(rot), vec3Scale(scale), nInstancedBranches(0u) {}
 		};
 
 		std::vector<Node*> vNodes;
 		std::vector<Segment*> vSegments;
 	};
 
+	// First occurrence of a bracketed sub-branch, which later identical occurrences are instanced from
+	struct BranchPrototype {
+		size_t strBegin; // branch contents in the result string, excluding brackets
+		size_t strLength;
+		size_t closePos; // position of the closing bracket of the first occurrence
+		glm::vec3 entrySize; // turtle size on entry, which the branch geometry depends on
+		float turnAngle;
+		glm::quat entryNodeRotation; // rotation of the node the branch grows from, relative to root; its first segment bends from it
+		BranchInstance root; // turtle frame on entry to the first occurrence
+		size_t nodeBegin, nodeEnd; // scaffold built for the first occurrence
+		size_t segBegin, segEnd;
+		glm::vec3 localMin, localMax; // bounds in the root frame
+		glm::vec3 capsuleMin, capsuleMax; // bounds of its own segments' capsule end points in the root frame, while bounding
+		float capsuleRadius; // of the sphere around their center holding those capsules
+		std::vector<std::pair<size_t, BranchInstance>> vNested; // instanced sub-branches skipped while building, relative to root
+		std::vector<BranchInstance> vInstances; // world-space root frames of every later occurrence
+	};
+
+	// Branch instance as seen by picking: rays are moved into the frame of the prototype's first occurrence
+	struct PickableInstance {
+		BranchInstance xform;
+		BranchInstance prototypeRoot;
+		uint32_t segBegin, segCount;
+	};
+
+	// Meshes segments [first, last) of the scaffold onto the mesh, optionally recording where each one's indices begin
+	void appendSegmentMeshes(size_t first, size_t last, uint16_t numSubsegments, std::vector<GLuint> *segmentFirstIndices);
+	static void getSegmentMeshSize(const Scaffold::Segment *seg, uint16_t numSubsegments, size_t &vertexCount, size_t &indexCount);
+	// Writes exactly the vertices and indices getSegmentMeshSize() counts; baseVertex is where the vertices go in the mesh
+	void generateSegmentMesh(const Scaffold::Segment *seg, uint16_t numSubsegments, GLuint baseVertex, glm::vec3 *points, glm::vec4 *colors, GLuint *inds);
+
+	bool instanceBranch();
+	void closeBranchPrototype();
+	void emitBranchInstance(size_t prototype, const BranchInstance &xform);
+	void generateBranchPrototypeMesh(const BranchPrototype &proto, uint16_t numSubsegments);
+
 private:
 	unsigned int m_nIters;
 	RuleMap m_mapRules; // symbols map to vectors of probability/replacement string pairs
@@ -119,16 +235,65 @@ private:
 
 	bool m_bNeedsRefresh;
 
+	GenerationStage m_eStage;
+	unsigned int m_nCurrentIter; // rewriting iteration in progress
+	size_t m_nCursor; // next symbol (or segment) to process in the current stage
+	size_t m_nSubCursor; // next piece of work within the item at the cursor, for stages whose items vary widely in size
+	std::string m_strWorking; // string being rewritten by the current stage
+	uint64_t m_ullRewriteSeed; // random numbers of the current rewriting pass are hashed from it and the symbol position
+	std::vector<const std::string*> m_vpRewrites; // per symbol of the slice being rewritten, NULL to keep or drop it
+	std::vector<size_t> m_vnRewriteOffsets; // of each symbol's rewrite in the slice's output, plus the end
+
 	std::string m_strResult;
 
 	Scaffold m_Scaffold;
-
-	GLuint m_glVAO, m_glVBO, m_glEBO;
+	std::vector<Scaffold::Node*> m_vpDeadNodes; // of scaffolds reset() dropped, waiting to be freed
+	std::vector<Scaffold::Segment*> m_vpDeadSegments;
+
+	// Branch instancing lookups, valid while building
+	std::vector<size_t> m_vBracketMatch; // for each '[' in the result string, the position of its ']'
+	std::vector<size_t> m_vOpenBrackets;
+	std::vector<uint64_t> m_vullPrefixHash; // polynomial prefix hashes of the result string
+	std::vector<uint64_t> m_vullHashPower;
+	std::vector<BranchPrototype> m_vBranchPrototypes;
+	std::unordered_map<uint64_t, std::vector<size_t>> m_mapBranchLookup; // branch content hash to candidate prototypes
+	std::vector<size_t> m_vOpenPrototypes; // prototypes whose first occurrence is being built
+	std::vector<CapsuleBVH::GroupBoundary> m_vBranchBoundaries; // segment positions where branches begin and end
+
+	std::vector<CapsuleBVH::Capsule> m_vSegmentCapsules; // collected while bounding, then handed to the hierarchies
+	std::vector<CapsuleBVH::Capsule> m_vInstanceCapsules;
+	CapsuleBVH m_SegmentBVH;
+	CapsuleBVH m_InstanceBVH; // bounding spheres of branch instances
+	std::vector<PickableInstance> m_vPickableInstances;
+	std::vector<GLuint> m_vuiSegmentFirstIndex; // first index of each segment's geometry in the main mesh, plus the end
+
+	GeometryPool::Allocation m_PoolAllocation; // where the uploaded mesh lives in the renderer's geometry pool
 	std::vector<glm::vec3> m_vvec3Points;
 	std::vector<glm::vec4> m_vvec4Colors;
-	std::vector<GLushort> m_vusInds;
-
-	std::uniform_real_distribution<float> m_UniformDist;
-	std::mt19937 m_mtEngine; // Mersenne twister MT19937
+	std::vector<GLuint> m_vuiInds;
+	size_t m_nMeshVertexCount, m_nMeshIndexCount; // the meshing stages will write, counted while bounding
+	size_t m_nMainIndexCount; // indices belonging to the non-instanced mesh; branch meshes follow
+	std::vector<GeometryPool::Instance> m_vBranchInstances; // root frames of every branch instance, ready for upload
+	std::vector<InstancedBranchMesh> m_vInstancedBranchMeshes;
+	Renderer::LODChain m_MainLODs;
+	MeshSimplifier m_Simplifier;
+	bool m_bSimplifying; // simplifier holds the mesh at the cursor
+	int m_nLODLevel; // level being simplified
+	GLsizei m_nUploadedIndexCount; // index count of the mesh currently in the GL buffers
+	std::vector<InstancedBranchMesh> m_vUploadedBranchMeshes;
+	glm::vec3 m_vec3UploadedCentering; // data centering of the mesh currently in the GL buffers
+	float m_fUploadedBoundingRadius;
+	unsigned int m_nUploadCount;
+	Renderer::LODChain m_UploadedMainLODs;
+	CapsuleBVH m_UploadedSegmentBVH;
+	CapsuleBVH m_UploadedInstanceBVH;
+	std::vector<PickableInstance> m_vUploadedPickableInstances;
+	std::vector<GLuint> m_vuiUploadedSegmentFirstIndex;
+
+	std::mt19937 m_mtEngine; // Mersenne twister MT19937, seeds each rewriting pass
+
+	JobSystem *m_pJobSystem;
+	std::vector<size_t> m_vnSegmentVertexOffsets; // of each segment being meshed, plus the end
+	std::vector<size_t> m_vnSegmentIndexOffsets;
 };
 
@@ -6,6 +6,8 @@
 // Standard Headers
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <string>
 #include <random>
 #include <ctime> // for time()
 
@@ -21,17 +23,57 @@ int main(int argc, char * argv[])
 {
 	srand(time(NULL)); // Seed rand with time
 
+	// --record <file> and --play <file> record the run's input, or play a recording back; --seed <n> seeds the L-system.
+	// --headless renders offscreen for --frames <n> frames (or the playback), then writes timings to --stats <file>.
+	const char *recordFile = NULL;
+	const char *playFile = NULL;
+	const char *seed = NULL;
+	bool headless = false;
+	unsigned int frames = 0u;
+	const char *statsFile = "";
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			recordFile = argv[++i];
+		else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)
+			playFile = argv[++i];
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = argv[++i];
+		else if (strcmp(argv[i], "--headless") == 0)
+			headless = true;
+		else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = static_cast<unsigned int>(strtoul(argv[++i], NULL, 10));
+		else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+			statsFile = argv[++i];
+		else
+		{
+			fprintf(stderr, "Usage: %s [--record <file> | --play <file>] [--seed <n>] [--headless [--frames <n>] [--stats <file>]]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
     // Load GLFW and Create a Window
     glfwInit();
 
 	engine = new Engine();
 
+	if (headless)
+		engine->setHeadless(frames, statsFile);
+
 	if(!engine->init())
 	{
 		fprintf(stderr, "Failed to Create OpenGL Context");
 		return EXIT_FAILURE;
 	}
 
+	if (seed)
+		engine->setSeed(static_cast<uint32_t>(strtoul(seed, NULL, 10)));
+
+	if (playFile && !engine->playInput(playFile))
+		return EXIT_FAILURE;
+	else if (recordFile && !engine->recordInput(recordFile))
+		return EXIT_FAILURE;
+
 	engine->mainLoop();
 
 	//glfwTerminate();
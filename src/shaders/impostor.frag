@@ -0,0 +1,15 @@
+layout(binding = DIFFUSE_TEXTURE_BINDING)
+	uniform sampler2DArray atlas;
+
+in vec3 v3TexCoord;
+in float fOpacity;
+out vec4 outputColor;
+
+void main()
+{
+	vec4 v4Texel = texture(atlas, v3TexCoord);
+	if (v4Texel.a < 0.5)
+		discard;
+
+	outputColor = vec4(v4Texel.rgb, fOpacity);
+}
\ No newline at end of file
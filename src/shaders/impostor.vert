@@ -0,0 +1,67 @@
+layout(location = INSTANCE_POSITION_ATTRIB_LOCATION)
+	in vec4 v4InstancePositionRadius;
+layout(location = INSTANCE_ORIENTATION_ATTRIB_LOCATION)
+	in vec4 v4InstanceOrientation; // quaternion (x, y, z, w)
+layout(location = IMPOSTOR_PARAMS_ATTRIB_LOCATION)
+	in vec2 v2ImpostorParams; // variant, opacity
+	
+layout(std140, binding = SCENE_UNIFORM_BUFFER_LOCATION) 
+	uniform FrameUniforms
+	{
+		vec4 v4Viewport;
+		mat4 m4View;
+		mat4 m4Projection;
+		mat4 m4ViewProjection;
+	};
+
+out vec3 v3TexCoord;
+out float fOpacity;
+
+vec3 quatRotate(vec4 q, vec3 v)
+{
+	return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+vec2 signNotZero(vec2 v)
+{
+	return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 octEncode(vec3 d)
+{
+	d /= abs(d.x) + abs(d.y) + abs(d.z);
+	return d.y >= 0.0 ? d.xz : (1.0 - abs(d.zx)) * signNotZero(d.xz);
+}
+
+vec3 octDecode(vec2 e)
+{
+	vec3 d = vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y);
+	if (d.y < 0.0)
+		d.xz = (1.0 - abs(e.yx)) * signNotZero(e);
+	return normalize(d);
+}
+
+void main()
+{
+	vec2 v2Corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+	vec3 v3Center = v4InstancePositionRadius.xyz;
+	float fRadius = v4InstancePositionRadius.w;
+	vec4 v4InverseOrientation = vec4(-v4InstanceOrientation.xyz, v4InstanceOrientation.w);
+
+	// Nearest baked view to the direction of the camera, in the baked object's space
+	vec3 v3Camera = -transpose(mat3(m4View)) * m4View[3].xyz;
+	vec3 v3ViewDir = quatRotate(v4InverseOrientation, normalize(v3Camera - v3Center));
+	vec2 v2Cell = clamp(floor((octEncode(v3ViewDir) * 0.5 + 0.5) * IMPOSTOR_GRID_SIZE), 0.0, IMPOSTOR_GRID_SIZE - 1.0);
+
+	// Lay the card in the image plane of that view, with the same basis as ImpostorAtlas::getCellView()
+	vec3 v3CellDir = octDecode((v2Cell + 0.5) / IMPOSTOR_GRID_SIZE * 2.0 - 1.0);
+	vec3 v3Up = abs(v3CellDir.y) > 0.99 ? vec3(0.0, 0.0, 1.0) : vec3(0.0, 1.0, 0.0);
+	vec3 v3Right = normalize(cross(-v3CellDir, v3Up));
+	v3Up = cross(v3Right, -v3CellDir);
+
+	vec3 v3Offset = quatRotate(v4InstanceOrientation, (v2Corner.x * v3Right + v2Corner.y * v3Up) * fRadius);
+
+	v3TexCoord = vec3((v2Cell + v2Corner * 0.5 + 0.5) / IMPOSTOR_GRID_SIZE, v2ImpostorParams.x);
+	fOpacity = v2ImpostorParams.y;
+	gl_Position = m4ViewProjection * vec4(v3Center + v3Offset, 1.0);
+}
\ No newline at end of file
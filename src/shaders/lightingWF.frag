@@ -6,8 +6,6 @@ layout(binding = EMISSIVE_TEXTURE_BINDING)
 	uniform sampler2D emissiveTex;
 layout(location = MATERIAL_SHININESS_UNIFORM_LOCATION)
 	uniform float shininess;
-layout(location = LIGHT_COUNT_UNIFORM_LOCATION)
-	uniform int numLights;
 
 float lineWidth = 1.f;
 vec4 lineColor = vec4(0.f, 0.f, 0.f, 1.f);
@@ -34,7 +32,31 @@ struct Light {
 	float isSpotLight;
 };
 
-uniform Light lights[MAX_LIGHTS];
+layout(std430, binding = LIGHTS_STORAGE_BUFFER_BINDING)
+	readonly buffer LightBuffer
+	{
+		mat4 m4InverseProjection;
+		float clusterNear;
+		float clusterFar;
+		int numLights;
+		Light lights[];
+	};
+
+layout(std430, binding = LIGHT_CLUSTERS_STORAGE_BUFFER_BINDING)
+	readonly buffer LightClusters
+	{
+		uint clusterLightCounts[LIGHT_CLUSTER_COUNT];
+		uint clusterLightIndices[];
+	};
+
+layout(std140, binding = SCENE_UNIFORM_BUFFER_LOCATION) 
+	uniform FrameUniforms
+	{
+		vec4 v4Viewport;
+		mat4 m4View;
+		mat4 m4Projection;
+		mat4 m4ViewProjection;
+	};
 
 
 // Helper functions to apply control flow without shader branchings from normal if/else statements
@@ -52,6 +74,16 @@ vec3 ifelse3v(vec3 valueIf, vec3 valueElse, float valueIn)
 // Declare light calc function
 vec3 phong(Light light, vec3 surfDiffCol, vec3 surfSpecCol, vec3 normal, vec3 fragPos, vec3 surfToViewDir);
 
+// Cluster containing a fragment, given its view space position
+uint clusterIndex(vec3 viewPos)
+{
+	vec2 tile = (gl_FragCoord.xy - v4Viewport.xy) / v4Viewport.zw * vec2(LIGHT_CLUSTER_GRID_X, LIGHT_CLUSTER_GRID_Y);
+	float slice = log(-viewPos.z / clusterNear) / log(clusterFar / clusterNear) * float(LIGHT_CLUSTER_GRID_Z);
+
+	uvec3 cluster = uvec3(clamp(vec3(tile, slice), vec3(0.f), vec3(LIGHT_CLUSTER_GRID_X - 1, LIGHT_CLUSTER_GRID_Y - 1, LIGHT_CLUSTER_GRID_Z - 1)));
+	return cluster.x + LIGHT_CLUSTER_GRID_X * (cluster.y + LIGHT_CLUSTER_GRID_Y * cluster.z);
+}
+
 
 void main()
 {
@@ -64,8 +96,15 @@ void main()
 	
     vec3 result = vec3(0.f);
 
-	for(int i = 0; i < numLights; i++)
-		result += ifelse3v(phong(lights[i], surfaceDiffColor.rgb, surfaceSpecColor.rgb, norm, GPos, fragToViewDir), vec3(0.f), lights[i].isOn);
+	// only the lights binned into this fragment's cluster can reach it
+	uint cluster = clusterIndex(GPos);
+	uint clusterLights = clusterLightCounts[cluster];
+
+	for(uint i = 0; i < clusterLights; i++)
+	{
+		Light light = lights[clusterLightIndices[cluster * MAX_LIGHTS_PER_CLUSTER + i]];
+		result += ifelse3v(phong(light, surfaceDiffColor.rgb, surfaceSpecColor.rgb, norm, GPos, fragToViewDir), vec3(0.f), light.isOn);
+	}
 
 	result += surfaceEmisColor.rgb;
 	//vec3 gammaCorrection = vec3(1.f/2.2f);
@@ -0,0 +1,30 @@
+#extension GL_ARB_shader_draw_parameters : require
+
+layout(location = POSITION_ATTRIB_LOCATION)
+	in vec3 v3Position;
+layout(location = COLOR_ATTRIB_LOCATION)
+	in vec4 v4ColorIn;
+
+// Model matrices of a multi-draw, one per draw
+layout(std430, binding = DRAW_TRANSFORMS_STORAGE_BUFFER_BINDING)
+	readonly buffer DrawTransforms
+	{
+		mat4 m4Models[];
+	};
+	
+layout(std140, binding = SCENE_UNIFORM_BUFFER_LOCATION) 
+	uniform FrameUniforms
+	{
+		vec4 v4Viewport;
+		mat4 m4View;
+		mat4 m4Projection;
+		mat4 m4ViewProjection;
+	};
+
+out vec4 v4Color;
+
+void main()
+{
+	v4Color = v4ColorIn;
+	gl_Position = m4ViewProjection * m4Models[gl_DrawIDARB] * vec4(v3Position, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+#extension GL_ARB_shader_draw_parameters : require
+
+layout(location = POSITION_ATTRIB_LOCATION)
+	in vec3 v3Position;
+layout(location = COLOR_ATTRIB_LOCATION)
+	in vec4 v4ColorIn;
+
+struct CulledDraw {
+	mat4 model;
+	vec4 bounds;
+	uint firstIndex[MAX_LOD_LEVELS];
+	uint indexCount[MAX_LOD_LEVELS];
+	int baseVertex;
+	uint baseInstance;
+	uint instanceCount;
+	uint levels;
+	uint visibleBase;
+	float scale;
+	uint padding[2];
+};
+
+layout(std430, binding = INSTANCE_DATA_STORAGE_BUFFER_BINDING)
+	readonly buffer InstanceData
+	{
+		float fInstanceData[];
+	};
+
+layout(std430, binding = CULLED_DRAWS_STORAGE_BUFFER_BINDING)
+	readonly buffer CulledDraws
+	{
+		CulledDraw draws[];
+	};
+
+layout(std430, binding = VISIBLE_INSTANCES_STORAGE_BUFFER_BINDING)
+	readonly buffer VisibleInstances
+	{
+		uint visibleInstances[];
+	};
+
+layout(std430, binding = CULLED_COMMAND_INFO_STORAGE_BUFFER_BINDING)
+	readonly buffer CulledCommandInfo
+	{
+		uvec2 commandInfo[];
+	};
+
+layout(std140, binding = SCENE_UNIFORM_BUFFER_LOCATION) 
+	uniform FrameUniforms
+	{
+		vec4 v4Viewport;
+		mat4 m4View;
+		mat4 m4Projection;
+		mat4 m4ViewProjection;
+	};
+
+// Where the level being drawn starts in the command info
+layout(location = CULLED_COMMAND_OFFSET_UNIFORM_LOCATION)
+	uniform uint nCommandOffset;
+
+out vec4 v4Color;
+
+vec3 quatRotate(vec4 q, vec3 v)
+{
+	return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main()
+{
+	uvec2 info = commandInfo[nCommandOffset + gl_DrawIDARB];
+	uint instance = visibleInstances[info.x + gl_InstanceID];
+
+	vec3 v3InstancePosition = vec3(fInstanceData[instance * INSTANCE_DATA_FLOATS + 0u], fInstanceData[instance * INSTANCE_DATA_FLOATS + 1u], fInstanceData[instance * INSTANCE_DATA_FLOATS + 2u]);
+	vec4 v4InstanceOrientation = vec4(fInstanceData[instance * INSTANCE_DATA_FLOATS + 3u], fInstanceData[instance * INSTANCE_DATA_FLOATS + 4u], fInstanceData[instance * INSTANCE_DATA_FLOATS + 5u], fInstanceData[instance * INSTANCE_DATA_FLOATS + 6u]);
+
+	v4Color = v4ColorIn;
+	vec3 v3InstancedPosition = v3InstancePosition + quatRotate(v4InstanceOrientation, v3Position);
+	gl_Position = m4ViewProjection * draws[info.y].model * vec4(v3InstancedPosition, 1.0);
+}
@@ -0,0 +1,247 @@
+// Renders a fixed scene of GPU culled instances offscreen, with instance culling validation on, and fails if
+// the GPU culled any instance differently from the CPU. Needs no window: the context is created through EGL
+// without a surface (e.g. Mesa's llvmpipe with EGL_PLATFORM=surfaceless), and frames go to a texture.
+//
+// Usage: CullingValidation [frames]
+// Run from the directory holding shaders/ and GLSLpreamble.h, as the build leaves them next to the executable.
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <glSkel/Renderer.h>
+
+#define VALIDATION_DEFAULT_FRAMES 16
+#define VALIDATION_WIDTH 640
+#define VALIDATION_HEIGHT 400
+#define VALIDATION_SCENE_EXTENT 30.f // instances are spread over a box this far out from the origin
+#define VALIDATION_LOD_FULL_DETAIL_SIZE 32.f
+#define VALIDATION_ORBIT_RADIUS 25.f // the camera circles the origin inside the box, so instances are culled on every side
+
+// Fixed instance counts of the scene's draws, 114,000 instances in all
+static const GLsizei s_arrInstanceCounts[] = { 100000, 2000, 3000, 4000, 5000 };
+
+// Same sequence on every platform, unlike the standard distributions
+static float nextRandom(uint32_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return static_cast<float>(state) / 4294967295.f;
+}
+
+static bool createContext()
+{
+	EGLDisplay display = EGL_NO_DISPLAY;
+
+	// a display that needs no window system, where available
+	const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+	if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay)
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API))
+		return false;
+
+	// nothing is drawn to a surface, so no config is needed where that is allowed (surfaceless displays have none)
+	EGLConfig config = EGL_NO_CONFIG_KHR;
+	const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+	if (!extensions || !strstr(extensions, "EGL_KHR_no_config_context"))
+	{
+		const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		EGLint configs = 0;
+		if (!eglChooseConfig(display, configAttribs, &config, 1, &configs) || configs == 0)
+			return false;
+	}
+
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+
+	return context != EGL_NO_CONTEXT && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Puts a cube with a chain of four LOD levels in the geometry pool
+//          once per draw, each with its own instances, and returns the GPU
+//          culled submissions drawing them
+//-----------------------------------------------------------------------------
+static std::vector<Renderer::RendererSubmission> buildScene(Renderer &renderer)
+{
+	static const glm::vec3 corners[8] = {
+		glm::vec3(-1.f, -1.f, -1.f), glm::vec3(1.f, -1.f, -1.f), glm::vec3(1.f, 1.f, -1.f), glm::vec3(-1.f, 1.f, -1.f),
+		glm::vec3(-1.f, -1.f, 1.f), glm::vec3(1.f, -1.f, 1.f), glm::vec3(1.f, 1.f, 1.f), glm::vec3(-1.f, 1.f, 1.f)
+	};
+	static const GLuint faces[36] = {
+		0, 2, 1, 0, 3, 2, 4, 5, 6, 4, 6, 7, 0, 1, 5, 0, 5, 4,
+		3, 6, 2, 3, 7, 6, 0, 4, 7, 0, 7, 3, 1, 2, 6, 1, 6, 5
+	};
+	const float halfSize = 0.2f;
+
+	glm::vec3 points[8];
+	glm::vec4 colors[8];
+	for (int i = 0; i < 8; ++i)
+	{
+		points[i] = corners[i] * halfSize;
+		colors[i] = glm::vec4((corners[i] + 1.f) * 0.5f, 1.f);
+	}
+
+	GeometryPool &pool = renderer.getGeometryPool();
+	uint32_t random = 0x2545F491u;
+
+	std::vector<Renderer::RendererSubmission> scene;
+	for (size_t d = 0u; d < sizeof(s_arrInstanceCounts) / sizeof(s_arrInstanceCounts[0]); ++d)
+	{
+		GLsizei instanceCount = s_arrInstanceCounts[d];
+		GeometryPool::Allocation alloc = pool.allocate(8, 36, instanceCount);
+
+		std::vector<GeometryPool::Instance> instances(instanceCount);
+		for (auto &instance : instances)
+		{
+			instance.position = (glm::vec3(nextRandom(random), nextRandom(random) * 0.3f, nextRandom(random)) * 2.f - 1.f) * VALIDATION_SCENE_EXTENT;
+			glm::vec3 axis(nextRandom(random) - 0.5f, nextRandom(random) - 0.5f, nextRandom(random) + 0.1f);
+			instance.orientation = glm::angleAxis(nextRandom(random) * glm::two_pi<float>(), glm::normalize(axis));
+		}
+
+		pool.uploadVertices(alloc, points, colors);
+		pool.uploadIndices(alloc, faces);
+		pool.uploadInstances(alloc, instances.data());
+
+		Renderer::RendererSubmission rs;
+		rs.primitiveType = GL_TRIANGLES;
+		rs.shader = renderer.getShaderHandle("pooledCulled");
+		rs.VAO = pool.getVAO();
+		rs.vertCount = alloc.indexCount;
+		rs.firstIndex = alloc.firstIndex;
+		rs.baseVertex = alloc.baseVertex;
+		rs.baseInstance = alloc.baseInstance;
+		rs.instanceCount = instanceCount;
+		rs.gpuCulled = true;
+		rs.instanceBounds = glm::vec4(0.f, 0.f, 0.f, halfSize * glm::root_three<float>());
+		rs.modelToWorldTransform = glm::rotate(glm::mat4(), 0.3f * d, glm::vec3(0.f, 1.f, 0.f)) * glm::scale(glm::mat4(), glm::vec3(1.f + 0.5f * d));
+
+		// levels 1 to 4, drawing fewer of the cube's faces each
+		rs.lods.levels = 1 + static_cast<int>(d % MAX_LOD_LEVELS);
+		for (int lod = 0; lod < rs.lods.levels; ++lod)
+		{
+			rs.lods.firstIndex[lod] = alloc.firstIndex;
+			rs.lods.indexCount[lod] = 36 - 6 * lod;
+		}
+
+		scene.push_back(rs);
+	}
+
+	return scene;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int frames = argc > 1 ? static_cast<unsigned int>(strtoul(argv[1], NULL, 10)) : VALIDATION_DEFAULT_FRAMES;
+
+	if (!createContext())
+	{
+		fprintf(stderr, "Could not create an OpenGL 4.5 context through EGL\n");
+		return EXIT_FAILURE;
+	}
+
+	// GLEW built for GLX loads the GL functions first, then fails to find a GLX display for an EGL context,
+	// which doesn't matter here; what counts is the core version it found
+	glewExperimental = GL_TRUE;
+	glewInit();
+	if (!GLEW_VERSION_4_5)
+	{
+		fprintf(stderr, "OpenGL 4.5 is needed, got %s\n", glGetString(GL_VERSION));
+		return EXIT_FAILURE;
+	}
+	printf("%s, OpenGL %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+	Renderer &renderer = Renderer::getInstance();
+	if (!renderer.init())
+	{
+		fprintf(stderr, "Could not initialize the renderer\n");
+		return EXIT_FAILURE;
+	}
+
+	// held at full size, so every run culls against the same viewport
+	renderer.getDynamicResolution().setScaleRange(1.f, 1.f);
+	renderer.getDynamicResolution().setTargetFrameTime(std::numeric_limits<float>::max());
+
+	GLuint output;
+	glCreateTextures(GL_TEXTURE_2D, 1, &output);
+	glTextureStorage2D(output, 1, GL_RGBA8, VALIDATION_WIDTH, VALIDATION_HEIGHT);
+	renderer.setOutputTexture(output);
+
+	renderer.setInstanceCullingValidation(true);
+	renderer.setOcclusionCulling(true);
+	// small enough for the instances, a few pixels to a few hundred high, to go through every level
+	renderer.setLODFullDetailSize(VALIDATION_LOD_FULL_DETAIL_SIZE);
+
+	std::vector<Renderer::RendererSubmission> scene = buildScene(renderer);
+	GLsizei instances = 0;
+	for (auto const &rs : scene)
+		instances += rs.instanceCount;
+
+	glm::mat4 projection = glm::perspective(glm::radians(60.f), static_cast<float>(VALIDATION_WIDTH) / VALIDATION_HEIGHT, 0.1f, 50.f);
+	renderer.setProjectionMatrix(projection);
+
+	uint64_t validated = 0u;
+	uint64_t mismatches = 0u;
+	unsigned int validatedFrames = 0u;
+	for (unsigned int frame = 0u; frame < frames; ++frame)
+	{
+		float angle = glm::two_pi<float>() * frame / frames;
+		glm::vec3 eye(VALIDATION_ORBIT_RADIUS * glm::sin(angle), 4.f, VALIDATION_ORBIT_RADIUS * glm::cos(angle));
+		glm::mat4 view = glm::lookAt(eye, glm::vec3(0.f), glm::vec3(0.f, 1.f, 0.f));
+		renderer.setViewMatrix(view);
+
+		FrameUniforms frameUniforms;
+		frameUniforms.v4Viewport = glm::vec4(0, 0, VALIDATION_WIDTH, VALIDATION_HEIGHT);
+		frameUniforms.m4View = view;
+		frameUniforms.m4Projection = projection;
+		frameUniforms.m4ViewProjection = projection * view;
+		renderer.setFrameUniforms(frameUniforms);
+
+		for (auto &rs : scene)
+			renderer.addToDynamicRenderQueue(rs);
+
+		renderer.RenderFrame(VALIDATION_WIDTH, VALIDATION_HEIGHT);
+
+		const Renderer::RenderStats &stats = renderer.getStats();
+		if (stats.validatedInstances > 0u)
+			++validatedFrames;
+		validated += stats.validatedInstances;
+		mismatches += stats.cullingMismatches;
+	}
+
+	GLenum error = glGetError();
+
+	printf("%u frames of %d instances: %llu instance culls validated over %u frames, %llu mismatches\n", frames, instances,
+		static_cast<unsigned long long>(validated), validatedFrames, static_cast<unsigned long long>(mismatches));
+
+	if (error != GL_NO_ERROR)
+		fprintf(stderr, "OpenGL error 0x%04x\n", error);
+	if (validated == 0u)
+		fprintf(stderr, "Nothing was validated; the culling programs did not link\n");
+
+	return error == GL_NO_ERROR && validated > 0u && mismatches == 0u ? EXIT_SUCCESS : EXIT_FAILURE;
+}
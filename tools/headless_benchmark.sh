@@ -0,0 +1,70 @@
+#!/bin/sh
+# Runs chondrus headless for a number of frames with a fixed seed, and checks the frame time statistics it
+# writes. Without a display it runs under xvfb-run, with software rendering (llvmpipe, where GL is Mesa).
+#
+# Usage: tools/headless_benchmark.sh <directory holding chondrus> [frames] [stats file]
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 <directory holding chondrus> [frames] [stats file]" >&2
+	exit 2
+fi
+
+BIN_DIR=$(cd "$1" && pwd)
+FRAMES=${2:-120}
+STATS=${3:-$BIN_DIR/benchmark.json}
+WARMUP_FRAMES=30 # BENCHMARK_WARMUP_FRAMES, left out of the statistics
+
+if [ "$FRAMES" -le "$WARMUP_FRAMES" ]; then
+	echo "Run more than $WARMUP_FRAMES frames, the first ones are warmup" >&2
+	exit 2
+fi
+
+if [ -z "$DISPLAY" ]; then
+	if ! command -v xvfb-run >/dev/null 2>&1; then
+		echo "No display to open the (invisible) window on, and xvfb-run is not installed" >&2
+		exit 1
+	fi
+	RUN="xvfb-run -a -s '-screen 0 1280x800x24'"
+	export LIBGL_ALWAYS_SOFTWARE=1
+else
+	RUN=
+fi
+
+rm -f "$STATS"
+
+# shaders are loaded from the working directory
+cd "$BIN_DIR"
+eval $RUN ./chondrus --headless --frames "$FRAMES" --seed 1 --stats "\"$STATS\""
+
+python3 - "$STATS" "$FRAMES" "$WARMUP_FRAMES" <<'EOF'
+import json, math, sys
+
+path, frames, warmup = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+with open(path) as f:
+    stats = json.load(f)
+
+errors = []
+for key in ("frameTime", "renderThreadTime", "simulationTime"):
+    times = stats.get(key)
+    if not isinstance(times, dict):
+        errors.append("%s missing" % key)
+        continue
+    values = [times.get(name) for name in ("min", "p50", "p95", "p99", "max")]
+    if not all(isinstance(v, (int, float)) and math.isfinite(v) and v >= 0 for v in values + [times.get("mean")]):
+        errors.append("%s has missing or invalid times: %s" % (key, times))
+        continue
+    if values != sorted(values) or not values[0] <= times["mean"] <= values[-1]:
+        errors.append("%s percentiles out of order: %s" % (key, times))
+    if key != "simulationTime" and times.get("frames") != frames - warmup:
+        errors.append("%s covers %s frames, expected %d" % (key, times.get("frames"), frames - warmup))
+    if key == "simulationTime" and not times.get("frames", 0) > 0:
+        errors.append("no simulation updates timed")
+
+if errors:
+    sys.exit("%s: %s" % (path, "; ".join(errors)))
+
+print("%s: %d frames on %s, frame time mean %.2f ms, p99 %.2f ms" % (path, stats["frameTime"]["frames"],
+    stats.get("renderer"), stats["frameTime"]["mean"], stats["frameTime"]["p99"]))
+EOF